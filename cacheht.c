@@ -21,6 +21,16 @@ static int CacheHT_CalculateSlotCount(int CacheSize)
     return ROUND(PreValue, 10) + 7;
 }
 
+static void CacheHT_ClearSlots(Array *Slots)
+{
+    int loop;
+
+    for(loop = 0; loop != Slots->Allocated; ++loop)
+    {
+        ((Cht_Slot *)Array_GetBySubscript(Slots, loop))->Next = -1;
+    }
+}
+
 int CacheHT_Init(CacheHT *h, char *BaseAddr, int CacheSize)
 {
     int loop;
@@ -30,25 +40,71 @@ int CacheHT_Init(CacheHT *h, char *BaseAddr, int CacheSize)
     h->Slots.Data = BaseAddr + CacheSize - (h->Slots.DataLength) * (h->Slots.Used);
     h->Slots.Allocated = h->Slots.Used;
 
-    for(loop = 0; loop != h->Slots.Allocated; ++loop)
-    {
-        ((Cht_Slot *)Array_GetBySubscript(&(h->Slots), loop))->Next = -1;
-    }
+    CacheHT_ClearSlots(&(h->Slots));
 
     h->NodeChunk.DataLength = sizeof(Cht_Node);
     h->NodeChunk.Data = h->Slots.Data - h->NodeChunk.DataLength;
     h->NodeChunk.Used = 0;
     h->NodeChunk.Allocated = -1;
 
-    h->FreeList = -1;
+    h->NodesOffset = h->NodeChunk.Data - BaseAddr;
+    h->SlotsOffset = h->Slots.Data - BaseAddr;
+    h->SlotsNode = -1;
+
+    memset(&(h->OldSlots), 0, sizeof(h->OldSlots));
+    h->OldSlotsOffset = 0;
+    h->OldSlotsNode = -1;
+    h->RehashIndex = -1;
+
+    h->ItemCount = 0;
+    h->ClockHand = 0;
+
+    for(loop = 0; loop != CHT_SIZE_CLASSES + 1; ++loop)
+    {
+        h->FreeLists[loop] = -1;
+    }
+    h->FreeBytes = 0;
+
+    h->StaleTime = 0;
+    h->ExpiryTime = 0;
+    h->ExpiryCursor = -1;
+    for(loop = 0; loop != CHT_EXPIRY_BUCKETS; ++loop)
+    {
+        h->Expiry[loop] = -1;
+    }
 
     return 0;
 }
 
+/* Nonzero returned if the header doesn't look like one of a table of
+   `CacheSize' bytes, then the table should be initialized again. */
 int CacheHT_ReInit(CacheHT *h, char *BaseAddr, int CacheSize)
 {
-    h->Slots.Data = BaseAddr + CacheSize - (h->Slots.DataLength) * (h->Slots.Used);
-    h->NodeChunk.Data = h->Slots.Data - h->NodeChunk.DataLength;
+    int SlotCount = CacheHT_CalculateSlotCount(CacheSize);
+    int32_t NodesOffset = CacheSize - sizeof(Cht_Slot) * SlotCount - sizeof(Cht_Node);
+
+    /* The nodes always start right below the initial slots */
+    if( h->NodesOffset != NodesOffset ||
+        h->NodeChunk.DataLength != sizeof(Cht_Node) ||
+        h->NodeChunk.Allocated != -1 ||
+        h->NodeChunk.Used < 0 ||
+        h->NodeChunk.Used > NodesOffset / (int32_t)sizeof(Cht_Node) + 1 ||
+        h->Slots.DataLength != sizeof(Cht_Slot) ||
+        h->Slots.Used <= 0 ||
+        h->SlotsOffset < 0 ||
+        h->SlotsOffset + sizeof(Cht_Slot) * h->Slots.Used > (uint32_t)CacheSize
+        )
+    {
+        return -1;
+    }
+
+    h->NodeChunk.Data = BaseAddr + h->NodesOffset;
+    h->Slots.Data = BaseAddr + h->SlotsOffset;
+
+    if( h->RehashIndex >= 0 )
+    {
+        h->OldSlots.Data = BaseAddr + h->OldSlotsOffset;
+    }
 
     return 0;
 }
@@ -67,7 +123,12 @@ static int CacheHT_CreateNewNode(CacheHT *h, uint32_t ChunkSize, Cht_Node **Out,
     }
 
     NewNode = (Cht_Node *)Array_GetBySubscript(NodeChunk, NewNode_i);
+    /* Not indexed until the entry has been written */
+    NewNode->Slot = -1;
     NewNode->Next = -1;
+    NewNode->ExpiryPrev = -1;
+    NewNode->ExpiryNext = -1;
+    NewNode->Flags = 0;
 
     NewNode->Length = ChunkSize;
 
@@ -79,56 +140,127 @@ static int CacheHT_CreateNewNode(CacheHT *h, uint32_t ChunkSize, Cht_Node **Out,
     return NewNode_i;
 }
 
-int32_t CacheHT_FindUnusedNode(CacheHT      *h,
-                                uint32_t    ChunkSize,
-                                Cht_Node    **Out,
-                                void        *Boundary,
-                                BOOL        *NewCreated
-                                )
+static int32_t *CacheHT_FreeListOf(CacheHT *h, uint32_t ChunkSize)
 {
-    int32_t Subscript = h->FreeList;
-    Cht_Node    *FirstNode = NULL;
-    Cht_Node    *SecondNode = NULL;
+    int Class = ChunkSize / CHT_CLASS_SIZE - 1;
 
-    Array       *NodeChunk = &(h->NodeChunk);
+    if( Class < 0 )
+    {
+        Class = 0;
+    } else if( Class > CHT_SIZE_CLASSES ){
+        Class = CHT_SIZE_CLASSES;
+    }
+
+    return h->FreeLists + Class;
+}
+
+static void CacheHT_FreeListUnlink(CacheHT *h, int32_t Subscript, Cht_Node *Node)
+{
+    if( Node->ExpiryPrev >= 0 )
+    {
+        ((Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Node->ExpiryPrev))->Next = Node->Next;
+    } else {
+        *CacheHT_FreeListOf(h, Node->Length) = Node->Next;
+    }
+
+    if( Node->Next >= 0 )
+    {
+        ((Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Node->Next))->ExpiryPrev = Node->ExpiryPrev;
+    }
+
+    Node->Next = -1;
+    Node->ExpiryPrev = -1;
+    Node->Flags &= ~CHT_NODE_FREE;
 
-    while ( Subscript >= 0 )
+    h->FreeBytes -= Node->Length;
+}
+
+/* A free node whose chunk is not smaller than `ChunkSize', without creating
+   any new node. Chunks of the same size class are always of the same size,
+   so only the last list needs searching. Larger classes are tried as well if
+   `Larger' is TRUE. */
+int32_t CacheHT_FindFreeNode(CacheHT *h, uint32_t ChunkSize, BOOL Larger, Cht_Node **Out)
+{
+    int32_t     *FreeList = CacheHT_FreeListOf(h, ChunkSize);
+    int32_t     *LastList = Larger ? h->FreeLists + CHT_SIZE_CLASSES : FreeList;
+    int32_t     Subscript;
+    Cht_Node    *Node;
+
+    for( ; FreeList <= LastList; ++FreeList )
     {
-        FirstNode = SecondNode;
-        SecondNode = (Cht_Node *)Array_GetBySubscript(NodeChunk, Subscript);
-        if( SecondNode->Length == ChunkSize )
+        for( Subscript = *FreeList; Subscript >= 0; Subscript = Node->Next )
         {
-            if( FirstNode == NULL )
+            Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Subscript);
+            if( Node->Length >= ChunkSize )
             {
-                h->FreeList = SecondNode->Next;
-            } else {
-                FirstNode->Next = SecondNode->Next;
-            }
+                CacheHT_FreeListUnlink(h, Subscript, Node);
 
-            SecondNode->Next = -1;
+                if( Out != NULL )
+                {
+                    *Out = Node;
+                }
+
+                return Subscript;
+            }
 
-            if( Out != NULL )
+            if( FreeList != h->FreeLists + CHT_SIZE_CLASSES )
             {
-                *Out = SecondNode;
+                break;
             }
+        }
+    }
+
+    return -1;
+}
 
-            *NewCreated = FALSE;
+int32_t CacheHT_FindUnusedNode(CacheHT      *h,
+                                uint32_t    ChunkSize,
+                                Cht_Node    **Out,
+                                void        *Boundary,
+                                BOOL        *NewCreated
+                                )
+{
+    int32_t Subscript = CacheHT_FindFreeNode(h, ChunkSize, FALSE, Out);
 
+    if( Subscript < 0 )
+    {
+        Subscript = CacheHT_CreateNewNode(h, ChunkSize, Out, Boundary);
+        if( Subscript >= 0 )
+        {
+            *NewCreated = TRUE;
             return Subscript;
         }
 
-        Subscript = SecondNode->Next;
+        /* No room left, a larger free chunk is better than nothing */
+        Subscript = CacheHT_FindFreeNode(h, ChunkSize, TRUE, Out);
     }
 
-    *NewCreated = TRUE;
-    return CacheHT_CreateNewNode(h, ChunkSize, Out, Boundary);
+    *NewCreated = FALSE;
+    return Subscript;
+}
+
+/* The slot of a hash value, from `OldSlots' if it hasn't been moved yet */
+static Cht_Slot *CacheHT_SlotOf(CacheHT *h, uint64_t HashValue, int *Slot_i)
+{
+    Array *Slots = &(h->Slots);
+
+    if( h->RehashIndex >= 0 &&
+        HashValue % h->OldSlots.Used >= h->RehashIndex
+        )
+    {
+        Slots = &(h->OldSlots);
+    }
+
+    *Slot_i = HashValue % Slots->Used;
+
+    return (Cht_Slot *)Array_GetBySubscript(Slots, *Slot_i);
 }
 
 int CacheHT_InsertToSlot(CacheHT    *h,
                          const char *Key,
                          int        Node_index,
                          Cht_Node   *Node,
-                         uint32_t   *HashValue
+                         uint64_t   *HashValue
                          )
 {
     int         Slot_i;
@@ -139,20 +271,25 @@ int CacheHT_InsertToSlot(CacheHT    *h,
 
     if( HashValue != NULL )
     {
-        Slot_i = (*HashValue) % (h->Slots.Allocated);
+        Node->HashValue = *HashValue;
     } else {
-        Slot_i = HASH(Key, 0) % (h->Slots.Allocated);
+        Node->HashValue = HASH64(Key, 0);
     }
 
-    Node->Slot = Slot_i;
-
-    Slot = (Cht_Slot *)Array_GetBySubscript(&(h->Slots), Slot_i);
+    Slot = CacheHT_SlotOf(h, Node->HashValue, &Slot_i);
     if( Slot == NULL )
         return -2;
 
+    Node->Slot = Slot_i;
+
     Node->Next = Slot->Next;
     Slot->Next = Node_index;
 
+    /* A new node gets its second chance too */
+    Node->Flags |= CHT_NODE_REFERENCED;
+
+    ++(h->ItemCount);
+
     return 0;
 }
 
@@ -180,18 +317,62 @@ static Cht_Node *CacheHT_FindPredecesor(CacheHT *h, Cht_Slot *Slot, int32_t SubS
     return NULL;
 }
 
+/* Put a node into its free list, or simply delete it if it's the last one,
+   together with the free ones before it */
+static void CacheHT_FreeNode(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node)
+{
+    Array *NodeChunk = &(h->NodeChunk);
+
+    Node->Slot = -1;
+
+    if( SubScriptOfNode != NodeChunk->Used - 1 )
+    {
+        int32_t *FreeList = CacheHT_FreeListOf(h, Node->Length);
+
+        Node->Flags |= CHT_NODE_FREE;
+        Node->ExpiryPrev = -1;
+        Node->ExpiryNext = -1;
+        Node->Next = *FreeList;
+
+        if( *FreeList >= 0 )
+        {
+            ((Cht_Node *)Array_GetBySubscript(NodeChunk, *FreeList))->ExpiryPrev = SubScriptOfNode;
+        }
+
+        *FreeList = SubScriptOfNode;
+
+        h->FreeBytes += Node->Length;
+    } else {
+        --(NodeChunk->Used);
+
+        while( NodeChunk->Used > 0 )
+        {
+            SubScriptOfNode = NodeChunk->Used - 1;
+            Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, SubScriptOfNode);
+
+            if( (Node->Flags & CHT_NODE_FREE) == 0 )
+            {
+                break;
+            }
+
+            CacheHT_FreeListUnlink(h, SubScriptOfNode, Node);
+            --(NodeChunk->Used);
+        }
+    }
+}
+
 int CacheHT_RemoveFromSlot(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node)
 {
-    Array       *NodeChunk = &(h->NodeChunk);
     Cht_Slot    *Slot;
     Cht_Node    *Predecesor;
+    int         Slot_i;
 
     if( Node->Slot < 0 )
     {
         return 0;
     }
 
-    Slot = (Cht_Slot *)Array_GetBySubscript(&(h->Slots), Node->Slot);
+    Slot = CacheHT_SlotOf(h, Node->HashValue, &Slot_i);
     if( Slot == NULL )
     {
         return -1;
@@ -205,61 +386,568 @@ int CacheHT_RemoveFromSlot(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node)
         Predecesor->Next = Node->Next;
     }
 
-    /* If this node is not the last one of NodeChunk, add it into free list,
-     * or simply delete it from NodeChunk
-     */
-    if( SubScriptOfNode != NodeChunk->Used - 1 )
-    {
-        Node->Next = h->FreeList;
-        h->FreeList = SubScriptOfNode;
-        Node->Slot = -1;
-    } else {
-        --(NodeChunk->Used);
-    }
+    --(h->ItemCount);
+
+    CacheHT_FreeNode(h, SubScriptOfNode, Node);
 
     return 0;
 }
 
-Cht_Node *CacheHT_Get(CacheHT *h, const char *Key, Cht_Node *Start, uint32_t *HashValue)
+/* Only nodes of the same hash value are returned, their keys are left to the
+ * caller to compare.
+ */
+Cht_Node *CacheHT_Get(CacheHT *h, const char *Key, Cht_Node *Start, uint64_t *HashValue)
 {
     Cht_Node    *Node;
+    uint64_t    Hash;
+    int32_t     Next;
 
     if( h == NULL || Key == NULL)
         return NULL;
 
+    Hash = HashValue != NULL ? *HashValue : HASH64(Key, 0);
+
     if( Start == NULL )
     {
         int         Slot_i;
         Cht_Slot    *Slot;
 
-        if( HashValue != NULL )
+        Slot = CacheHT_SlotOf(h, Hash, &Slot_i);
+
+        Next = Slot->Next;
+    } else {
+        Next = Start->Next;
+    }
+
+    while( (Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Next)) != NULL )
+    {
+        if( Node->HashValue == Hash )
         {
-            Slot_i = (*HashValue) % (h->Slots.Allocated);
-        } else {
-            Slot_i = HASH(Key, 0) % (h->Slots.Allocated);
+            return Node;
         }
 
-        Slot = (Cht_Slot *)Array_GetBySubscript(&(h->Slots), Slot_i);
+        Next = Node->Next;
+    }
+
+    return NULL;
+}
 
-        Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Slot->Next);
-        if( Node == NULL )
-            return NULL;
+/* Bytes needed by the new slots returned, 0 if no need to grow */
+int CacheHT_NeedGrowing(CacheHT *h, int *NewSlotCount)
+{
+    if( h->RehashIndex >= 0 ||
+        h->ItemCount <= h->Slots.Used * CHT_MAX_LOAD_FACTOR
+        )
+    {
+        return 0;
+    }
 
-        return Node;
+    *NewSlotCount = h->Slots.Used * 2 + 1;
+
+    return sizeof(Cht_Slot) * (*NewSlotCount);
+}
+
+/* Start moving nodes to the new slots located at `Chunk', which is the chunk
+   of node `Node_index' */
+int CacheHT_Grow(CacheHT    *h,
+                 char       *BaseAddr,
+                 int32_t    Node_index,
+                 char       *Chunk,
+                 int        NewSlotCount
+                 )
+{
+    if( h->RehashIndex >= 0 )
+    {
+        return -1;
+    }
+
+    h->OldSlots = h->Slots;
+    h->OldSlotsOffset = h->SlotsOffset;
+    h->OldSlotsNode = h->SlotsNode;
+
+    h->Slots.Data = Chunk;
+    h->Slots.Used = NewSlotCount;
+    h->Slots.Allocated = NewSlotCount;
+    h->SlotsOffset = Chunk - BaseAddr;
+    h->SlotsNode = Node_index;
+
+    CacheHT_ClearSlots(&(h->Slots));
+
+    h->RehashIndex = 0;
+
+    return 0;
+}
+
+/* Move at most `Steps' old slots to the new slots */
+void CacheHT_Rehash(CacheHT *h, int Steps)
+{
+    while( h->RehashIndex >= 0 && Steps-- > 0 )
+    {
+        Cht_Slot    *OldSlot = (Cht_Slot *)Array_GetBySubscript(&(h->OldSlots), h->RehashIndex);
+        int32_t     Subscript = OldSlot->Next;
+
+        while( Subscript >= 0 )
+        {
+            Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Subscript);
+            int32_t     Next = Node->Next;
+            Cht_Slot    *Slot;
+
+            Node->Slot = Node->HashValue % h->Slots.Used;
+            Slot = (Cht_Slot *)Array_GetBySubscript(&(h->Slots), Node->Slot);
+
+            Node->Next = Slot->Next;
+            Slot->Next = Subscript;
+
+            Subscript = Next;
+        }
+
+        OldSlot->Next = -1;
+
+        if( ++(h->RehashIndex) == h->OldSlots.Used )
+        {
+            /* Done, the initial slots at the top are never freed */
+            if( h->OldSlotsNode >= 0 )
+            {
+                CacheHT_FreeNode(h,
+                                 h->OldSlotsNode,
+                                 (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), h->OldSlotsNode)
+                                 );
+            }
+
+            memset(&(h->OldSlots), 0, sizeof(h->OldSlots));
+            h->OldSlotsOffset = 0;
+            h->OldSlotsNode = -1;
+            h->RehashIndex = -1;
+        }
+    }
+}
+
+double CacheHT_LoadFactor(CacheHT *h)
+{
+    return (double)(h->ItemCount) / (h->Slots.Used + (h->RehashIndex >= 0 ? h->OldSlots.Used : 0));
+}
+
+/* The node to be evicted, chosen by CLOCK. Referenced nodes passed by the hand
+   are given a second chance, free nodes and slots are never chosen. */
+int32_t CacheHT_ClockVictim(CacheHT *h, Cht_Node **Out)
+{
+    Array   *NodeChunk = &(h->NodeChunk);
+    int     Steps;
+
+    /* Every referenced node is passed at most once */
+    for( Steps = 2 * NodeChunk->Used; Steps > 0; --Steps )
+    {
+        int32_t     Subscript;
+        Cht_Node    *Node;
+
+        if( h->ClockHand >= NodeChunk->Used || h->ClockHand < 0 )
+        {
+            h->ClockHand = 0;
+        }
 
+        Subscript = h->ClockHand++;
+        Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, Subscript);
+
+        if( Node->Slot < 0 )
+        {
+            continue;
+        }
+
+        if( Node->Flags & CHT_NODE_REFERENCED )
+        {
+            Node->Flags &= ~CHT_NODE_REFERENCED;
+            continue;
+        }
+
+        *Out = Node;
+        return Subscript;
+    }
+
+    return -1;
+}
+
+int32_t CacheHT_SubscriptOf(CacheHT *h, const Cht_Node *Node)
+{
+    /* `NodeChunk' grows down */
+    return (h->NodeChunk.Data - (const char *)Node) / h->NodeChunk.DataLength;
+}
+
+static int32_t *CacheHT_ExpiryBucket(CacheHT *h, time_t Time)
+{
+    return h->Expiry + (Time / CHT_EXPIRY_GRANULARITY) % CHT_EXPIRY_BUCKETS;
+}
+
+/* The bucket in which a node is swept */
+static int32_t *CacheHT_ExpiryBucketOf(CacheHT *h, Cht_Node *Node)
+{
+    return CacheHT_ExpiryBucket(h, Node->TimeAdded + Node->TTL + h->StaleTime);
+}
+
+/* Nodes are linked again if the time is changed */
+void CacheHT_SetStaleTime(CacheHT *h, uint32_t StaleTime)
+{
+    int32_t loop;
+
+    if( h->StaleTime == StaleTime )
+    {
+        return;
+    }
+
+    h->StaleTime = StaleTime;
+
+    h->ExpiryCursor = -1;
+    for( loop = 0; loop != CHT_EXPIRY_BUCKETS; ++loop )
+    {
+        h->Expiry[loop] = -1;
+    }
+
+    for( loop = 0; loop != h->NodeChunk.Used; ++loop )
+    {
+        Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), loop);
+
+        /* Free nodes and slots chunks are not linked */
+        if( Node->Slot >= 0 && (Node->Flags & CHT_NODE_FREE) == 0 )
+        {
+            CacheHT_ExpiryLink(h, Node);
+        }
+    }
+}
+
+void CacheHT_ExpiryLink(CacheHT *h, Cht_Node *Node)
+{
+    int32_t *Bucket = CacheHT_ExpiryBucketOf(h, Node);
+    int32_t Subscript = CacheHT_SubscriptOf(h, Node);
+
+    Node->ExpiryPrev = -1;
+    Node->ExpiryNext = *Bucket;
+
+    if( *Bucket >= 0 )
+    {
+        ((Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), *Bucket))->ExpiryPrev = Subscript;
+    }
+
+    *Bucket = Subscript;
+}
+
+void CacheHT_ExpiryUnlink(CacheHT *h, Cht_Node *Node)
+{
+    int32_t Subscript = CacheHT_SubscriptOf(h, Node);
+
+    if( Node->ExpiryPrev >= 0 )
+    {
+        ((Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Node->ExpiryPrev))->ExpiryNext = Node->ExpiryNext;
     } else {
-        Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Start->Next);
-        if( Node == NULL )
-            return NULL;
+        /* The first one of a bucket, or of the nodes being swept */
+        int32_t *Bucket = CacheHT_ExpiryBucketOf(h, Node);
+
+        if( *Bucket == Subscript )
+        {
+            *Bucket = Node->ExpiryNext;
+        } else if( h->ExpiryCursor == Subscript ){
+            h->ExpiryCursor = Node->ExpiryNext;
+        } else {
+            /* Not linked */
+            return;
+        }
+    }
+
+    if( Node->ExpiryNext >= 0 )
+    {
+        ((Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Node->ExpiryNext))->ExpiryPrev = Node->ExpiryPrev;
+    }
+
+    Node->ExpiryPrev = -1;
+    Node->ExpiryNext = -1;
+}
+
+/* Take all the nodes out of the bucket of `BucketTime', and they are going to
+ * be popped by `CacheHT_ExpiryPop' one by one.
+ */
+void CacheHT_ExpiryDetach(CacheHT *h, time_t BucketTime)
+{
+    int32_t *Bucket = CacheHT_ExpiryBucket(h, BucketTime);
+
+    h->ExpiryCursor = *Bucket;
+    *Bucket = -1;
+}
+
+/* The popped node is not linked anywhere, either remove it or link it again */
+int32_t CacheHT_ExpiryPop(CacheHT *h, Cht_Node **Out)
+{
+    int32_t Subscript = h->ExpiryCursor;
+    Cht_Node *Node;
+
+    if( Subscript < 0 )
+    {
+        return -1;
+    }
+
+    Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), Subscript);
+
+    h->ExpiryCursor = Node->ExpiryNext;
+    if( h->ExpiryCursor >= 0 )
+    {
+        ((Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), h->ExpiryCursor))->ExpiryPrev = -1;
+    }
+
+    Node->ExpiryPrev = -1;
+    Node->ExpiryNext = -1;
+
+    *Out = Node;
+    return Subscript;
+}
+
+/* Let node `To_i' take the place of node `From_i', which is then freed. The
+   data of the chunk must have been copied by the caller. */
+int CacheHT_Relocate(CacheHT *h, int32_t From_i, int32_t To_i)
+{
+    Array       *NodeChunk = &(h->NodeChunk);
+    Cht_Node    *From = (Cht_Node *)Array_GetBySubscript(NodeChunk, From_i);
+    Cht_Node    *To = (Cht_Node *)Array_GetBySubscript(NodeChunk, To_i);
+    uint32_t    Length;
+    int32_t     Offset;
+
+    if( From == NULL || To == NULL || From_i == To_i )
+    {
+        return -1;
+    }
+
+    if( From->Slot >= 0 )
+    {
+        int         Slot_i;
+        Cht_Slot    *Slot = CacheHT_SlotOf(h, From->HashValue, &Slot_i);
+        Cht_Node    *Predecesor = CacheHT_FindPredecesor(h, Slot, From_i);
 
-        return Node;
+        if( Predecesor == NULL )
+        {
+            Slot->Next = To_i;
+        } else {
+            Predecesor->Next = To_i;
+        }
+
+        if( From->ExpiryPrev >= 0 )
+        {
+            ((Cht_Node *)Array_GetBySubscript(NodeChunk, From->ExpiryPrev))->ExpiryNext = To_i;
+        } else {
+            int32_t *Bucket = CacheHT_ExpiryBucketOf(h, From);
+
+            if( *Bucket == From_i )
+            {
+                *Bucket = To_i;
+            } else if( h->ExpiryCursor == From_i ){
+                h->ExpiryCursor = To_i;
+            }
+        }
+
+        if( From->ExpiryNext >= 0 )
+        {
+            ((Cht_Node *)Array_GetBySubscript(NodeChunk, From->ExpiryNext))->ExpiryPrev = To_i;
+        }
+    } else if( From_i == h->SlotsNode ){
+        h->SlotsOffset += To->Offset - From->Offset;
+        h->Slots.Data += To->Offset - From->Offset;
+        h->SlotsNode = To_i;
+    } else if( From_i == h->OldSlotsNode ){
+        h->OldSlotsOffset += To->Offset - From->Offset;
+        h->OldSlots.Data += To->Offset - From->Offset;
+        h->OldSlotsNode = To_i;
+    }
+
+    /* Everything but the chunk */
+    Length = To->Length;
+    Offset = To->Offset;
+    *To = *From;
+    To->Length = Length;
+    To->Offset = Offset;
+
+    From->Flags = 0;
+    From->Next = -1;
+    From->ExpiryPrev = -1;
+    From->ExpiryNext = -1;
+    CacheHT_FreeNode(h, From_i, From);
+
+    return 0;
+}
+
+/* Whether the slots are in the chunk of node `SlotsNode' */
+static BOOL CacheHT_SlotsInPlace(CacheHT *h, const char *ChunkBase)
+{
+    Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h->NodeChunk), h->SlotsNode);
+
+    return Node != NULL &&
+           Node->Slot < 0 &&
+           (Node->Flags & CHT_NODE_FREE) == 0 &&
+           ChunkBase + Node->Offset == h->Slots.Data &&
+           Node->Length >= sizeof(Cht_Slot) * h->Slots.Used &&
+           h->Slots.Allocated == h->Slots.Used;
+}
+
+/* Index the nodes again, without trusting anything but the nodes themselves.
+   Only the first `Valid' nodes are kept, of which the free ones, the ones not
+   indexed and the ones marked CHT_NODE_BROKEN are freed. Entries of the same
+   hash values as the dropped ones, which may be the rest of their record sets,
+   are dropped as well. Nodes must have been checked by `CacheHT_ReInit' and
+   the caller. Count of the dropped entries returned. */
+int32_t CacheHT_Rebuild(CacheHT     *h,
+                        char        *BaseAddr,
+                        const char  *ChunkBase,
+                        int         CacheSize,
+                        int32_t     Valid
+                        )
+{
+    Array   *NodeChunk = &(h->NodeChunk);
+    int32_t Dropped = 0;
+    int32_t loop;
+
+    /* The slots may have been grown into a chunk, or the initial ones at the
+       top are used again */
+    if( h->SlotsNode >= Valid ||
+        (h->SlotsNode >= 0 && !CacheHT_SlotsInPlace(h, ChunkBase))
+        )
+    {
+        h->SlotsNode = -1;
+    }
+
+    if( h->SlotsNode < 0 )
+    {
+        h->Slots.Used = CacheHT_CalculateSlotCount(CacheSize);
+        h->Slots.Allocated = h->Slots.Used;
+        h->Slots.Data = BaseAddr + CacheSize - sizeof(Cht_Slot) * h->Slots.Used;
+        h->SlotsOffset = h->Slots.Data - BaseAddr;
+    }
+
+    CacheHT_ClearSlots(&(h->Slots));
+
+    /* The old slots are freed below as a node not indexed */
+    memset(&(h->OldSlots), 0, sizeof(h->OldSlots));
+    h->OldSlotsOffset = 0;
+    h->OldSlotsNode = -1;
+    h->RehashIndex = -1;
+
+    h->ItemCount = 0;
+    h->ClockHand = 0;
+
+    for(loop = 0; loop != CHT_SIZE_CLASSES + 1; ++loop)
+    {
+        h->FreeLists[loop] = -1;
+    }
+    h->FreeBytes = 0;
+
+    /* Every bucket will be swept once */
+    h->ExpiryTime = 0;
+    h->ExpiryCursor = -1;
+    for(loop = 0; loop != CHT_EXPIRY_BUCKETS; ++loop)
+    {
+        h->Expiry[loop] = -1;
+    }
+
+    /* No node is deleted until `Used' is set to `Valid' at last */
+    for( loop = 0; loop != Valid; ++loop )
+    {
+        Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, loop);
+        int         Slot_i;
+        Cht_Slot    *Slot;
+
+        Node->Next = -1;
+        Node->ExpiryPrev = -1;
+        Node->ExpiryNext = -1;
+
+        if( loop == h->SlotsNode )
+        {
+            Node->Flags = 0;
+            continue;
+        }
+
+        /* Freed below */
+        if( Node->Flags & CHT_NODE_BROKEN )
+        {
+            continue;
+        }
+
+        if( Node->Slot < 0 || (Node->Flags & CHT_NODE_FREE) != 0 )
+        {
+            Node->Flags = 0;
+            CacheHT_FreeNode(h, loop, Node);
+            continue;
+        }
+
+        Slot = CacheHT_SlotOf(h, Node->HashValue, &Slot_i);
+
+        Node->Slot = Slot_i;
+        Node->Next = Slot->Next;
+        Slot->Next = loop;
+
+        ++(h->ItemCount);
+
+        CacheHT_ExpiryLink(h, Node);
+    }
+
+    /* The broken entries and the ones after `Valid' */
+    for( loop = 0; loop != NodeChunk->Used; ++loop )
+    {
+        Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, loop);
+        int         Slot_i;
+        Cht_Slot    *Slot;
+        int32_t     Subscript;
+
+        if( loop < Valid ?
+            (Node->Flags & CHT_NODE_BROKEN) == 0 :
+            (Node->Slot < 0 || (Node->Flags & CHT_NODE_FREE) != 0)
+            )
+        {
+            continue;
+        }
+
+        Slot = CacheHT_SlotOf(h, Node->HashValue, &Slot_i);
+
+        Subscript = Slot->Next;
+        while( Subscript >= 0 )
+        {
+            Cht_Node *Same = (Cht_Node *)Array_GetBySubscript(NodeChunk, Subscript);
+
+            if( Same->HashValue != Node->HashValue )
+            {
+                Subscript = Same->Next;
+                continue;
+            }
+
+            CacheHT_ExpiryUnlink(h, Same);
+            CacheHT_RemoveFromSlot(h, Subscript, Same);
+            ++Dropped;
+
+            /* Start over, the chain has changed */
+            Subscript = Slot->Next;
+        }
+
+        ++Dropped;
+
+        if( loop < Valid )
+        {
+            Node->Flags = 0;
+            CacheHT_FreeNode(h, loop, Node);
+        }
+    }
+
+    /* Then the free nodes at the end */
+    NodeChunk->Used = Valid;
+    while( NodeChunk->Used > 0 )
+    {
+        Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, NodeChunk->Used - 1);
+
+        if( (Node->Flags & CHT_NODE_FREE) == 0 )
+        {
+            break;
+        }
+
+        CacheHT_FreeListUnlink(h, NodeChunk->Used - 1, Node);
+        --(NodeChunk->Used);
     }
 
+    return Dropped;
 }
 
 void CacheHT_Free(CacheHT *h)
 {
     Array_Free(&(h->NodeChunk));
     Array_Free(&(h->Slots));
-    h->FreeList = -1;
 }
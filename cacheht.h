@@ -4,6 +4,29 @@
 #include <time.h>
 #include "array.h"
 
+/* Nodes are also linked into expiry buckets by `TimeAdded + TTL', each
+ * bucket covers CHT_EXPIRY_GRANULARITY seconds, and the buckets are reused
+ * every CHT_EXPIRY_BUCKETS * CHT_EXPIRY_GRANULARITY seconds.
+ */
+#define CHT_EXPIRY_BUCKETS      1024
+#define CHT_EXPIRY_GRANULARITY  2
+
+/* Slots are doubled once there are more nodes than this times of slots */
+#define CHT_MAX_LOAD_FACTOR     2
+
+/* Free chunks are kept by size classes of CHT_CLASS_SIZE bytes, chunks larger
+ * than CHT_CLASS_SIZE * CHT_SIZE_CLASSES bytes share the last list.
+ */
+#define CHT_CLASS_SIZE      8
+#define CHT_SIZE_CLASSES    128
+
+/* Flags of nodes */
+#define CHT_NODE_FREE       0x01
+/* Reference bit of CLOCK, set by lookups and cleared by the clock hand */
+#define CHT_NODE_REFERENCED 0x02
+/* Set on nodes whose entries are found broken when reloading */
+#define CHT_NODE_BROKEN     0x04
+
 typedef struct _Cht_Node{
     int32_t     Slot;
     int32_t     Next;
@@ -11,18 +34,67 @@ typedef struct _Cht_Node{
     uint32_t    TTL;
     time_t      TimeAdded;
     uint32_t    Length;
+    /* A free node uses `ExpiryPrev' and `Next' to link its free list */
+    int32_t     ExpiryPrev;
+    int32_t     ExpiryNext;
+    uint64_t    HashValue;
+    uint32_t    Flags;
+    /* Lookups since it was added or refreshed */
+    uint32_t    Hits;
+    /* Of the entry and `HashValue', set before the node is indexed */
+    uint32_t    Checksum;
 } Cht_Node;
 
 typedef struct _HashTable{
     Array   NodeChunk;
     Array   Slots;
-    int32_t FreeList;
+
+    /* Free nodes by the size classes of their chunks, doubly linked */
+    int32_t FreeLists[CHT_SIZE_CLASSES + 1];
+    int32_t FreeBytes;
+
+    /* Offsets from the base address, the arrays above are located by them
+       when reloading */
+    int32_t NodesOffset;
+    int32_t SlotsOffset;
+    /* The node whose chunk holds `Slots', -1 for the initial slots */
+    int32_t SlotsNode;
+
+    /* Incremental rehashing, slots of `OldSlots' before `RehashIndex' have
+       been moved to `Slots'. `RehashIndex' is -1 if not rehashing. */
+    Array   OldSlots;
+    int32_t OldSlotsOffset;
+    int32_t OldSlotsNode;
+    int32_t RehashIndex;
+
+    /* Nodes indexed */
+    int32_t ItemCount;
+
+    /* Next node to be checked for eviction */
+    int32_t ClockHand;
+
+    /* Expired nodes are kept this long (seconds) before being swept, for the
+       stale answers */
+    uint32_t StaleTime;
+
+    /* Buckets earlier than this have been swept */
+    time_t  ExpiryTime;
+    /* Nodes of the bucket being swept, detached from the bucket */
+    int32_t ExpiryCursor;
+    int32_t Expiry[CHT_EXPIRY_BUCKETS];
 }CacheHT;
 
 int CacheHT_Init(CacheHT *h, char *BaseAddr, int CacheSize);
 
 int CacheHT_ReInit(CacheHT *h, char *BaseAddr, int CacheSize);
 
+int32_t CacheHT_Rebuild(CacheHT     *h,
+                        char        *BaseAddr,
+                        const char  *ChunkBase,
+                        int         CacheSize,
+                        int32_t     Valid
+                        );
+
 int32_t CacheHT_FindUnusedNode(CacheHT      *h,
                                 uint32_t    ChunkSize,
                                 Cht_Node    **Out,
@@ -30,16 +102,51 @@ int32_t CacheHT_FindUnusedNode(CacheHT      *h,
                                 BOOL        *NewCreated
                                 );
 
+int32_t CacheHT_FindFreeNode(CacheHT     *h,
+                             uint32_t   ChunkSize,
+                             BOOL       Larger,
+                             Cht_Node   **Out
+                             );
+
+int CacheHT_Relocate(CacheHT *h, int32_t From_i, int32_t To_i);
+
 int CacheHT_InsertToSlot(CacheHT    *h,
                          const char *Key,
                          int        Node_index,
                          Cht_Node   *Node,
-                         uint32_t   *HashValue
+                         uint64_t   *HashValue
                          );
 
 int CacheHT_RemoveFromSlot(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node);
 
-Cht_Node *CacheHT_Get(CacheHT *h, const char *Key, Cht_Node *Start, uint32_t *HashValue);
+Cht_Node *CacheHT_Get(CacheHT *h, const char *Key, Cht_Node *Start, uint64_t *HashValue);
+
+int CacheHT_NeedGrowing(CacheHT *h, int *NewSlotCount);
+
+int CacheHT_Grow(CacheHT    *h,
+                 char       *BaseAddr,
+                 int32_t    Node_index,
+                 char       *Chunk,
+                 int        NewSlotCount
+                 );
+
+void CacheHT_Rehash(CacheHT *h, int Steps);
+
+double CacheHT_LoadFactor(CacheHT *h);
+
+int32_t CacheHT_ClockVictim(CacheHT *h, Cht_Node **Out);
+
+int32_t CacheHT_SubscriptOf(CacheHT *h, const Cht_Node *Node);
+
+void CacheHT_SetStaleTime(CacheHT *h, uint32_t StaleTime);
+
+void CacheHT_ExpiryLink(CacheHT *h, Cht_Node *Node);
+
+void CacheHT_ExpiryUnlink(CacheHT *h, Cht_Node *Node);
+
+void CacheHT_ExpiryDetach(CacheHT *h, time_t BucketTime);
+
+int32_t CacheHT_ExpiryPop(CacheHT *h, Cht_Node **Out);
 
 void CacheHT_Free(CacheHT *h);
 
@@ -0,0 +1,164 @@
+#include <string.h>
+#include "cachesketch.h"
+#include "common.h"
+#include "utils.h"
+
+/* Lookups counted before the counters are halved, times of the width */
+#define CACHE_SKETCH_SAMPLE_FACTOR  10
+
+#define CACHE_SKETCH_MIN_WIDTH  256
+
+/* Every row indexes the counters by a different scramble of the hash */
+static const uint64_t Seeds[CACHE_SKETCH_ROWS] = {
+    0xC3A5C85C97CB3127ULL,
+    0xB492B66FBE98F273ULL,
+    0x9AE16A3B2F90404FULL,
+    0xCBF29CE484222325ULL
+};
+
+int CacheSketch_Init(CacheSketch *s, int32_t Size, int32_t EntrySize)
+{
+    uint32_t    Width = CACHE_SKETCH_MIN_WIDTH;
+
+    while( Width < (uint32_t)(Size / EntrySize) && Width < 0x1000000 )
+    {
+        Width *= 2;
+    }
+
+    s->Counters = SafeMalloc(Width * CACHE_SKETCH_ROWS);
+    s->Doorkeeper = SafeMalloc(Width * CACHE_SKETCH_ROWS);
+    if( s->Counters == NULL || s->Doorkeeper == NULL )
+    {
+        CacheSketch_Free(s);
+        return -1;
+    }
+
+    memset(s->Counters, 0, Width * CACHE_SKETCH_ROWS);
+    memset(s->Doorkeeper, 0, Width * CACHE_SKETCH_ROWS);
+
+    s->Mask = Width - 1;
+    s->Additions = 0;
+    s->SampleSize = Width * CACHE_SKETCH_SAMPLE_FACTOR;
+
+    return 0;
+}
+
+static uint8_t *CacheSketch_Counter(const CacheSketch *s,
+                                    uint64_t HashValue,
+                                    int Row
+                                    )
+{
+    uint64_t    h = (HashValue + Seeds[Row]) * Seeds[Row];
+
+    h ^= h >> 32;
+
+    return s->Counters + (s->Mask + 1) * Row + ((uint32_t)h & s->Mask);
+}
+
+/* Bit of the key in the doorkeeper, the doorkeeper is as large as the
+ * counters, that is, 8 bits for every counter.
+ */
+static BOOL CacheSketch_Door(const CacheSketch *s,
+                             uint64_t HashValue,
+                             uint32_t *Byte,
+                             uint8_t *Bit
+                             )
+{
+    uint64_t    h = (HashValue ^ (HashValue >> 29)) * Seeds[CACHE_SKETCH_ROWS - 1];
+    uint32_t    Index = (uint32_t)(h >> 32) & ((s->Mask + 1) * CACHE_SKETCH_ROWS * 8 - 1);
+
+    *Byte = Index / 8;
+    *Bit = 1 << (Index % 8);
+
+    return (s->Doorkeeper[*Byte] & *Bit) != 0;
+}
+
+static int CacheSketch_Count(const CacheSketch *s, uint64_t HashValue)
+{
+    int Min = CACHE_SKETCH_MAX;
+    int Row;
+
+    for( Row = 0; Row != CACHE_SKETCH_ROWS; ++Row )
+    {
+        int Count = *CacheSketch_Counter(s, HashValue, Row);
+
+        if( Count < Min )
+        {
+            Min = Count;
+        }
+    }
+
+    return Min;
+}
+
+int CacheSketch_Estimate(const CacheSketch *s, uint64_t HashValue)
+{
+    uint32_t    Byte;
+    uint8_t     Bit;
+    int         Count = CacheSketch_Count(s, HashValue);
+
+    /* The counters outlive the doorkeeper when being halved */
+    return CacheSketch_Door(s, HashValue, &Byte, &Bit) ? Count + 1 : Count;
+}
+
+void CacheSketch_Add(CacheSketch *s, uint64_t HashValue)
+{
+    uint32_t    Byte;
+    uint8_t     Bit;
+    int         Min;
+    int         Row;
+
+    ++(s->Additions);
+
+    if( !CacheSketch_Door(s, HashValue, &Byte, &Bit) )
+    {
+        s->Doorkeeper[Byte] |= Bit;
+        return;
+    }
+
+    Min = CacheSketch_Count(s, HashValue);
+    if( Min >= CACHE_SKETCH_MAX )
+    {
+        return;
+    }
+
+    /* Conservative update, only the smallest counters are incremented, the
+     * others have been overestimated by collisions.
+     */
+    for( Row = 0; Row != CACHE_SKETCH_ROWS; ++Row )
+    {
+        uint8_t *Counter = CacheSketch_Counter(s, HashValue, Row);
+
+        if( *Counter == Min )
+        {
+            *Counter = Min + 1;
+        }
+    }
+}
+
+void CacheSketch_Age(CacheSketch *s)
+{
+    uint32_t    loop;
+
+    if( s->Additions < s->SampleSize )
+    {
+        return;
+    }
+
+    for( loop = 0; loop != (s->Mask + 1) * CACHE_SKETCH_ROWS; ++loop )
+    {
+        s->Counters[loop] >>= 1;
+    }
+
+    memset(s->Doorkeeper, 0, (s->Mask + 1) * CACHE_SKETCH_ROWS);
+
+    s->Additions /= 2;
+}
+
+void CacheSketch_Free(CacheSketch *s)
+{
+    SafeFree(s->Counters);
+    SafeFree(s->Doorkeeper);
+    s->Counters = NULL;
+    s->Doorkeeper = NULL;
+}
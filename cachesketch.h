@@ -0,0 +1,48 @@
+#ifndef CACHESKETCH_H_INCLUDED
+#define CACHESKETCH_H_INCLUDED
+
+#include <stdint.h>
+
+/* Count-min sketch estimating how often the keys of the cache are looked up,
+ * for admitting new entries to a full shard (TinyLFU,
+ * https://arxiv.org/abs/1512.00727). It is kept in ordinary memory, never
+ * in the cache file, since the counts are meaningful only to a running
+ * instance.
+ *
+ * The first lookup of a key only marks it in the doorkeeper, a bitmap, so that
+ * keys looked up once, which are the most, never get into the counters and
+ * inflate the estimations of others. Counters saturate at CACHE_SKETCH_MAX,
+ * and all of them are halved, and the doorkeeper cleared, once `SampleSize'
+ * lookups have been counted, so that keys which were popular long ago fade
+ * out.
+ */
+#define CACHE_SKETCH_ROWS   4
+#define CACHE_SKETCH_MAX    15
+
+typedef struct _CacheSketch{
+    /* CACHE_SKETCH_ROWS rows of `Mask + 1' counters */
+    uint8_t     *Counters;
+    uint32_t    Mask;
+
+    /* 8 * CACHE_SKETCH_ROWS * `Mask + 1' bits */
+    uint8_t     *Doorkeeper;
+
+    /* Lookups counted since the last halving */
+    uint32_t    Additions;
+    uint32_t    SampleSize;
+} CacheSketch;
+
+/* About one counter each row for every `EntrySize' bytes of `Size' */
+int CacheSketch_Init(CacheSketch *s, int32_t Size, int32_t EntrySize);
+
+/* None of these is thread-safe, the caller serializes them */
+void CacheSketch_Add(CacheSketch *s, uint64_t HashValue);
+
+int CacheSketch_Estimate(const CacheSketch *s, uint64_t HashValue);
+
+/* Halve the counters if enough lookups have been counted */
+void CacheSketch_Age(CacheSketch *s);
+
+void CacheSketch_Free(CacheSketch *s);
+
+#endif // CACHESKETCH_H_INCLUDED
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cachesnapshot.h"
+#include "dnscache.h"
+#include "dnsparser.h"
+#include "dnsgenerator.h"
+#include "array.h"
+#include "utils.h"
+#include "logs.h"
+#include "timedtask.h"
+
+/* Format of a snapshot, numbers are all in network order:
+ *  Magic (8 bytes), Version (32 bits), Time written (32 bits)
+ *  Records, the newest first, as in the messages
+ *  (https://tools.ietf.org/html/rfc1035#section-4.1.3):
+ *      Name (uncompressed), Type (16 bits), Class (16 bits),
+ *      TTL left (32 bits), RDLength (16 bits), RData (names uncompressed)
+ */
+#define SNAPSHOT_MAGIC          "DNSFSNAP"
+#define SNAPSHOT_VERSION        2
+#define SNAPSHOT_HEADER_LENGTH  16
+
+/* Type, class, TTL and RDLength */
+#define SNAPSHOT_FIXED_LENGTH   10
+
+/* Names and RDATA longer than these are never cached */
+#define SNAPSHOT_NAME_MAX       256
+#define SNAPSHOT_RDATA_MAX      1024
+
+static BOOL             Enabled = FALSE;
+static char             SnapshotFile[1024];
+static BOOL             IgnoreTTL = FALSE;
+
+/* Snapshots are written by the timed task and at exit */
+static EFFECTIVE_LOCK   WritingLock;
+
+typedef struct _SnapshotIndex{
+    time_t  TimeAdded;
+    int32_t Offset; /* Of the record in `Records' */
+    int32_t Length;
+} SnapshotIndex;
+
+typedef struct _SnapshotContext{
+    /* Records one after another, in the order of enumerating */
+    char    *Records;
+    int32_t Used;
+    int32_t Allocated;
+
+    Array   Index;
+    BOOL    Failed;
+} SnapshotContext;
+
+static void CacheSnapshot_Collect(const char *Name,
+                                  DNSRecordType Type,
+                                  DNSRecordClass Klass,
+                                  const char *RData,
+                                  int RDLength,
+                                  uint32_t TTL,
+                                  time_t TimeAdded,
+                                  SnapshotContext *c
+                                  )
+{
+    SnapshotIndex   i;
+    int             NameLength = strlen(Name) + 1;
+    int             Length = NameLength + SNAPSHOT_FIXED_LENGTH + RDLength;
+    char            *Record;
+
+    if( c->Failed )
+    {
+        return;
+    }
+
+    if( c->Used + Length > c->Allocated )
+    {
+        int32_t NewAllocated = c->Allocated * 2 + Length;
+
+        if( SafeRealloc((void **)&(c->Records), NewAllocated) != 0 )
+        {
+            c->Failed = TRUE;
+            return;
+        }
+
+        c->Allocated = NewAllocated;
+    }
+
+    i.TimeAdded = TimeAdded;
+    i.Offset = c->Used;
+    i.Length = Length;
+    if( Array_PushBack(&(c->Index), &i, NULL) < 0 )
+    {
+        c->Failed = TRUE;
+        return;
+    }
+
+    Record = c->Records + c->Used;
+
+    memcpy(Record, Name, NameLength);
+    Record += NameLength;
+
+    SET_16_BIT_U_INT(Record, Type);
+    SET_16_BIT_U_INT(Record + 2, Klass);
+    SET_32_BIT_U_INT(Record + 4, TTL);
+    SET_16_BIT_U_INT(Record + 8, RDLength);
+    memcpy(Record + SNAPSHOT_FIXED_LENGTH, RData, RDLength);
+
+    c->Used += Length;
+}
+
+/* The newest first */
+static int CacheSnapshot_Compare(const SnapshotIndex *One, const SnapshotIndex *Two)
+{
+    if( One->TimeAdded == Two->TimeAdded )
+    {
+        return 0;
+    }
+
+    return One->TimeAdded > Two->TimeAdded ? -1 : 1;
+}
+
+/* The records are written into a temporary file first, which then takes the
+ * place of the old snapshot, so that a snapshot is never half written. The
+ * processes sharing a cache all write snapshots, each has a temporary file of
+ * its own.
+ */
+static int CacheSnapshot_WriteFile(SnapshotContext *c)
+{
+    char    TmpFile[sizeof(SnapshotFile) + 16];
+    char    Header[SNAPSHOT_HEADER_LENGTH];
+    FILE    *fp;
+    int     loop;
+
+#ifdef WIN32
+    sprintf(TmpFile, "%s.%d.tmp", SnapshotFile, (int)GetCurrentProcessId());
+#else /* WIN32 */
+    sprintf(TmpFile, "%s.%d.tmp", SnapshotFile, (int)getpid());
+#endif /* WIN32 */
+
+    fp = fopen(TmpFile, "wb");
+    if( fp == NULL )
+    {
+        return -1;
+    }
+
+    memcpy(Header, SNAPSHOT_MAGIC, 8);
+    SET_32_BIT_U_INT(Header + 8, SNAPSHOT_VERSION);
+    SET_32_BIT_U_INT(Header + 12, time(NULL));
+
+    if( fwrite(Header, 1, sizeof(Header), fp) != sizeof(Header) )
+    {
+        fclose(fp);
+        return -2;
+    }
+
+    for( loop = 0; loop != Array_GetUsed(&(c->Index)); ++loop )
+    {
+        SnapshotIndex   *i = Array_GetBySubscript(&(c->Index), loop);
+
+        if( fwrite(c->Records + i->Offset, 1, i->Length, fp) != i->Length )
+        {
+            fclose(fp);
+            return -3;
+        }
+    }
+
+    if( fclose(fp) != 0 )
+    {
+        return -4;
+    }
+
+#ifdef WIN32
+    remove(SnapshotFile);
+#endif /* WIN32 */
+
+    if( rename(TmpFile, SnapshotFile) != 0 )
+    {
+        return -5;
+    }
+
+    return Array_GetUsed(&(c->Index));
+}
+
+static int CacheSnapshot_Write(void)
+{
+    SnapshotContext c;
+    int             ret;
+
+    c.Records = NULL;
+    c.Used = 0;
+    c.Allocated = 0;
+    c.Failed = FALSE;
+
+    if( Array_Init(&(c.Index), sizeof(SnapshotIndex), 1024, FALSE, NULL) != 0 )
+    {
+        return -1;
+    }
+
+    DNSCache_Enum((DNSCache_EnumCallback)CacheSnapshot_Collect, &c);
+
+    if( c.Failed )
+    {
+        ret = -2;
+    } else {
+        Array_Sort(&(c.Index),
+                   (int (*)(const void *, const void *))CacheSnapshot_Compare
+                   );
+
+        ret = CacheSnapshot_WriteFile(&c);
+    }
+
+    SafeFree(c.Records);
+    Array_Free(&(c.Index));
+
+    return ret;
+}
+
+static int CacheSnapshot_Task(void *Unused, void *Unused2)
+{
+    int ret;
+
+    EFFECTIVE_LOCK_GET(WritingLock);
+    ret = CacheSnapshot_Write();
+    EFFECTIVE_LOCK_RELEASE(WritingLock);
+
+    if( ret < 0 )
+    {
+        ERRORMSG("Writing the cache snapshot failed : %d.\n", ret);
+    }
+
+    return 0;
+}
+
+void CacheSnapshot_Save(void)
+{
+    int ret;
+
+    if( !Enabled )
+    {
+        return;
+    }
+
+    EFFECTIVE_LOCK_GET(WritingLock);
+    ret = CacheSnapshot_Write();
+    EFFECTIVE_LOCK_RELEASE(WritingLock);
+
+    if( ret < 0 )
+    {
+        ERRORMSG("Writing the cache snapshot failed : %d.\n", ret);
+    } else {
+        INFO("%d records written to the cache snapshot.\n", ret);
+    }
+}
+
+/* An uncompressed wire-format name read into `Name', -1 if it's broken */
+static int CacheSnapshot_ReadName(FILE *fp, char Name[SNAPSHOT_NAME_MAX])
+{
+    int Length = 0;
+
+    do
+    {
+        int LabelLength = fgetc(fp);
+
+        if( LabelLength == EOF ||
+            LabelLength > 63 ||
+            Length + 1 + LabelLength >= SNAPSHOT_NAME_MAX
+            )
+        {
+            return -1;
+        }
+
+        Name[Length++] = LabelLength;
+
+        if( LabelLength == 0 )
+        {
+            return 0;
+        }
+
+        if( fread(Name + Length, 1, LabelLength, fp) != LabelLength )
+        {
+            return -1;
+        }
+
+        Length += LabelLength;
+
+    } while( TRUE );
+}
+
+/* Records are loaded the newest first until the cache is full */
+static void CacheSnapshot_Load(void)
+{
+    FILE    *fp = fopen(SnapshotFile, "rb");
+    char    Header[SNAPSHOT_HEADER_LENGTH];
+    char    Name[SNAPSHOT_NAME_MAX];
+    char    Fixed[SNAPSHOT_FIXED_LENGTH];
+    char    RData[SNAPSHOT_RDATA_MAX];
+    time_t  Elapsed;
+    int     Loaded = 0, Skipped = 0;
+
+    if( fp == NULL )
+    {
+        return;
+    }
+
+    if( fread(Header, 1, sizeof(Header), fp) != sizeof(Header) ||
+        memcmp(Header, SNAPSHOT_MAGIC, 8) != 0 ||
+        GET_32_BIT_U_INT(Header + 8) != SNAPSHOT_VERSION
+        )
+    {
+        WARNING("`%s' is not a cache snapshot of this version, ignored.\n", SnapshotFile);
+        fclose(fp);
+        return;
+    }
+
+    Elapsed = time(NULL) - (time_t)GET_32_BIT_U_INT(Header + 12);
+    if( Elapsed < 0 || IgnoreTTL )
+    {
+        Elapsed = 0;
+    }
+
+    while( TRUE )
+    {
+        uint32_t    TTL;
+        int         RDLength;
+        int         ret;
+
+        /* The end */
+        if( (ret = fgetc(fp)) == EOF )
+        {
+            break;
+        }
+
+        ungetc(ret, fp);
+
+        if( CacheSnapshot_ReadName(fp, Name) != 0 ||
+            fread(Fixed, 1, sizeof(Fixed), fp) != sizeof(Fixed)
+            )
+        {
+            WARNING("The cache snapshot is truncated.\n");
+            break;
+        }
+
+        TTL = GET_32_BIT_U_INT(Fixed + 4);
+        RDLength = GET_16_BIT_U_INT(Fixed + 8);
+
+        if( RDLength > sizeof(RData) ||
+            fread(RData, 1, RDLength, fp) != RDLength
+            )
+        {
+            WARNING("The cache snapshot is truncated.\n");
+            break;
+        }
+
+        /* Expired */
+        if( TTL <= Elapsed )
+        {
+            ++Skipped;
+            continue;
+        }
+
+        ret = DNSCache_AddEntry(Name,
+                                (DNSRecordType)GET_16_BIT_U_INT(Fixed),
+                                (DNSRecordClass)GET_16_BIT_U_INT(Fixed + 2),
+                                RData,
+                                RDLength,
+                                TTL - Elapsed
+                                );
+        if( ret == 0 )
+        {
+            ++Loaded;
+        } else if( ret == -1 )
+        {
+            /* The rest are older */
+            INFO("The cache is full, the older records of the snapshot are not loaded.\n");
+            break;
+        } else {
+            ++Skipped;
+        }
+    }
+
+    fclose(fp);
+
+    INFO("%d records loaded from the cache snapshot, %d skipped.\n",
+         Loaded,
+         Skipped
+         );
+}
+
+int CacheSnapshot_Init(ConfigFileInfo *ConfigInfo, BOOL Load)
+{
+    const char  *File = ConfigGetRawString(ConfigInfo, "CacheSnapshot");
+    int         Interval = ConfigGetInt32(ConfigInfo, "CacheSnapshotInterval");
+
+    if( File == NULL || *File == '\0' )
+    {
+        return 0;
+    }
+
+    if( strlen(File) >= sizeof(SnapshotFile) )
+    {
+        ERRORMSG("The path of `CacheSnapshot' is too long.\n");
+        return -1;
+    }
+
+    strcpy(SnapshotFile, File);
+    IgnoreTTL = ConfigGetBoolean(ConfigInfo, "IgnoreTTL");
+
+    INFO("Cache Snapshot : %s\n", SnapshotFile);
+
+    EFFECTIVE_LOCK_INIT(WritingLock);
+    Enabled = TRUE;
+
+    if( Load )
+    {
+        CacheSnapshot_Load();
+    }
+
+    atexit(CacheSnapshot_Save);
+
+    if( Interval > 0 )
+    {
+        return TimedTask_Add(TRUE,
+                             TRUE,
+                             Interval * 1000,
+                             (TaskFunc)CacheSnapshot_Task,
+                             NULL,
+                             NULL,
+                             FALSE
+                             );
+    }
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef CACHESNAPSHOT_H_INCLUDED
+#define CACHESNAPSHOT_H_INCLUDED
+
+#include "readconfig.h"
+
+/* A snapshot holds the plain records of the cache, the way they are in the
+ * messages, so it doesn't depend on the size or the layout of the cache. A
+ * snapshot written in another version of its format is ignored. It's written
+ * periodically and when the program exits, and loaded into a new cache when
+ * the program starts.
+ */
+
+/* `Load' is FALSE if the cache has been reloaded from the cache file */
+int CacheSnapshot_Init(ConfigFileInfo *ConfigInfo, BOOL Load);
+
+/* Also called at exit, does nothing if snapshots are disabled */
+void CacheSnapshot_Save(void);
+
+#endif // CACHESNAPSHOT_H_INCLUDED
@@ -0,0 +1,392 @@
+#include <string.h>
+#include "clientsubnet.h"
+#include "dnsparser.h"
+#include "dnsgenerator.h"
+#include "common.h"
+#include "logs.h"
+
+#define CLIENT_SUBNET_OPTION_CODE   8
+
+/* FAMILY, SOURCE PREFIX-LENGTH and SCOPE PREFIX-LENGTH */
+#define CLIENT_SUBNET_FIXED_LENGTH  4
+
+/* UDP payload size advertised by the OPT records added */
+#define CLIENT_SUBNET_PAYLOAD_SIZE  1280
+
+/* Source prefix lengths sent upstream, 0 if disabled */
+static int  PrefixIPv4 = 0;
+static int  PrefixIPv6 = 0;
+
+int ClientSubnet_Init(ConfigFileInfo *ConfigInfo)
+{
+    PrefixIPv4 = ConfigGetInt32(ConfigInfo, "ClientSubnetIPv4");
+    PrefixIPv6 = ConfigGetInt32(ConfigInfo, "ClientSubnetIPv6");
+
+    if( PrefixIPv4 < 0 || PrefixIPv4 > 32 )
+    {
+        WARNING("Bad `ClientSubnetIPv4' : %d, disabled.\n", PrefixIPv4);
+        PrefixIPv4 = 0;
+    }
+
+    if( PrefixIPv6 < 0 || PrefixIPv6 > 128 )
+    {
+        WARNING("Bad `ClientSubnetIPv6' : %d, disabled.\n", PrefixIPv6);
+        PrefixIPv6 = 0;
+    }
+
+    if( PrefixIPv4 > 0 || PrefixIPv6 > 0 )
+    {
+        INFO("Client Subnet : IPv4 /%d, IPv6 /%d\n", PrefixIPv4, PrefixIPv6);
+    }
+
+    return 0;
+}
+
+/* Bits beyond the prefix cleared */
+static void ClientSubnet_Mask(ClientSubnet *s)
+{
+    int Bytes = s->Prefix / 8;
+
+    if( s->Prefix % 8 != 0 )
+    {
+        s->Address[Bytes] &= (unsigned char)(0xFF << (8 - s->Prefix % 8));
+        ++Bytes;
+    }
+
+    memset(s->Address + Bytes, 0, sizeof(s->Address) - Bytes);
+}
+
+/* The option in the RDATA of an OPT record, NULL if there isn't */
+static const char *ClientSubnet_FindOption(const char *RData, int RDLength)
+{
+    const char *End = RData + RDLength;
+
+    while( End - RData >= 4 )
+    {
+        int Length = GET_16_BIT_U_INT(RData + 2);
+
+        if( End - RData - 4 < Length )
+        {
+            return NULL;
+        }
+
+        if( GET_16_BIT_U_INT(RData) == CLIENT_SUBNET_OPTION_CODE )
+        {
+            return RData;
+        }
+
+        RData += 4 + Length;
+    }
+
+    return NULL;
+}
+
+int ClientSubnet_Parse(const char *RData, int RDLength, ClientSubnet *s)
+{
+    const char  *Option = ClientSubnet_FindOption(RData, RDLength);
+    int         Length;
+    int         Family;
+    int         MaxPrefix;
+
+    if( Option == NULL )
+    {
+        return -1;
+    }
+
+    Length = GET_16_BIT_U_INT(Option + 2) - CLIENT_SUBNET_FIXED_LENGTH;
+    Family = GET_16_BIT_U_INT(Option + 4);
+
+    switch( Family )
+    {
+    case 1:
+        MaxPrefix = 32;
+        break;
+
+    case 2:
+        MaxPrefix = 128;
+        break;
+
+    default:
+        return -2;
+    }
+
+    /* No more address than the prefix takes
+       (https://tools.ietf.org/html/rfc7871#section-6) */
+    if( GET_8_BIT_U_INT(Option + 6) > MaxPrefix ||
+        GET_8_BIT_U_INT(Option + 7) > MaxPrefix ||
+        Length != (GET_8_BIT_U_INT(Option + 6) + 7) / 8
+        )
+    {
+        return -3;
+    }
+
+    memset(s, 0, sizeof(ClientSubnet));
+
+    s->Family = Family;
+    s->Prefix = GET_8_BIT_U_INT(Option + 6);
+    s->Scope = GET_8_BIT_U_INT(Option + 7);
+    memcpy(s->Address, Option + 8, Length);
+
+    ClientSubnet_Mask(s);
+
+    return 0;
+}
+
+void ClientSubnet_FromClient(IHeader *h,
+                             const struct sockaddr *Addr,
+                             sa_family_t Family
+                             )
+{
+    ClientSubnet *s = &(h->Subnet);
+    const unsigned char *Address;
+
+    /* Scopes of queries are always 0 */
+    s->Scope = 0;
+
+    if( s->InQuery )
+    {
+        return;
+    }
+
+    if( Family == AF_INET )
+    {
+        Address = (const unsigned char *)&(((const struct sockaddr_in *)Addr)->sin_addr);
+        s->Family = 1;
+    } else if( Family == AF_INET6 ){
+        static const unsigned char Mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+        Address = (const unsigned char *)&(((const struct sockaddr_in6 *)Addr)->sin6_addr);
+
+        /* IPv4 clients of IPv6 sockets */
+        if( memcmp(Address, Mapped, sizeof(Mapped)) == 0 )
+        {
+            Address += sizeof(Mapped);
+            s->Family = 1;
+        } else {
+            s->Family = 2;
+        }
+    } else {
+        return;
+    }
+
+    s->Prefix = s->Family == 1 ? PrefixIPv4 : PrefixIPv6;
+    if( s->Prefix == 0 )
+    {
+        s->Family = 0;
+        return;
+    }
+
+    memcpy(s->Address, Address, s->Family == 1 ? 4 : 16);
+    ClientSubnet_Mask(s);
+}
+
+/* RDATA of the OPT record of a message, NULL if there isn't.
+ * The start of the record is stored in `Record'.
+ */
+static char *ClientSubnet_FindOpt(char *Entity,
+                                  int EntityLength,
+                                  char **Record,
+                                  int *RDLength
+                                  )
+{
+    DnsSimpleParser p;
+    DnsSimpleParserIterator i;
+
+    if( DnsSimpleParser_Init(&p, Entity, EntityLength, FALSE) != 0 ||
+        DnsSimpleParserIterator_Init(&i, &p) != 0
+        )
+    {
+        return NULL;
+    }
+
+    while( (*Record = i.Next(&i)) != NULL )
+    {
+        if( i.Purpose == DNS_RECORD_PURPOSE_ADDITIONAL &&
+            i.Type == DNS_TYPE_OPT
+            )
+        {
+            char *RData = i.RowData(&i);
+
+            if( RData + i.DataLength > Entity + EntityLength )
+            {
+                return NULL;
+            }
+
+            *RDLength = i.DataLength;
+            return RData;
+        }
+    }
+
+    return NULL;
+}
+
+int ClientSubnet_Insert(char *Entity,
+                        int EntityLength,
+                        int BufferLength,
+                        const ClientSubnet *s,
+                        int Scope
+                        )
+{
+    char    *Record;
+    char    *RData;
+    char    *Tail;
+    int     RDLength;
+    int     AddressLength = (s->Prefix + 7) / 8;
+    int     OptionLength = 4 + CLIENT_SUBNET_FIXED_LENGTH + AddressLength;
+
+    RData = ClientSubnet_FindOpt(Entity, EntityLength, &Record, &RDLength);
+    if( RData == NULL )
+    {
+        return -1;
+    }
+
+    if( EntityLength + OptionLength > BufferLength ||
+        RDLength + OptionLength > 0xFFFF
+        )
+    {
+        return -2;
+    }
+
+    /* The records after the OPT record, if there are any */
+    Tail = RData + RDLength;
+    memmove(Tail + OptionLength, Tail, Entity + EntityLength - Tail);
+
+    SET_16_BIT_U_INT(Tail, CLIENT_SUBNET_OPTION_CODE);
+    SET_16_BIT_U_INT(Tail + 2, CLIENT_SUBNET_FIXED_LENGTH + AddressLength);
+    SET_16_BIT_U_INT(Tail + 4, s->Family);
+    Tail[6] = s->Prefix;
+    Tail[7] = Scope;
+    memcpy(Tail + 8, s->Address, AddressLength);
+
+    SET_16_BIT_U_INT(RData - 2, RDLength + OptionLength);
+
+    return EntityLength + OptionLength;
+}
+
+/* Queries not carrying an OPT record get one, so that the option could be
+ * added. What have been added is recorded in `IHeader::SubnetAdded' to be
+ * removed from the answer, since the client didn't ask for it.
+ */
+int ClientSubnet_AddToQuery(MsgContext *MsgCtx, int BufferLength)
+{
+    IHeader *h = (IHeader *)MsgCtx;
+    char    *Entity = IHEADER_TAIL(h);
+    int     Added = CLIENT_SUBNET_ADDED_OPTION;
+    int     Length;
+
+    /* Sent again by TCP modules, or nothing to add */
+    if( h->Subnet.Family == 0 ||
+        h->Subnet.InQuery ||
+        h->SubnetAdded != CLIENT_SUBNET_ADDED_NONE
+        )
+    {
+        return 0;
+    }
+
+    BufferLength -= sizeof(IHeader);
+
+    /* OPT record 11 bytes, the option no more than 24 bytes */
+    if( h->EntityLength + 11 + 24 > BufferLength )
+    {
+        return -1;
+    }
+
+    if( !(h->EDNSEnabled) )
+    {
+        DnsGenerator g;
+
+        if( DnsGenerator_Init(&g,
+                              Entity,
+                              BufferLength,
+                              Entity,
+                              h->EntityLength,
+                              FALSE
+                              )
+            != 0 )
+        {
+            return -2;
+        }
+
+        while( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ADDITIONAL );
+
+        if( g.EDns(&g, CLIENT_SUBNET_PAYLOAD_SIZE, FALSE) != 0 )
+        {
+            return -3;
+        }
+
+        h->EntityLength = g.Length(&g);
+        Added = CLIENT_SUBNET_ADDED_OPT;
+    }
+
+    Length = ClientSubnet_Insert(Entity,
+                                 h->EntityLength,
+                                 BufferLength,
+                                 &(h->Subnet),
+                                 0
+                                 );
+    if( Length < 0 )
+    {
+        return -4;
+    }
+
+    h->EntityLength = Length;
+    h->SubnetAdded = Added;
+
+    return 0;
+}
+
+void ClientSubnet_RemoveFromAnswer(MsgContext *MsgCtx)
+{
+    IHeader *h = (IHeader *)MsgCtx;
+    char    *Entity = IHEADER_TAIL(h);
+    char    *EntityEnd = Entity + h->EntityLength;
+    char    *Record;
+    char    *RData;
+    char    *Option;
+    int     RDLength;
+    int     OptionLength;
+
+    if( h->SubnetAdded == CLIENT_SUBNET_ADDED_NONE )
+    {
+        return;
+    }
+
+    RData = ClientSubnet_FindOpt(Entity, h->EntityLength, &Record, &RDLength);
+    if( RData == NULL )
+    {
+        return;
+    }
+
+    if( h->SubnetAdded == CLIENT_SUBNET_ADDED_OPT )
+    {
+        /* The whole record */
+        memmove(Record, RData + RDLength, EntityEnd - (RData + RDLength));
+        h->EntityLength -= RData + RDLength - Record;
+        h->EDNSEnabled = FALSE;
+
+        DNSSetAdditionalCount(Entity, DNSGetAdditionalCount(Entity) - 1);
+        return;
+    }
+
+    Option = (char *)ClientSubnet_FindOption(RData, RDLength);
+    if( Option == NULL )
+    {
+        return;
+    }
+
+    OptionLength = 4 + GET_16_BIT_U_INT(Option + 2);
+
+    memmove(Option, Option + OptionLength, EntityEnd - (Option + OptionLength));
+    h->EntityLength -= OptionLength;
+
+    SET_16_BIT_U_INT(RData - 2, RDLength - OptionLength);
+}
+
+/* Scopes are not compared, they are of answers */
+BOOL ClientSubnet_Same(const ClientSubnet *One, const ClientSubnet *Two)
+{
+    return One->Family == Two->Family &&
+           One->Prefix == Two->Prefix &&
+           One->InQuery == Two->InQuery &&
+           memcmp(One->Address, Two->Address, sizeof(One->Address)) == 0;
+}
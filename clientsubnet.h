@@ -0,0 +1,49 @@
+#ifndef CLIENTSUBNET_H_INCLUDED
+#define CLIENTSUBNET_H_INCLUDED
+
+#include "readconfig.h"
+#include "iheader.h"
+
+/* EDNS Client Subnet, https://tools.ietf.org/html/rfc7871
+ * Queries are sent upstream with the networks of their clients, and answers
+ * are cached for the networks they are scoped to by the upstream servers.
+ */
+
+/* Values of `IHeader::SubnetAdded' */
+#define CLIENT_SUBNET_ADDED_NONE    0
+#define CLIENT_SUBNET_ADDED_OPTION  1 /* Into the OPT record of the query */
+#define CLIENT_SUBNET_ADDED_OPT     2 /* Along with the OPT record */
+
+int ClientSubnet_Init(ConfigFileInfo *ConfigInfo);
+
+/* The option in the RDATA of an OPT record parsed into `s', 0 if found */
+int ClientSubnet_Parse(const char *RData, int RDLength, ClientSubnet *s);
+
+/* `IHeader::Subnet' set to the network of the client, unless the query
+ * carries one or the family is disabled.
+ */
+void ClientSubnet_FromClient(IHeader *h,
+                             const struct sockaddr *Addr,
+                             sa_family_t Family
+                             );
+
+/* The option with `Scope' appended to the OPT record of a message, which is
+ * no longer than `BufferLength'. Length of the new message returned.
+ */
+int ClientSubnet_Insert(char *Entity,
+                        int EntityLength,
+                        int BufferLength,
+                        const ClientSubnet *s,
+                        int Scope
+                        );
+
+/* The network of the client added to a query going upstream */
+int ClientSubnet_AddToQuery(MsgContext *MsgCtx, int BufferLength);
+
+/* Whatever added by `ClientSubnet_AddToQuery' removed from the answer */
+void ClientSubnet_RemoveFromAnswer(MsgContext *MsgCtx);
+
+/* Whether two queries are of the same network */
+BOOL ClientSubnet_Same(const ClientSubnet *One, const ClientSubnet *Two);
+
+#endif // CLIENTSUBNET_H_INCLUDED
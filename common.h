@@ -59,6 +59,7 @@
     #define CREATE_THREAD(func_ptr, para_ptr, result_holder)    (result_holder) = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)(func_ptr), (para_ptr), 0, NULL);
     #define EXIT_THREAD(r)  return (r)
     #define DETACH_THREAD(t)    CloseHandle(t)
+    #define WAIT_THREAD(t)  (WaitForSingleObject((t), INFINITE), CloseHandle(t))
 
     /* Mutex */
     #define CREATE_MUTEX(m)     ((m) = CreateMutex(NULL, FALSE, NULL))
@@ -188,6 +189,7 @@
     #define CREATE_THREAD(func_ptr, para_ptr, return_value) (pthread_create(&return_value, NULL, (void *(*)())(func_ptr), (para_ptr)))
     #define EXIT_THREAD(r)  pthread_exit(r)
     #define DETACH_THREAD(t)    pthread_detach(t)
+    #define WAIT_THREAD(t)  pthread_join((t), NULL)
 
     /* mutex */
     #define CREATE_MUTEX(m)     (pthread_mutex_init(&(m), NULL))
@@ -351,6 +353,24 @@
     #define __inout_opt
 #endif /* __inout_opt */
 
+/* Variables of which each thread has its own copy */
+#ifdef _MSC_VER
+    #define THREAD_LOCAL    __declspec(thread)
+#else
+    #define THREAD_LOCAL    __thread
+#endif /* _MSC_VER */
+
+/* Atomic operations on a `volatile long', the new value returned */
+#ifdef WIN32
+    #define ATOMIC_INCREASE(p)  InterlockedIncrement(p)
+    #define ATOMIC_DECREASE(p)  InterlockedDecrement(p)
+    #define ATOMIC_ADD(p, v)    (InterlockedExchangeAdd((p), (v)) + (v))
+#else
+    #define ATOMIC_INCREASE(p)  __sync_add_and_fetch((p), 1)
+    #define ATOMIC_DECREASE(p)  __sync_sub_and_fetch((p), 1)
+    #define ATOMIC_ADD(p, v)    __sync_add_and_fetch((p), (v))
+#endif /* WIN32 */
+
 #define LENGTH_OF_IPV6_ADDRESS_ASCII    (sizeof("XXXX:XXXX:XXXX:XXXX:XXXX:XXXX:xxx.xxx.xxx.xxx"))
 #define LENGTH_OF_IPV4_ADDRESS_ASCII    (sizeof("xxx.xxx.xxx.xxx"))
 
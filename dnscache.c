@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <ctype.h>
 #include "dnscache.h"
 #include "dnsgenerator.h"
 #include "utils.h"
@@ -10,838 +11,3876 @@
 #include "logs.h"
 #include "timedtask.h"
 #include "domainstatistic.h"
+#include "packetcache.h"
+#include "mmgr.h"
+#include "cachesnapshot.h"
+#include "clientsubnet.h"
+#include "cachesketch.h"
+#include "ptimer.h"
+#include "msgpool.h"
 
-#define CACHE_VERSION   22
+#define CACHE_VERSION   36
 
 #define CACHE_END   '\x0A'
 #define CACHE_START '\xFF'
 
+/* Longest wire-format name, with its terminating zero */
+#define CACHE_KEY_NAME_MAX  256
+#define CACHE_KEY_MAX       (CACHE_KEY_NAME_MAX + 5 + CACHE_KEY_SUBNET_MAX)
+#define CACHE_ITEM_MAX      1024
+
+/* How many nodes could be swept each time the lock is held */
+#define CACHE_EXPIRY_BATCH  64
+
+/* How many old slots are moved to the new slots each time a shard is written,
+ * when its slots are growing.
+ */
+#define CACHE_REHASH_STEPS  16
+
+/* Negative answers (RFC 2308) are keyed by the name and the type of the
+ * question, with class 0 which no real record is of.
+ * Their RData: RCode(1) SOAOwnerName SOARData
+ */
+#define CACHE_CLASS_NEGATIVE    DNS_CLASS_UNKNOWN
+
+/* Resolved CNAME chains are flattened, keyed by the name and the type of the
+ * question, with class ANY which no real record is of either.
+ * Their RData: HopCount(1) CanonicalNames (RDLength RData)...
+ * The canonical names are the targets of the hops one after another, the
+ * RDatas are of the records the chain ends with.
+ */
+#define CACHE_CLASS_CHAIN       DNS_CLASS_ANY
+
+/* CNAME chains longer than this are neither followed nor flattened */
+#define CACHE_CNAME_DEPTH_MAX   16
+
+/* Answers to queries with the DO bit set come with DNSSEC records, they are
+ * kept apart from the others.
+ */
+#define CACHE_PARTITION_PLAIN   0
+#define CACHE_PARTITION_DNSSEC  1
+
+/* Answers scoped to a network by EDNS Client Subnet (RFC 7871) are kept apart
+ * from the ones for everyone, their partitions are marked with this bit and
+ * their keys go on with Family(1) Scope(1) and the address truncated to the
+ * scope.
+ */
+#define CACHE_PARTITION_SUBNET  0x80
+#define CACHE_KEY_SUBNET_MAX    (2 + 16)
+
+/* UDP payload size advertised by answers from the cache */
+#define CACHE_EDNS_PAYLOAD_SIZE 1280
+
+/* How many entries could be moved by the compactor each time the lock is
+ * held, an idle shard is compacted batch by batch until nothing could be moved.
+ */
+#define CACHE_COMPACT_BATCH 64
+
+/* How many RRsets could be evicted to make room for a new entry */
+#define CACHE_EVICTION_MAX  16
+
+/* RRsets of an answer dropped at most, the rest of it is not cached then */
+#define CACHE_DROPPED_MAX   8
+
+/* Lookups buffered by a thread at most, see `DNSCache_CountLookup' */
+#define CACHE_LOOKUP_BUFFER 64
+
+/* Interval of the statistic logs, in milliseconds */
+#define CACHE_STATISTIC_INTERVAL    60000
+
+/* TTL of the expired records answered, https://tools.ietf.org/html/rfc8767 */
+#define CACHE_STALE_TTL         30
+
+/* A question is refreshed at most once in this many seconds */
+#define CACHE_REFRESH_INTERVAL  5
+
+/* Slots recording when questions were refreshed last time, direct mapped */
+#define CACHE_REFRESH_SLOTS     1024
+
+/* The least size of a shard, same as the least size of the whole cache of
+ * old versions.
+ */
+#define CACHE_SHARD_MIN_SIZE    102400
+
+/* Estimated bytes taken by an entry, the admission sketch of a shard has a
+ * counter each row for every this many bytes.
+ */
+#define CACHE_SKETCH_ENTRY_SIZE 128
+
+/* Values of `CacheHugePages' */
+#define CACHE_HUGE_PAGES_NONE           0
+#define CACHE_HUGE_PAGES_TRANSPARENT    1
+#define CACHE_HUGE_PAGES_EXPLICIT       2
+
+/* Anonymous mappings backing `MemoryCache' with huge pages are aligned to and
+ * rounded up to this.
+ */
+#define CACHE_HUGE_PAGE_SIZE    (2 * 1024 * 1024)
+
+/* Pages are touched this far apart when prefaulting, no larger than any page
+ * size.
+ */
+#define CACHE_PAGE_SIZE         4096
+
+/* Threads checking and indexing the entries when reloading, each one gets a
+ * batch of this many nodes at a time.
+ */
+#define CACHE_RELOAD_THREADS    4
+#define CACHE_RELOAD_BATCH      4096
+
 static BOOL             Inited = FALSE;
-static BOOL             CacheParallel = FALSE;
 
-static RWLock           CacheLock = NULL_RWLOCK;
+/* Whether the entries have been reloaded from the cache file */
+static BOOL             Reloaded = FALSE;
+static BOOL             CacheParallel = FALSE;
 
 static FileHandle       CacheFileHandle = INVALID_FILE;
 static MappingHandle    CacheMappingHandle = INVALID_MAP;
 static char             *MapStart = NULL;
 static BOOL             MemoryCache = FALSE;
 
-static int32_t          CacheSize;
-static BOOL             IgnoreTTL;
-
-static int32_t          *CacheCount;
+/* Whether the cache file is shared with other processes */
+static BOOL             SharedCache = FALSE;
 
-static volatile int32_t *CacheEnd; /* Offset */
+/* Length of the anonymous mapping if `MemoryCache' is backed by huge pages,
+ * 0 if it is allocated by `SafeMalloc'.
+ */
+static size_t           MapLength = 0;
 
-static CacheHT          *CacheInfo;
+static int32_t          CacheSize;
+static BOOL             IgnoreTTL;
 
 static CacheTtlCtrl     *TtlCtrl = NULL;
 
+/* Entries in the last `PrefetchPercent' percent of their TTL are refreshed
+ * before expiring, if they have been looked up `PrefetchHits' times.
+ */
+static uint32_t         PrefetchPercent = 0;
+static uint32_t         PrefetchHits = 0;
+
+/* Expired entries are answered for this long (seconds) while being refreshed */
+static uint32_t         StaleTime = 0;
+
+/* Whether new entries are admitted to full shards by how often they are
+ * looked up, see `DNSCache_Admit'.
+ */
+static BOOL             CacheAdmission = FALSE;
+
+/* Refreshing queries are sent back here, their answers are discarded */
+static SOCKET           RefreshSocket = INVALID_SOCKET;
+static Address_Type     RefreshAddress;
+static EFFECTIVE_LOCK   RefreshLock;
+static time_t           RefreshTimes[CACHE_REFRESH_SLOTS];
+
+extern BOOL Ipv6_Enabled;
+
+/* Bitmap of the types to be cached, set by `CacheType' */
+static uint8_t          CachedTypes[65536 / 8];
+
+/* Scope lengths answers of IPv4 and IPv6 networks have been cached for, only
+ * these ones are looked up. Bytes rather than bits, so that they could be set
+ * without any lock.
+ */
+static uint8_t          SubnetScopes[2][128 + 1];
+
+/* Processes sharing a cache file lock its shards by robust mutexes in the
+ * file, which are taken over if their holders die. A reader takes one of the
+ * `CACHE_SHARED_STRIPES' ones of a shard, and a writer all of them, so that
+ * lookups of different threads rarely wait for each other.
+ */
+#if !defined(WIN32) && defined(HAVE_PTHREAD_MUTEX_CONSISTENT)
+    #define CACHE_SHARED_SUPPORTED
+    typedef pthread_mutex_t CacheSharedLock;
+#else
+    typedef int             CacheSharedLock;
+#endif
+
+#define CACHE_SHARED_STRIPES    8
+
+/* Layout of the cache:
+ *  struct _Header
+ *  struct _ShardHeader[ShardCount]
+ *  Region of shard 0 : entries grow up from its start, nodes grow down from
+ *                      its top, right below its slots.
+ *  Region of shard 1 : ...
+ */
 struct _Header{
     uint32_t    Ver;
     int32_t     CacheSize;
-    int32_t     End;
+    int32_t     ShardCount;
+    /* Nonzero if the cache is shared by processes, see `DNSCache_Share' */
+    int32_t     Shared;
+    /* Where the processes sharing the cache map it */
+    uint64_t    Base;
+    char        Comment[128 - sizeof(uint32_t) - sizeof(int32_t) * 3 - sizeof(uint64_t)];
+};
+
+struct _ShardHeader{
+    int32_t     Start; /* Offset */
+    int32_t     Size;
+    int32_t     End; /* Offset */
     int32_t     CacheCount;
+    /* Odd while the shard is being modified, see `DNSCache_WrLock' */
+    uint32_t    Generation;
+    CacheSharedLock SharedLocks[CACHE_SHARED_STRIPES];
     CacheHT     ht;
-    char        Comment[128 - sizeof(uint32_t) - sizeof(int32_t) - sizeof(int32_t) - sizeof(int32_t) - sizeof(CacheHT)];
 };
 
-static void DNSCacheTTLCountdown_Task(void *Unused, void *Unused2)
-{
-    BOOL        GotMutex = FALSE;
+/* Every shard has its own lock, so the lookups and the insertions of keys
+ * which fall into different shards never contend with each other.
+ */
+typedef struct _CacheShard{
+    RWLock              Lock;
+    struct _ShardHeader *Header;
+
+    /* Insertions, to tell whether the shard has been idle since last sweep */
+    uint32_t            Writes;
+    uint32_t            LastWrites;
+
+    /* Entries evicted for new ones, and new ones not cached for lack of room */
+    uint32_t            Evictions;
+    uint32_t            Rejections;
+
+    /* Lookups of keys, and new entries not admitted for being looked up less
+     * than the victims, if `CacheAdmission' is on. The sketch is local to the
+     * process and has a lock of its own, so flushing lookups into it does not
+     * take `Lock', see `DNSCache_FlushLookups'.
+     */
+    CacheSketch         Sketch;
+    EFFECTIVE_LOCK      SketchLock;
+    uint32_t            Declines;
 
-    Array       *ChunkList = &(CacheInfo->NodeChunk);
-    int         loop = ChunkList->Used - 1;
-    Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(ChunkList, loop);
+    /* Nodes whose chunks are found in place when reloading */
+    int32_t             ReloadedNodes;
+} CacheShard;
 
-    time_t      CurrentTime = time(NULL);
+static CacheShard       *Shards = NULL;
+static int32_t          ShardCount = 1;
 
-    while( Node != NULL )
-    {
-        if( Node->TTL > 0 )
-        {
-            if( CurrentTime - Node->TimeAdded >= Node->TTL )
-            {
-                if(GotMutex == FALSE)
-                {
-                    RWLock_WrLock(CacheLock);
-                    GotMutex = TRUE;
-                }
+/* Of `_ShardHeader::SharedLocks', the one this thread reads by, -1 if not
+ * chosen yet
+ */
+static THREAD_LOCAL int SharedStripe = -1;
+static volatile long    StripesChosen = 0;
 
-                Node->TTL = 0;
+/* Lookups not yet counted, see `DNSCache_CountLookup' */
+static THREAD_LOCAL uint64_t    Lookups[CACHE_LOOKUP_BUFFER];
+static THREAD_LOCAL int         LookupCount = 0;
 
-                *(char *)(MapStart + Node->Offset) = 0xFD;
+/* State of generating an answer from the cache */
+typedef struct _CacheLookup{
+    time_t      CurrentTime;
 
-                CacheHT_RemoveFromSlot(CacheInfo, loop, Node);
+    /* Whether expired entries are used */
+    BOOL        Stale;
 
-                --(*CacheCount);
+    /* Set if any entry used should be refreshed */
+    BOOL        Refresh;
 
-            }
-        }
+    /* How long the answer stays as it is, for the packet cache */
+    uint32_t    Fresh;
+} CacheLookup;
 
-        Node = (Cht_Node *)Array_GetBySubscript(ChunkList, --loop);
-    }
+/* Region of shard `Index', the shards share the cache evenly */
+static void DNSCache_ShardRegion(int Index, int32_t *Start, int32_t *Size)
+{
+    int32_t RegionStart = ROUND_UP(sizeof(struct _Header) + sizeof(struct _ShardHeader) * ShardCount, 8);
+    int32_t RegionSize = ROUND_DOWN((CacheSize - RegionStart) / ShardCount, 8);
 
-    if(GotMutex == TRUE)
-    {
-        if( ChunkList->Used == 0 )
-        {
-            (*CacheEnd) = sizeof(struct _Header);
-        } else {
-            Node = (Cht_Node *)Array_GetBySubscript(ChunkList, ChunkList->Used - 1);
-            (*CacheEnd) = Node->Offset + Node->Length;
-        }
+    *Start = RegionStart + RegionSize * Index;
+    *Size = RegionSize;
+}
 
-        RWLock_UnWLock(CacheLock);
-    }
+static void DNSCache_InitShard(struct _ShardHeader *sh, int Index)
+{
+    DNSCache_ShardRegion(Index, &(sh->Start), &(sh->Size));
+    sh->End = sh->Start;
+    sh->CacheCount = 0;
+    sh->Generation = 0;
+
+    CacheHT_Init(&(sh->ht), MapStart + sh->Start, sh->Size);
 }
 
-static BOOL IsReloadable(void)
+/* Writes to a shard are done in order: the entry, its checksum, and then the
+ * index. A shard whose generation is found odd when reloading was stopped in
+ * the middle of a write, the entries are checked anyway.
+ */
+#ifdef CACHE_SHARED_SUPPORTED
+/* A writer of any process locks every stripe of a shared shard, in order. The
+ * generation found odd then tells that a writer died in the middle of a write
+ * (whose stripes may have been taken over by readers already), and the shard
+ * is emptied, since it may be broken.
+ */
+static void DNSCache_SharedWrLock(CacheShard *s)
 {
-    struct _Header  *Header = (struct _Header *)MapStart;
+    struct _ShardHeader *sh = s->Header;
+    int loop;
 
-    if( Header->Ver != CACHE_VERSION )
+    for( loop = 0; loop != CACHE_SHARED_STRIPES; ++loop )
     {
-        ERRORMSG("The existing cache is not compatible with this version of program.\n");
-        return FALSE;
+        if( pthread_mutex_lock(&(sh->SharedLocks[loop])) == EOWNERDEAD )
+        {
+            pthread_mutex_consistent(&(sh->SharedLocks[loop]));
+        }
     }
 
-    if( Header->CacheSize != CacheSize )
+    if( sh->Generation % 2 != 0 )
     {
-        ERRORMSG("The size of the existing cache and the value of `CacheSize' should be equal.\n");
-        return FALSE;
+        WARNING("Shard %d of the cache was being written by a stopped process, discarded.\n",
+                (int)(s - Shards)
+                );
+        DNSCache_InitShard(sh, s - Shards);
     }
-
-    return TRUE;
 }
 
-static void ReloadCache(void)
+static void DNSCache_SharedUnWLock(CacheShard *s)
 {
-    struct _Header  *Header = (struct _Header *)MapStart;
-
-    INFO("Reloading the cache ...\n");
-
-    CacheInfo = &(Header->ht);
-
-    CacheHT_ReInit(CacheInfo, MapStart, CacheSize);
-
-    CacheEnd = &(Header->End);
-    CacheCount = &(Header->CacheCount);
+    int loop;
 
-    INFO("Cache reloaded, containing %d entries for %d items.\n", CacheInfo->NodeChunk.Used, (*CacheCount));
+    for( loop = CACHE_SHARED_STRIPES - 1; loop >= 0; --loop )
+    {
+        pthread_mutex_unlock(&(s->Header->SharedLocks[loop]));
+    }
 }
 
-static void CreateNewCache(void)
+/* A reader locks the stripe of its thread only. A writer can't be in the
+ * middle of a write meanwhile unless it has died, in which case the shard is
+ * emptied as a writer does, and locked again.
+ */
+static void DNSCache_SharedRdLock(CacheShard *s)
 {
-    struct _Header  *Header = (struct _Header *)MapStart;
-
-    memset(MapStart, 0, CacheSize);
-
-    Header->Ver = CACHE_VERSION;
-    Header->CacheSize = CacheSize;
-    Header->CacheCount = 0;
-    CacheEnd = &(Header->End);
-    *CacheEnd = sizeof(struct _Header);
-    memset(Header->Comment, 0, sizeof(Header->Comment));
-    strncpy(Header->Comment,
-            "\nDo not edit this file.\n",
-            sizeof(Header->Comment)
-            );
+    struct _ShardHeader *sh = s->Header;
 
-    Header->Comment[sizeof(Header->Comment) - 1] = '\0';
+    if( SharedStripe < 0 )
+    {
+        SharedStripe = (int)((getpid() + ATOMIC_INCREASE(&StripesChosen)) %
+                             CACHE_SHARED_STRIPES);
+    }
 
-    CacheInfo = &(Header->ht);
-    CacheCount = &(Header->CacheCount);
+    while( pthread_mutex_lock(&(sh->SharedLocks[SharedStripe])) == EOWNERDEAD )
+    {
+        pthread_mutex_consistent(&(sh->SharedLocks[SharedStripe]));
 
-    CacheHT_Init(CacheInfo, MapStart, CacheSize);
+        if( sh->Generation % 2 == 0 )
+        {
+            break;
+        }
 
+        pthread_mutex_unlock(&(sh->SharedLocks[SharedStripe]));
+        DNSCache_SharedWrLock(s);
+        DNSCache_SharedUnWLock(s);
+    }
 }
+#endif /* CACHE_SHARED_SUPPORTED */
 
-static int InitCacheInfo(ConfigFileInfo *ConfigInfo, BOOL Reload)
+static void DNSCache_RdLock(CacheShard *s)
 {
-    if( Reload == TRUE )
+#ifdef CACHE_SHARED_SUPPORTED
+    if( SharedCache )
     {
-        if( IsReloadable() )
-        {
-            ReloadCache();
-        } else {
-            if( ConfigGetBoolean(ConfigInfo, "OverwriteCache") == FALSE )
-            {
-                return -1;
-            } else {
-                CreateNewCache();
-                INFO("The existing cache has been overwritten.\n");
-            }
-        }
-    } else {
-        CreateNewCache();
+        DNSCache_SharedRdLock(s);
+        return;
     }
-    return 0;
+#endif /* CACHE_SHARED_SUPPORTED */
+
+    RWLock_RdLock(s->Lock);
 }
 
-static void DNSCache_Cleanup(void)
+static void DNSCache_UnRLock(CacheShard *s)
 {
-    if( CacheFileHandle != INVALID_FILE )
-    {
-        if(CacheMappingHandle != INVALID_MAP)
-        {
-            UNMAP_FILE(MapStart, CacheSize);
-            DESTROY_MAPPING(CacheMappingHandle);
-        }
-        CLOSE_FILE(CacheFileHandle);
-    }
-    if( TtlCtrl != NULL)
-    {
-        CacheTtlCrtl_Free(TtlCtrl);
-    }
-    if( MemoryCache && MapStart != NULL )
+#ifdef CACHE_SHARED_SUPPORTED
+    if( SharedCache )
     {
-        CacheHT_Free(CacheInfo);
-        SafeFree(MapStart);
+        pthread_mutex_unlock(&(s->Header->SharedLocks[SharedStripe]));
+        return;
     }
-    RWLock_Destroy(CacheLock);
+#endif /* CACHE_SHARED_SUPPORTED */
+
+    RWLock_UnRLock(s->Lock);
 }
 
-int DNSCache_Init(ConfigFileInfo *ConfigInfo)
+static void DNSCache_WrLock(CacheShard *s)
 {
-    int         _CacheSize = ConfigGetInt32(ConfigInfo, "CacheSize");
-    const char  *CacheFile = ConfigGetRawString(ConfigInfo, "CacheFile");
-    int         InitCacheInfoState;
+#ifdef CACHE_SHARED_SUPPORTED
+    if( SharedCache )
+    {
+        DNSCache_SharedWrLock(s);
+    } else {
+        RWLock_WrLock(s->Lock);
+    }
+#else
+    RWLock_WrLock(s->Lock);
+#endif /* CACHE_SHARED_SUPPORTED */
 
-    int         OverrideTTL;
-    int         TTLMultiple;
+    ++(s->Header->Generation);
+}
 
-    StringList  *ctc = ConfigGetStringList(ConfigInfo, "CacheControl");
+static void DNSCache_UnWLock(CacheShard *s)
+{
+    ++(s->Header->Generation);
 
-    if( ConfigGetBoolean(ConfigInfo, "UseCache") == FALSE )
+#ifdef CACHE_SHARED_SUPPORTED
+    if( SharedCache )
     {
-        return 0;
+        DNSCache_SharedUnWLock(s);
+        return;
     }
+#endif /* CACHE_SHARED_SUPPORTED */
 
-    CacheParallel = ConfigGetBoolean(ConfigInfo, "CacheParallel");
+    RWLock_UnWLock(s->Lock);
+}
 
-    IgnoreTTL = ConfigGetBoolean(ConfigInfo, "IgnoreTTL");
+static CacheShard *DNSCache_GetShard(uint64_t HashValue)
+{
+    /* Slots are chosen by `HashValue % SlotCount', scramble it first so that
+     * a shard never ends up with only a part of its slots used.
+     */
+    uint32_t h = (uint32_t)(HashValue ^ (HashValue >> 32));
 
-    OverrideTTL = ConfigGetInt32(ConfigInfo, "OverrideTTL");
-    TTLMultiple = ConfigGetInt32(ConfigInfo, "MultipleTTL");
+    return Shards + ((h * 2654435761U) >> 16) % ShardCount;
+}
 
-    if( ctc != NULL || OverrideTTL > -1 || TTLMultiple > 1 )
+/* Lookups are counted for `DNSCache_Admit', even those missing, since the
+ * entries are to be added then. They are made with the read locks held, so
+ * each thread buffers them, and adds them to the sketches of their shards
+ * with the sketch locks held later, see `DNSCache_FlushLookups'. Lookups made
+ * while the buffer is full are lost, which does little harm to the
+ * estimations.
+ */
+static void DNSCache_CountLookup(uint64_t HashValue)
+{
+    if( CacheAdmission && LookupCount < CACHE_LOOKUP_BUFFER )
     {
-        TtlCtrl = malloc(sizeof(CacheTtlCtrl));
-        if( TtlCtrl == NULL || CacheTtlCrtl_Init(TtlCtrl) != 0 )
-        {
-            return -1;
-        }
+        Lookups[LookupCount++] = HashValue;
     }
+}
 
-    atexit(DNSCache_Cleanup);
+/* Must be called with no lock held */
+static void DNSCache_FlushLookups(void)
+{
+    int Start;
 
-    if( ctc != NULL )
+    if( LookupCount < CACHE_LOOKUP_BUFFER / 2 )
     {
-        CacheTtlCrtl_Add_From_StringList(TtlCtrl, ctc);
+        return;
     }
 
-    if( OverrideTTL > -1 )
+    /* Shard by shard, lookups of the shards flushed are zeroed */
+    for( Start = 0; Start != LookupCount; ++Start )
     {
-        CacheTtlCrtl_Add(TtlCtrl, "*", TTL_STATE_FIXED, 1, OverrideTTL, TRUE);
-    } else {
-        if( TTLMultiple < 1 )
+        CacheShard  *s;
+        int         loop;
+
+        if( Lookups[Start] == 0 )
         {
-            ERRORMSG("Invalid `MultipleTTL'.\n");
-        } else if( TTLMultiple > 1 ){
-            CacheTtlCrtl_Add(TtlCtrl, "*", TTL_STATE_VARIABLE, TTLMultiple, 0, TRUE);
+            continue;
         }
-    }
-
-    CacheSize = ROUND_UP(_CacheSize, 8);
-
-    if( CacheSize < 102400 )
-    {
-        ERRORMSG("Cache size must not less than 102400 bytes.\n");
-        return 1;
-    }
 
-    if( ConfigGetBoolean(ConfigInfo, "MemoryCache") == TRUE )
-    {
-        MemoryCache = TRUE;
-        MapStart = SafeMalloc(CacheSize);
+        s = DNSCache_GetShard(Lookups[Start]);
+        EFFECTIVE_LOCK_GET(s->SketchLock);
 
-        if( MapStart == NULL )
+        for( loop = Start; loop != LookupCount; ++loop )
         {
-            ERRORMSG("Cache initializing failed.\n");
-            return 2;
+            if( Lookups[loop] != 0 && DNSCache_GetShard(Lookups[loop]) == s )
+            {
+                CacheSketch_Add(&(s->Sketch), Lookups[loop]);
+                Lookups[loop] = 0;
+            }
         }
 
-        InitCacheInfoState = InitCacheInfo(ConfigInfo, FALSE);
-    } else {
-        BOOL FileExists;
+        EFFECTIVE_LOCK_RELEASE(s->SketchLock);
+    }
 
-        INFO("Cache File : %s\n", CacheFile);
+    LookupCount = 0;
+}
 
-        FileExists = FileIsReadable(CacheFile);
+/* Same as `HASH64' on the lowercased dotted form of an uncompressed
+ * wire-format name, that is, `IHeader::HashValue' of a question of the name.
+ */
+static uint64_t DNSCache_NameHash(const char *Name)
+{
+    uint64_t    h = 0;
+    BOOL        First = TRUE;
 
-        CacheFileHandle = OPEN_FILE(CacheFile);
-        if(CacheFileHandle == INVALID_FILE)
-        {
-            int ErrorNum = GET_LAST_ERROR();
-            char ErrorMessage[320];
+    while( *Name != '\0' )
+    {
+        int LabelLength = GET_8_BIT_U_INT(Name);
 
-            GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+        if( !First )
+        {
+            h = h * 131 + '.';
+        }
 
-            ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
+        First = FALSE;
 
-            return 3;
+        for( ++Name; LabelLength > 0 && *Name != '\0'; --LabelLength, ++Name )
+        {
+            h = h * 131 + (char)tolower(*Name);
         }
+    }
 
-        CacheMappingHandle = CREATE_FILE_MAPPING(CacheFileHandle, CacheSize);
-        if(CacheMappingHandle == INVALID_MAP)
-        {
-            int ErrorNum = GET_LAST_ERROR();
-            char ErrorMessage[320];
+    return h;
+}
 
-            GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+/* Key: lowercased wire-format name, type and class (both in network order),
+ * then the partition, and the network for scoped answers.
+ * `Name' is an uncompressed wire-format name and `NameHash' its hash value
+ * (see `DNSCache_NameHash'). `Scope' is the network the answer is scoped to,
+ * its `Prefix' being the scope length, NULL for the answers for everyone. The
+ * hash value of the key is stored in `HashValue', and the length of the key
+ * returned.
+ */
+static int DNSCache_MakeKey(__out char *Key,
+                            __in const char *Name,
+                            __in uint64_t NameHash,
+                            __in DNSRecordType Type,
+                            __in DNSRecordClass Klass,
+                            __in int Partition,
+                            __in const ClientSubnet *Scope,
+                            __out uint64_t *HashValue
+                            )
+{
+    int KeyLength = 0;
 
-            ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
-            return 4;
-        }
+    while( *Name != '\0' )
+    {
+        int LabelLength = GET_8_BIT_U_INT(Name);
 
-        MapStart = (char *)MPA_FILE(CacheMappingHandle, CacheSize);
-        if(MapStart == INVALID_MAPPING_FILE)
+        if( LabelLength > 63 || KeyLength + LabelLength + 1 > CACHE_KEY_NAME_MAX )
         {
-            int ErrorNum = GET_LAST_ERROR();
-            char ErrorMessage[320];
-
-            GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
-
-            ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
-            return 5;
+            return -1;
         }
 
-        if( FileExists == FALSE )
+        Key[KeyLength++] = LabelLength;
+
+        for( ++Name; LabelLength > 0; --LabelLength, ++Name )
         {
-            InitCacheInfoState = InitCacheInfo(ConfigInfo, FALSE);
-        } else {
-            InitCacheInfoState = InitCacheInfo(ConfigInfo, ConfigGetBoolean(ConfigInfo, "ReloadCache"));
+            Key[KeyLength++] = tolower(*Name);
         }
     }
 
-    if( InitCacheInfoState != 0 )
-    {
-        return 6;
-    }
+    Key[KeyLength++] = '\0';
 
-    RWLock_Init(CacheLock);
-
-    Inited = TRUE;
-
-    if( !IgnoreTTL )
+    if( Scope != NULL )
     {
-        TimedTask_Add(TRUE,
-                      FALSE,
-                      59000,
-                      (TaskFunc)DNSCacheTTLCountdown_Task,
-                      NULL,
-                      NULL,
-                      TRUE
-                      );
+        Partition |= CACHE_PARTITION_SUBNET;
     }
 
-    return 0;
-}
+    SET_16_BIT_U_INT(Key + KeyLength, Type);
+    SET_16_BIT_U_INT(Key + KeyLength + 2, Klass);
+    Key[KeyLength + 4] = Partition;
+    KeyLength += 5;
 
-BOOL Cache_IsInited(void)
-{
-    return Inited;
-}
+    *HashValue = ((NameHash * 131 + Type) * 131 + Klass) * 131 + Partition;
 
-static int32_t DNSCache_GetAviliableChunk(uint32_t Length, Cht_Node **Out)
-{
-    int32_t NodeNumber;
-    Cht_Node    *Node;
-    uint32_t    RoundedLength = ROUND_UP(Length, 8);
+    if( Scope != NULL )
+    {
+        int AddressLength = (Scope->Prefix + 7) / 8;
+        int loop;
 
-    BOOL    NewCreated;
+        Key[KeyLength] = Scope->Family;
+        Key[KeyLength + 1] = Scope->Prefix;
+        memcpy(Key + KeyLength + 2, Scope->Address, AddressLength);
 
-    NodeNumber = CacheHT_FindUnusedNode(CacheInfo, RoundedLength, &Node, MapStart + (*CacheEnd) + RoundedLength, &NewCreated);
-    if( NodeNumber >= 0 )
-    {
-        if( NewCreated == TRUE )
+        /* Bits beyond the scope */
+        if( Scope->Prefix % 8 != 0 )
         {
-            Node->Offset = (*CacheEnd);
-            (*CacheEnd) += RoundedLength;
+            Key[KeyLength + 1 + AddressLength] &= (char)(0xFF << (8 - Scope->Prefix % 8));
         }
 
-        memset(MapStart + Node->Offset + Length, 0xFE, RoundedLength - Length);
+        for( loop = 0; loop != 2 + AddressLength; ++loop )
+        {
+            *HashValue = *HashValue * 131 + GET_8_BIT_U_INT(Key + KeyLength + loop);
+        }
 
-        *Out = Node;
-        return NodeNumber;
-    } else {
-        *Out = NULL;
-        return -1;
+        KeyLength += 2 + AddressLength;
     }
 
+    return KeyLength;
 }
 
-static Cht_Node *DNSCache_FindFromCache(char *Content, size_t Length, Cht_Node *Start, time_t CurrentTime)
+/* Length of the key of an entry, the start byte excluded, -1 if it's broken */
+static int DNSCache_EntryKeyLength(const char *Entry, int ChunkLength)
 {
-    Cht_Node *Node = Start;
+    int Length = 1;
 
-    do{
-        Node = CacheHT_Get(CacheInfo, Content, Node, NULL);
-        if( Node == NULL )
+    if( ChunkLength < 1 || Entry[0] != CACHE_START )
+    {
+        return -1;
+    }
+
+    /* Name of the key */
+    while( Length < ChunkLength && Entry[Length] != '\0' )
+    {
+        if( GET_8_BIT_U_INT(Entry + Length) > 63 )
         {
-            return NULL;
+            return -1;
         }
 
-        if( IgnoreTTL == TRUE || (CurrentTime - Node->TimeAdded < Node->TTL) )
+        Length += GET_8_BIT_U_INT(Entry + Length) + 1;
+    }
+
+    /* The end of the name, type, class and partition */
+    Length += 1 + 5;
+    if( Length > ChunkLength )
+    {
+        return -1;
+    }
+
+    /* Family, scope and the address truncated to it */
+    if( (GET_8_BIT_U_INT(Entry + Length - 1) & CACHE_PARTITION_SUBNET) != 0 )
+    {
+        Length += 2;
+        if( Length > ChunkLength ||
+            GET_8_BIT_U_INT(Entry + Length - 1) > 128
+            )
+        {
+            return -1;
+        }
+
+        Length += (GET_8_BIT_U_INT(Entry + Length - 1) + 7) / 8;
+        if( Length > ChunkLength )
+        {
+            return -1;
+        }
+    }
+
+    return Length - 1;
+}
+
+/* Length of an entry, see `DNSCache_StoreItem', -1 if it's broken */
+static int DNSCache_EntryLength(const char *Entry, int ChunkLength)
+{
+    int Length = DNSCache_EntryKeyLength(Entry, ChunkLength);
+
+    if( Length < 0 )
+    {
+        return -1;
+    }
+
+    /* The start byte, the key and RDLength */
+    Length += 1 + 2;
+    if( Length > ChunkLength )
+    {
+        return -1;
+    }
+
+    Length += GET_16_BIT_U_INT(Entry + Length - 2) + 1;
+    if( Length > ChunkLength || Entry[Length - 1] != CACHE_END )
+    {
+        return -1;
+    }
+
+    return Length;
+}
+
+/* FNV-1a of an entry, seeded with the fields of its node which are used to
+ * index it again.
+ */
+static uint32_t DNSCache_Checksum(const Cht_Node *Node, const char *Entry, int Length)
+{
+    uint32_t    Checksum = 2166136261U;
+    uint64_t    TimeAdded = (uint64_t)(Node->TimeAdded);
+
+    Checksum = (Checksum ^ (uint32_t)Node->HashValue) * 16777619U;
+    Checksum = (Checksum ^ (uint32_t)(Node->HashValue >> 32)) * 16777619U;
+    Checksum = (Checksum ^ Node->TTL) * 16777619U;
+    Checksum = (Checksum ^ (uint32_t)TimeAdded) * 16777619U;
+    Checksum = (Checksum ^ (uint32_t)(TimeAdded >> 32)) * 16777619U;
+
+    for( ; Length > 0; --Length, ++Entry )
+    {
+        Checksum ^= GET_8_BIT_U_INT(Entry);
+        Checksum *= 16777619U;
+    }
+
+    return Checksum;
+}
+
+/* Must be called after the entry or the node is modified */
+static void DNSCache_Seal(Cht_Node *Node)
+{
+    const char  *Entry = MapStart + Node->Offset;
+
+    Node->Checksum = DNSCache_Checksum(Node,
+                                       Entry,
+                                       DNSCache_EntryLength(Entry, Node->Length)
+                                       );
+}
+
+/* Must be called with the write lock of the shard held */
+static void DNSCache_RemoveNode(CacheShard *s, int32_t Subscript, Cht_Node *Node)
+{
+    CacheHT *CacheInfo = &(s->Header->ht);
+
+    CacheHT_ExpiryUnlink(CacheInfo, Node);
+
+    Node->TTL = 0;
+
+    *(char *)(MapStart + Node->Offset) = 0xFD;
+
+    CacheHT_RemoveFromSlot(CacheInfo, Subscript, Node);
+
+    --(s->Header->CacheCount);
+}
+
+/* Must be called with the write lock of the shard held */
+static void DNSCache_TrimEnd(CacheShard *s)
+{
+    Array *ChunkList = &(s->Header->ht.NodeChunk);
+
+    if( ChunkList->Used == 0 )
+    {
+        s->Header->End = s->Header->Start;
+    } else {
+        Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(ChunkList, ChunkList->Used - 1);
+        s->Header->End = Node->Offset + Node->Length;
+    }
+}
+
+/* Hash value of a key, the same as the one `DNSCache_MakeKey' gives */
+static uint64_t DNSCache_KeyHash(const char *Key, int KeyLength)
+{
+    int         NameLength = strlen(Key) + 1;
+    uint64_t    HashValue = DNSCache_NameHash(Key);
+    int         loop;
+
+    HashValue = HashValue * 131 + GET_16_BIT_U_INT(Key + NameLength);
+    HashValue = HashValue * 131 + GET_16_BIT_U_INT(Key + NameLength + 2);
+    HashValue = HashValue * 131 + GET_8_BIT_U_INT(Key + NameLength + 4);
+
+    for( loop = NameLength + 5; loop < KeyLength; ++loop )
+    {
+        HashValue = HashValue * 131 + GET_8_BIT_U_INT(Key + loop);
+    }
+
+    return HashValue;
+}
+
+/* An RRset and the signatures covering it are cached and evicted as a whole,
+ * so that no answer is ever made of a part of them.
+ */
+typedef struct _CacheUnit{
+    /* Of the RRset */
+    char        Key[CACHE_KEY_MAX];
+    int         KeyLength;
+    uint64_t    HashValue;
+
+    /* Of the signatures, which are kept in the DNSSEC partitions only */
+    BOOL        Signed;
+    DNSRecordType   Covered;
+    char        SigKey[CACHE_KEY_MAX];
+    uint64_t    SigHashValue;
+} CacheUnit;
+
+/* The unit of a record, of which `Key' is the key and `RData' the RDATA */
+static void DNSCache_GetUnit(CacheUnit *u,
+                             const char *Key,
+                             int KeyLength,
+                             const char *RData
+                             )
+{
+    int NameLength = strlen(Key) + 1;
+    DNSRecordType   Type = (DNSRecordType)GET_16_BIT_U_INT(Key + NameLength);
+    DNSRecordClass  Klass = (DNSRecordClass)GET_16_BIT_U_INT(Key + NameLength + 2);
+    int Partition = GET_8_BIT_U_INT(Key + NameLength + 4) & ~CACHE_PARTITION_SUBNET;
+
+    memcpy(u->Key, Key, KeyLength);
+    u->KeyLength = KeyLength;
+
+    u->Signed = Klass == DNS_CLASS_IN && Partition == CACHE_PARTITION_DNSSEC;
+    if( !u->Signed )
+    {
+        u->HashValue = DNSCache_KeyHash(u->Key, KeyLength);
+        return;
+    }
+
+    /* TYPE COVERED is the first field of RRSIG */
+    u->Covered = Type == DNS_TYPE_RRSIG ?
+                 (DNSRecordType)GET_16_BIT_U_INT(RData) :
+                 Type;
+
+    SET_16_BIT_U_INT(u->Key + NameLength, u->Covered);
+    u->HashValue = DNSCache_KeyHash(u->Key, KeyLength);
+
+    memcpy(u->SigKey, Key, KeyLength);
+    SET_16_BIT_U_INT(u->SigKey + NameLength, DNS_TYPE_RRSIG);
+    u->SigHashValue = DNSCache_KeyHash(u->SigKey, KeyLength);
+}
+
+static BOOL DNSCache_SameUnit(const CacheUnit *One, const CacheUnit *Two)
+{
+    return One->KeyLength == Two->KeyLength &&
+           memcmp(One->Key, Two->Key, One->KeyLength) == 0;
+}
+
+/* Units of an answer failed to be stored, whose other records are skipped */
+typedef struct _CacheDropped{
+    uint64_t    HashValues[CACHE_DROPPED_MAX];
+    int         Count;
+} CacheDropped;
+
+static BOOL DNSCache_IsDropped(const CacheDropped *d, const CacheUnit *u)
+{
+    int loop;
+
+    for( loop = 0; loop != d->Count; ++loop )
+    {
+        if( d->HashValues[loop] == u->HashValue )
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Remove every entry of `Key', expired or not. Signatures are removed only if
+ * they cover `Covered', all entries are if it is DNS_TYPE_UNKNOWN. The number
+ * of entries removed returned. Must be called with the write lock of the shard
+ * held.
+ */
+static int DNSCache_RemoveEntries(CacheShard *s,
+                                  const char *Key,
+                                  int KeyLength,
+                                  uint64_t HashValue,
+                                  DNSRecordType Covered
+                                  )
+{
+    CacheHT     *CacheInfo = &(s->Header->ht);
+    Cht_Node    *Node = NULL;
+    int         Removed = 0;
+
+    while( (Node = CacheHT_Get(CacheInfo, Key, Node, &HashValue)) != NULL )
+    {
+        const char *Entry = MapStart + Node->Offset;
+
+        if( DNSCache_EntryKeyLength(Entry, Node->Length) != KeyLength ||
+            memcmp(Key, Entry + 1, KeyLength) != 0 ||
+            (Covered != DNS_TYPE_UNKNOWN &&
+             GET_16_BIT_U_INT(Entry + 1 + KeyLength + 2) != Covered
+             )
+            )
+        {
+            continue;
+        }
+
+        DNSCache_RemoveNode(s, CacheHT_SubscriptOf(CacheInfo, Node), Node);
+        ++Removed;
+
+        /* The chain has changed, start over */
+        Node = NULL;
+    }
+
+    return Removed;
+}
+
+/* Remove the entries of a unit. If `Held' is not NULL, its write lock is held
+ * by the caller, and only the entries in it are removed; FALSE is returned
+ * then if some are in other shards, for which the function must be called
+ * again with `Held' being NULL once the lock is released. The number of
+ * entries removed is added to `Removed' if it's not NULL.
+ */
+static BOOL DNSCache_RemoveUnit(const CacheUnit *u, CacheShard *Held, int *Removed)
+{
+    BOOL        Done = TRUE;
+    int         Count = 0;
+    int         loop;
+
+    for( loop = 0; loop != (u->Signed ? 2 : 1); ++loop )
+    {
+        const char  *Key = loop == 0 ? u->Key : u->SigKey;
+        uint64_t    HashValue = loop == 0 ? u->HashValue : u->SigHashValue;
+        DNSRecordType Covered = loop == 0 ? DNS_TYPE_UNKNOWN : u->Covered;
+        CacheShard  *s = DNSCache_GetShard(HashValue);
+
+        if( s == Held )
+        {
+            Count += DNSCache_RemoveEntries(s, Key, u->KeyLength, HashValue, Covered);
+        } else if( Held == NULL )
+        {
+            DNSCache_WrLock(s);
+            Count += DNSCache_RemoveEntries(s, Key, u->KeyLength, HashValue, Covered);
+            DNSCache_TrimEnd(s);
+            DNSCache_UnWLock(s);
+        } else {
+            Done = FALSE;
+        }
+    }
+
+    if( Removed != NULL )
+    {
+        *Removed += Count;
+    }
+
+    return Done;
+}
+
+/* Sweep the due expiry buckets of a shard, at most CACHE_EXPIRY_BATCH nodes
+ * are handled each time the lock is held.
+ */
+static void DNSCacheTTLCountdown_Shard(CacheShard *s, time_t CurrentTime)
+{
+    CacheHT     *CacheInfo = &(s->Header->ht);
+
+    /* Buckets earlier than `Due' have all expired */
+    time_t      Due = CurrentTime - CurrentTime % CHT_EXPIRY_GRANULARITY;
+
+    BOOL        Done = FALSE;
+
+    while( !Done )
+    {
+        int         Count = 0;
+        int32_t     Subscript;
+        Cht_Node    *Node;
+
+        DNSCache_WrLock(s);
+
+        /* A new cache, or a reloaded one which has been stopped for a long time */
+        if( CacheInfo->ExpiryTime + CHT_EXPIRY_GRANULARITY * CHT_EXPIRY_BUCKETS < Due )
+        {
+            CacheInfo->ExpiryTime = Due - CHT_EXPIRY_GRANULARITY * CHT_EXPIRY_BUCKETS;
+        }
+
+        while( Count < CACHE_EXPIRY_BATCH && CacheInfo->ExpiryTime < Due )
+        {
+            if( CacheInfo->ExpiryCursor < 0 )
+            {
+                CacheHT_ExpiryDetach(CacheInfo, CacheInfo->ExpiryTime);
+            }
+
+            for( ;
+                 Count < CACHE_EXPIRY_BATCH &&
+                 (Subscript = CacheHT_ExpiryPop(CacheInfo, &Node)) >= 0;
+                 ++Count
+                 )
+            {
+                /* Expired ones are kept a while for stale answers */
+                if( CurrentTime - Node->TimeAdded >=
+                    (time_t)Node->TTL + CacheInfo->StaleTime
+                    )
+                {
+                    DNSCache_RemoveNode(s, Subscript, Node);
+                } else {
+                    /* It's for the next rounds */
+                    CacheHT_ExpiryLink(CacheInfo, Node);
+                }
+            }
+
+            if( CacheInfo->ExpiryCursor < 0 )
+            {
+                CacheInfo->ExpiryTime += CHT_EXPIRY_GRANULARITY;
+            }
+        }
+
+        Done = (CacheInfo->ExpiryTime >= Due);
+
+        CacheHT_Rehash(CacheInfo, CACHE_REHASH_STEPS);
+
+        if( Count > 0 )
+        {
+            DNSCache_TrimEnd(s);
+        }
+
+        DNSCache_UnWLock(s);
+    }
+}
+
+/* Move the chunk at the end of the shard into a free chunk, so that the shard
+ * shrinks. Must be called with the write lock of the shard held.
+ */
+static BOOL DNSCache_CompactOnce(CacheShard *s)
+{
+    CacheHT     *CacheInfo = &(s->Header->ht);
+    int32_t     Last = CacheInfo->NodeChunk.Used - 1;
+    int32_t     Subscript;
+    Cht_Node    *From;
+    Cht_Node    *To;
+
+    if( Last < 0 || CacheInfo->FreeBytes == 0 )
+    {
+        return FALSE;
+    }
+
+    From = (Cht_Node *)Array_GetBySubscript(&(CacheInfo->NodeChunk), Last);
+
+    Subscript = CacheHT_FindFreeNode(CacheInfo, From->Length, TRUE, &To);
+    if( Subscript < 0 )
+    {
+        return FALSE;
+    }
+
+    memcpy(MapStart + To->Offset, MapStart + From->Offset, From->Length);
+
+    CacheHT_Relocate(CacheInfo, Last, Subscript);
+
+    return TRUE;
+}
+
+static void DNSCache_Compact(CacheShard *s)
+{
+    BOOL    Idle = (s->Writes == s->LastWrites);
+    BOOL    Moved = TRUE;
+
+    s->LastWrites = s->Writes;
+
+    while( Moved )
+    {
+        int Count;
+
+        DNSCache_WrLock(s);
+
+        for( Count = 0;
+             Count < CACHE_COMPACT_BATCH && (Moved = DNSCache_CompactOnce(s));
+             ++Count
+             );
+
+        if( Count > 0 )
+        {
+            DNSCache_TrimEnd(s);
+        }
+
+        DNSCache_UnWLock(s);
+
+        /* A busy shard only gets one batch each time */
+        if( !Idle )
+        {
+            break;
+        }
+    }
+}
+
+/* Answers to the refreshing queries have been cached by the modules */
+static void DNSCache_DrainRefreshSocket(void)
+{
+    char Buffer[CONTEXT_DATA_LENGTH];
+
+    if( RefreshSocket == INVALID_SOCKET )
+    {
+        return;
+    }
+
+    while( recvfrom(RefreshSocket, Buffer, sizeof(Buffer), 0, NULL, NULL) > 0 );
+}
+
+static void DNSCacheTTLCountdown_Task(void *Unused, void *Unused2)
+{
+    int     loop;
+    time_t  CurrentTime = time(NULL);
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        DNSCacheTTLCountdown_Shard(Shards + loop, CurrentTime);
+        DNSCache_Compact(Shards + loop);
+    }
+
+    DNSCache_DrainRefreshSocket();
+}
+
+static void DNSCache_Statistic_Task(void *Unused, void *Unused2)
+{
+    int loop;
+
+    if( !Log_DebugOn() )
+    {
+        return;
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        CacheShard  *s = Shards + loop;
+        CacheHT     *CacheInfo = &(s->Header->ht);
+
+        DNSCache_RdLock(s);
+        DEBUG("Cache shard %d: %d items, %d slots%s, load factor %.2f, %d of %d bytes used, %d bytes free, %u evicted, %u rejected, %u declined.\n",
+              loop,
+              CacheInfo->ItemCount,
+              CacheInfo->Slots.Used,
+              CacheInfo->RehashIndex >= 0 ? " (rehashing)" : "",
+              CacheHT_LoadFactor(CacheInfo),
+              s->Header->End - s->Header->Start,
+              s->Header->Size,
+              CacheInfo->FreeBytes,
+              s->Evictions,
+              s->Rejections,
+              s->Declines
+              );
+        DNSCache_UnRLock(s);
+    }
+}
+
+static BOOL IsReloadable(const struct _Header *Header)
+{
+    if( Header->Ver != CACHE_VERSION )
+    {
+        ERRORMSG("The existing cache is not compatible with this version of program.\n");
+        return FALSE;
+    }
+
+    if( Header->CacheSize != CacheSize )
+    {
+        ERRORMSG("The size of the existing cache and the value of `CacheSize' should be equal.\n");
+        return FALSE;
+    }
+
+    if( Header->ShardCount != ShardCount )
+    {
+        ERRORMSG("The shard count of the existing cache and the value of `CacheShards' should be equal.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Chunks are laid one after another in the order of their nodes, from the
+ * start of the shard, and never reach the nodes. Count of the nodes before the
+ * first one breaking it returned, the rest are not trusted.
+ */
+static int32_t DNSCache_CheckChunks(struct _ShardHeader *sh)
+{
+    Array   *NodeChunk = &(sh->ht.NodeChunk);
+    int32_t End = sh->Start;
+    int32_t Valid;
+
+    for( Valid = 0; Valid != NodeChunk->Used; ++Valid )
+    {
+        Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, Valid);
+        int32_t     Room = ((char *)Node - MapStart) - End;
+
+        if( Node->Offset != End ||
+            Node->Length == 0 ||
+            Node->Length % 8 != 0 ||
+            Room < 0 ||
+            Node->Length > (uint32_t)Room
+            )
+        {
+            break;
+        }
+
+        End += Node->Length;
+    }
+
+    /* Nodes are lower and lower, chunks are higher and higher */
+    while( Valid > 0 )
+    {
+        Cht_Node *Last = (Cht_Node *)Array_GetBySubscript(NodeChunk, Valid - 1);
+
+        if( End <= (char *)Last - MapStart )
+        {
+            break;
+        }
+
+        End = Last->Offset;
+        --Valid;
+    }
+
+    return Valid;
+}
+
+/* The scope length of a scoped entry is to be looked up */
+static void DNSCache_NoteScope(const char *Entry)
+{
+    const char  *NameEnd = Entry + 1 + strlen(Entry + 1) + 1;
+    int         Family = GET_8_BIT_U_INT(NameEnd + 5);
+    int         Scope = GET_8_BIT_U_INT(NameEnd + 6);
+
+    if( (GET_8_BIT_U_INT(NameEnd + 4) & CACHE_PARTITION_SUBNET) != 0 &&
+        (Family == 1 || Family == 2)
+        )
+    {
+        SubnetScopes[Family - 1][Scope] = 1;
+    }
+}
+
+/* Mark the nodes in [From, To) whose entries are broken */
+static void DNSCache_CheckEntries(struct _ShardHeader *sh, int32_t From, int32_t To)
+{
+    for( ; From < To; ++From )
+    {
+        Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(&(sh->ht.NodeChunk), From);
+        const char  *Entry = MapStart + Node->Offset;
+        int         Length;
+
+        /* Free chunks and slots */
+        if( Node->Slot < 0 || (Node->Flags & CHT_NODE_FREE) != 0 )
+        {
+            continue;
+        }
+
+        Length = DNSCache_EntryLength(Entry, Node->Length);
+        if( Length < 0 ||
+            DNSCache_Checksum(Node, Entry, Length) != Node->Checksum
+            )
+        {
+            Node->Flags |= CHT_NODE_BROKEN;
+        } else {
+            Node->Flags &= ~CHT_NODE_BROKEN;
+            DNSCache_NoteScope(Entry);
+        }
+    }
+}
+
+typedef struct _CacheReloadWorker{
+    ThreadHandle    Thread;
+    int             Index;
+
+    /* Entries have been checked, shards are to be indexed */
+    BOOL            Rebuilding;
+
+    int32_t         Broken;
+} CacheReloadWorker;
+
+static void DNSCache_Reload_Work(CacheReloadWorker *w)
+{
+    int loop;
+    int Batch = 0;
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        struct _ShardHeader *sh = Shards[loop].Header;
+        int32_t Used = Shards[loop].ReloadedNodes;
+        int32_t From;
+
+        if( w->Rebuilding )
+        {
+            if( loop % CACHE_RELOAD_THREADS == w->Index )
+            {
+                w->Broken += CacheHT_Rebuild(&(sh->ht),
+                                             MapStart + sh->Start,
+                                             MapStart,
+                                             sh->Size,
+                                             Used
+                                             );
+                sh->CacheCount = sh->ht.ItemCount;
+                DNSCache_TrimEnd(Shards + loop);
+            }
+
+            continue;
+        }
+
+        /* Batches of all the shards are dealt to the workers in turn */
+        for( From = 0; From < Used; From += CACHE_RELOAD_BATCH, ++Batch )
+        {
+            if( Batch % CACHE_RELOAD_THREADS == w->Index )
+            {
+                DNSCache_CheckEntries(sh,
+                                      From,
+                                      Used - From > CACHE_RELOAD_BATCH ? From + CACHE_RELOAD_BATCH : Used
+                                      );
+            }
+        }
+    }
+}
+
+/* Nothing but the entries themselves is trusted, broken ones are dropped and
+ * the rest are indexed again.
+ */
+static void ReloadCache(void)
+{
+    struct _ShardHeader *sh = (struct _ShardHeader *)(MapStart + sizeof(struct _Header));
+    CacheReloadWorker   Workers[CACHE_RELOAD_THREADS];
+    int loop;
+    int Round;
+    int NodeCount = 0, ItemCount = 0, Broken = 0;
+
+    INFO("Reloading the cache ...\n");
+
+    for( loop = 0; loop != ShardCount; ++loop, ++sh )
+    {
+        int32_t Start, Size;
+
+        Shards[loop].Header = sh;
+
+        DNSCache_ShardRegion(loop, &Start, &Size);
+        if( sh->Start != Start ||
+            sh->Size != Size ||
+            CacheHT_ReInit(&(sh->ht), MapStart + sh->Start, sh->Size) != 0
+            )
+        {
+            WARNING("Shard %d of the cache is broken, discarded.\n", loop);
+            DNSCache_InitShard(sh, loop);
+            Shards[loop].ReloadedNodes = 0;
+            continue;
+        }
+
+        if( sh->Generation % 2 != 0 )
+        {
+            INFO("Shard %d of the cache was being written when the program stopped.\n", loop);
+            ++(sh->Generation);
+        }
+
+        Shards[loop].ReloadedNodes = DNSCache_CheckChunks(sh);
+    }
+
+    /* Checking first, then indexing */
+    for( Round = 0; Round != 2; ++Round )
+    {
+        for( loop = 0; loop != CACHE_RELOAD_THREADS; ++loop )
+        {
+            Workers[loop].Index = loop;
+            Workers[loop].Rebuilding = (Round == 1);
+            Workers[loop].Broken = 0;
+
+            CREATE_THREAD(DNSCache_Reload_Work, Workers + loop, Workers[loop].Thread);
+        }
+
+        for( loop = 0; loop != CACHE_RELOAD_THREADS; ++loop )
+        {
+            WAIT_THREAD(Workers[loop].Thread);
+            Broken += Workers[loop].Broken;
+        }
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        NodeCount += Shards[loop].Header->ht.NodeChunk.Used;
+        ItemCount += Shards[loop].Header->CacheCount;
+    }
+
+    if( Broken > 0 )
+    {
+        WARNING("%d broken or incomplete entries of the cache have been dropped.\n", Broken);
+    }
+
+    INFO("Cache reloaded, containing %d entries for %d items.\n", NodeCount, ItemCount);
+
+    Reloaded = TRUE;
+}
+
+static void CreateNewCache(void)
+{
+    struct _Header  *Header = (struct _Header *)MapStart;
+    struct _ShardHeader *sh = (struct _ShardHeader *)(MapStart + sizeof(struct _Header));
+
+    int     loop;
+
+    memset(MapStart, 0, CacheSize);
+
+    Header->Ver = CACHE_VERSION;
+    Header->CacheSize = CacheSize;
+    Header->ShardCount = ShardCount;
+    memset(Header->Comment, 0, sizeof(Header->Comment));
+    strncpy(Header->Comment,
+            "\nDo not edit this file.\n",
+            sizeof(Header->Comment)
+            );
+
+    Header->Comment[sizeof(Header->Comment) - 1] = '\0';
+
+    for( loop = 0; loop != ShardCount; ++loop, ++sh )
+    {
+        DNSCache_InitShard(sh, loop);
+
+        Shards[loop].Header = sh;
+    }
+}
+
+static void DNSCache_InitCachedTypes(ConfigFileInfo *ConfigInfo)
+{
+    StringList  *Types = ConfigGetStringList(ConfigInfo, "CacheType");
+    StringListIterator  sli;
+    const char  *Type_Str;
+
+    memset(CachedTypes, 0, sizeof(CachedTypes));
+
+    if( Types == NULL || StringListIterator_Init(&sli, Types) != 0 )
+    {
+        return;
+    }
+
+    while( (Type_Str = sli.Next(&sli)) != NULL )
+    {
+        int Type;
+
+        if( sscanf(Type_Str, "%d", &Type) != 1 || Type <= 0 || Type > 65535 )
+        {
+            WARNING("Bad `CacheType' : %s\n", Type_Str);
+            continue;
+        }
+
+        switch( Type )
+        {
+        /* Not real records */
+        case DNS_TYPE_OPT:
+        case DNS_TYPE_TKEY:
+        case DNS_TYPE_TSIG:
+        case DNS_TYPE_IXFR:
+        case DNS_TYPE_AXFR:
+        case DNS_TYPE_ANY:
+            WARNING("Type %d could not be cached.\n", Type);
+            break;
+
+        default:
+            CachedTypes[Type / 8] |= 1 << (Type % 8);
+            break;
+        }
+    }
+}
+
+static int InitCacheInfo(ConfigFileInfo *ConfigInfo, BOOL Reload)
+{
+    if( Reload == TRUE )
+    {
+        if( IsReloadable((struct _Header *)MapStart) )
+        {
+            ReloadCache();
+        } else {
+            if( ConfigGetBoolean(ConfigInfo, "OverwriteCache") == FALSE )
+            {
+                return -1;
+            } else {
+                CreateNewCache();
+                INFO("The existing cache has been overwritten.\n");
+            }
+        }
+    } else {
+        CreateNewCache();
+    }
+
+    /* Until `DNSCache_Share' is done */
+    ((struct _Header *)MapStart)->Shared = 0;
+
+    return 0;
+}
+
+#ifdef CACHE_SHARED_SUPPORTED
+/* The first process sharing the cache file locks it exclusively while setting
+ * the cache up, and every process sharing it locks it shared afterwards, so
+ * the locks are all gone once they exit.
+ */
+static int DNSCache_LockFile(short Type, BOOL Wait)
+{
+    struct flock    fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = Type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+
+    return fcntl(CacheFileHandle, Wait ? F_SETLKW : F_SETLK, &fl);
+}
+
+/* The cache set up by the first process shared with the others */
+static int DNSCache_Share(void)
+{
+    struct _Header  *Header = (struct _Header *)MapStart;
+    pthread_mutexattr_t Attr;
+    int loop;
+
+    if( pthread_mutexattr_init(&Attr) != 0 )
+    {
+        return -1;
+    }
+
+    if( pthread_mutexattr_setpshared(&Attr, PTHREAD_PROCESS_SHARED) != 0 ||
+        pthread_mutexattr_setrobust(&Attr, PTHREAD_MUTEX_ROBUST) != 0
+        )
+    {
+        pthread_mutexattr_destroy(&Attr);
+        return -2;
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        int Stripe;
+
+        for( Stripe = 0; Stripe != CACHE_SHARED_STRIPES; ++Stripe )
+        {
+            if( pthread_mutex_init(&(Shards[loop].Header->SharedLocks[Stripe]),
+                                   &Attr
+                                   )
+                != 0 )
+            {
+                pthread_mutexattr_destroy(&Attr);
+                return -3;
+            }
+        }
+    }
+
+    pthread_mutexattr_destroy(&Attr);
+
+    /* Pointers in the cache are valid only where it is mapped now */
+    Header->Base = (uint64_t)(size_t)MapStart;
+    Header->Shared = 1;
+
+    /* Let the others in */
+    if( DNSCache_LockFile(F_RDLCK, FALSE) != 0 )
+    {
+        return -4;
+    }
+
+    INFO("Cache is shared with other processes.\n");
+
+    return 0;
+}
+
+/* Map the cache shared by other processes, where they map it. Scopes of
+ * answers cached by them later are not known to this process, their entries
+ * are found only after this process caches the same scopes.
+ */
+static int DNSCache_Attach(void)
+{
+    struct _Header  Header;
+    struct _ShardHeader *sh;
+    char    *Base;
+    int     loop;
+    int     ItemCount = 0;
+
+    if( pread(CacheFileHandle, &Header, sizeof(Header), 0) != sizeof(Header) ||
+        Header.Shared == 0
+        )
+    {
+        ERRORMSG("The cache file is not being shared.\n");
+        return -1;
+    }
+
+    if( !IsReloadable(&Header) )
+    {
+        return -2;
+    }
+
+    Base = (char *)(size_t)Header.Base;
+    MapStart = mmap(Base,
+                    CacheSize,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    CacheFileHandle,
+                    0
+                    );
+    if( MapStart == INVALID_MAPPING_FILE )
+    {
+        return -3;
+    }
+
+    if( MapStart != Base )
+    {
+        ERRORMSG("The cache could not be mapped where the other processes map it.\n");
+        UNMAP_FILE(MapStart, CacheSize);
+        MapStart = INVALID_MAPPING_FILE;
+        return -4;
+    }
+
+    sh = (struct _ShardHeader *)(MapStart + sizeof(struct _Header));
+    for( loop = 0; loop != ShardCount; ++loop, ++sh )
+    {
+        CacheShard  *s = Shards + loop;
+        Array       *NodeChunk = &(sh->ht.NodeChunk);
+        int32_t     Subscript;
+
+        s->Header = sh;
+
+        DNSCache_RdLock(s);
+        for( Subscript = 0; Subscript != NodeChunk->Used; ++Subscript )
+        {
+            Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, Subscript);
+
+            if( Node->Slot >= 0 && (Node->Flags & CHT_NODE_FREE) == 0 )
+            {
+                DNSCache_NoteScope(MapStart + Node->Offset);
+            }
+        }
+        ItemCount += sh->CacheCount;
+        DNSCache_UnRLock(s);
+    }
+
+    INFO("Cache attached, shared with other processes, containing %d items.\n", ItemCount);
+
+    Reloaded = TRUE;
+
+    return 0;
+}
+#endif /* CACHE_SHARED_SUPPORTED */
+
+static void DNSCache_Cleanup(void)
+{
+    if( CacheFileHandle != INVALID_FILE )
+    {
+        if(CacheMappingHandle != INVALID_MAP)
+        {
+            UNMAP_FILE(MapStart, CacheSize);
+            DESTROY_MAPPING(CacheMappingHandle);
+        }
+        CLOSE_FILE(CacheFileHandle);
+    }
+    if( TtlCtrl != NULL)
+    {
+        CacheTtlCrtl_Free(TtlCtrl);
+    }
+    if( RefreshSocket != INVALID_SOCKET )
+    {
+        CLOSE_SOCKET(RefreshSocket);
+    }
+    if( MemoryCache && MapStart != NULL )
+    {
+        /* Slots and nodes are all inside `MapStart', nothing else to free */
+        if( MapLength > 0 )
+        {
+#ifndef WIN32
+            munmap(MapStart, MapLength);
+#endif
+        } else {
+            SafeFree(MapStart);
+        }
+    }
+    if( Shards != NULL )
+    {
+        int loop;
+
+        for( loop = 0; loop != ShardCount; ++loop )
+        {
+            RWLock_Destroy(Shards[loop].Lock);
+            EFFECTIVE_LOCK_DESTROY(Shards[loop].SketchLock);
+
+            if( CacheAdmission )
+            {
+                CacheSketch_Free(&(Shards[loop].Sketch));
+            }
+        }
+
+        SafeFree(Shards);
+    }
+}
+
+static int DNSCache_HugePagesOption(ConfigFileInfo *ConfigInfo)
+{
+    const char  *Option = ConfigGetRawString(ConfigInfo, "CacheHugePages");
+
+    if( Option == NULL || strcmp(Option, "no") == 0 )
+    {
+        return CACHE_HUGE_PAGES_NONE;
+    } else if( strcmp(Option, "transparent") == 0 ){
+        return CACHE_HUGE_PAGES_TRANSPARENT;
+    } else if( strcmp(Option, "explicit") == 0 ){
+        return CACHE_HUGE_PAGES_EXPLICIT;
+    } else {
+        WARNING("Bad `CacheHugePages' : %s, disabled.\n", Option);
+        return CACHE_HUGE_PAGES_NONE;
+    }
+}
+
+/* Memory of `CacheSize' bytes backed by huge pages, NULL if failed. Explicit
+ * huge pages must have been reserved (/proc/sys/vm/nr_hugepages), transparent
+ * ones are used if there aren't.
+ */
+static char *DNSCache_MapHugePages(int HugePages)
+{
+#if !defined(WIN32) && defined(MAP_ANONYMOUS)
+    size_t  Length = ROUND_UP((size_t)CacheSize, CACHE_HUGE_PAGE_SIZE);
+    char    *Area;
+    size_t  Head;
+
+#ifdef MAP_HUGETLB
+    if( HugePages == CACHE_HUGE_PAGES_EXPLICIT )
+    {
+        Area = mmap(NULL,
+                    Length,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1,
+                    0
+                    );
+        if( Area != MAP_FAILED )
+        {
+            MapLength = Length;
+            INFO("Cache is backed by explicit huge pages.\n");
+            return Area;
+        }
+
+        WARNING("No explicit huge page could be got for the cache, transparent ones will be tried.\n");
+    }
+#endif /* MAP_HUGETLB */
+
+    /* One more huge page, to be cut into an aligned area */
+    Area = mmap(NULL,
+                Length + CACHE_HUGE_PAGE_SIZE,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0
+                );
+    if( Area == MAP_FAILED )
+    {
+        return NULL;
+    }
+
+    Head = ROUND_UP((size_t)Area, CACHE_HUGE_PAGE_SIZE) - (size_t)Area;
+    if( Head > 0 )
+    {
+        munmap(Area, Head);
+    }
+    munmap(Area + Head + Length, CACHE_HUGE_PAGE_SIZE - Head);
+
+    Area += Head;
+    MapLength = Length;
+
+#ifdef MADV_HUGEPAGE
+    if( madvise(Area, Length, MADV_HUGEPAGE) == 0 )
+    {
+        INFO("Cache is backed by transparent huge pages.\n");
+        return Area;
+    }
+#endif /* MADV_HUGEPAGE */
+
+    WARNING("Transparent huge pages are not available for the cache.\n");
+    return Area;
+#else
+    WARNING("Huge pages are not supported on this platform.\n");
+    return SafeMalloc(CacheSize);
+#endif
+}
+
+/* Every page of the cache touched, so that no lookup takes a page fault. The
+ * pages of the cache file are read in, those of `MemoryCache' are allocated.
+ */
+static void DNSCache_Prefault(void)
+{
+    PTimer          Timer;
+    volatile char   *Page = MapStart;
+    volatile char   *End = MapStart + CacheSize;
+    volatile char   Sink = 0;
+
+    PTimer_Start(&Timer);
+
+#if !defined(WIN32) && defined(MADV_WILLNEED)
+    if( !MemoryCache )
+    {
+        /* Read ahead in large batches instead of page by page */
+        madvise(MapStart, CacheSize, MADV_WILLNEED);
+    }
+#endif
+
+    for( ; Page < End; Page += CACHE_PAGE_SIZE )
+    {
+        if( MemoryCache )
+        {
+            *Page = 0;
+        } else {
+            /* Not to dirty the file */
+            Sink ^= *Page;
+        }
+    }
+
+    INFO("Cache prefaulted, %d bytes in %lu ms.\n", CacheSize, PTimer_End(&Timer));
+}
+
+/* `StaleTime' applied to the shards, whose expiry lists are linked again if
+ * it changes. Those attached are being used by the other processes, and so
+ * are left as they are, with the time kept in them taking over.
+ */
+static void DNSCache_ApplyStaleTime(BOOL Attached)
+{
+    int loop;
+
+    if( Attached )
+    {
+        uint32_t Stored = Shards[0].Header->ht.StaleTime;
+
+        if( Stored != StaleTime )
+        {
+            WARNING("`CacheServeStale' differs from that of the processes sharing the cache, %u is used.\n",
+                    (unsigned int)Stored
+                    );
+            StaleTime = Stored;
+        }
+
+        return;
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        CacheHT_SetStaleTime(&(Shards[loop].Header->ht), StaleTime);
+    }
+}
+
+int DNSCache_Init(ConfigFileInfo *ConfigInfo)
+{
+    int         _CacheSize = ConfigGetInt32(ConfigInfo, "CacheSize");
+    const char  *CacheFile = ConfigGetRawString(ConfigInfo, "CacheFile");
+    int         InitCacheInfoState;
+    int         loop;
+
+    int         OverrideTTL;
+    int         TTLMultiple;
+
+    StringList  *ctc = ConfigGetStringList(ConfigInfo, "CacheControl");
+
+    if( ConfigGetBoolean(ConfigInfo, "UseCache") == FALSE )
+    {
+        return 0;
+    }
+
+    CacheParallel = ConfigGetBoolean(ConfigInfo, "CacheParallel");
+
+    CacheAdmission = ConfigGetBoolean(ConfigInfo, "CacheAdmission");
+
+    IgnoreTTL = ConfigGetBoolean(ConfigInfo, "IgnoreTTL");
+
+    if( !IgnoreTTL )
+    {
+        int Prefetch = ConfigGetInt32(ConfigInfo, "CachePrefetch");
+        int ServeStale = ConfigGetInt32(ConfigInfo, "CacheServeStale");
+
+        if( Prefetch < 0 || Prefetch > 100 )
+        {
+            ERRORMSG("Invalid `CachePrefetch'.\n");
+        } else {
+            PrefetchPercent = Prefetch;
+            PrefetchHits = ConfigGetInt32(ConfigInfo, "CachePrefetchHits");
+        }
+
+        if( ServeStale < 0 )
+        {
+            ERRORMSG("Invalid `CacheServeStale'.\n");
+        } else {
+            StaleTime = ServeStale;
+        }
+    }
+
+    DNSCache_InitCachedTypes(ConfigInfo);
+
+    OverrideTTL = ConfigGetInt32(ConfigInfo, "OverrideTTL");
+    TTLMultiple = ConfigGetInt32(ConfigInfo, "MultipleTTL");
+
+    if( ctc != NULL || OverrideTTL > -1 || TTLMultiple > 1 )
+    {
+        TtlCtrl = malloc(sizeof(CacheTtlCtrl));
+        if( TtlCtrl == NULL || CacheTtlCrtl_Init(TtlCtrl) != 0 )
+        {
+            return -1;
+        }
+    }
+
+    atexit(DNSCache_Cleanup);
+
+    if( ctc != NULL )
+    {
+        CacheTtlCrtl_Add_From_StringList(TtlCtrl, ctc);
+    }
+
+    if( OverrideTTL > -1 )
+    {
+        CacheTtlCrtl_Add(TtlCtrl, "*", TTL_STATE_FIXED, 1, OverrideTTL, TRUE);
+    } else {
+        if( TTLMultiple < 1 )
+        {
+            ERRORMSG("Invalid `MultipleTTL'.\n");
+        } else if( TTLMultiple > 1 ){
+            CacheTtlCrtl_Add(TtlCtrl, "*", TTL_STATE_VARIABLE, TTLMultiple, 0, TRUE);
+        }
+    }
+
+    CacheSize = ROUND_UP(_CacheSize, 8);
+
+    if( CacheSize < CACHE_SHARD_MIN_SIZE )
+    {
+        ERRORMSG("Cache size must not less than 102400 bytes.\n");
+        return 1;
+    }
+
+    ShardCount = ConfigGetInt32(ConfigInfo, "CacheShards");
+    if( ShardCount < 1 )
+    {
+        ERRORMSG("Invalid `CacheShards'.\n");
+        ShardCount = 1;
+    } else if( CacheSize / ShardCount < CACHE_SHARD_MIN_SIZE ){
+        ShardCount = CacheSize / CACHE_SHARD_MIN_SIZE;
+        WARNING("`CacheSize' is too small for `CacheShards', %d shards will be used.\n", ShardCount);
+    }
+
+    Shards = SafeMalloc(sizeof(CacheShard) * ShardCount);
+    if( Shards == NULL )
+    {
+        ERRORMSG("Cache initializing failed.\n");
+        return 2;
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        RWLock_Init(Shards[loop].Lock);
+        EFFECTIVE_LOCK_INIT(Shards[loop].SketchLock);
+        Shards[loop].Writes = 0;
+        Shards[loop].LastWrites = 0;
+        Shards[loop].Evictions = 0;
+        Shards[loop].Rejections = 0;
+        Shards[loop].Declines = 0;
+        Shards[loop].Sketch.Counters = NULL;
+        Shards[loop].Sketch.Doorkeeper = NULL;
+        Shards[loop].ReloadedNodes = 0;
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        if( CacheAdmission &&
+            CacheSketch_Init(&(Shards[loop].Sketch),
+                             CacheSize / ShardCount,
+                             CACHE_SKETCH_ENTRY_SIZE
+                             )
+            != 0 )
+        {
+            ERRORMSG("Cache initializing failed.\n");
+            return 2;
+        }
+    }
+
+    if( ConfigGetBoolean(ConfigInfo, "MemoryCache") == TRUE )
+    {
+        int HugePages = DNSCache_HugePagesOption(ConfigInfo);
+
+        MemoryCache = TRUE;
+
+        if( ConfigGetBoolean(ConfigInfo, "SharedCache") == TRUE )
+        {
+            WARNING("`SharedCache' works only with the file cache, the memory cache is not shared.\n");
+        }
+
+        if( HugePages != CACHE_HUGE_PAGES_NONE )
+        {
+            MapStart = DNSCache_MapHugePages(HugePages);
+        } else {
+            MapStart = SafeMalloc(CacheSize);
+        }
+
+        if( MapStart == NULL )
+        {
+            ERRORMSG("Cache initializing failed.\n");
+            return 2;
+        }
+
+        if( ConfigGetBoolean(ConfigInfo, "CachePrefault") == TRUE )
+        {
+            DNSCache_Prefault();
+        }
+
+        InitCacheInfoState = InitCacheInfo(ConfigInfo, FALSE);
+        if( InitCacheInfoState == 0 )
+        {
+            DNSCache_ApplyStaleTime(FALSE);
+        }
+    } else {
+        BOOL FileExists;
+
+        /* Processes sharing the cache but the first one */
+        BOOL Attaching = FALSE;
+
+        INFO("Cache File : %s\n", CacheFile);
+
+#ifdef CACHE_SHARED_SUPPORTED
+        SharedCache = ConfigGetBoolean(ConfigInfo, "SharedCache");
+#else
+        if( ConfigGetBoolean(ConfigInfo, "SharedCache") == TRUE )
+        {
+            WARNING("`SharedCache' is not supported on this platform.\n");
+        }
+#endif /* CACHE_SHARED_SUPPORTED */
+
+        FileExists = FileIsReadable(CacheFile);
+
+        CacheFileHandle = OPEN_FILE(CacheFile);
+        if(CacheFileHandle == INVALID_FILE)
+        {
+            int ErrorNum = GET_LAST_ERROR();
+            char ErrorMessage[320];
+
+            GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+
+            ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
+
+            return 3;
+        }
+
+        CacheMappingHandle = CREATE_FILE_MAPPING(CacheFileHandle, CacheSize);
+        if(CacheMappingHandle == INVALID_MAP)
+        {
+            int ErrorNum = GET_LAST_ERROR();
+            char ErrorMessage[320];
+
+            GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+
+            ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
+            return 4;
+        }
+
+#ifdef CACHE_SHARED_SUPPORTED
+        if( SharedCache && DNSCache_LockFile(F_WRLCK, FALSE) != 0 )
+        {
+            /* Wait for the first process to set the cache up */
+            if( DNSCache_LockFile(F_RDLCK, TRUE) != 0 )
+            {
+                int ErrorNum = GET_LAST_ERROR();
+                char ErrorMessage[320];
+
+                GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+
+                ERRORMSG("Locking the cache file failed : %d : %s.\n", ErrorNum, ErrorMessage);
+                return 7;
+            }
+
+            Attaching = TRUE;
+
+            if( DNSCache_Attach() != 0 )
+            {
+                ERRORMSG("Attaching to the shared cache failed.\n");
+                return 8;
+            }
+        } else {
+            MapStart = (char *)MPA_FILE(CacheMappingHandle, CacheSize);
+        }
+#else
+        MapStart = (char *)MPA_FILE(CacheMappingHandle, CacheSize);
+#endif /* CACHE_SHARED_SUPPORTED */
+
+        if(MapStart == INVALID_MAPPING_FILE)
+        {
+            int ErrorNum = GET_LAST_ERROR();
+            char ErrorMessage[320];
+
+            GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+
+            ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
+            return 5;
+        }
+
+        if( ConfigGetBoolean(ConfigInfo, "CachePrefault") == TRUE )
+        {
+            /* Before being reloaded, which reads them all */
+            DNSCache_Prefault();
+        }
+
+        if( Attaching )
+        {
+            InitCacheInfoState = 0;
+        } else if( FileExists == FALSE ){
+            InitCacheInfoState = InitCacheInfo(ConfigInfo, FALSE);
+        } else {
+            InitCacheInfoState = InitCacheInfo(ConfigInfo, ConfigGetBoolean(ConfigInfo, "ReloadCache"));
+        }
+
+        /* Before the others are let in */
+        if( InitCacheInfoState == 0 )
+        {
+            DNSCache_ApplyStaleTime(Attaching);
+        }
+
+#ifdef CACHE_SHARED_SUPPORTED
+        if( SharedCache && !Attaching && InitCacheInfoState == 0 &&
+            DNSCache_Share() != 0
+            )
+        {
+            ERRORMSG("Sharing the cache failed.\n");
+            return 9;
+        }
+#endif /* CACHE_SHARED_SUPPORTED */
+    }
+
+    if( InitCacheInfoState != 0 )
+    {
+        return 6;
+    }
+
+    if( PrefetchPercent > 0 || StaleTime > 0 )
+    {
+        RefreshSocket = TryBindLocal(Ipv6_Enabled, 10500, &RefreshAddress);
+        if( RefreshSocket != INVALID_SOCKET &&
+            SetSocketNonBlock(RefreshSocket, TRUE) != 0
+            )
+        {
+            CLOSE_SOCKET(RefreshSocket);
+            RefreshSocket = INVALID_SOCKET;
+        }
+
+        if( RefreshSocket == INVALID_SOCKET )
+        {
+            ERRORMSG("Creating the socket for refreshing failed, entries will not be refreshed.\n");
+        }
+
+        EFFECTIVE_LOCK_INIT(RefreshLock);
+    }
+
+    Inited = TRUE;
+
+    /* A snapshot is not needed by a reloaded cache, but still written */
+    if( CacheSnapshot_Init(ConfigInfo, !Reloaded) != 0 )
+    {
+        WARNING("Cache snapshots are disabled.\n");
+    }
+
+    if( !IgnoreTTL )
+    {
+        /* Answers are snapshots, they could only be kept until expiring */
+        PacketCache_Init(ConfigInfo);
+
+        TimedTask_Add(TRUE,
+                      FALSE,
+                      CHT_EXPIRY_GRANULARITY * 1000,
+                      (TaskFunc)DNSCacheTTLCountdown_Task,
+                      NULL,
+                      NULL,
+                      TRUE
+                      );
+    }
+
+    TimedTask_Add(TRUE,
+                  FALSE,
+                  CACHE_STATISTIC_INTERVAL,
+                  (TaskFunc)DNSCache_Statistic_Task,
+                  NULL,
+                  NULL,
+                  FALSE
+                  );
+
+    return 0;
+}
+
+BOOL Cache_IsInited(void)
+{
+    return Inited;
+}
+
+static int32_t DNSCache_GetAviliableChunk(CacheShard *s, uint32_t Length, Cht_Node **Out)
+{
+    int32_t NodeNumber;
+    Cht_Node    *Node;
+    uint32_t    RoundedLength = ROUND_UP(Length, 8);
+
+    BOOL    NewCreated;
+
+    NodeNumber = CacheHT_FindUnusedNode(&(s->Header->ht), RoundedLength, &Node, MapStart + s->Header->End + RoundedLength, &NewCreated);
+    if( NodeNumber >= 0 )
+    {
+        if( NewCreated == TRUE )
+        {
+            Node->Offset = s->Header->End;
+            s->Header->End += RoundedLength;
+        }
+
+        memset(MapStart + Node->Offset + Length, 0xFE, RoundedLength - Length);
+
+        *Out = Node;
+        return NodeNumber;
+    } else {
+        *Out = NULL;
+        return -1;
+    }
+
+}
+
+/* Must be called with the write lock of the shard held */
+static void DNSCache_GrowSlots(CacheShard *s)
+{
+    CacheHT     *CacheInfo = &(s->Header->ht);
+    int         NewSlotCount;
+    int         Bytes;
+    int32_t     Subscript;
+    Cht_Node    *Node;
+
+    CacheHT_Rehash(CacheInfo, CACHE_REHASH_STEPS);
+
+    Bytes = CacheHT_NeedGrowing(CacheInfo, &NewSlotCount);
+    if( Bytes == 0 )
+    {
+        return;
+    }
+
+    /* The slots are placed in a chunk, just like an entry which never expires */
+    Subscript = DNSCache_GetAviliableChunk(s, Bytes, &Node);
+    if( Subscript < 0 )
+    {
+        /* No room, try it next time */
+        return;
+    }
+
+    Node->Slot = -1;
+    Node->TTL = 0;
+    Node->TimeAdded = 0;
+
+    CacheHT_Grow(CacheInfo,
+                 MapStart + s->Header->Start,
+                 Subscript,
+                 MapStart + Node->Offset,
+                 NewSlotCount
+                 );
+}
+
+static Cht_Node *DNSCache_FindFromCache(CacheShard *s,
+                                        uint64_t HashValue,
+                                        const char *Content,
+                                        size_t Length,
+                                        Cht_Node *Start,
+                                        time_t CurrentTime,
+                                        BOOL Stale /* Expired entries within `StaleTime' are found too */
+                                        )
+{
+    Cht_Node *Node = Start;
+    uint32_t Grace = Stale ? StaleTime : 0;
+
+    do{
+        Node = CacheHT_Get(&(s->Header->ht), Content, Node, &HashValue);
+        if( Node == NULL )
+        {
+            return NULL;
+        }
+
+        if( IgnoreTTL == TRUE ||
+            (CurrentTime - Node->TimeAdded < (time_t)Node->TTL + Grace)
+            )
+        {
+            if( memcmp(Content, MapStart + Node->Offset + 1, Length) == 0 )
+            {
+                /* Readers may race on it, they all set the same bit */
+                if( (Node->Flags & CHT_NODE_REFERENCED) == 0 )
+                {
+                    Node->Flags |= CHT_NODE_REFERENCED;
+                }
+
+                return Node;
+            }
+        }
+
+    } while( TRUE );
+
+}
+
+/* TinyLFU, a new entry takes the place of the victim only if its key has been
+ * looked up more often. The other records of an RRset partly cached are always
+ * admitted, and should one still be declined, the caller drops the records of
+ * the set already stored, see `DNSCache_AddItemsToCache'. Must be called with
+ * the write lock of the shard held.
+ */
+static BOOL DNSCache_Admit(CacheShard *s,
+                           const char *Key,
+                           int KeyLength,
+                           uint64_t HashValue,
+                           const Cht_Node *Victim,
+                           time_t CurrentTime
+                           )
+{
+    BOOL Hotter;
+
+    /* Lookups may be flushed into the sketch meanwhile */
+    EFFECTIVE_LOCK_GET(s->SketchLock);
+
+    CacheSketch_Age(&(s->Sketch));
+
+    Hotter = CacheSketch_Estimate(&(s->Sketch), HashValue) >
+             CacheSketch_Estimate(&(s->Sketch), Victim->HashValue);
+
+    EFFECTIVE_LOCK_RELEASE(s->SketchLock);
+
+    if( Hotter )
+    {
+        return TRUE;
+    }
+
+    return DNSCache_FindFromCache(s, HashValue, Key, KeyLength, NULL, CurrentTime, TRUE) != NULL;
+}
+
+/* Evict the coldest units until a chunk could be got. The parts of the units
+ * evicted living in other shards are put into `Deferred', `DeferredCount' of
+ * them, to be removed once the lock is released. Must be called with the write
+ * lock of the shard held.
+ */
+static int32_t DNSCache_GetChunkEvicting(CacheShard *s,
+                                         const char *Key,
+                                         int KeyLength,
+                                         uint64_t HashValue,
+                                         const CacheUnit *Own,
+                                         uint32_t Length,
+                                         time_t CurrentTime,
+                                         Cht_Node **Out,
+                                         CacheUnit *Deferred,
+                                         int *DeferredCount
+                                         )
+{
+    int32_t Subscript = DNSCache_GetAviliableChunk(s, Length, Out);
+    int     Evicted = 0;
+
+    while( Subscript < 0 && Evicted < CACHE_EVICTION_MAX )
+    {
+        Cht_Node    *Victim;
+        int32_t     Victim_i = CacheHT_ClockVictim(&(s->Header->ht), &Victim);
+        const char  *Entry;
+        int         VictimKeyLength;
+        int         Removed = 0;
+
+        if( Victim_i < 0 )
+        {
+            break;
+        }
+
+        Entry = MapStart + Victim->Offset;
+        VictimKeyLength = DNSCache_EntryKeyLength(Entry, Victim->Length);
+        if( VictimKeyLength < 0 )
+        {
+            DNSCache_RemoveNode(s, Victim_i, Victim);
+            DNSCache_TrimEnd(s);
+            ++Evicted;
+            ++(s->Evictions);
+            Subscript = DNSCache_GetAviliableChunk(s, Length, Out);
+            continue;
+        }
+
+        DNSCache_GetUnit(Deferred + *DeferredCount,
+                         Entry + 1,
+                         VictimKeyLength,
+                         Entry + 1 + VictimKeyLength + 2
+                         );
+
+        /* A set is never made room for by evicting a part of itself */
+        if( DNSCache_SameUnit(Deferred + *DeferredCount, Own) )
+        {
+            ++(s->Declines);
+            return -1;
+        }
+
+        /* Only the first victim is compared with */
+        if( CacheAdmission &&
+            Evicted == 0 &&
+            !DNSCache_Admit(s, Key, KeyLength, HashValue, Victim, CurrentTime)
+            )
+        {
+            ++(s->Declines);
+            return -1;
+        }
+
+        if( !DNSCache_RemoveUnit(Deferred + *DeferredCount, s, &Removed) )
+        {
+            ++(*DeferredCount);
+        }
+
+        DNSCache_TrimEnd(s);
+        ++Evicted;
+        s->Evictions += Removed;
+
+        Subscript = DNSCache_GetAviliableChunk(s, Length, Out);
+    }
+
+    if( Subscript < 0 )
+    {
+        ++(s->Rejections);
+    }
+
+    return Subscript;
+}
+
+static uint32_t DNSCache_CacheMinTTL(CacheShard *s,
+                                     const char *Key,
+                                     int KeyLength,
+                                     uint64_t HashValue,
+                                     uint32_t NewTTL,
+                                     time_t CurrentTime
+                                     )
+{
+    uint32_t RecordTTL = NewTTL;
+    Cht_Node *Node = NULL;
+
+    /* Get the smallest, in case of not equal. */
+    while( (Node = DNSCache_FindFromCache(s, HashValue, Key, KeyLength, Node, CurrentTime, FALSE)) != NULL )
+    {
+        uint32_t TTL = Node->TTL - (CurrentTime - Node->TimeAdded);
+        if( RecordTTL > TTL )
+        {
+            RecordTTL = TTL;
+        }
+    }
+
+    Node = NULL;
+    while( (Node = DNSCache_FindFromCache(s, HashValue, Key, KeyLength, Node, CurrentTime, FALSE)) != NULL )
+    {
+        CacheHT_ExpiryUnlink(&(s->Header->ht), Node);
+        Node->TTL = RecordTTL;
+        Node->TimeAdded = CurrentTime;
+        DNSCache_Seal(Node);
+        CacheHT_ExpiryLink(&(s->Header->ht), Node);
+    }
+
+    return RecordTTL;
+}
+
+/* Types of records which are cached and answered from the cache */
+static BOOL DNSCache_TypeCached(DNSRecordType Type)
+{
+    return (CachedTypes[(uint16_t)Type / 8] >> ((uint16_t)Type % 8)) & 1;
+}
+
+static uint32_t DNSCache_ControlledTTL(const CtrlContent *TtlContent, uint32_t TTL)
+{
+    if( TtlContent == NULL )
+    {
+        return TTL;
+    }
+
+    switch( TtlContent->State )
+    {
+        case TTL_STATE_NO_CACHE:
+            return 0;
+
+        case TTL_STATE_ORIGINAL:
+            return TTL;
+
+        default:
+            return (TtlContent->Coefficient) * TTL + (TtlContent->Increment);
+    }
+}
+
+/* Copy the RData of a record to `Buffer', with names in it uncompressed.
+ * Length of the copied data returned.
+ */
+static int DNSCache_ExpandRData(DnsSimpleParserIterator *i,
+                                char *Buffer,
+                                int BufferLength
+                                )
+{
+    char    *RData = i->RowData(i);
+    int     Length;
+    int     NameLength;
+
+    switch( i->Type )
+    {
+    /* Types whose names may be compressed, see RFC 3597, section 4. The ones
+       of other types are copied as they are. */
+    case DNS_TYPE_CNAME:
+    case DNS_TYPE_NS:
+    case DNS_TYPE_PTR:
+        return DNSExpandName(i->Parser->RawDns,
+                             i->Parser->RawDnsLength,
+                             RData,
+                             Buffer,
+                             BufferLength
+                             );
+
+    case DNS_TYPE_MX:
+        /* PREFERENCE EXCHANGE */
+        if( i->DataLength < 3 || BufferLength < 2 )
+        {
+            return -1;
+        }
+
+        memcpy(Buffer, RData, 2);
+
+        Length = DNSExpandName(i->Parser->RawDns,
+                               i->Parser->RawDnsLength,
+                               RData + 2,
+                               Buffer + 2,
+                               BufferLength - 2
+                               );
+
+        return Length < 0 ? -1 : Length + 2;
+
+    case DNS_TYPE_SRV:
+        /* PRIORITY WEIGHT PORT TARGET, the target must not be compressed,
+           but some servers do */
+        if( i->DataLength < 7 || BufferLength < 6 )
+        {
+            return -1;
+        }
+
+        memcpy(Buffer, RData, 6);
+
+        Length = DNSExpandName(i->Parser->RawDns,
+                               i->Parser->RawDnsLength,
+                               RData + 6,
+                               Buffer + 6,
+                               BufferLength - 6
+                               );
+
+        return Length < 0 ? -1 : Length + 6;
+
+    case DNS_TYPE_SOA:
+        /* MNAME RNAME SERIAL REFRESH RETRY EXPIRE MINIMUM */
+        Length = DNSExpandName(i->Parser->RawDns,
+                               i->Parser->RawDnsLength,
+                               RData,
+                               Buffer,
+                               BufferLength
+                               );
+        if( Length < 0 )
+        {
+            return -1;
+        }
+
+        RData = DNSJumpOverName(RData);
+        NameLength = DNSExpandName(i->Parser->RawDns,
+                                   i->Parser->RawDnsLength,
+                                   RData,
+                                   Buffer + Length,
+                                   BufferLength - Length
+                                   );
+        if( NameLength < 0 )
+        {
+            return -1;
+        }
+
+        Length += NameLength;
+        RData = DNSJumpOverName(RData);
+
+        if( Length + 20 > BufferLength ||
+            RData + 20 > i->RowData(i) + i->DataLength
+            )
+        {
+            return -1;
+        }
+
+        memcpy(Buffer + Length, RData, 20);
+
+        return Length + 20;
+
+    default:
+        if( i->DataLength > BufferLength )
+        {
+            return -1;
+        }
+
+        memcpy(Buffer, RData, i->DataLength);
+        return i->DataLength;
+    }
+}
+
+/* Put an item into the cache.
+ * Item: \xFF Key RDLength RData \x0A
+ * `Buffer' holds the whole item, `Length' is the length of it.
+ */
+static int DNSCache_StoreItem(const char *Buffer,
+                              int Length,
+                              int KeyLength,
+                              uint64_t HashValue,
+                              uint32_t RecordTTL,
+                              time_t CurrentTime,
+                              BOOL Evicting
+                              )
+{
+    const char  *Item = Buffer + 1;
+    CacheShard  *s;
+    Cht_Node    *Existing;
+
+    /* The set of the item, and the parts of the victims in other shards */
+    CacheUnit   Own;
+    CacheUnit   Deferred[CACHE_EVICTION_MAX];
+    int         DeferredCount = 0;
+
+    int         Ret = 0;
+
+    if( RecordTTL == 0 )
+    {
+        return 0;
+    }
+
+    /* Determine whether the cache item has existed in the main cache zone */
+    s = DNSCache_GetShard(HashValue);
+    DNSCache_WrLock(s);
+    Existing = DNSCache_FindFromCache(s, HashValue, Item, Length - 2, NULL, CurrentTime, TRUE);
+    if( Existing != NULL )
+    {
+        /* The same record answered again, by a refresh mostly */
+        CacheHT_ExpiryUnlink(&(s->Header->ht), Existing);
+        Existing->TTL = RecordTTL;
+        Existing->TimeAdded = CurrentTime;
+        Existing->Hits = 0;
+        DNSCache_Seal(Existing);
+        CacheHT_ExpiryLink(&(s->Header->ht), Existing);
+    } else {
+        /* If not, add it */
+
+        /* Subscript of a chunk in the main cache zone */
+        int32_t Subscript;
+
+        /* Node with subscript `Subscript' */
+        Cht_Node    *Node;
+
+        /* Get a usable chunk and its subscript */
+        if( Evicting )
+        {
+            DNSCache_GetUnit(&Own, Item, KeyLength, Item + KeyLength + 2);
+            Subscript = DNSCache_GetChunkEvicting(s,
+                                                  Item,
+                                                  KeyLength,
+                                                  HashValue,
+                                                  &Own,
+                                                  Length,
+                                                  CurrentTime,
+                                                  &Node,
+                                                  Deferred,
+                                                  &DeferredCount
+                                                  );
+        } else {
+            Subscript = DNSCache_GetAviliableChunk(s, Length, &Node);
+        }
+
+        /* If there is a usable chunk */
+        if(Subscript >= 0)
+        {
+            /* Copy the cache to this entry */
+            memcpy(MapStart + Node->Offset, Buffer, Length);
+
+            if( CacheParallel )
+            {
+                RecordTTL = DNSCache_CacheMinTTL(s, Item, KeyLength, HashValue, RecordTTL, CurrentTime);
+            }
+
+            /* Assign TTL */
+            Node->TTL = RecordTTL;
+
+            Node->TimeAdded = CurrentTime;
+            Node->Hits = 0;
+
+            Node->HashValue = HashValue;
+            Node->Checksum = DNSCache_Checksum(Node, Buffer, Length);
+
+            /* Index this entry on the hash table */
+            CacheHT_InsertToSlot(&(s->Header->ht), Item, Subscript, Node, &HashValue);
+            CacheHT_ExpiryLink(&(s->Header->ht), Node);
+
+            ++(s->Header->CacheCount);
+            ++(s->Writes);
+
+            DNSCache_GrowSlots(s);
+        } else {
+            Ret = -6;
+        }
+    }
+    DNSCache_UnWLock(s);
+
+    while( DeferredCount > 0 )
+    {
+        DNSCache_RemoveUnit(Deferred + --DeferredCount, NULL, NULL);
+    }
+
+    return Ret;
+}
+
+/* Key: see `DNSCache_MakeKey'
+   RData: as in the message, except that names are uncompressed
+   https://tools.ietf.org/html/rfc1035 */
+static int DNSCache_AddAItemToCache(DnsSimpleParserIterator *i,
+                                    const char *Record,
+                                    time_t CurrentTime,
+                                    const CtrlContent *InfectedTtlContent,
+                                    int Partition,
+                                    const ClientSubnet *Scope,
+                                    CacheDropped *Dropped
+                                    )
+{
+    /* used to store cache data temporarily */
+    char            Buffer[CACHE_ITEM_MAX];
+    char            *Item = Buffer + 1;
+    int             KeyLength;
+    int             DataLength;
+
+    /* Iterator of `Buffer' */
+    char            *BufferItr = Buffer;
+
+    char            Name[CACHE_KEY_NAME_MAX];
+
+    const CtrlContent   *TtlContent = NULL;
+
+    uint64_t    HashValue;
+
+    CacheUnit   u;
+    int         Ret;
+
+    /* Assign start byte of the cache */
+    Buffer[0] = CACHE_START;
+
+    /* Assign the key of the cache */
+    if( DNSExpandName(i->Parser->RawDns,
+                      i->Parser->RawDnsLength,
+                      Record,
+                      Name,
+                      sizeof(Name)
+                      )
+        < 0 )
+    {
+        return -1;
+    }
+
+    KeyLength = DNSCache_MakeKey(Item,
+                                 Name,
+                                 DNSCache_NameHash(Name),
+                                 i->Type,
+                                 i->Klass,
+                                 Partition,
+                                 Scope,
+                                 &HashValue
+                                 );
+    if( KeyLength < 0 )
+    {
+        return -2;
+    }
+
+    /* Detemine which TTL scheme will be used */
+    if( TtlCtrl != NULL )
+    {
+        char TextName[260];
+
+        if( i->GetName(i, TextName, sizeof(TextName)) < 0 )
+        {
+            return -3;
+        }
+
+        if( InfectedTtlContent != NULL )
+        {
+            switch( InfectedTtlContent->Infection )
+            {
+                default:
+                case TTL_CTRL_INFECTION_AGGRESSIVLY:
+                    TtlContent = InfectedTtlContent;
+                    break;
+
+                case TTL_CTRL_INFECTION_PASSIVLY:
+                    TtlContent = CacheTtlCrtl_Get(TtlCtrl, TextName);
+                    if( TtlContent == NULL )
+                    {
+                        TtlContent = InfectedTtlContent;
+                    }
+                    break;
+
+                case TTL_CTRL_INFECTION_NONE:
+                    TtlContent = CacheTtlCrtl_Get(TtlCtrl, TextName);
+                    break;
+            }
+        } else {
+            TtlContent = CacheTtlCrtl_Get(TtlCtrl, TextName);
+        }
+    }
+
+    /* Jump just over the key, right at RDLength */
+    BufferItr = Item + KeyLength;
+
+    /* Generate data and store them */
+    DataLength = DNSCache_ExpandRData(i,
+                                      BufferItr + 2,
+                                      sizeof(Buffer) - (BufferItr + 2 - Buffer) - 1
+                                      );
+    if( DataLength < 0 )
+    {
+        return -4;
+    }
+
+    SET_16_BIT_U_INT(BufferItr, DataLength);
+    BufferItr += 2 + DataLength;
+
+    /* Mark the end */
+    *BufferItr = CACHE_END;
+
+    /* The whole cache data generating completed */
+
+    DNSCache_GetUnit(&u, Item, KeyLength, Item + KeyLength + 2);
+    if( DNSCache_IsDropped(Dropped, &u) )
+    {
+        return -5;
+    }
+
+    /* Add the cache item to the main cache zone below */
+    Ret = DNSCache_StoreItem(Buffer,
+                             BufferItr - Buffer + 1,
+                             KeyLength,
+                             HashValue,
+                             DNSCache_ControlledTTL(TtlContent, i->GetTTL(i)),
+                             CurrentTime,
+                             TRUE
+                             );
+    if( Ret != 0 )
+    {
+        /* Records of the set stored before are not to be answered alone */
+        DNSCache_RemoveUnit(&u, NULL, NULL);
+        Dropped->HashValues[Dropped->Count++] = u.HashValue;
+    }
+
+    return Ret;
+}
+
+static BOOL DNSCache_SameName(const char *One, const char *Another)
+{
+    /* Label lengths are never letters */
+    for( ; tolower(*One) == tolower(*Another); ++One, ++Another )
+    {
+        if( *One == '\0' )
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Cache an NXDOMAIN or NODATA answer with the SOA record coming along with
+ * it, for the name the CNAME chain in the answer ends with.
+ * https://tools.ietf.org/html/rfc2308
+ */
+static int DNSCache_AddNegativeToCache(DnsSimpleParser *p,
+                                       time_t CurrentTime,
+                                       const CtrlContent *TtlContent,
+                                       const ClientSubnet *Scope
+                                       )
+{
+    char    Buffer[CACHE_ITEM_MAX];
+    char    *Item = Buffer + 1;
+    char    *BufferItr;
+    int     KeyLength;
+    int     DataLength;
+    int     SoaLength;
+
+    char    Name[CACHE_KEY_NAME_MAX];
+    char    Owner[CACHE_KEY_NAME_MAX];
+
+    DNSRecordType   Type = DNS_TYPE_UNKNOWN;
+    ResponseCode    RCode = p->_Flags.ResponseCode(p);
+
+    uint64_t    HashValue;
+    uint32_t    RecordTTL;
+
+    DnsSimpleParserIterator i;
+    char *Record;
+
+    if( (RCode != RESPONSE_CODE_NO_ERROR && RCode != RESPONSE_CODE_NAME_ERROR) ||
+        p->_Flags.Truncated(p) ||
+        DnsSimpleParserIterator_Init(&i, p) != 0
+        )
+    {
+        return 0;
+    }
+
+    while( (Record = i.Next(&i)) != NULL )
+    {
+        switch( i.Purpose )
+        {
+        case DNS_RECORD_PURPOSE_QUESTION:
+            if( i.Klass != DNS_CLASS_IN ||
+                !DNSCache_TypeCached(i.Type) ||
+                DNSExpandName(p->RawDns, p->RawDnsLength, Record, Name, sizeof(Name)) < 0
+                )
+            {
+                return 0;
+            }
+
+            Type = i.Type;
+            break;
+
+        case DNS_RECORD_PURPOSE_ANSWER:
+            if( i.Type == Type )
+            {
+                /* Not negative */
+                return 0;
+            }
+
+            if( i.Type == DNS_TYPE_CNAME &&
+                DNSExpandName(p->RawDns, p->RawDnsLength, Record, Owner, sizeof(Owner)) >= 0 &&
+                DNSCache_SameName(Owner, Name)
+                )
+            {
+                if( DNSExpandName(p->RawDns,
+                                  p->RawDnsLength,
+                                  i.RowData(&i),
+                                  Name,
+                                  sizeof(Name)
+                                  )
+                    < 0 )
+                {
+                    return 0;
+                }
+            }
+            break;
+
+        case DNS_RECORD_PURPOSE_NAME_SERVER:
+            if( i.Type != DNS_TYPE_SOA || i.Klass != DNS_CLASS_IN )
+            {
+                break;
+            }
+
+            Buffer[0] = CACHE_START;
+
+            KeyLength = DNSCache_MakeKey(Item,
+                                         Name,
+                                         DNSCache_NameHash(Name),
+                                         Type,
+                                         CACHE_CLASS_NEGATIVE,
+                                         CACHE_PARTITION_PLAIN,
+                                         Scope,
+                                         &HashValue
+                                         );
+            if( KeyLength < 0 )
+            {
+                return -1;
+            }
+
+            /* RDLength, RCode, the owner of SOA, then SOA itself */
+            BufferItr = Item + KeyLength;
+            BufferItr[2] = RCode;
+
+            DataLength = DNSExpandName(p->RawDns,
+                                       p->RawDnsLength,
+                                       Record,
+                                       BufferItr + 3,
+                                       CACHE_KEY_NAME_MAX
+                                       );
+            if( DataLength < 0 )
+            {
+                return -2;
+            }
+
+            DataLength += 1;
+
+            SoaLength = DNSCache_ExpandRData(&i,
+                                             BufferItr + 2 + DataLength,
+                                             sizeof(Buffer) - (BufferItr + 2 + DataLength - Buffer) - 1
+                                             );
+            if( SoaLength < 0 )
+            {
+                return -3;
+            }
+
+            DataLength += SoaLength;
+
+            /* MINIMUM is the last 4 bytes */
+            RecordTTL = GET_32_BIT_U_INT(BufferItr + 2 + DataLength - 4);
+            if( RecordTTL > i.GetTTL(&i) )
+            {
+                RecordTTL = i.GetTTL(&i);
+            }
+
+            SET_16_BIT_U_INT(BufferItr, DataLength);
+            BufferItr += 2 + DataLength;
+            *BufferItr = CACHE_END;
+
+            return DNSCache_StoreItem(Buffer,
+                                      BufferItr - Buffer + 1,
+                                      KeyLength,
+                                      HashValue,
+                                      DNSCache_ControlledTTL(TtlContent, RecordTTL),
+                                      CurrentTime,
+                                      TRUE
+                                      );
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Flatten the CNAME chain in the answer, starting from the name of the
+ * question and ending with the records of the type of the question, into one
+ * entry, see `CACHE_CLASS_CHAIN'.
+ */
+static int DNSCache_AddChainToCache(DnsSimpleParser *p,
+                                    time_t CurrentTime,
+                                    const CtrlContent *TtlContent,
+                                    const ClientSubnet *Scope
+                                    )
+{
+    char    Buffer[CACHE_ITEM_MAX];
+    char    *Item = Buffer + 1;
+    char    *RData = NULL;
+    char    *BufferItr = NULL;
+    char    *BufferEnd = Buffer + sizeof(Buffer) - 1; /* For `CACHE_END' */
+    int     KeyLength;
+
+    char    QName[CACHE_KEY_NAME_MAX];
+    char    Owner[CACHE_KEY_NAME_MAX];
+
+    /* The name the chain has got to */
+    const char  *Current = QName;
+    int         Hops = 0;
+    int         Terminals = 0;
+
+    DNSRecordType   Type = DNS_TYPE_UNKNOWN;
+    uint32_t        RecordTTL = (uint32_t)-1;
+    uint64_t        HashValue;
+
+    DnsSimpleParserIterator i;
+    char *Record;
+
+    if( p->_Flags.ResponseCode(p) != RESPONSE_CODE_NO_ERROR ||
+        p->_Flags.Truncated(p) ||
+        DnsSimpleParserIterator_Init(&i, p) != 0
+        )
+    {
+        return 0;
+    }
+
+    while( (Record = i.Next(&i)) != NULL )
+    {
+        int Length;
+
+        if( i.Purpose == DNS_RECORD_PURPOSE_QUESTION )
         {
-            if( memcmp(Content, MapStart + Node->Offset + 1, Length) == 0 )
+            if( i.Klass != DNS_CLASS_IN ||
+                i.Type == DNS_TYPE_CNAME ||
+                !DNSCache_TypeCached(i.Type) ||
+                DNSExpandName(p->RawDns, p->RawDnsLength, Record, QName, sizeof(QName)) < 0
+                )
             {
-                return Node;
+                return 0;
+            }
+
+            Type = i.Type;
+
+            Buffer[0] = CACHE_START;
+
+            KeyLength = DNSCache_MakeKey(Item,
+                                         QName,
+                                         DNSCache_NameHash(QName),
+                                         Type,
+                                         CACHE_CLASS_CHAIN,
+                                         CACHE_PARTITION_PLAIN,
+                                         Scope,
+                                         &HashValue
+                                         );
+            if( KeyLength < 0 )
+            {
+                return -1;
             }
+
+            /* RDLength, then the hop count */
+            RData = Item + KeyLength + 2;
+            BufferItr = RData + 1;
+
+            continue;
         }
 
-    } while( TRUE );
+        if( i.Purpose != DNS_RECORD_PURPOSE_ANSWER )
+        {
+            break;
+        }
 
-}
+        if( RData == NULL ||
+            i.Klass != DNS_CLASS_IN ||
+            DNSExpandName(p->RawDns, p->RawDnsLength, Record, Owner, sizeof(Owner)) < 0 ||
+            !DNSCache_SameName(Owner, Current)
+            )
+        {
+            continue;
+        }
 
-static uint32_t DNSCache_CacheMinTTL(char *Content, size_t Length, uint32_t NewTTL, time_t CurrentTime)
-{
-    uint32_t RecordTTL = NewTTL;
-    Cht_Node *Node = NULL;
+        if( i.Type == DNS_TYPE_CNAME && Terminals == 0 )
+        {
+            if( Hops == CACHE_CNAME_DEPTH_MAX )
+            {
+                return 0;
+            }
 
-    /* Get the smallest, in case of not equal. */
-    while( (Node = DNSCache_FindFromCache(Content, Length, Node, CurrentTime)) != NULL )
-    {
-        uint32_t TTL = Node->TTL - (CurrentTime - Node->TimeAdded);
-        if( RecordTTL > TTL )
+            Length = DNSExpandName(p->RawDns,
+                                   p->RawDnsLength,
+                                   i.RowData(&i),
+                                   BufferItr,
+                                   BufferEnd - BufferItr
+                                   );
+            if( Length < 0 || DNSCache_SameName(BufferItr, QName) )
+            {
+                return 0;
+            }
+
+            Current = BufferItr;
+            ++Hops;
+        } else if( i.Type == Type && Hops > 0 ){
+            if( BufferEnd - BufferItr < 2 )
+            {
+                return 0;
+            }
+
+            Length = DNSCache_ExpandRData(&i, BufferItr + 2, BufferEnd - BufferItr - 2);
+            if( Length < 0 )
+            {
+                return 0;
+            }
+
+            SET_16_BIT_U_INT(BufferItr, Length);
+            Length += 2;
+            ++Terminals;
+        } else {
+            continue;
+        }
+
+        BufferItr += Length;
+
+        if( i.GetTTL(&i) < RecordTTL )
         {
-            RecordTTL = TTL;
+            RecordTTL = i.GetTTL(&i);
         }
     }
 
-    Node = NULL;
-    while( (Node = DNSCache_FindFromCache(Content, Length, Node, CurrentTime)) != NULL )
+    if( Terminals == 0 )
     {
-        Node->TTL = RecordTTL;
-        Node->TimeAdded = CurrentTime;
+        return 0;
     }
 
-    return RecordTTL;
+    RData[0] = Hops;
+    SET_16_BIT_U_INT(RData - 2, BufferItr - RData);
+    *BufferItr = CACHE_END;
+
+    return DNSCache_StoreItem(Buffer,
+                              BufferItr - Buffer + 1,
+                              KeyLength,
+                              HashValue,
+                              DNSCache_ControlledTTL(TtlContent, RecordTTL),
+                              CurrentTime,
+                              TRUE
+                              );
 }
 
-/* Item: \xFFStrName\x01IntType\x01IntClass\x00ParsedAnswer\x0A
-   ht: StrName\x01IntType\x01IntClass, NtcTriplet
-   https://tools.ietf.org/html/rfc1035 */
-static int DNSCache_AddAItemToCache(DnsSimpleParserIterator *i,
-                                    time_t CurrentTime,
-                                    const CtrlContent *InfectedTtlContent
-                                    )
+int DNSCache_AddItemsToCache(MsgContext *MsgCtx, BOOL IsFirst)
 {
-    /* used to store cache data temporarily, TODO: no bounds checking here */
-    char            Buffer[512];
-    char            *Item = Buffer + 1;
+    IHeader *Header = (IHeader *)MsgCtx;
+    char *DnsEntity = IHEADER_TAIL(Header);
+    const CtrlContent *TtlContent = NULL;
+    int Partition;
 
-    /* Iterator of `Buffer' */
-    char            *BufferItr = Buffer;
+    /* The network the answer is scoped to, NULL if it's for everyone */
+    ClientSubnet Subnet = Header->Subnet;
+    const ClientSubnet *Scope = NULL;
 
-    const CtrlContent   *TtlContent;
+    DnsSimpleParser p;
+    DnsSimpleParserIterator i;
+    char *Record;
 
-    /* Assign start byte of the cache */
-    Buffer[0] = CACHE_START;
+    CacheDropped Dropped;
 
-    /* Assign the name of the cache */
-    if( i->GetName(i, Item, sizeof(Buffer) -1) < 0 )
+    if(Inited == FALSE) return 0;
+    if(!IsFirst && !CacheParallel) return 0;
+
+    if( DnsSimpleParser_Init(&p, DnsEntity, Header->EntityLength, FALSE) != 0 )
     {
         return -1;
     }
 
-    /* Detemine which TTL scheme will be used */
-    if( InfectedTtlContent != NULL )
+    if( DnsSimpleParserIterator_Init(&i, &p) != 0 )
     {
-        switch( InfectedTtlContent->Infection )
-        {
-            default:
-            case TTL_CTRL_INFECTION_AGGRESSIVLY:
-                TtlContent = InfectedTtlContent;
-                break;
+        return -2;
+    }
 
-            case TTL_CTRL_INFECTION_PASSIVLY:
-                TtlContent = CacheTtlCrtl_Get(TtlCtrl, Item);
-                if( TtlContent == NULL )
-                {
-                    TtlContent = InfectedTtlContent;
-                }
-                break;
+    TtlContent =  CacheTtlCrtl_Get(TtlCtrl, Header->Domain);
 
-            case TTL_CTRL_INFECTION_NONE:
-                TtlContent = CacheTtlCrtl_Get(TtlCtrl, Item);
-                break;
+    Partition = Header->DNSSECOk ? CACHE_PARTITION_DNSSEC : CACHE_PARTITION_PLAIN;
+
+    /* `Scope' of the subnet is from the answer, never wider than the network
+       sent (RFC 7871, section 7.3.1) */
+    if( Subnet.Family != 0 && Subnet.Scope > 0 && Subnet.Prefix > 0 )
+    {
+        if( Subnet.Scope < Subnet.Prefix )
+        {
+            Subnet.Prefix = Subnet.Scope;
         }
-    } else {
-        TtlContent = CacheTtlCrtl_Get(TtlCtrl, Item);
+
+        Scope = &Subnet;
+        SubnetScopes[Subnet.Family - 1][Subnet.Prefix] = 1;
     }
 
-    /* Jump just over the name, right at '\0' */
-    BufferItr = Item + strlen(Item);
-    if( BufferItr >= Buffer + sizeof(Buffer) )
+    Dropped.Count = 0;
+
+    while( Dropped.Count < CACHE_DROPPED_MAX &&
+           (Record = i.Next(&i)) != NULL
+           )
     {
-        return -2;
+        BOOL RightPurpose = i.Purpose != DNS_RECORD_PURPOSE_UNKNOWN &&
+                            i.Purpose != DNS_RECORD_PURPOSE_QUESTION;
+
+        /* Signatures are needed by the answers with the DO bit set */
+        BOOL CachedType = DNSCache_TypeCached(i.Type) ||
+                          (Partition == CACHE_PARTITION_DNSSEC &&
+                           i.Type == DNS_TYPE_RRSIG
+                           );
+
+        BOOL CachedClass = i.Klass == DNS_CLASS_IN;
+
+        if( RightPurpose && CachedType && CachedClass )
+        {
+            DNSCache_AddAItemToCache(&i,
+                                     Record,
+                                     time(NULL),
+                                     TtlContent,
+                                     Partition,
+                                     Scope,
+                                     &Dropped
+                                     );
+        }
     }
 
-    /* Set record type and class */
-    BufferItr += snprintf(BufferItr,
-                          sizeof(Buffer) - (BufferItr - Buffer),
-                          "\1%d\1%d",
-                          i->Type,
-                          i->Klass
-                          );
-    if( BufferItr >= Buffer + sizeof(Buffer) )
+    /* Negative answers with the DO bit set need NSEC records to be proved,
+       which are not kept */
+    if( Partition == CACHE_PARTITION_PLAIN )
     {
-        return -3;
+        DNSCache_AddNegativeToCache(&p, time(NULL), TtlContent, Scope);
+
+        /* Chains with the DO bit set need the signatures of every hop */
+        DNSCache_AddChainToCache(&p, time(NULL), TtlContent, Scope);
     }
 
-    /* End of name\1type\1class triple */
-    *BufferItr++ = '\0';
-    if( BufferItr >= Buffer + sizeof(Buffer) )
+    return 0;
+}
+
+/* TTL of a found entry to be answered with. Entries expired, or popular ones
+ * about to expire, are marked to be refreshed.
+ */
+static uint32_t DNSCache_LookupTTL(Cht_Node *Node, CacheLookup *l)
+{
+    uint32_t Age = l->CurrentTime - Node->TimeAdded;
+    uint32_t Remaining;
+
+    if( IgnoreTTL == TRUE )
     {
-        return -4;
+        return Node->TTL;
     }
 
-    /* Generate data and store them */
-    if( i->TextifyData(i,
-                       "%v",
-                       BufferItr,
-                       sizeof(Buffer) - (BufferItr - Buffer)
-                       ) <= 0 )
+    /* Readers may race on it, a lost hit does no harm */
+    ++(Node->Hits);
+
+    if( Age >= Node->TTL )
     {
-        return -5;
+        l->Refresh = TRUE;
+        l->Fresh = 0;
+        return CACHE_STALE_TTL;
     }
-    BufferItr += strlen(BufferItr) + 1;
-    if( BufferItr >= Buffer + sizeof(Buffer) )
+
+    Remaining = Node->TTL - Age;
+
+    if( PrefetchPercent > 0 )
     {
-        return -6;
+        uint32_t Window = (uint64_t)(Node->TTL) * PrefetchPercent / 100;
+
+        if( Remaining <= Window )
+        {
+            /* Not kept by the packet cache, so that hits are counted here */
+            l->Fresh = 0;
+
+            if( Node->Hits >= PrefetchHits )
+            {
+                l->Refresh = TRUE;
+            }
+        } else if( Remaining - Window < l->Fresh ){
+            l->Fresh = Remaining - Window;
+        }
     }
 
-    /* Mark the end */
-    *BufferItr = CACHE_END;
+    return Remaining;
+}
 
-    /* The whole cache data generating completed */
+/* State code returned. Only the signatures covering `Covered' are generated
+ * if `Type' is DNS_TYPE_RRSIG.
+ */
+static int DNSCache_GetRawRecordsFromCache( __in    const char *Name,
+                                            __in    uint64_t NameHash,
+                                            __in    DNSRecordType Type,
+                                            __in    DNSRecordClass Klass,
+                                            __in    int Partition,
+                                            __in    const ClientSubnet *Scope,
+                                            __in    DNSRecordType Covered,
+                                            __inout DnsGenerator *g,
+                                            __inout CacheLookup *l
+                                            )
+{
+    int Ret = -100;
 
-    /* Add the cache item to the main cache zone below */
+    char Key[CACHE_KEY_MAX];
+    int KeyLength;
 
-    /* Determine whether the cache item has existed in the main cache zone */
-    if(DNSCache_FindFromCache(Item, BufferItr - Buffer, NULL, CurrentTime) == NULL)
-    {
-        /* If not, add it */
+    uint32_t    NewTTL;
 
-        /* Subscript of a chunk in the main cache zone */
-        int32_t Subscript;
+    Cht_Node *Node = NULL; /* Important */
 
-        uint32_t RecordTTL;
+    CacheShard  *s;
+    uint64_t    HashValue;
 
-        /* Node with subscript `Subscript' */
-        Cht_Node    *Node;
+    KeyLength = DNSCache_MakeKey(Key, Name, NameHash, Type, Klass, Partition, Scope, &HashValue);
+    if( KeyLength < 0 )
+    {
+        return -609;
+    }
 
-        if( TtlContent != NULL )
-        {
-            switch( TtlContent->State )
-            {
-                case TTL_STATE_NO_CACHE:
-                    RecordTTL = 0;
-                    break;
+    s = DNSCache_GetShard(HashValue);
 
-                case TTL_STATE_ORIGINAL:
-                    RecordTTL = i->GetTTL(i);
-                    break;
+    DNSCache_RdLock(s);
+    DNSCache_CountLookup(HashValue);
 
-                default:
-                    RecordTTL = (TtlContent->Coefficient) * i->GetTTL(i) + (TtlContent->Increment);
-                    break;
-            }
-        } else {
-            RecordTTL = i->GetTTL(i);
-        }
+    do
+    {
+        char *CacheItr;
+
+        Node = DNSCache_FindFromCache(s,
+                                      HashValue,
+                                      Key,
+                                      KeyLength,
+                                      Node,
+                                      l->CurrentTime,
+                                      l->Stale
+                                      );
 
-        if( RecordTTL == 0 )
+        if( Node == NULL )
         {
-            return 0;
+            break;
         }
 
-        /* Get a usable chunk and its subscript */
-        Subscript = DNSCache_GetAviliableChunk(BufferItr - Buffer + 1, &Node);
+        /* Now the RDLength position */
+        CacheItr = MapStart + Node->Offset + 1 + KeyLength;
 
-        /* If there is a usable chunk */
-        if(Subscript >= 0)
+        /* RRSIG RData starts with the type covered */
+        if( Type == DNS_TYPE_RRSIG &&
+            (GET_16_BIT_U_INT(CacheItr) < 2 ||
+             GET_16_BIT_U_INT(CacheItr + 2) != Covered
+             )
+            )
         {
-            /* Copy the cache to this entry */
-            memcpy(MapStart + Node->Offset, Buffer, BufferItr - Buffer + 1);
+            continue;
+        }
 
-            if( CacheParallel )
+        Ret = 0;
+
+        if( Node->TTL != 0 )
+        {
+            NewTTL = DNSCache_LookupTTL(Node, l);
+
+            if( g->WireRecord(g,
+                              MapStart + Node->Offset + 1,
+                              Type,
+                              Klass,
+                              CacheItr + 2,
+                              GET_16_BIT_U_INT(CacheItr),
+                              NewTTL
+                              )
+                != 0 )
             {
-                RecordTTL = DNSCache_CacheMinTTL(Item, strlen(Item), RecordTTL, CurrentTime);
+                Ret = -1;
+                break;
             }
+        }
+    } while ( TRUE );
 
-            /* Assign TTL */
-            Node->TTL = RecordTTL;
+    DNSCache_UnRLock(s);
 
-            Node->TimeAdded = CurrentTime;
+    return Ret;
+}
 
-            /* Index this entry on the hash table */
-            CacheHT_InsertToSlot(CacheInfo, Item, Subscript, Node, NULL);
+/* State code returned, the remaining TTL is stored in `TTL' */
+static int DNSCache_GetCNameFromCache(__in const char *Name,
+                                      __in uint64_t NameHash,
+                                      __out char *Buffer,
+                                      __in int Partition,
+                                      __in const ClientSubnet *Scope,
+                                      __inout DnsGenerator *g,
+                                      __inout CacheLookup *l
+                                      )
+{
+    char Key[CACHE_KEY_MAX];
+    int KeyLength;
+    Cht_Node *Node;
+    char *CacheItr;
+    uint32_t NewTTL;
 
-            ++(*CacheCount);
-        } else {
-            return -1;
-        }
+    CacheShard  *s;
+    uint64_t    HashValue;
+
+    KeyLength = DNSCache_MakeKey(Key,
+                                 Name,
+                                 NameHash,
+                                 DNS_TYPE_CNAME,
+                                 DNS_CLASS_IN,
+                                 Partition,
+                                 Scope,
+                                 &HashValue
+                                 );
+    if( KeyLength < 0 )
+    {
+        return -1;
+    }
+
+    s = DNSCache_GetShard(HashValue);
+
+    DNSCache_RdLock(s);
+    DNSCache_CountLookup(HashValue);
+
+    Node = DNSCache_FindFromCache(s,
+                                  HashValue,
+                                  Key,
+                                  KeyLength,
+                                  NULL,
+                                  l->CurrentTime,
+                                  l->Stale
+                                  );
+    if( Node == NULL )
+    {
+        DNSCache_UnRLock(s);
+        return -2;
+    }
+
+    NewTTL = DNSCache_LookupTTL(Node, l);
+
+    /* RDLength, then the uncompressed canonical name */
+    CacheItr = MapStart + Node->Offset + 1 + KeyLength;
+
+    memcpy(Buffer, CacheItr + 2, GET_16_BIT_U_INT(CacheItr));
+
+    if( g->WireRecord(g,
+                      MapStart + Node->Offset + 1,
+                      DNS_TYPE_CNAME,
+                      DNS_CLASS_IN,
+                      CacheItr + 2,
+                      GET_16_BIT_U_INT(CacheItr),
+                      NewTTL
+                      )
+        != 0 )
+    {
+        DNSCache_UnRLock(s);
+        return -3;
     }
 
+    DNSCache_UnRLock(s);
+
     return 0;
 }
 
-int DNSCache_AddItemsToCache(MsgContext *MsgCtx, BOOL IsFirst)
+/* RCode of the negative answer returned, negative if not found. The SOA record
+ * is generated in the authority section.
+ */
+static int DNSCache_GetNegativeFromCache(__in const char *Name,
+                                         __in uint64_t NameHash,
+                                         __in DNSRecordType Type,
+                                         __in const ClientSubnet *Scope,
+                                         __inout DnsGenerator *g,
+                                         __inout CacheLookup *l
+                                         )
 {
-    IHeader *Header = (IHeader *)MsgCtx;
-    char *DnsEntity = IHEADER_TAIL(Header);
-    const CtrlContent *TtlContent = NULL;
+    char Key[CACHE_KEY_MAX];
+    int KeyLength;
+    Cht_Node *Node;
+    char *CacheItr;
+    char *Owner;
+    int OwnerLength;
+    uint32_t NewTTL;
+    int RCode;
+
+    CacheShard  *s;
+    uint64_t    HashValue;
+
+    KeyLength = DNSCache_MakeKey(Key,
+                                 Name,
+                                 NameHash,
+                                 Type,
+                                 CACHE_CLASS_NEGATIVE,
+                                 CACHE_PARTITION_PLAIN,
+                                 Scope,
+                                 &HashValue
+                                 );
+    if( KeyLength < 0 )
+    {
+        return -1;
+    }
 
-    DnsSimpleParser p;
-    DnsSimpleParserIterator i;
+    s = DNSCache_GetShard(HashValue);
 
-    if(Inited == FALSE) return 0;
-    if(!IsFirst && !CacheParallel) return 0;
+    DNSCache_RdLock(s);
+    DNSCache_CountLookup(HashValue);
 
-    if( DnsSimpleParser_Init(&p, DnsEntity, Header->EntityLength, FALSE) != 0 )
+    Node = DNSCache_FindFromCache(s,
+                                  HashValue,
+                                  Key,
+                                  KeyLength,
+                                  NULL,
+                                  l->CurrentTime,
+                                  l->Stale
+                                  );
+    if( Node == NULL )
+    {
+        DNSCache_UnRLock(s);
+        return -2;
+    }
+
+    NewTTL = DNSCache_LookupTTL(Node, l);
+
+    /* RDLength, RCode, the owner of SOA, then SOA itself */
+    CacheItr = MapStart + Node->Offset + 1 + KeyLength;
+    RCode = CacheItr[2];
+    Owner = CacheItr + 3;
+    OwnerLength = DNSJumpOverName(Owner) - Owner;
+
+    if( g->NextPurpose(g) != DNS_RECORD_PURPOSE_NAME_SERVER ||
+        g->WireRecord(g,
+                      Owner,
+                      DNS_TYPE_SOA,
+                      DNS_CLASS_IN,
+                      Owner + OwnerLength,
+                      GET_16_BIT_U_INT(CacheItr) - 1 - OwnerLength,
+                      NewTTL
+                      )
+        != 0 )
+    {
+        DNSCache_UnRLock(s);
+        return -3;
+    }
+
+    DNSCache_UnRLock(s);
+
+    return RCode;
+}
+
+/* State code returned, -2 if there is no flattened chain for the question */
+static int DNSCache_GetChainFromCache(__in const char *Name,
+                                     __in uint64_t NameHash,
+                                     __in DNSRecordType Type,
+                                     __in const ClientSubnet *Scope,
+                                     __inout DnsGenerator *g,
+                                     __inout CacheLookup *l
+                                     )
+{
+    char Key[CACHE_KEY_MAX];
+    int KeyLength;
+    Cht_Node *Node;
+    char *CacheItr;
+    char *CacheEnd;
+    const char *Owner;
+    int Hops;
+    uint32_t NewTTL;
+
+    CacheShard  *s;
+    uint64_t    HashValue;
+
+    KeyLength = DNSCache_MakeKey(Key,
+                                 Name,
+                                 NameHash,
+                                 Type,
+                                 CACHE_CLASS_CHAIN,
+                                 CACHE_PARTITION_PLAIN,
+                                 Scope,
+                                 &HashValue
+                                 );
+    if( KeyLength < 0 )
     {
         return -1;
     }
 
-    if( DnsSimpleParserIterator_Init(&i, &p) != 0 )
+    s = DNSCache_GetShard(HashValue);
+
+    DNSCache_RdLock(s);
+    DNSCache_CountLookup(HashValue);
+
+    Node = DNSCache_FindFromCache(s,
+                                  HashValue,
+                                  Key,
+                                  KeyLength,
+                                  NULL,
+                                  l->CurrentTime,
+                                  l->Stale
+                                  );
+    if( Node == NULL )
     {
+        DNSCache_UnRLock(s);
         return -2;
     }
 
-    TtlContent =  CacheTtlCrtl_Get(TtlCtrl, Header->Domain);
-    RWLock_WrLock(CacheLock);
+    NewTTL = DNSCache_LookupTTL(Node, l);
 
-    while( i.Next(&i) != NULL )
-    {
-        BOOL RightPurpose = i.Purpose != DNS_RECORD_PURPOSE_UNKNOWN &&
-                            i.Purpose != DNS_RECORD_PURPOSE_QUESTION;
+    /* RDLength, hop count, canonical names, then the records */
+    Owner = MapStart + Node->Offset + 1;
+    CacheItr = MapStart + Node->Offset + 1 + KeyLength;
+    CacheEnd = CacheItr + 2 + GET_16_BIT_U_INT(CacheItr);
+    Hops = GET_8_BIT_U_INT(CacheItr + 2);
 
-        BOOL CachedType = i.Type == DNS_TYPE_A ||
-                          i.Type == DNS_TYPE_AAAA ||
-                          i.Type == DNS_TYPE_CNAME;
+    for( CacheItr += 3; Hops > 0; --Hops )
+    {
+        int NameLength = DNSJumpOverName(CacheItr) - CacheItr;
+
+        if( g->WireRecord(g,
+                          Owner,
+                          DNS_TYPE_CNAME,
+                          DNS_CLASS_IN,
+                          CacheItr,
+                          NameLength,
+                          NewTTL
+                          )
+            != 0 )
+        {
+            DNSCache_UnRLock(s);
+            return -3;
+        }
 
-        BOOL CachedClass = i.Klass == DNS_CLASS_IN;
+        Owner = CacheItr;
+        CacheItr += NameLength;
+    }
 
-        if( RightPurpose && CachedType && CachedClass )
+    while( CacheItr < CacheEnd )
+    {
+        if( g->WireRecord(g,
+                          Owner,
+                          Type,
+                          DNS_CLASS_IN,
+                          CacheItr + 2,
+                          GET_16_BIT_U_INT(CacheItr),
+                          NewTTL
+                          )
+            != 0 )
         {
-            DNSCache_AddAItemToCache(&i, time(NULL), TtlContent);
+            DNSCache_UnRLock(s);
+            return -3;
         }
+
+        CacheItr += 2 + GET_16_BIT_U_INT(CacheItr);
     }
 
-    RWLock_UnWLock(CacheLock);
+    DNSCache_UnRLock(s);
 
     return 0;
 }
 
 /* State code returned */
-static int DNSCache_GetRawRecordsFromCache( __in    const char *Name,
-                                            __in    DNSRecordType Type,
-                                            __in    DNSRecordClass Klass,
-                                            __inout DnsGenerator *g,
-                                            __in    time_t CurrentTime
-                                            )
+/* Signatures of the records of `Type' at `Name' generated, if there are any */
+static int DNSCache_GetSignaturesFromCache(__in const char *Name,
+                                           __in uint64_t NameHash,
+                                           __in DNSRecordType Type,
+                                           __in const ClientSubnet *Scope,
+                                           __inout DnsGenerator *g,
+                                           __inout CacheLookup *l
+                                           )
 {
-    int Ret = -100;
+    int Ret = DNSCache_GetRawRecordsFromCache(Name,
+                                              NameHash,
+                                              DNS_TYPE_RRSIG,
+                                              DNS_CLASS_IN,
+                                              CACHE_PARTITION_DNSSEC,
+                                              Scope,
+                                              Type,
+                                              g,
+                                              l
+                                              );
+
+    return Ret == -100 ? 0 : Ret;
+}
 
-    char Name_Type_Class[256];
+/* `NameHash' is `IHeader::HashValue' of the question, `Scope' is the network
+ * of the client truncated to a scope length, NULL for the answers for everyone.
+ */
+static int DNSCache_GetByQuestion(__inout DnsGenerator *g,
+                                  __inout DnsSimpleParser *p,
+                                  __in uint64_t NameHash,
+                                  __in int Partition,
+                                  __in const ClientSubnet *Scope,
+                                  __inout CacheLookup *l,
+                                  __out int *RCode
+                                  )
+{
+    char    Name[CACHE_KEY_NAME_MAX];
+    char    CName[CACHE_KEY_NAME_MAX];
+    char    *Question;
+    int     Ret;
 
-    uint32_t    NewTTL;
+    DnsSimpleParserIterator i;
 
-    Cht_Node *Node = NULL; /* Important */
+    if( DnsSimpleParserIterator_Init(&i, p) != 0 )
+    {
+        return -1;
+    }
 
-    if( snprintf(Name_Type_Class,
-             sizeof(Name_Type_Class),
-             "%s\1%d\1%d",
-             Name,
-             Type,
-             Klass
-             )
-        >= sizeof(Name_Type_Class)
-        ) {
-            return -609;
+    Question = i.Next(&i);
+    if( Question == NULL || i.Purpose != DNS_RECORD_PURPOSE_QUESTION )
+    {
+        return -2;
     }
 
-    do
+    if( i.Klass != DNS_CLASS_IN || !DNSCache_TypeCached(i.Type) )
     {
-        char *CacheItr;
+        return -4;
+    }
 
-        Node = DNSCache_FindFromCache(Name_Type_Class,
-                                      strlen(Name_Type_Class) + 1,
-                                      Node,
-                                      CurrentTime
-                                      );
+    if( DNSExpandName(p->RawDns, p->RawDnsLength, Question, Name, sizeof(Name)) < 0 )
+    {
+        return -3;
+    }
 
-        if( Node == NULL )
+    /* If the intended type is not DNS_TYPE_CNAME, then first find its cname */
+    if( i.Type != DNS_TYPE_CNAME )
+    {
+        int Hops = 0;
+
+        if( Partition == CACHE_PARTITION_PLAIN )
         {
-            break;
+            /* The whole chain and the records it ends with in one lookup */
+            Ret = DNSCache_GetChainFromCache(Name, NameHash, i.Type, Scope, g, l);
+            if( Ret == 0 )
+            {
+                *RCode = RESPONSE_CODE_NO_ERROR;
+                return 0;
+            } else if( Ret != -2 ){
+                return -8;
+            }
         }
 
-        Ret = 0;
-
-        if( Node->TTL != 0 )
+        while( (Ret = DNSCache_GetCNameFromCache(Name, NameHash, CName, Partition, Scope, g, l))
+               != -2
+               )
         {
-            /* TTL*/
-            if( IgnoreTTL == TRUE )
+            if( Ret != 0 )
             {
-                NewTTL = Node->TTL;
-            } else {
-                NewTTL = Node->TTL - (CurrentTime - Node->TimeAdded);
+                return -5;
             }
 
-            /* Data */
-            for(CacheItr = MapStart + Node->Offset + 1;
-                *CacheItr != '\0';
-                ++CacheItr
-            );
-            /* Now *CacheItr == '\0' */
-            ++CacheItr;
-            /* Now the data position */
-
-            switch( Type )
+            /* Too long, or looping */
+            if( ++Hops > CACHE_CNAME_DEPTH_MAX )
             {
-            case DNS_TYPE_CNAME:
-                if( g->CName(g, Name, CacheItr, NewTTL) != 0 )
-                {
-                    return -1;
-                }
-                break;
-
-            case DNS_TYPE_A:
-                if( g->A(g, Name, CacheItr, NewTTL) != 0 )
-                {
-                    return -2;
-                }
-                break;
-
-            case DNS_TYPE_AAAA:
-                if( g->AAAA(g, Name, CacheItr, NewTTL) != 0 )
-                {
-                    return -3;
-                }
-                break;
-
-            default:
-                return -4;
-                break;
+                return -9;
             }
-        }
-    } while ( TRUE );
 
-    return Ret;
-}
+            if( Partition == CACHE_PARTITION_DNSSEC &&
+                DNSCache_GetSignaturesFromCache(Name, NameHash, DNS_TYPE_CNAME, Scope, g, l) != 0
+                )
+            {
+                return -7;
+            }
 
-static Cht_Node *DNSCache_GetCNameFromCache(__in char *Name, __out char *Buffer, __in time_t CurrentTime)
-{
-    char Name_Type_Class[256];
-    Cht_Node *Node = NULL;
+            memcpy(Name, CName, sizeof(Name));
+            NameHash = DNSCache_NameHash(Name);
+        }
+    }
 
-    if( snprintf(Name_Type_Class, sizeof(Name_Type_Class), "%s\1%d\1%d", Name, DNS_TYPE_CNAME, 1) >= sizeof(Name_Type_Class) ){
-        return NULL;
+    *RCode = RESPONSE_CODE_NO_ERROR;
+
+    Ret = DNSCache_GetRawRecordsFromCache(Name,
+                                          NameHash,
+                                          i.Type,
+                                          i.Klass,
+                                          Partition,
+                                          Scope,
+                                          DNS_TYPE_UNKNOWN,
+                                          g,
+                                          l
+                                          );
+    if( Ret == 0 && Partition == CACHE_PARTITION_DNSSEC )
+    {
+        Ret = DNSCache_GetSignaturesFromCache(Name, NameHash, i.Type, Scope, g, l);
     }
 
-    do
+    if( Ret == -100 && Partition == CACHE_PARTITION_PLAIN )
     {
-        Node = DNSCache_FindFromCache(Name_Type_Class, strlen(Name_Type_Class) + 1, Node, CurrentTime);
-        if( Node == NULL )
+        /* No record, but it may be known not to exist */
+        Ret = DNSCache_GetNegativeFromCache(Name, NameHash, i.Type, Scope, g, l);
+        if( Ret < 0 )
         {
-            return NULL;
+            return -6;
         }
 
-        strcpy(Buffer, MapStart + Node->Offset + 1 + strlen(Name_Type_Class) + 1);
-        return Node;
-
-    } while( TRUE );
+        *RCode = Ret;
+    } else if( Ret != 0 ){
+        return -6;
+    }
 
+    return 0;
 }
 
-/* State code returned */
-static int DNSCache_GetByQuestion(__inout DnsGenerator *g,
-                                  __inout DnsSimpleParser *p,
-                                  __in time_t CurrentTime
-                                  )
+/* Send the question of `h' upstream in the background, the answer updates the
+ * cache when it arrives.
+ */
+static int DNSCache_Refresh(IHeader *h, time_t CurrentTime)
 {
-    char    Name[260];
-    char    CName[260];
-
-    uint32_t NewTTL;
+    static const char DNSHeader[DNS_HEADER_LENGTH] = {
+        00, 00, /* QueryIdentifier */
+        01, 00, /* Flags */
+        00, 00, /* QuestionCount */
+        00, 00, /* AnswerCount */
+        00, 00, /* NameServerCount */
+        00, 00, /* AdditionalCount */
+    };
+
+    char    *Buffer;
+    IHeader *Header;
+    char    *Entity;
+    time_t  *LastTime;
+    uint64_t Slot;
+    int     loop;
+    int     ret;
 
-    DnsSimpleParserIterator i;
+    DnsGenerator g;
 
-    if( DnsSimpleParserIterator_Init(&i, p) != 0 )
+    if( RefreshSocket == INVALID_SOCKET )
     {
         return -1;
     }
 
-    if( i.Next(&i) == NULL || i.Purpose != DNS_RECORD_PURPOSE_QUESTION )
+    /* Only one refresh at a time for a question of a network */
+    Slot = (h->HashValue * 131 + h->Type) * 131 + h->DNSSECOk;
+    for( loop = 0; loop != (h->Subnet.Prefix + 7) / 8; ++loop )
     {
-        return -2;
+        Slot = Slot * 131 + h->Subnet.Address[loop];
     }
 
-    if( i.Klass != DNS_CLASS_IN ||
-        (i.Type != DNS_TYPE_CNAME &&
-            i.Type != DNS_TYPE_A &&
-            i.Type != DNS_TYPE_AAAA
-            )
-        )
+    LastTime = RefreshTimes + Slot % CACHE_REFRESH_SLOTS;
+
+    EFFECTIVE_LOCK_GET(RefreshLock);
+    if( CurrentTime - *LastTime < CACHE_REFRESH_INTERVAL )
     {
-        return -4;
+        EFFECTIVE_LOCK_RELEASE(RefreshLock);
+        return 0;
     }
+    *LastTime = CurrentTime;
+    EFFECTIVE_LOCK_RELEASE(RefreshLock);
 
-    if( i.GetName(&i, Name, sizeof(Name)) < 0 )
+    /* Modules may keep it */
+    Buffer = (char *)MsgPool_Get();
+    if( Buffer == NULL )
     {
-        return -3;
+        return -6;
     }
 
-    RWLock_RdLock(CacheLock);
+    Header = (IHeader *)Buffer;
+    Entity = Buffer + sizeof(IHeader);
 
-    /* If the intended type is not DNS_TYPE_CNAME, then first find its cname */
-    if( i.Type != DNS_TYPE_CNAME )
+    if( DnsGenerator_Init(&g,
+                          Entity,
+                          CONTEXT_DATA_LENGTH - sizeof(IHeader),
+                          DNSHeader,
+                          DNS_HEADER_LENGTH,
+                          FALSE
+                          )
+        != 0 )
     {
-        Cht_Node *Node = NULL;
-        while( (Node = DNSCache_GetCNameFromCache(Name, CName, CurrentTime))
-               != NULL
-               )
-        {
-            if( IgnoreTTL == TRUE )
-            {
-                NewTTL = Node->TTL;
-            } else {
-                NewTTL = Node->TTL - (CurrentTime - Node->TimeAdded);
-            }
+        ret = -2;
+        goto EXIT_1;
+    }
 
-            if( g->CName(g, "a", CName, NewTTL) != 0 )
-            {
-                RWLock_UnRLock(CacheLock);
-                return -5;
-            }
+    g.SetIdentifier(&g, rand());
 
-            strcpy(Name, CName);
+    if( g.Question(&g, h->Domain, h->Type, DNS_CLASS_IN) != 0 )
+    {
+        ret = -3;
+        goto EXIT_1;
+    }
+
+    if( h->EDNSEnabled )
+    {
+        while( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ADDITIONAL );
+
+        if( g.EDns(&g, CACHE_EDNS_PAYLOAD_SIZE, h->DNSSECOk) != 0 )
+        {
+            ret = -4;
+            goto EXIT_1;
         }
     }
 
-    if( DNSCache_GetRawRecordsFromCache(Name, i.Type, i.Klass, g, CurrentTime)
-        != 0
-        )
+    if( IHeader_Fill(Header,
+                     FALSE,
+                     Entity,
+                     g.Length(&g),
+                     (struct sockaddr *)&(RefreshAddress.Addr),
+                     RefreshSocket,
+                     RefreshAddress.family,
+                     "Refresh"
+                     )
+        != 0 )
     {
-        RWLock_UnRLock(CacheLock);
-        return -6;
+        ret = -5;
+        goto EXIT_1;
     }
 
-    RWLock_UnRLock(CacheLock);
-    return 0;
+    Header->Refreshing = TRUE;
+
+    /* Answers scoped to the network of the client are refreshed */
+    Header->Subnet = h->Subnet;
+    Header->Subnet.InQuery = 0;
+
+    DNSCache_DrainRefreshSocket();
+
+    ret = MMgr_Send(Buffer, CONTEXT_DATA_LENGTH);
+
+EXIT_1:
+    MsgPool_Put((MsgContext *)Buffer);
+    return ret;
 }
 
 /* Content length returned */
@@ -857,53 +3896,151 @@ int DNSCache_FetchFromCache(MsgContext *MsgCtx, int BufferLength)
     int LeftBufferLength = BufferLength - sizeof(IHeader) - h->EntityLength;
 
     int ResultLength;
+    int RCode;
 
-    if( Inited != TRUE )
-    {
-        return -792;
-    }
+    /* Scoped answers are looked up from the longest scope length, no longer
+       than the prefix length of the client, to 0 meaning the answers for
+       everyone */
+    ClientSubnet Scope = h->Subnet;
+    int ScopeLength = h->Subnet.Family != 0 ? h->Subnet.Prefix : 0;
 
-    /* We did/do NOT cache these types of answers.
+    /* Answers to queries with the DO bit set come from their own partition.
         EDNS0: https://datatracker.ietf.org/doc/html/rfc2671
         DNSSEC Indicating: https://datatracker.ietf.org/doc/html/rfc3225
         EDNS Extensions: https://datatracker.ietf.org/doc/html/rfc6891
      */
-    if( h->EDNSEnabled )
+    int Partition = h->EDNSEnabled && h->DNSSECOk ?
+                    CACHE_PARTITION_DNSSEC : CACHE_PARTITION_PLAIN;
+
+    int PacketFlags = 0;
+
+    CacheLookup l;
+
+    if( Inited != TRUE )
     {
-        return -4;
+        return -792;
     }
 
-    if( DnsSimpleParser_Init(&p, RequestContent, h->EntityLength, FALSE) != 0 )
+    /* Refreshing queries have to go upstream */
+    if( h->Refreshing )
     {
-        return -1;
+        return -8;
     }
 
-    if( DnsGenerator_Init(&g,
-                          HereToGenerate,
-                          LeftBufferLength,
-                          RequestContent,
-                          h->EntityLength,
-                          TRUE
-                          )
-       != 0)
+    if( h->EDNSEnabled )
     {
-        return -2;
+        PacketFlags |= PACKET_CACHE_FLAG_EDNS;
+        if( h->DNSSECOk )
+        {
+            PacketFlags |= PACKET_CACHE_FLAG_DO;
+        }
     }
 
-    if( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ANSWER )
+    DNSCache_FlushLookups();
+
+    l.CurrentTime = time(NULL);
+    l.Stale = FALSE;
+    l.Refresh = FALSE;
+    l.Fresh = (uint32_t)-1;
+
+    ResultLength = PacketCache_Fetch(RequestContent,
+                                     h->EntityLength,
+                                     BufferLength - sizeof(IHeader),
+                                     h->HashValue,
+                                     h->Type,
+                                     PacketFlags,
+                                     &(h->Subnet),
+                                     l.CurrentTime
+                                     );
+    if( ResultLength > 0 )
     {
-        return -5;
+        h->EntityLength = ResultLength;
+        if( MsgContext_SendBack(MsgCtx) < 0 )
+        {
+            return -861;
+        }
+
+        ShowNormalMessage(h, 'C');
+        DomainStatistic_Add(h, STATISTIC_TYPE_CACHE);
+
+        return 0;
+    }
+
+    if( DnsSimpleParser_Init(&p, RequestContent, h->EntityLength, FALSE) != 0 )
+    {
+        return -1;
     }
 
-    if( DNSCache_GetByQuestion(&g, &p, time(NULL)) != 0 )
+    do
     {
-        return -3;
+        const ClientSubnet *Scoped = NULL;
+
+        /* Only the scope lengths answers have been cached for */
+        while( ScopeLength > 0 &&
+               SubnetScopes[h->Subnet.Family - 1][ScopeLength] == 0
+               )
+        {
+            --ScopeLength;
+        }
+
+        if( ScopeLength > 0 )
+        {
+            Scope.Prefix = ScopeLength;
+            Scoped = &Scope;
+        }
+
+        if( DnsGenerator_Init(&g,
+                              HereToGenerate,
+                              LeftBufferLength,
+                              RequestContent,
+                              h->EntityLength,
+                              TRUE
+                              )
+           != 0)
+        {
+            return -2;
+        }
+
+        if( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ANSWER )
+        {
+            return -5;
+        }
+
+        if( DNSCache_GetByQuestion(&g, &p, h->HashValue, Partition, Scoped, &l, &RCode) == 0 )
+        {
+            break;
+        }
+
+        if( ScopeLength > 0 )
+        {
+            --ScopeLength;
+            continue;
+        }
+
+        /* Try again with the expired entries, https://tools.ietf.org/html/rfc8767 */
+        if( l.Stale || StaleTime == 0 )
+        {
+            return -3;
+        }
+
+        l.Stale = TRUE;
+        ScopeLength = h->Subnet.Family != 0 ? h->Subnet.Prefix : 0;
+    } while( TRUE );
+
+    if( h->EDNSEnabled )
+    {
+        while( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ADDITIONAL );
+
+        if( g.EDns(&g, CACHE_EDNS_PAYLOAD_SIZE, h->DNSSECOk) != 0 )
+        {
+            return -7;
+        }
     }
 
     g.Header->Flags.Direction = 1;
     g.Header->Flags.AuthoritativeAnswer = 0;
     g.Header->Flags.RecursionAvailable = 1;
-    g.Header->Flags.ResponseCode = 0;
+    g.Header->Flags.ResponseCode = RCode;
     g.Header->Flags.Type = 0;
 
     ResultLength = DNSCompress(HereToGenerate, g.Length(&g));
@@ -914,7 +4051,33 @@ int DNSCache_FetchFromCache(MsgContext *MsgCtx, int BufferLength)
 
     memmove(RequestContent, HereToGenerate, ResultLength);
 
+    /* Clients sending their networks are told the scopes of the answers */
+    if( h->Subnet.InQuery )
+    {
+        ResultLength = ClientSubnet_Insert(RequestContent,
+                                           ResultLength,
+                                           BufferLength - sizeof(IHeader),
+                                           &(h->Subnet),
+                                           ScopeLength
+                                           );
+        if( ResultLength < 0 )
+        {
+            return -9;
+        }
+    }
+
     h->EntityLength = ResultLength;
+
+    PacketCache_Add(RequestContent,
+                    ResultLength,
+                    h->HashValue,
+                    h->Type,
+                    PacketFlags,
+                    &(h->Subnet),
+                    l.Fresh,
+                    l.CurrentTime
+                    );
+
     if( MsgContext_SendBack(MsgCtx) < 0 )
     {
         /** TODO: Error handling */
@@ -924,5 +4087,150 @@ int DNSCache_FetchFromCache(MsgContext *MsgCtx, int BufferLength)
     ShowNormalMessage(h, 'C');
     DomainStatistic_Add(h, STATISTIC_TYPE_CACHE);
 
+    if( l.Refresh )
+    {
+        DNSCache_Refresh(h, l.CurrentTime);
+    }
+
+    return 0;
+}
+
+void DNSCache_Enum(DNSCache_EnumCallback Callback, void *Arg)
+{
+    time_t  CurrentTime = time(NULL);
+    int     loop;
+
+    if( !Inited )
+    {
+        return;
+    }
+
+    for( loop = 0; loop != ShardCount; ++loop )
+    {
+        CacheShard  *s = Shards + loop;
+        Array       *NodeChunk;
+        int32_t     Subscript;
+
+        DNSCache_RdLock(s);
+
+        NodeChunk = &(s->Header->ht.NodeChunk);
+        for( Subscript = 0; Subscript != NodeChunk->Used; ++Subscript )
+        {
+            Cht_Node    *Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, Subscript);
+            const char  *Entry = MapStart + Node->Offset;
+            const char  *NameEnd;
+            int         KeyLength;
+            uint32_t    TTL = Node->TTL;
+
+            /* Free chunks and slots */
+            if( Node->Slot < 0 || (Node->Flags & CHT_NODE_FREE) != 0 )
+            {
+                continue;
+            }
+
+            if( !IgnoreTTL )
+            {
+                if( CurrentTime - Node->TimeAdded >= (time_t)Node->TTL )
+                {
+                    continue;
+                }
+
+                TTL -= CurrentTime - Node->TimeAdded;
+            }
+
+            if( DNSCache_EntryLength(Entry, Node->Length) < 0 )
+            {
+                continue;
+            }
+
+            KeyLength = DNSCache_EntryKeyLength(Entry, Node->Length);
+            NameEnd = Entry + 1 + strlen(Entry + 1) + 1;
+
+            /* Only the records of the plain partition, for everyone */
+            if( GET_16_BIT_U_INT(NameEnd + 2) != DNS_CLASS_IN ||
+                GET_8_BIT_U_INT(NameEnd + 4) != CACHE_PARTITION_PLAIN
+                )
+            {
+                continue;
+            }
+
+            Callback(Entry + 1,
+                     (DNSRecordType)GET_16_BIT_U_INT(NameEnd),
+                     DNS_CLASS_IN,
+                     Entry + 1 + KeyLength + 2,
+                     GET_16_BIT_U_INT(Entry + 1 + KeyLength),
+                     TTL,
+                     Node->TimeAdded,
+                     Arg
+                     );
+        }
+
+        DNSCache_UnRLock(s);
+    }
+}
+
+int DNSCache_AddEntry(const char *Name,
+                      DNSRecordType Type,
+                      DNSRecordClass Klass,
+                      const char *RData,
+                      int RDLength,
+                      uint32_t TTL
+                      )
+{
+    char        Buffer[CACHE_ITEM_MAX];
+    char        *Item = Buffer + 1;
+    int         KeyLength;
+    uint64_t    HashValue;
+
+    if( !Inited )
+    {
+        return -2;
+    }
+
+    /* `CacheType' may have been changed */
+    if( Klass != DNS_CLASS_IN || !DNSCache_TypeCached(Type) )
+    {
+        return -3;
+    }
+
+    Buffer[0] = CACHE_START;
+
+    /* Names are lowercased and the hash value is got */
+    KeyLength = DNSCache_MakeKey(Item,
+                                 Name,
+                                 DNSCache_NameHash(Name),
+                                 Type,
+                                 Klass,
+                                 CACHE_PARTITION_PLAIN,
+                                 NULL,
+                                 &HashValue
+                                 );
+    if( KeyLength < 0 )
+    {
+        return -4;
+    }
+
+    if( RDLength < 0 || 1 + KeyLength + 2 + RDLength + 1 > sizeof(Buffer) )
+    {
+        return -5;
+    }
+
+    SET_16_BIT_U_INT(Item + KeyLength, RDLength);
+    memcpy(Item + KeyLength + 2, RData, RDLength);
+    Item[KeyLength + 2 + RDLength] = CACHE_END;
+
+    if( DNSCache_StoreItem(Buffer,
+                           1 + KeyLength + 2 + RDLength + 1,
+                           KeyLength,
+                           HashValue,
+                           TTL,
+                           time(NULL),
+                           FALSE
+                           )
+        != 0 )
+    {
+        return -1;
+    }
+
     return 0;
 }
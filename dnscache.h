@@ -13,4 +13,33 @@ int DNSCache_AddItemsToCache(MsgContext *MsgCtx, BOOL IsFirst);
 
 int DNSCache_FetchFromCache(MsgContext *MsgCtx, int BufferLength);
 
+/* The records of the cache, except those internal to it: the negative ones,
+ * the chains, the answers to the queries with the DO bit set and the answers
+ * scoped to networks. `Name' is a lowercased wire-format name and `RData' is
+ * uncompressed, `RDLength' bytes, TTL being what's left. Called with the shard
+ * of the record locked.
+ */
+typedef void (*DNSCache_EnumCallback)(const char *Name,
+                                      DNSRecordType Type,
+                                      DNSRecordClass Klass,
+                                      const char *RData,
+                                      int RDLength,
+                                      uint32_t TTL,
+                                      time_t TimeAdded,
+                                      void *Arg
+                                      );
+
+void DNSCache_Enum(DNSCache_EnumCallback Callback, void *Arg);
+
+/* A record enumerated added, its key derived again. Entries are never evicted
+ * for it, -1 returned if no room, other negative values if it's not cached.
+ */
+int DNSCache_AddEntry(const char *Name,
+                      DNSRecordType Type,
+                      DNSRecordClass Klass,
+                      const char *RData,
+                      int RDLength,
+                      uint32_t TTL
+                      );
+
 #endif /* _DNS_CACHE_ */
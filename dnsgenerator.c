@@ -37,6 +37,7 @@ int DNSCompress(__inout char *DNSBody, __in int DNSBodyLength)
     DnsSimpleParserIterator i;
 
     char *LastName;
+    char *LastOwner;
     char *CurrentName;
 
     if( DnsSimpleParser_Init(&p, DNSBody, DNSBodyLength, FALSE) != 0 )
@@ -55,6 +56,8 @@ int DNSCompress(__inout char *DNSBody, __in int DNSBodyLength)
         return -3;
     }
 
+    LastOwner = LastName;
+
     i.GotoAnswers(&i);
     while( (CurrentName = i.Next(&i)) != NULL &&
            i.Purpose == DNS_RECORD_PURPOSE_ANSWER
@@ -82,7 +85,14 @@ int DNSCompress(__inout char *DNSBody, __in int DNSBodyLength)
                 p.RawDnsLength - ((CurrentName + LengthDifference) - p.RawDns)
                 );
 
-        DNSLabelMakePointer(CurrentName, LastName - p.RawDns);
+        /* Signatures follow the records they cover, sharing their owners */
+        if( i.Type == DNS_TYPE_RRSIG )
+        {
+            DNSLabelMakePointer(CurrentName, LastOwner - p.RawDns);
+        } else {
+            DNSLabelMakePointer(CurrentName, LastName - p.RawDns);
+            LastOwner = LastName;
+        }
 
         /* Yeah, changed that */
         p.RawDnsLength -= LengthDifference;
@@ -426,7 +436,7 @@ static int DnsGenerator_AAAA(DnsGenerator *g,
     return 0;
 }
 
-static int DnsGenerator_EDns(DnsGenerator *g, int UdpPayloadSize)
+static int DnsGenerator_EDns(DnsGenerator *g, int UdpPayloadSize, BOOL DNSSECOk)
 {
     DnsRecordPurpose p = DnsGenerator_CurrentPurpose(g);
 
@@ -450,7 +460,8 @@ static int DnsGenerator_EDns(DnsGenerator *g, int UdpPayloadSize)
         return -3;
     }
 
-    if( DnsGenerator_32Uint(g, 0) != 0 )
+    /* EXTENDED-RCODE VERSION DO Z */
+    if( DnsGenerator_32Uint(g, DNSSECOk ? 0x8000 : 0) != 0 )
     {
         return -4;
     }
@@ -526,6 +537,62 @@ static int DnsGenerator_RawData(DnsGenerator *g,
     return 0;
 }
 
+/* Same as `DnsGenerator_RawData', but `Name' is in wire format (uncompressed),
+   both the name and the data are copied as they are */
+static int DnsGenerator_WireRecord(DnsGenerator *g,
+                                   const char *Name,
+                                   DNSRecordType Type,
+                                   DNSRecordClass Klass,
+                                   const char *Data,
+                                   int DataLength,
+                                   int Ttl
+                                   )
+{
+    DnsRecordPurpose p = DnsGenerator_CurrentPurpose(g);
+    int NameLength = 0;
+
+    if( p != DNS_RECORD_PURPOSE_ANSWER &&
+        p != DNS_RECORD_PURPOSE_NAME_SERVER &&
+        p != DNS_RECORD_PURPOSE_ADDITIONAL
+        )
+    {
+        return 1;
+    }
+
+    if( Data == NULL || DataLength < 0 )
+    {
+        return 2;
+    }
+
+    while( Name[NameLength] != '\0' )
+    {
+        NameLength += GET_8_BIT_U_INT(Name + NameLength) + 1;
+    }
+    ++NameLength;
+
+    if( LEFT_LENGTH(g) < NameLength + 10 + DataLength )
+    {
+        return -1;
+    }
+
+    memcpy(g->Itr, Name, NameLength);
+    g->Itr += NameLength;
+
+    DnsGenerator_16Uint(g, Type);
+    DnsGenerator_16Uint(g, Klass);
+    DnsGenerator_32Uint(g, Ttl);
+    DnsGenerator_16Uint(g, DataLength);
+
+    memcpy(g->Itr, Data, DataLength);
+    g->Itr += DataLength;
+
+    SET_16_BIT_U_INT(g->NumberOfRecords,
+                     GET_16_BIT_U_INT(g->NumberOfRecords) + 1
+                     );
+
+    return 0;
+}
+
 static void DnsGenerator_CopyHeader(DnsGenerator *g,
                                    const char *Source,
                                    BOOL IncludeRecordCounts
@@ -861,6 +928,7 @@ int DnsGenerator_Init(DnsGenerator *g,
     g->AAAA = DnsGenerator_AAAA;
     g->EDns = DnsGenerator_EDns;
     g->RawData = DnsGenerator_RawData;
+    g->WireRecord = DnsGenerator_WireRecord;
 
     return 0;
 }
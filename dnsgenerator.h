@@ -86,7 +86,7 @@ struct _DnsGenerator {
                 int Ttl
                 );
 
-    int (*EDns)(DnsGenerator *g, int UdpPayloadSize);
+    int (*EDns)(DnsGenerator *g, int UdpPayloadSize, BOOL DNSSECOk);
 
     int (*RawData)(DnsGenerator *g,
                    const char *Name,
@@ -96,6 +96,15 @@ struct _DnsGenerator {
                    int DataLength,
                    int Ttl
                    );
+
+    int (*WireRecord)(DnsGenerator *g,
+                      const char *Name, /* Wire format, uncompressed */
+                      DNSRecordType Type,
+                      DNSRecordClass Klass,
+                      const char *Data,
+                      int DataLength,
+                      int Ttl
+                      );
 };
 
 int DnsGenerator_Init(DnsGenerator *g,
@@ -229,6 +229,58 @@ int DNSCopyLable(const char *DNSBody, char *here, const char *src)
     return FullLength;
 }
 
+/* Copy the name at `NameStart' to `Buffer' in wire format, with all
+   compression pointers followed. Length of the copied name returned. */
+int DNSExpandName(const char *DNSBody, int DNSBodyLength, const char *NameStart, char *Buffer, int BufferLength)
+{
+    const char *End = DNSBody + DNSBodyLength;
+    const char *NameItr = NameStart;
+    int Length = 0;
+    int Jumps = 0;
+
+    while( TRUE )
+    {
+        int LabelCount;
+
+        if( NameItr < DNSBody || NameItr >= End )
+        {
+            return -1;
+        }
+
+        LabelCount = GET_8_BIT_U_INT(NameItr);
+
+        if( DNSIsLabelPointerStart(LabelCount) )
+        {
+            /* Pointer loops */
+            if( ++Jumps > 127 || NameItr + 1 >= End )
+            {
+                return -2;
+            }
+
+            NameItr = DNSBody + DNSLabelGetPointer(NameItr);
+            continue;
+        }
+
+        if( LabelCount > 63 ||
+            NameItr + LabelCount + 1 > End ||
+            Length + LabelCount + 1 > BufferLength
+            )
+        {
+            return -3;
+        }
+
+        memcpy(Buffer + Length, NameItr, LabelCount + 1);
+        Length += LabelCount + 1;
+
+        if( LabelCount == 0 )
+        {
+            return Length;
+        }
+
+        NameItr += LabelCount + 1;
+    }
+}
+
 /**
   New Implementation
 */
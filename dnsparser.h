@@ -143,6 +143,8 @@ char *GetAllAnswers(char *DNSBody, int DNSBodyLength, char *Buffer, int BufferLe
 
 int DNSCopyLable(const char *DNSBody, char *here, const char *src);
 
+int DNSExpandName(const char *DNSBody, int DNSBodyLength, const char *NameStart, char *Buffer, int BufferLength);
+
 /**
   New Implementation
 */
@@ -43,6 +43,7 @@ const DNSTypeAndName DNSTypeList[] = {
     {251,   "IXFR"},
     {252,   "AXFR"},
     {255,   "*"},
+    {257,   "CAA"},
     {32768, "TA"},
     {32769, "DLV"}
 };
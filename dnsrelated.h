@@ -44,6 +44,7 @@ typedef enum _DNSRecordType{
     DNS_TYPE_IXFR       =   251,
     DNS_TYPE_AXFR       =   252,
     DNS_TYPE_ANY        =   255,
+    DNS_TYPE_CAA        =   257,
     DNS_TYPE_TA         =   32768,
     DNS_TYPE_DLV        =   32769,
 }DNSRecordType;
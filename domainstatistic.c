@@ -264,6 +264,7 @@ int DomainStatistic_Init(ConfigFileInfo *ConfigInfo)
 int DomainStatistic_Add(IHeader *h, StatisticType Type)
 {
     DomainInfo *ExistInfo;
+    uint32_t HashValue;
 
     if( MainFile == NULL || h == NULL )
     {
@@ -274,10 +275,12 @@ int DomainStatistic_Add(IHeader *h, StatisticType Type)
 
     if( SkipStatistic == FALSE )
     {
+        /* `HASH' of the domain */
+        HashValue = (uint32_t)h->HashValue;
 
         if( StringChunk_Match(&MainChunk,
                               h->Domain,
-                              &(h->HashValue),
+                              &HashValue,
                               (void **)&ExistInfo,
                               NULL,
                               NULL
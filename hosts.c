@@ -6,15 +6,17 @@
 #include "logs.h"
 #include "domainstatistic.h"
 #include "mmgr.h"
-
-#define CONTEXT_DATA_LENGTH  2048
+#include "msgpool.h"
 
 extern BOOL Ipv6_Enabled;
 
 static BOOL BlockIpv6WhenIpv4Exists = FALSE;
 
+/* Recursive queries passed to the hosts thread by address, received by
+ * `InnerSocket' and sent by `InnerSender'
+ */
 static SOCKET   InnerSocket;
-static Address_Type InnerAddress;
+static SOCKET   InnerSender;
 static SocketPuller Puller;
 
 BOOL Hosts_TypeExisting(const char *Domain, HostsRecordType Type)
@@ -69,15 +71,17 @@ HostsUtilsTryResult Hosts_Try(MsgContext *MsgCtx, int BufferLength)
 
     if( ret == HOSTSUTILS_TRY_RECURSED )
     {
-        if( sendto(InnerSocket,
-                   (const char *)Header, /* Only send header and identifier */
-                   sizeof(IHeader) + sizeof(uint16_t), /* Only send header and identifier */
-                   MSG_NOSIGNAL,
-                   (const struct sockaddr *)&(InnerAddress.Addr),
-                   GetAddressLength(InnerAddress.family)
-                   )
-            < 0 )
+        /* Only the address is sent, the reference taken here goes with it */
+        MsgPool_Ref(MsgCtx);
+
+        if( send(InnerSender,
+                 (const char *)&MsgCtx,
+                 sizeof(MsgCtx),
+                 MSG_NOSIGNAL
+                 )
+            != sizeof(MsgCtx) )
         {
+            MsgPool_Put(MsgCtx);
             return HOSTSUTILS_TRY_NONE;
         }
     }
@@ -132,13 +136,14 @@ static int Hosts_SocketLoop(void *Unused)
 
     #define LEFT_LENGTH_SL (CONTEXT_DATA_LENGTH - sizeof(IHeader))
 
+    /* Answers made for recursive queries */
     char    InnerBuffer[CONTEXT_DATA_LENGTH];
     MsgContext *InnerMsgCtx = (MsgContext *)InnerBuffer;
     IHeader *InnerHeader = (IHeader *)InnerBuffer;
     //char    *InnerEntity = InnerBuffer + sizeof(IHeader);
 
+    /* Answers of the queries of the CNAMEs */
     char OuterBuffer[CONTEXT_DATA_LENGTH];
-    //MsgContext *OuterMsgCtx = (MsgContext *)OuterBuffer;
     IHeader *OuterHeader = (IHeader *)OuterBuffer;
     char    *OuterEntity = OuterBuffer + sizeof(IHeader);
 
@@ -161,7 +166,7 @@ static int Hosts_SocketLoop(void *Unused)
     Puller.Add(&Puller, InnerSocket, NULL, 0);
     Puller.Add(&Puller, OuterSocket, NULL, 0);
 
-    if( ModuleContext_Init(&Context, CONTEXT_DATA_LENGTH) != 0 )
+    if( ModuleContext_Init(&Context) != 0 )
     {
         ret = -431;
         goto EXIT_1;
@@ -187,58 +192,76 @@ static int Hosts_SocketLoop(void *Unused)
         } else if( Pulled == InnerSocket )
         {
             /* Recursive query */
-            MsgContext *MsgCtxStored;
+            MsgContext *MsgCtxPassed, *MsgCtxStored;
+            IHeader *PassedHeader;
+            MsgContext *RecursedMsgCtx;
             char RecursedDomain[DOMAIN_NAME_LENGTH_MAX + 1];
             uint16_t NewIdentifier;
 
             TimeLimit = ShortTime;
 
-            State = recvfrom(InnerSocket,
-                             InnerBuffer, /* Receiving a header */
-                             sizeof(InnerBuffer),
-                             0,
-                             NULL,
-                             NULL
-                             );
+            State = recv(InnerSocket,
+                         (char *)&MsgCtxPassed, /* Receiving an address */
+                         sizeof(MsgCtxPassed),
+                         0
+                         );
 
-            if( State < 1 )
+            if( State != sizeof(MsgCtxPassed) )
             {
                 continue;
             }
 
-            if( Hosts_GetCName(InnerHeader->Domain, RecursedDomain) != 0 )
+            PassedHeader = (IHeader *)MsgCtxPassed;
+
+            if( Hosts_GetCName(PassedHeader->Domain, RecursedDomain) != 0 )
             {
                 ERRORMSG("Fatal error 221.\n");
+                MsgPool_Put(MsgCtxPassed);
                 continue;
             }
 
             NewIdentifier = rand();
 
-            if( HostsUtils_GenerateQuery(OuterBuffer,
+            RecursedMsgCtx = MsgPool_Get();
+            if( RecursedMsgCtx == NULL )
+            {
+                MsgPool_Put(MsgCtxPassed);
+                continue;
+            }
+
+            if( HostsUtils_GenerateQuery((char *)RecursedMsgCtx,
                                          CONTEXT_DATA_LENGTH,
                                          OuterSocket,
                                          &OuterAddress,
-                                         MsgContext_IsFromTCP(InnerMsgCtx),
+                                         MsgContext_IsFromTCP(MsgCtxPassed),
                                          NewIdentifier,
                                          RecursedDomain,
-                                         InnerHeader->Type
+                                         PassedHeader->Type
                                          )
                 != 0 )
             {
                 /** TODO: Show an error */
+                MsgPool_Put(RecursedMsgCtx);
+                MsgPool_Put(MsgCtxPassed);
                 continue;
             }
 
-            MsgCtxStored = Context.Add(&Context, InnerMsgCtx);
+            MsgCtxStored = Context.Add(&Context, MsgCtxPassed);
+
+            /* The reference of `Hosts_Try' */
+            MsgPool_Put(MsgCtxPassed);
+
             if( MsgCtxStored == NULL )
             {
                 ERRORMSG("Fatal error 230.\n");
+                MsgPool_Put(RecursedMsgCtx);
                 continue;
             }
 
-            OuterHeader->Parent = (IHeader *)MsgCtxStored;
+            ((IHeader *)RecursedMsgCtx)->Parent = (IHeader *)MsgCtxStored;
 
-            MMgr_Send(OuterBuffer, CONTEXT_DATA_LENGTH);
+            MMgr_Send((const char *)RecursedMsgCtx, CONTEXT_DATA_LENGTH);
+            MsgPool_Put(RecursedMsgCtx);
 
         } else if( Pulled == OuterSocket )
         {
@@ -312,10 +335,16 @@ int Hosts_Init(ConfigFileInfo *ConfigInfo)
                                                  "BlockIpv6WhenIpv4Exists"
                                                  );
 
-    InnerSocket = TryBindLocal(Ipv6_Enabled, 10200, &InnerAddress);
-    if( InnerSocket == INVALID_SOCKET )
     {
-        return -25;
+        SOCKET Pair[2];
+
+        if( CreateLocalSocketPair(10200, Pair) != 0 )
+        {
+            return -25;
+        }
+
+        InnerSocket = Pair[0];
+        InnerSender = Pair[1];
     }
 
     CREATE_THREAD(Hosts_SocketLoop, NULL, t);
@@ -2,8 +2,6 @@
 #include "dnsgenerator.h"
 #include "goodiplist.h"
 
-#define CONTEXT_DATA_LENGTH 2048
-
 static int HostsUtils_GetCName_Callback(int Number,
                                         HostsRecordType Type,
                                         const char *Data,
@@ -232,7 +230,7 @@ HostsUtilsTryResult HostsUtils_Try(MsgContext *MsgCtx,
         if( Header->EDNSEnabled )
         {
             while( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ADDITIONAL );
-            if( g.EDns(&g, 1280) != 0 )
+            if( g.EDns(&g, 1280, Header->DNSSECOk) != 0 )
             {
                 return HOSTSUTILS_TRY_NONE;
             }
@@ -423,7 +421,7 @@ int HostsUtils_CombineRecursedResponse(MsgContext   *Buffer,
     {
         while( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ADDITIONAL );
 
-        if( g.EDns(&g, 1280) != 0 )
+        if( g.EDns(&g, 1280, NewHeader->DNSSECOk) != 0 )
         {
             return -351;
         }
@@ -3,6 +3,7 @@
 #include "dnsparser.h"
 #include "dnsgenerator.h"
 #include "common.h"
+#include "clientsubnet.h"
 #include "logs.h"
 
 static BOOL ap = FALSE;
@@ -13,9 +14,16 @@ void IHeader_Reset(IHeader *h)
     h->RequestTcp = FALSE;
     h->Agent[0] = '\0';
     h->BackAddress.family = AF_UNSPEC;
+    h->ConnectionId = 0;
+    h->SendBack = NULL;
     h->Domain[0] = '\0';
     h->HashValue = 0;
     h->EDNSEnabled = FALSE;
+    h->DNSSECOk = FALSE;
+    h->UDPPayloadSize = 512;
+    h->Refreshing = FALSE;
+    memset(&(h->Subnet), 0, sizeof(h->Subnet));
+    h->SubnetAdded = 0;
 }
 
 int IHeader_Fill(IHeader *h,
@@ -34,6 +42,13 @@ int IHeader_Fill(IHeader *h,
     h->Parent = NULL;
     h->RequestTcp = FALSE;
     h->EDNSEnabled = FALSE;
+    h->DNSSECOk = FALSE;
+    h->UDPPayloadSize = 512;
+    h->Refreshing = FALSE;
+    h->ConnectionId = 0;
+    h->SendBack = NULL;
+    memset(&(h->Subnet), 0, sizeof(h->Subnet));
+    h->SubnetAdded = 0;
 
     if( DnsSimpleParser_Init(&p, DnsEntity, EntityLength, FALSE) != 0 )
     {
@@ -61,7 +76,7 @@ int IHeader_Fill(IHeader *h,
             }
 
             StrToLower(h->Domain);
-            h->HashValue = HASH(h->Domain, 0);
+            h->HashValue = HASH64(h->Domain, 0);
             h->Type = (DNSRecordType)DNSGetRecordType(DNSJumpHeader(DnsEntity));
             break;
 
@@ -69,6 +84,26 @@ int IHeader_Fill(IHeader *h,
             if( i.Type == DNS_TYPE_OPT )
             {
                 h->EDNSEnabled = TRUE;
+
+                /* The `TTL' of OPT: EXTENDED-RCODE VERSION DO Z */
+                h->DNSSECOk = (i.GetTTL(&i) & 0x8000) != 0;
+
+                /* The `CLASS' of OPT, values less than 512 are taken as 512
+                   (https://tools.ietf.org/html/rfc6891#section-6.2.3) */
+                if( (int)(i.Klass) > 512 )
+                {
+                    h->UDPPayloadSize = i.Klass;
+                }
+
+                if( i.RowData(&i) + i.DataLength <= DnsEntity + EntityLength &&
+                    ClientSubnet_Parse(i.RowData(&i),
+                                       i.DataLength,
+                                       &(h->Subnet)
+                                       )
+                    == 0 )
+                {
+                    h->Subnet.InQuery = 1;
+                }
             }
             break;
 
@@ -134,7 +169,7 @@ int MsgContext_AddFakeEdns(MsgContext *MsgCtx, int BufferLength)
 
     while( g.NextPurpose(&g) != DNS_RECORD_PURPOSE_ADDITIONAL );
 
-    g.EDns(&g, 1280);
+    g.EDns(&g, 1280, FALSE);
 
     h->EntityLength = g.Length(&g);
     h->EDNSEnabled = TRUE;
@@ -169,17 +204,6 @@ int MsgContext_SendBack(MsgContext *MsgCtx)
         Length += 2;
 
         DNSSetTcpLength(Content, h->EntityLength);
-
-        if( send(h->SendBackSocket,
-                 Content,
-                 Length,
-                 MSG_NOSIGNAL
-                 )
-            != Length )
-        {
-            /** TODO: Show error */
-            return -112;
-        }
     } else {
         /* UDP */
         if( h->ReturnHeader )
@@ -187,7 +211,16 @@ int MsgContext_SendBack(MsgContext *MsgCtx)
             Content -= sizeof(IHeader);
             Length += sizeof(IHeader);
         }
+    }
 
+    if( h->SendBack != NULL )
+    {
+        if( h->SendBack(h, Content, Length) != 0 )
+        {
+            /** TODO: Show error */
+            return -112;
+        }
+    } else {
         if( sendto(h->SendBackSocket,
                    Content,
                    Length,
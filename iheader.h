@@ -10,6 +10,20 @@ typedef struct _IHeader IHeader;
 
 typedef struct _MsgContext MsgContext;
 
+/* How a frontend sends an answer back to its client, `Content' being ready
+ * to be sent as it is. 0 returned if sent or queued.
+ */
+typedef int (*IHeader_SendBackFunc)(IHeader *h, const char *Content, int Length);
+
+/* EDNS Client Subnet, see clientsubnet.h */
+typedef struct _ClientSubnet{
+    uint8_t         Family;     /* 1 for IPv4, 2 for IPv6, 0 if none */
+    uint8_t         Prefix;     /* SOURCE PREFIX-LENGTH */
+    uint8_t         Scope;      /* SCOPE PREFIX-LENGTH, of answers only */
+    uint8_t         InQuery;    /* Carried by the query from the client */
+    unsigned char   Address[16]; /* Bits beyond `Prefix' are all zero */
+} ClientSubnet;
+
 struct _IHeader{
     IHeader     *Parent;    /* Solve CNAME hosts records. */
     BOOL        RequestTcp; /* Parent is from TCP. */
@@ -17,13 +31,25 @@ struct _IHeader{
 
     Address_Type    BackAddress;    /* UDP requires it while TCP doesn't */
     SOCKET          SendBackSocket;
+    uint32_t        ConnectionId;   /* TCP only, see tcpfrontend.c */
+
+    /* Set by the frontend after `IHeader_Fill', NULL if answers are sent to
+     * `BackAddress' by `SendBackSocket'
+     */
+    IHeader_SendBackFunc    SendBack;
 
     char            Domain[256];
-    uint32_t        HashValue;
+    uint64_t        HashValue;  /* `HASH64' of `Domain' */
     DNSRecordType   Type;
 
     BOOL            ReturnHeader;
     BOOL            EDNSEnabled;
+    BOOL            DNSSECOk;   /* The DO bit of EDNS */
+    int             UDPPayloadSize; /* Of the client, 512 without EDNS */
+    BOOL            Refreshing; /* Sent by the cache to refresh its entries */
+
+    ClientSubnet    Subnet;
+    int             SubnetAdded; /* See `ClientSubnet_AddToQuery' */
 
     int             EntityLength;
 
@@ -35,10 +61,11 @@ struct _IHeader{
     uint16_t        TcpLengthRaw;   /* Place holder for sending TCP message. */
 };
 
-/* The **variable** context item structure:
-
+/* Length of every context */
 #define CONTEXT_DATA_LENGTH 2048
 
+/* The **variable** context item structure:
+
 struct _MsgContext{
     IHeader h;
     char    Entity[CONTEXT_DATA_LENGTH - sizeof(IHeader)];
@@ -2,6 +2,9 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h> /* exit() */
+#ifndef WIN32
+#include <signal.h>
+#endif /* WIN32 */
 
 #ifndef NODOWNLOAD
     #ifndef WIN32
@@ -22,6 +25,9 @@
 #include "tcpfrontend.h"
 #include "timedtask.h"
 #include "domainstatistic.h"
+#include "cachesnapshot.h"
+#include "clientsubnet.h"
+#include "msgpool.h"
 
 #define VERSION__ "6.5.1"
 #define DESCRIPTIONS "DNSforwarder\nVersion: "VERSION__". License: GPL v3.\nTime of compilation: "__DATE__" "__TIME__".\n\n"
@@ -76,10 +82,25 @@ static int EnvironmentInit(void)
     TmpTypeDescriptor.str = "127.0.0.1:53";
     ConfigSetDefaultValue(&ConfigInfo, TmpTypeDescriptor, "UDPLocal");
 
+    TmpTypeDescriptor.INT32 = 1;
+    ConfigAddOption(&ConfigInfo, "UDPThreads", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "UDPBatch", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
     TmpTypeDescriptor.str = NULL;
     ConfigAddOption(&ConfigInfo, "TCPLocal", STRATEGY_APPEND_DISCARD_DEFAULT, TYPE_STRING, TmpTypeDescriptor);
     ConfigSetStringDelimiters(&ConfigInfo, "TCPLocal", ",");
 
+    TmpTypeDescriptor.INT32 = 128;
+    ConfigAddOption(&ConfigInfo, "TCPBacklog", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 256;
+    ConfigAddOption(&ConfigInfo, "TCPMaxConnections", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 30;
+    ConfigAddOption(&ConfigInfo, "TCPIdleTimeout", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
     TmpTypeDescriptor.str = NULL;
     ConfigAddOption(&ConfigInfo, "ServerGroup", STRATEGY_APPEND_DISCARD_DEFAULT, TYPE_STRING, TmpTypeDescriptor);
     ConfigSetStringDelimiters(&ConfigInfo, "ServerGroup", "\t ");
@@ -107,6 +128,15 @@ static int EnvironmentInit(void)
     TmpTypeDescriptor.INT32 = 5;
     ConfigAddOption(&ConfigInfo, "TCPKeepAlive", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
 
+    TmpTypeDescriptor.boolean = TRUE;
+    ConfigAddOption(&ConfigInfo, "CoalesceQueries", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "ClientSubnetIPv4", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "ClientSubnetIPv6", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
     TmpTypeDescriptor.str = NULL;
     ConfigAddOption(&ConfigInfo, "BlockIP", STRATEGY_APPEND, TYPE_STRING, TmpTypeDescriptor);
 
@@ -180,18 +210,57 @@ static int EnvironmentInit(void)
     TmpTypeDescriptor.INT32 = 1048576;
     ConfigAddOption(&ConfigInfo, "CacheSize", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
 
+    TmpTypeDescriptor.INT32 = 1;
+    ConfigAddOption(&ConfigInfo, "CacheShards", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.boolean = FALSE;
+    ConfigAddOption(&ConfigInfo, "CacheAdmission", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 1024;
+    ConfigAddOption(&ConfigInfo, "PacketCacheEntries", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.str = NULL;
+    ConfigAddOption(&ConfigInfo, "CacheType", STRATEGY_APPEND_DISCARD_DEFAULT, TYPE_STRING, TmpTypeDescriptor);
+    ConfigSetStringDelimiters(&ConfigInfo, "CacheType", ",");
+    TmpTypeDescriptor.str = "1,2,5,6,12,15,16,28,33,64,65,257";
+    ConfigSetDefaultValue(&ConfigInfo, TmpTypeDescriptor, "CacheType");
+
     TmpTypeDescriptor.boolean = TRUE;
     ConfigAddOption(&ConfigInfo, "MemoryCache", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor);
 
+    TmpTypeDescriptor.str = "no";
+    ConfigAddOption(&ConfigInfo, "CacheHugePages", STRATEGY_REPLACE, TYPE_STRING, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.boolean = FALSE;
+    ConfigAddOption(&ConfigInfo, "CachePrefault", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor);
+
     GetFileDirectory(TmpStr);
     strcat(TmpStr, PATH_SLASH_STR);
     strcat(TmpStr, "cache");
     TmpTypeDescriptor.str = TmpStr;
     ConfigAddOption(&ConfigInfo, "CacheFile", STRATEGY_REPLACE, TYPE_PATH, TmpTypeDescriptor);
 
+    TmpTypeDescriptor.boolean = FALSE;
+    ConfigAddOption(&ConfigInfo, "SharedCache", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.str = NULL;
+    ConfigAddOption(&ConfigInfo, "CacheSnapshot", STRATEGY_REPLACE, TYPE_PATH, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 600;
+    ConfigAddOption(&ConfigInfo, "CacheSnapshotInterval", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
     TmpTypeDescriptor.boolean = FALSE;
     ConfigAddOption(&ConfigInfo, "IgnoreTTL", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor);
 
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "CachePrefetch", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 3;
+    ConfigAddOption(&ConfigInfo, "CachePrefetchHits", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "CacheServeStale", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
+
     TmpTypeDescriptor.INT32 = -1;
     ConfigAddOption(&ConfigInfo, "OverrideTTL", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor);
 
@@ -456,6 +525,56 @@ static void CleanupWSA(void)
 }
 #endif /* WIN32 */
 
+/* Other threads are still running on termination, so the cleanups registered
+ * by `atexit()' are not safe to be done, only what must be saved is saved.
+ */
+static void Terminate(void)
+{
+    CacheSnapshot_Save();
+    _Exit(0);
+}
+
+#ifdef WIN32
+static BOOL WINAPI TerminationHandler(DWORD CtrlType)
+{
+    INFO("Exiting on console event %d.\n", (int)CtrlType);
+    Terminate();
+    return TRUE;
+}
+
+static void TerminationInit(void)
+{
+    SetConsoleCtrlHandler(TerminationHandler, TRUE);
+}
+
+static void WaitForTermination(void)
+{
+    ExitThisThread();
+}
+#else /* WIN32 */
+static sigset_t TerminationSignals;
+
+/* Must be called before any thread is created, which inherits the mask */
+static void TerminationInit(void)
+{
+    sigemptyset(&TerminationSignals);
+    sigaddset(&TerminationSignals, SIGINT);
+    sigaddset(&TerminationSignals, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &TerminationSignals, NULL);
+}
+
+static void WaitForTermination(void)
+{
+    int Signal;
+
+    while( sigwait(&TerminationSignals, &Signal) != 0 );
+
+    INFO("Exiting on signal %d.\n", Signal);
+    Terminate();
+}
+#endif /* WIN32 */
+
 int main(int argc, char *argv[])
 {
 #ifdef WIN32
@@ -524,6 +643,8 @@ int main(int argc, char *argv[])
         }
     }
 
+    TerminationInit();
+
     atexit(CleanupConfigInfo);
     if( EnvironmentInit() != 0 )
     {
@@ -554,6 +675,11 @@ int main(int argc, char *argv[])
         return -505;
     }
 
+    if( MsgPool_Init() != 0 )
+    {
+        return -506;
+    }
+
     if( DomainStatistic_Init(&ConfigInfo) != 0 )
     {
         return -496;
@@ -561,6 +687,11 @@ int main(int argc, char *argv[])
 
     MsgContext_Init(ConfigGetBoolean(&ConfigInfo, "AP"));
 
+    if( ClientSubnet_Init(&ConfigInfo) != 0 )
+    {
+        return -497;
+    }
+
     UdpStatus = UdpFrontend_Init(&ConfigInfo, FALSE);
     TcpStatus = TcpFrontend_Init(&ConfigInfo, FALSE);
 
@@ -583,7 +714,7 @@ int main(int argc, char *argv[])
         TcpFrontend_StartWork();
     }
 
-    ExitThisThread();
+    WaitForTermination();
 
     return 0;
 }
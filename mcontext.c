@@ -1,14 +1,17 @@
 #include <string.h>
 #include <time.h>
 #include "mcontext.h"
+#include "msgpool.h"
 #include "common.h"
 
+/* Elements of the tree are `MsgContext *' */
+
 static int ModuleContext_Swep_Collect(Bst *t,
-                                      const MsgContext *Context,
+                                      MsgContext * const *Context,
                                       Array *Pending
                                       )
 {
-    if( time(NULL) - ((IHeader *)Context)->Timestamp > 2 )
+    if( time(NULL) - ((IHeader *)*Context)->Timestamp > 2 )
     {
         Array_PushBack(Pending, &Context, NULL);
     }
@@ -22,7 +25,7 @@ static void ModuleContext_Swep(ModuleContext *c, SwepCallback cb, void *Arg)
     int i;
 
     if( Array_Init(&Pending,
-                   sizeof(const MsgContext *),
+                   sizeof(MsgContext * const *),
                    4,
                    FALSE,
                    NULL
@@ -40,16 +43,19 @@ static void ModuleContext_Swep(ModuleContext *c, SwepCallback cb, void *Arg)
 
     for( i = 0; i < Array_GetUsed(&Pending); ++i )
     {
-        const MsgContext **Context;
+        MsgContext * const **Context;
+        MsgContext *Removed;
 
         Context = Array_GetBySubscript(&Pending, i);
+        Removed = **Context;
 
         if( cb != NULL )
         {
-            cb(*Context, i + 1, Arg);
+            cb(Removed, i + 1, Arg);
         }
 
         c->d.Delete(&(c->d), *Context);
+        MsgPool_Put(Removed);
     }
 
     Array_Free(&Pending);
@@ -67,17 +73,46 @@ static MsgContext *ModuleContext_Add(ModuleContext *c, MsgContext *MsgCtx)
     h = (IHeader *)MsgCtx;
     h->Timestamp = time(NULL);
 
-    return (MsgContext *)(c->d.Add(&(c->d), MsgCtx));
+    if( c->d.Add(&(c->d), &MsgCtx) == NULL )
+    {
+        return NULL;
+    }
+
+    MsgPool_Ref(MsgCtx);
+
+    return MsgCtx;
+}
+
+/* The element holding the context matching `Input', NULL if none */
+static MsgContext * const *ModuleContext_Search(ModuleContext *c,
+                                                 const MsgContext *Input
+                                                 )
+{
+    return c->d.Search(&(c->d), &Input, NULL);
 }
 
 static const MsgContext *ModuleContext_Find(ModuleContext *c, MsgContext *Input)
 {
-    return c->d.Search(&(c->d), Input, NULL);
+    MsgContext * const *ri = ModuleContext_Search(c, Input);
+
+    return ri == NULL ? NULL : *ri;
 }
 
 static void ModuleContext_Del(ModuleContext *c, MsgContext *Input)
 {
-    c->d.Delete(&(c->d), Input);
+    MsgContext * const *ri = NULL;
+
+    /* Those of the same key are told apart by their addresses */
+    do
+    {
+        ri = c->d.Search(&(c->d), &Input, ri);
+    } while( ri != NULL && *ri != Input );
+
+    if( ri != NULL )
+    {
+        c->d.Delete(&(c->d), ri);
+        MsgPool_Put(Input);
+    }
 }
 
 static int ModuleContext_GenAnswerHeaderAndRemove(ModuleContext *c,
@@ -86,38 +121,45 @@ static int ModuleContext_GenAnswerHeaderAndRemove(ModuleContext *c,
                                                    )
 {
     IHeader *h1, *h2;
-    const MsgContext *ri;
+    MsgContext * const *ri;
+    MsgContext *Stored;
 
     int EntityLength;
     BOOL EDNSEnabled;
+    uint8_t Scope;
 
     h1 = (IHeader *)Input;
     h2 = (IHeader *)Output;
 
-    ri = ModuleContext_Find(c, Input);
+    ri = ModuleContext_Search(c, Input);
     if( ri == NULL )
     {
         return -60;
     }
 
+    Stored = *ri;
+
     EntityLength = h1->EntityLength;
     EDNSEnabled = h1->EDNSEnabled;
+    Scope = h1->Subnet.Scope;
 
-    memcpy(Output, ri, sizeof(IHeader));
+    MsgPool_Copy(Output, Stored, sizeof(IHeader));
 
     h2->EntityLength = EntityLength;
     h2->EDNSEnabled = EDNSEnabled;
+    h2->Subnet.Scope = Scope;
 
-    IHeader_Reset((IHeader *)ri);
+    /* Not reset, others may still hold it */
     c->d.Delete(&(c->d), ri);
+    MsgPool_Put(Stored);
 
     return 0;
 }
 
 static int ModuleContextCompare(const void *_1, const void *_2)
 {
-    const IHeader *One = (IHeader *)_1;
-    const IHeader *Two = (IHeader *)_2;
+    const IHeader *One = *(IHeader * const *)_1;
+    const IHeader *Two = *(IHeader * const *)_2;
     int Id_1 = DNSGetQueryIdentifier(One + 1);
     int Id_2 = DNSGetQueryIdentifier(Two + 1);
 
@@ -125,23 +167,39 @@ static int ModuleContextCompare(const void *_1, const void *_2)
     {
         return Id_1 - Id_2;
     } else {
-        return One->HashValue - Two->HashValue;
+        if( One->HashValue == Two->HashValue )
+        {
+            return 0;
+        }
+
+        return One->HashValue < Two->HashValue ? -1 : 1;
     }
 }
 
+static int ModuleContext_Free_Put(Bst *t,
+                                  MsgContext * const *Context,
+                                  void *Unused
+                                  )
+{
+    MsgPool_Put(*Context);
+
+    return 0;
+}
+
 void ModuleContext_Free(ModuleContext *c)
 {
+    c->d.Enum(&(c->d), (Bst_Enum_Callback)ModuleContext_Free_Put, NULL);
     c->d.Free(&(c->d));
 }
 
-int ModuleContext_Init(ModuleContext *c, int ItemLength)
+int ModuleContext_Init(ModuleContext *c)
 {
     if( c == NULL )
     {
         return -86;
     }
 
-    if( Bst_Init(&(c->d), ItemLength, ModuleContextCompare) != 0 )
+    if( Bst_Init(&(c->d), sizeof(MsgContext *), ModuleContextCompare) != 0 )
     {
         return -106;
     }
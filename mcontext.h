@@ -5,6 +5,10 @@
 #include "iheader.h"
 #include "bst.h"
 
+/* Contexts are kept by pointer. Those added must be taken from the message
+ * pool, and a reference is held for each of them until it is removed.
+ */
+
 typedef void (*SwepCallback)(const MsgContext *MsgCtx, int Number, void *Arg);
 
 typedef struct _ModuleContext ModuleContext;
@@ -27,6 +31,6 @@ struct _ModuleContext{
 
 void ModuleContext_Free(ModuleContext *c);
 
-int ModuleContext_Init(ModuleContext *c, int ItemLength);
+int ModuleContext_Init(ModuleContext *c);
 
 #endif // MCONTEXT_H_INCLUDED
@@ -5,6 +5,7 @@
 #include "filter.h"
 #include "hosts.h"
 #include "dnscache.h"
+#include "pendingquery.h"
 #include "logs.h"
 #include "ipmisc.h"
 #include "readline.h"
@@ -740,6 +741,11 @@ int MMgr_Init(ConfigFileInfo *ConfigInfo)
         return -164;
     }
 
+    if( PendingQuery_Init(ConfigInfo) != 0 )
+    {
+        return -168;
+    }
+
     if( IpMiscMapping_Init(ConfigInfo) != 0 )
     {
         return -176;
@@ -797,6 +803,10 @@ int MMgr_Send(const char *Buffer, int BufferLength)
     IHeader *h = (IHeader *)Buffer;
 
     int ret;
+    int Pending;
+
+    /* `HASH' of the domain */
+    uint32_t HashValue = (uint32_t)h->HashValue;
 
     /* Determine whether to discard the query */
     if( Filter_Out(MsgCtx) )
@@ -815,13 +825,20 @@ int MMgr_Send(const char *Buffer, int BufferLength)
         return 0;
     }
 
+    /* Identical questions sent already, wait for their answer */
+    Pending = PendingQuery_Attach(MsgCtx);
+    if( Pending == 0 )
+    {
+        return 0;
+    }
+
     /* Ordinary modeles */
 
     RWLock_RdLock(ModulesLock);
 
     if( StringChunk_Domain_Match_WildCardRandom(CurModuleMap->Distributor,
                                                  h->Domain,
-                                                 &(h->HashValue),
+                                                 &HashValue,
                                                  (void **)&i,
                                                  ModuleFitRequest,
                                                  h
@@ -847,5 +864,10 @@ int MMgr_Send(const char *Buffer, int BufferLength)
 
     RWLock_UnRLock(ModulesLock);
 
+    if( ret != 0 && Pending == 1 )
+    {
+        PendingQuery_Drop(MsgCtx);
+    }
+
     return ret;
 }
@@ -9,6 +9,9 @@ int MMgr_Init(ConfigFileInfo *ConfigInfo);
 
 int Modules_Update(void);
 
+/* `Buffer' must be a context of the message pool, see msgpool.h. Modules
+ * keeping it take their own references.
+ */
 int MMgr_Send(const char *Buffer, int BufferLength);
 
 #endif // MMGR_H_INCLUDED
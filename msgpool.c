@@ -0,0 +1,181 @@
+#include <stddef.h>
+#include <string.h>
+#include "msgpool.h"
+#include "timedtask.h"
+#include "logs.h"
+#include "utils.h"
+
+/* Contexts a thread keeps before moving some to the shared list */
+#define MSG_POOL_LOCAL_MAX      64
+
+/* Contexts moved between the lists at a time */
+#define MSG_POOL_BULK           32
+
+#define MSG_POOL_STATISTIC_INTERVAL 60000
+
+typedef struct _MsgPoolItem MsgPoolItem;
+
+struct _MsgPoolItem{
+    MsgPoolItem     *Next;  /* Of a free list */
+    volatile long   Refs;
+
+    /* The context itself, aligned for every member of `IHeader' */
+    union {
+        uint64_t    u;
+        double      d;
+        void        *p;
+    } Context[CONTEXT_DATA_LENGTH / sizeof(uint64_t)];
+};
+
+#define ITEM_OF(ctx) \
+    ((MsgPoolItem *)((char *)(ctx) - offsetof(MsgPoolItem, Context)))
+
+static THREAD_LOCAL MsgPoolItem *LocalList = NULL;
+static THREAD_LOCAL int LocalCount = 0;
+static THREAD_LOCAL long LocalTaken = 0;
+
+static MsgPoolItem *SharedList = NULL;
+static EFFECTIVE_LOCK SharedLock;
+
+/* Statistic */
+static volatile long Allocated = 0;
+static volatile long Taken = 0; /* Flushed from `LocalTaken' in bulk */
+static volatile long Copies = 0;
+static volatile long CopiedBytes = 0;
+
+/* Up to `MSG_POOL_BULK' contexts moved from the shared list to the list of
+ * this thread.
+ */
+static void MsgPool_Refill(void)
+{
+    EFFECTIVE_LOCK_GET(SharedLock);
+
+    while( SharedList != NULL && LocalCount < MSG_POOL_BULK )
+    {
+        MsgPoolItem *i = SharedList;
+
+        SharedList = i->Next;
+        i->Next = LocalList;
+        LocalList = i;
+        ++LocalCount;
+    }
+
+    EFFECTIVE_LOCK_RELEASE(SharedLock);
+}
+
+MsgContext *MsgPool_Get(void)
+{
+    MsgPoolItem *i;
+
+    if( LocalList == NULL )
+    {
+        MsgPool_Refill();
+    }
+
+    if( LocalList != NULL )
+    {
+        i = LocalList;
+        LocalList = i->Next;
+        --LocalCount;
+    } else {
+        i = SafeMalloc(sizeof(MsgPoolItem));
+        if( i == NULL )
+        {
+            return NULL;
+        }
+
+        ATOMIC_INCREASE(&Allocated);
+    }
+
+    if( ++LocalTaken == MSG_POOL_BULK )
+    {
+        ATOMIC_ADD(&Taken, LocalTaken);
+        LocalTaken = 0;
+    }
+
+    i->Next = NULL;
+    i->Refs = 1;
+
+    return (MsgContext *)(i->Context);
+}
+
+void MsgPool_Ref(MsgContext *MsgCtx)
+{
+    ATOMIC_INCREASE(&(ITEM_OF(MsgCtx)->Refs));
+}
+
+void MsgPool_Put(MsgContext *MsgCtx)
+{
+    MsgPoolItem *i;
+
+    if( MsgCtx == NULL )
+    {
+        return;
+    }
+
+    i = ITEM_OF(MsgCtx);
+
+    if( ATOMIC_DECREASE(&(i->Refs)) != 0 )
+    {
+        return;
+    }
+
+    i->Next = LocalList;
+    LocalList = i;
+    ++LocalCount;
+
+    if( LocalCount > MSG_POOL_LOCAL_MAX )
+    {
+        /* Contexts taken by one thread and returned by another pile up */
+        EFFECTIVE_LOCK_GET(SharedLock);
+
+        while( LocalCount > MSG_POOL_LOCAL_MAX - MSG_POOL_BULK )
+        {
+            i = LocalList;
+            LocalList = i->Next;
+            --LocalCount;
+
+            i->Next = SharedList;
+            SharedList = i;
+        }
+
+        EFFECTIVE_LOCK_RELEASE(SharedLock);
+    }
+}
+
+void MsgPool_Copy(void *Dst, const void *Src, int Length)
+{
+    memcpy(Dst, Src, Length);
+
+    ATOMIC_INCREASE(&Copies);
+    ATOMIC_ADD(&CopiedBytes, Length);
+}
+
+static void MsgPool_Statistic_Task(void *Unused, void *Unused2)
+{
+    if( !Log_DebugOn() )
+    {
+        return;
+    }
+
+    DEBUG("Message contexts: %ld allocated, about %ld taken; %ld copies made, %ld bytes in total.\n",
+          (long)Allocated,
+          (long)Taken,
+          (long)Copies,
+          (long)CopiedBytes
+          );
+}
+
+int MsgPool_Init(void)
+{
+    EFFECTIVE_LOCK_INIT(SharedLock);
+
+    return TimedTask_Add(TRUE,
+                         FALSE,
+                         MSG_POOL_STATISTIC_INTERVAL,
+                         (TaskFunc)MsgPool_Statistic_Task,
+                         NULL,
+                         NULL,
+                         FALSE
+                         );
+}
@@ -0,0 +1,33 @@
+#ifndef MSGPOOL_H_INCLUDED
+#define MSGPOOL_H_INCLUDED
+
+#include "iheader.h"
+
+/* Pool of reference counted `MsgContext's of `CONTEXT_DATA_LENGTH' bytes.
+ * A query is received into a context taken from the pool, and then handed
+ * to the modules and the hosts by pointer. Whoever keeps it beyond the call
+ * takes a reference of its own, and the last reference dropped returns the
+ * context to the pool.
+ *
+ * Each thread keeps the contexts returned by it on a list of its own, moving
+ * them to and from a shared list in bulk, so taking and returning rarely
+ * needs locking. Memory of the pool is never given back to the system, so a
+ * pointer to a context stays readable after it has been returned.
+ */
+
+/* A context with one reference held by the caller, NULL if out of memory.
+ * Its content is undefined.
+ */
+MsgContext *MsgPool_Get(void);
+
+void MsgPool_Ref(MsgContext *MsgCtx);
+
+/* A reference dropped, NULL ignored */
+void MsgPool_Put(MsgContext *MsgCtx);
+
+/* Copies between contexts are made by this, so that they are counted */
+void MsgPool_Copy(void *Dst, const void *Src, int Length);
+
+int MsgPool_Init(void);
+
+#endif // MSGPOOL_H_INCLUDED
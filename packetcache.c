@@ -0,0 +1,342 @@
+#include <string.h>
+#include <ctype.h>
+#include "packetcache.h"
+#include "dnsparser.h"
+#include "dnsgenerator.h"
+#include "common.h"
+#include "utils.h"
+#include "logs.h"
+#include "clientsubnet.h"
+
+/* Responses longer than this are not kept */
+#define PACKET_CACHE_MESSAGE_MAX    512
+
+/* Nor the responses with more records than this */
+#define PACKET_CACHE_TTL_MAX        32
+
+typedef struct _PacketCacheEntry{
+    EFFECTIVE_LOCK  Lock;
+
+    uint64_t    HashValue;
+    int         Flags;
+
+    ClientSubnet    Subnet;
+
+    time_t      TimeAdded;
+    uint32_t    TTL; /* The smallest TTL of all records */
+
+    int         QuestionLength;
+    int         Length; /* 0 if empty */
+
+    int         TtlCount;
+    uint16_t    TtlOffsets[PACKET_CACHE_TTL_MAX];
+
+    char        Message[PACKET_CACHE_MESSAGE_MAX];
+} PacketCacheEntry;
+
+/* Direct mapped, a new response just takes the place of the old one */
+static PacketCacheEntry *Entries = NULL;
+static int              EntryCount = 0;
+
+static uint64_t PacketCache_Hash(uint64_t NameHash,
+                                 DNSRecordType Type,
+                                 int Flags,
+                                 const ClientSubnet *Subnet
+                                 )
+{
+    /* Continues the hash of the name, the same as the main cache */
+    uint64_t h = ((NameHash * 131 + Type) * 131 + DNS_CLASS_IN) * 131 + Flags;
+    int loop;
+
+    if( Subnet->Family != 0 )
+    {
+        for( loop = 0; loop != (Subnet->Prefix + 7) / 8; ++loop )
+        {
+            h = h * 131 + Subnet->Address[loop];
+        }
+
+        h = h * 131 + Subnet->Prefix;
+    }
+
+    return h;
+}
+
+/* Both halves of the hash value pick the entry */
+static PacketCacheEntry *PacketCache_Entry(uint64_t HashValue)
+{
+    return Entries + (uint32_t)(HashValue ^ (HashValue >> 32)) % EntryCount;
+}
+
+/* Question section length returned */
+static int PacketCache_QuestionLength(const char *Message, int MessageLength)
+{
+    const char *Question = DNSJumpHeader(Message);
+    int NameLength;
+
+    if( MessageLength <= DNS_HEADER_LENGTH ||
+        DNSGetQuestionCount(Message) != 1
+        )
+    {
+        return -1;
+    }
+
+    NameLength = DNSGetHostName(Message,
+                                MessageLength,
+                                Question,
+                                NULL,
+                                0
+                                );
+
+    if( NameLength <= 0 ||
+        DNS_HEADER_LENGTH + NameLength + 4 > MessageLength
+        )
+    {
+        return -1;
+    }
+
+    return NameLength + 4;
+}
+
+static BOOL PacketCache_SameQuestion(const char *One,
+                                     const char *Another,
+                                     int Length
+                                     )
+{
+    for( ; Length > 0; --Length, ++One, ++Another )
+    {
+        if( tolower(*One) != tolower(*Another) )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void PacketCache_Cleanup(void)
+{
+    int loop;
+
+    for( loop = 0; loop != EntryCount; ++loop )
+    {
+        EFFECTIVE_LOCK_DESTROY(Entries[loop].Lock);
+    }
+
+    SafeFree(Entries);
+    Entries = NULL;
+    EntryCount = 0;
+}
+
+int PacketCache_Init(ConfigFileInfo *ConfigInfo)
+{
+    int Count = ConfigGetInt32(ConfigInfo, "PacketCacheEntries");
+    int loop;
+
+    if( Count <= 0 )
+    {
+        return 0;
+    }
+
+    Entries = SafeMalloc(sizeof(PacketCacheEntry) * Count);
+    if( Entries == NULL )
+    {
+        ERRORMSG("Packet cache initializing failed.\n");
+        return -1;
+    }
+
+    for( loop = 0; loop != Count; ++loop )
+    {
+        EFFECTIVE_LOCK_INIT(Entries[loop].Lock);
+        Entries[loop].Length = 0;
+    }
+
+    EntryCount = Count;
+
+    atexit(PacketCache_Cleanup);
+
+    return 0;
+}
+
+int PacketCache_Fetch(char *Message,
+                      int MessageLength,
+                      int BufferLength,
+                      uint64_t NameHash,
+                      DNSRecordType Type,
+                      int Flags,
+                      const ClientSubnet *Subnet,
+                      time_t CurrentTime
+                      )
+{
+    uint64_t    HashValue;
+    int         QuestionLength;
+    int         Ret = -1;
+
+    PacketCacheEntry    *e;
+
+    if( EntryCount == 0 )
+    {
+        return -1;
+    }
+
+    QuestionLength = PacketCache_QuestionLength(Message, MessageLength);
+    if( QuestionLength < 0 )
+    {
+        return -2;
+    }
+
+    HashValue = PacketCache_Hash(NameHash, Type, Flags, Subnet);
+    e = PacketCache_Entry(HashValue);
+
+    EFFECTIVE_LOCK_GET(e->Lock);
+
+    if( e->Length > 0 &&
+        e->HashValue == HashValue &&
+        e->Flags == Flags &&
+        ClientSubnet_Same(&(e->Subnet), Subnet) &&
+        e->QuestionLength == QuestionLength &&
+        CurrentTime - e->TimeAdded < e->TTL &&
+        e->Length <= BufferLength &&
+        PacketCache_SameQuestion(DNSJumpHeader(Message),
+                                 DNSJumpHeader(e->Message),
+                                 QuestionLength
+                                 )
+        )
+    {
+        DNSHeader   *Header = (DNSHeader *)Message;
+        uint16_t    Identifier = Header->Identifier;
+        DNSFlags    RequestFlags = Header->Flags;
+        uint32_t    Elapsed = CurrentTime - e->TimeAdded;
+        int         loop;
+
+        /* The question of the request is left as it is, for its case */
+        memcpy(Message, e->Message, DNS_HEADER_LENGTH);
+        memcpy(DNSJumpHeader(Message) + QuestionLength,
+               DNSJumpHeader(e->Message) + QuestionLength,
+               e->Length - DNS_HEADER_LENGTH - QuestionLength
+               );
+
+        Header->Identifier = Identifier;
+        Header->Flags.RecursionDesired = RequestFlags.RecursionDesired;
+        Header->Flags.CheckingDisabled = RequestFlags.CheckingDisabled;
+
+        for( loop = 0; loop != e->TtlCount; ++loop )
+        {
+            char *TtlPos = Message + e->TtlOffsets[loop];
+
+            SET_32_BIT_U_INT(TtlPos, GET_32_BIT_U_INT(TtlPos) - Elapsed);
+        }
+
+        Ret = e->Length;
+    }
+
+    EFFECTIVE_LOCK_RELEASE(e->Lock);
+
+    return Ret;
+}
+
+int PacketCache_Add(const char *Message,
+                    int MessageLength,
+                    uint64_t NameHash,
+                    DNSRecordType Type,
+                    int Flags,
+                    const ClientSubnet *Subnet,
+                    uint32_t MaxTTL,
+                    time_t CurrentTime
+                    )
+{
+    uint64_t    HashValue;
+    int         QuestionLength;
+    uint32_t    MinTTL = 0;
+    int         TtlCount = 0;
+    uint16_t    TtlOffsets[PACKET_CACHE_TTL_MAX];
+    int         loop;
+
+    DnsSimpleParser p;
+    DnsSimpleParserIterator i;
+    char *Record;
+
+    PacketCacheEntry    *e;
+
+    if( EntryCount == 0 || MessageLength > PACKET_CACHE_MESSAGE_MAX )
+    {
+        return 0;
+    }
+
+    QuestionLength = PacketCache_QuestionLength(Message, MessageLength);
+    if( QuestionLength < 0 )
+    {
+        return -1;
+    }
+
+    if( DnsSimpleParser_Init(&p, (char *)Message, MessageLength, FALSE) != 0 ||
+        DnsSimpleParserIterator_Init(&i, &p) != 0
+        )
+    {
+        return -2;
+    }
+
+    /* Record where every TTL is */
+    while( (Record = i.Next(&i)) != NULL )
+    {
+        uint32_t TTL;
+
+        if( i.Purpose == DNS_RECORD_PURPOSE_QUESTION ||
+            i.Type == DNS_TYPE_OPT /* Its `TTL' field is flags */
+            )
+        {
+            continue;
+        }
+
+        if( TtlCount == PACKET_CACHE_TTL_MAX )
+        {
+            return 0;
+        }
+
+        TtlOffsets[TtlCount++] = DNSJumpOverName(Record) + 4 - Message;
+
+        TTL = i.GetTTL(&i);
+        if( TtlCount == 1 || TTL < MinTTL )
+        {
+            MinTTL = TTL;
+        }
+    }
+
+    if( MinTTL > MaxTTL )
+    {
+        MinTTL = MaxTTL;
+    }
+
+    if( MinTTL == 0 )
+    {
+        return 0;
+    }
+
+    HashValue = PacketCache_Hash(NameHash, Type, Flags, Subnet);
+    e = PacketCache_Entry(HashValue);
+
+    EFFECTIVE_LOCK_GET(e->Lock);
+
+    memcpy(e->Message, Message, MessageLength);
+    for( loop = DNS_HEADER_LENGTH;
+         loop != DNS_HEADER_LENGTH + QuestionLength;
+         ++loop
+         )
+    {
+        e->Message[loop] = tolower(e->Message[loop]);
+    }
+
+    memcpy(e->TtlOffsets, TtlOffsets, sizeof(uint16_t) * TtlCount);
+    e->TtlCount = TtlCount;
+
+    e->HashValue = HashValue;
+    e->Flags = Flags;
+    e->Subnet = *Subnet;
+    e->TimeAdded = CurrentTime;
+    e->TTL = MinTTL;
+    e->QuestionLength = QuestionLength;
+    e->Length = MessageLength;
+
+    EFFECTIVE_LOCK_RELEASE(e->Lock);
+
+    return 0;
+}
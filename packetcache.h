@@ -0,0 +1,39 @@
+#ifndef PACKETCACHE_H_INCLUDED
+#define PACKETCACHE_H_INCLUDED
+
+#include <time.h>
+#include "readconfig.h"
+#include "dnsrelated.h"
+#include "iheader.h"
+
+/* Whole responses generated from the cache, keyed by the question, the
+ * network of the client and these flags, so that a hit needs no lookups and
+ * no generation at all.
+ */
+#define PACKET_CACHE_FLAG_EDNS  0x01
+#define PACKET_CACHE_FLAG_DO    0x02
+
+int PacketCache_Init(ConfigFileInfo *ConfigInfo);
+
+/* Length of the answer written to `Message' returned, negative if missed */
+int PacketCache_Fetch(char *Message,
+                      int MessageLength,
+                      int BufferLength,
+                      uint64_t NameHash, /* `HASH64' of the lowercased name */
+                      DNSRecordType Type,
+                      int Flags,
+                      const ClientSubnet *Subnet,
+                      time_t CurrentTime
+                      );
+
+int PacketCache_Add(const char *Message,
+                    int MessageLength,
+                    uint64_t NameHash,
+                    DNSRecordType Type,
+                    int Flags,
+                    const ClientSubnet *Subnet,
+                    uint32_t MaxTTL, /* Kept no longer than this */
+                    time_t CurrentTime
+                    );
+
+#endif // PACKETCACHE_H_INCLUDED
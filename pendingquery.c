@@ -0,0 +1,556 @@
+#include <string.h>
+#include <time.h>
+#include "pendingquery.h"
+#include "bst.h"
+#include "array.h"
+#include "common.h"
+#include "utils.h"
+#include "logs.h"
+#include "timedtask.h"
+#include "clientsubnet.h"
+#include "msgpool.h"
+
+/* Same as the time the modules wait for an answer */
+#define PENDING_QUERY_TIMEOUT   2
+
+/* Queries are identical only if they are of the same flags */
+#define PENDING_QUERY_FLAG_EDNS 0x01
+#define PENDING_QUERY_FLAG_DO   0x02
+#define PENDING_QUERY_FLAG_TCP  0x04
+
+/* Advertised by the truncated answers */
+#define PENDING_QUERY_EDNS_PAYLOAD_SIZE 1280
+
+typedef struct _PendingQuery{
+    uint64_t        HashValue;
+    DNSRecordType   Type;
+    int             Flags;
+
+    /* Queries of different networks may be answered differently */
+    ClientSubnet    Subnet;
+
+    /* Identifier of the query sent upstream */
+    uint16_t        LeaderId;
+    BOOL            IsLeader;
+
+    time_t          Timestamp;
+
+    /* Of a waiting query, a reference is held. The answer is made in place. */
+    MsgContext      *MsgCtx;
+    int             QuestionEnd;
+} PendingQuery;
+
+static BOOL             Enabled = FALSE;
+static Bst              Queries;
+static EFFECTIVE_LOCK   QueriesLock;
+
+static int PendingQuery_Compare(const void *_1, const void *_2)
+{
+    const PendingQuery *One = (const PendingQuery *)_1;
+    const PendingQuery *Two = (const PendingQuery *)_2;
+
+    if( One->HashValue != Two->HashValue )
+    {
+        return One->HashValue < Two->HashValue ? -1 : 1;
+    } else {
+        return (int)(One->Type) - (int)(Two->Type);
+    }
+}
+
+static int PendingQuery_Flags(MsgContext *MsgCtx)
+{
+    IHeader *h = (IHeader *)MsgCtx;
+    int Flags = 0;
+
+    if( h->EDNSEnabled )
+    {
+        Flags |= PENDING_QUERY_FLAG_EDNS;
+    }
+
+    if( h->DNSSECOk )
+    {
+        Flags |= PENDING_QUERY_FLAG_DO;
+    }
+
+    if( MsgContext_IsFromTCP(MsgCtx) )
+    {
+        Flags |= PENDING_QUERY_FLAG_TCP;
+    }
+
+    return Flags;
+}
+
+/* Header and question length returned */
+static int PendingQuery_QuestionEnd(const char *Entity, int EntityLength)
+{
+    const char *Question = DNSJumpHeader(Entity);
+    int Length;
+
+    if( EntityLength <= DNS_HEADER_LENGTH ||
+        DNSGetQuestionCount(Entity) != 1
+        )
+    {
+        return -1;
+    }
+
+    Length = DNSJumpOverName((char *)Question) + 4 - Entity;
+    if( Length > EntityLength )
+    {
+        return -1;
+    }
+
+    return Length;
+}
+
+/* The leader of the question of `Key' not timed out */
+static const PendingQuery *PendingQuery_FindLeader(const PendingQuery *Key,
+                                                   time_t CurrentTime
+                                                   )
+{
+    const PendingQuery *Itr = NULL;
+
+    while( (Itr = Queries.Search(&Queries, Key, Itr)) != NULL )
+    {
+        if( Itr->IsLeader &&
+            Itr->Flags == Key->Flags &&
+            ClientSubnet_Same(&(Itr->Subnet), &(Key->Subnet)) &&
+            (Key->IsLeader == FALSE || Itr->LeaderId == Key->LeaderId) &&
+            CurrentTime - Itr->Timestamp <= PENDING_QUERY_TIMEOUT
+            )
+        {
+            return Itr;
+        }
+    }
+
+    return NULL;
+}
+
+int PendingQuery_Attach(MsgContext *MsgCtx)
+{
+    IHeader *h = (IHeader *)MsgCtx;
+    char *Entity = IHEADER_TAIL(h);
+    int QuestionEnd;
+
+    PendingQuery        New;
+    const PendingQuery  *Leader;
+
+    if( !Enabled )
+    {
+        return -1;
+    }
+
+    QuestionEnd = PendingQuery_QuestionEnd(Entity, h->EntityLength);
+    if( QuestionEnd < 0 )
+    {
+        return -2;
+    }
+
+    New.HashValue = h->HashValue;
+    New.Type = h->Type;
+    New.Flags = PendingQuery_Flags(MsgCtx);
+    New.Subnet = h->Subnet;
+    New.Timestamp = time(NULL);
+    New.IsLeader = FALSE;
+    New.MsgCtx = NULL;
+    New.QuestionEnd = QuestionEnd;
+
+    EFFECTIVE_LOCK_GET(QueriesLock);
+
+    Leader = PendingQuery_FindLeader(&New, New.Timestamp);
+    if( Leader != NULL )
+    {
+        /* Wait for the answer of the leader */
+        New.LeaderId = Leader->LeaderId;
+        New.MsgCtx = MsgCtx;
+
+        if( Queries.Add(&Queries, &New) != NULL )
+        {
+            MsgPool_Ref(MsgCtx);
+            EFFECTIVE_LOCK_RELEASE(QueriesLock);
+            return 0;
+        }
+    } else {
+        /* Become the leader */
+        New.LeaderId = DNSGetQueryIdentifier(Entity);
+        New.IsLeader = TRUE;
+
+        Queries.Add(&Queries, &New);
+    }
+
+    EFFECTIVE_LOCK_RELEASE(QueriesLock);
+
+    return 1;
+}
+
+/* Take out the queries waiting for the leader `Key', whose reference then
+ * belongs to the caller. `Found' is scratch. `QueriesLock' must be held.
+ */
+static void PendingQuery_TakeWaiting(const PendingQuery *Key,
+                                     Array *Found,
+                                     Array *Waiting
+                                     )
+{
+    const PendingQuery  *Itr = NULL;
+    int loop;
+
+    while( (Itr = Queries.Search(&Queries, Key, Itr)) != NULL )
+    {
+        if( !(Itr->IsLeader) &&
+            Itr->Flags == Key->Flags &&
+            ClientSubnet_Same(&(Itr->Subnet), &(Key->Subnet)) &&
+            Itr->LeaderId == Key->LeaderId
+            )
+        {
+            Array_PushBack(Found, &Itr, NULL);
+        }
+    }
+
+    /* Deleting does not move the others */
+    for( loop = 0; loop < Array_GetUsed(Found); ++loop )
+    {
+        const PendingQuery **w = Array_GetBySubscript(Found, loop);
+
+        Array_PushBack(Waiting, *w, NULL);
+        Queries.Delete(&Queries, *w);
+    }
+}
+
+/* The message cut to the header and the question, plus an OPT if the query
+ * had one. `h' is in a context.
+ */
+static void PendingQuery_CutToQuestion(IHeader *h, int QuestionEnd)
+{
+    DNSHeader   *Entity = IHEADER_TAIL(h);
+    char        *Opt = (char *)Entity + QuestionEnd;
+
+    DNSSetAnswerCount(Entity, 0);
+    DNSSetNameServerCount(Entity, 0);
+    DNSSetAdditionalCount(Entity, 0);
+    h->EntityLength = QuestionEnd;
+
+    /* An OPT answers an OPT (https://tools.ietf.org/html/rfc6891#section-7) */
+    if( h->EDNSEnabled )
+    {
+        Opt[0] = '\0';
+        SET_16_BIT_U_INT(Opt + 1, DNS_TYPE_OPT);
+        SET_16_BIT_U_INT(Opt + 3, PENDING_QUERY_EDNS_PAYLOAD_SIZE);
+        SET_32_BIT_U_INT(Opt + 5, h->DNSSECOk ? 0x8000 : 0);
+        SET_16_BIT_U_INT(Opt + 9, 0);
+
+        DNSSetAdditionalCount(Entity, 1);
+        h->EntityLength += 11;
+    }
+}
+
+/* The answer cut with TC set, for a waiting query over UDP which could not
+ * take the whole of it
+ */
+static void PendingQuery_Truncate(IHeader *h, int QuestionEnd)
+{
+    DNSHeader *Entity = IHEADER_TAIL(h);
+
+    Entity->Flags.TrunCation = 1;
+    PendingQuery_CutToQuestion(h, QuestionEnd);
+}
+
+/* Answer a waiting query with SERVFAIL, in its own context, as its leader
+ * could not be sent
+ */
+static void PendingQuery_FailOne(PendingQuery *Waiting)
+{
+    IHeader *h = (IHeader *)(Waiting->MsgCtx);
+    DNSHeader *Entity = IHEADER_TAIL(h);
+
+    Entity->Flags.Direction = 1;
+    Entity->Flags.RecursionAvailable = 1;
+    Entity->Flags.ResponseCode = RESPONSE_CODE_SERVER_FAILURE;
+    PendingQuery_CutToQuestion(h, Waiting->QuestionEnd);
+
+    if( MsgContext_SendBack((MsgContext *)h) != 0 )
+    {
+        return;
+    }
+
+    ShowRefusingMessage(h, "Failed to be sent upstream");
+    DomainStatistic_Add(h, STATISTIC_TYPE_REFUSED);
+}
+
+void PendingQuery_Drop(MsgContext *MsgCtx)
+{
+    IHeader *h = (IHeader *)MsgCtx;
+    int loop;
+
+    PendingQuery        Key;
+    const PendingQuery  *Leader;
+
+    Array   Found;
+    Array   Waiting;
+
+    if( !Enabled )
+    {
+        return;
+    }
+
+    Key.HashValue = h->HashValue;
+    Key.Type = h->Type;
+    Key.Flags = PendingQuery_Flags(MsgCtx);
+    Key.Subnet = h->Subnet;
+    Key.LeaderId = DNSGetQueryIdentifier(IHEADER_TAIL(h));
+    Key.IsLeader = TRUE;
+
+    if( Array_Init(&Found, sizeof(const PendingQuery *), 4, FALSE, NULL) != 0 )
+    {
+        return;
+    }
+
+    if( Array_Init(&Waiting, sizeof(PendingQuery), 4, FALSE, NULL) != 0 )
+    {
+        Array_Free(&Found);
+        return;
+    }
+
+    EFFECTIVE_LOCK_GET(QueriesLock);
+
+    Leader = PendingQuery_FindLeader(&Key, time(NULL));
+    if( Leader != NULL )
+    {
+        Queries.Delete(&Queries, Leader);
+
+        /* Those attached before the sending failed would never be answered */
+        PendingQuery_TakeWaiting(&Key, &Found, &Waiting);
+    }
+
+    EFFECTIVE_LOCK_RELEASE(QueriesLock);
+
+    for( loop = 0; loop < Array_GetUsed(&Waiting); ++loop )
+    {
+        PendingQuery *w = Array_GetBySubscript(&Waiting, loop);
+
+        PendingQuery_FailOne(w);
+        MsgPool_Put(w->MsgCtx);
+    }
+
+    Array_Free(&Found);
+    Array_Free(&Waiting);
+}
+
+/* Answer a waiting query with the answer of its leader, in its own context */
+static int PendingQuery_AnswerOne(PendingQuery *Waiting,
+                                  MsgContext *MsgCtx,
+                                  int AnswerQuestionEnd,
+                                  char Protocol,
+                                  StatisticType Type
+                                  )
+{
+    IHeader *Answer = (IHeader *)MsgCtx;
+    DNSHeader *AnswerEntity = IHEADER_TAIL(Answer);
+
+    IHeader *h = (IHeader *)(Waiting->MsgCtx);
+    DNSHeader *Entity = IHEADER_TAIL(h);
+
+    DNSHeader Request = *Entity;
+
+    if( Answer->EntityLength > CONTEXT_DATA_LENGTH - sizeof(IHeader) )
+    {
+        return -1;
+    }
+
+    if( AnswerQuestionEnd == Waiting->QuestionEnd )
+    {
+        /* The question as it was asked, for its case */
+        MsgPool_Copy(Entity, AnswerEntity, DNS_HEADER_LENGTH);
+        MsgPool_Copy((char *)Entity + AnswerQuestionEnd,
+                     (char *)AnswerEntity + AnswerQuestionEnd,
+                     Answer->EntityLength - AnswerQuestionEnd
+                     );
+    } else {
+        MsgPool_Copy(Entity, AnswerEntity, Answer->EntityLength);
+    }
+
+    h->EntityLength = Answer->EntityLength;
+
+    Entity->Identifier = Request.Identifier;
+    Entity->Flags.RecursionDesired = Request.Flags.RecursionDesired;
+    Entity->Flags.CheckingDisabled = Request.Flags.CheckingDisabled;
+
+    /* The leader may have taken more than this one could */
+    if( !(Waiting->Flags & PENDING_QUERY_FLAG_TCP) &&
+        h->EntityLength > h->UDPPayloadSize
+        )
+    {
+        PendingQuery_Truncate(h, AnswerQuestionEnd);
+    }
+
+    if( MsgContext_SendBack((MsgContext *)h) != 0 )
+    {
+        ShowErrorMessage(h, Protocol);
+        return -2;
+    }
+
+    ShowNormalMessage(h, Protocol);
+    DomainStatistic_Add(h, Type);
+
+    return 0;
+}
+
+int PendingQuery_Answer(MsgContext *MsgCtx, char Protocol, StatisticType Type)
+{
+    IHeader *h = (IHeader *)MsgCtx;
+    char *Entity = IHEADER_TAIL(h);
+    int AnswerQuestionEnd;
+    int Count = 0;
+    int loop;
+
+    PendingQuery        Key;
+    const PendingQuery  *Leader;
+
+    Array   Found;
+    Array   Waiting;
+
+    if( !Enabled )
+    {
+        return 0;
+    }
+
+    AnswerQuestionEnd = PendingQuery_QuestionEnd(Entity, h->EntityLength);
+    if( AnswerQuestionEnd < 0 )
+    {
+        return 0;
+    }
+
+    /* `h' has been restored to be the header of the leader, except its
+       `EDNSEnabled', which was set by the answer */
+    Key.HashValue = h->HashValue;
+    Key.Type = h->Type;
+    Key.Subnet = h->Subnet;
+    Key.LeaderId = DNSGetQueryIdentifier(Entity);
+    Key.IsLeader = TRUE;
+
+    if( Array_Init(&Found, sizeof(const PendingQuery *), 4, FALSE, NULL) != 0 )
+    {
+        return 0;
+    }
+
+    if( Array_Init(&Waiting, sizeof(PendingQuery), 4, FALSE, NULL) != 0 )
+    {
+        Array_Free(&Found);
+        return 0;
+    }
+
+    EFFECTIVE_LOCK_GET(QueriesLock);
+
+    Key.Flags = PendingQuery_Flags(MsgCtx) | PENDING_QUERY_FLAG_EDNS;
+    Leader = PendingQuery_FindLeader(&Key, time(NULL));
+    if( Leader == NULL )
+    {
+        Key.Flags &= ~PENDING_QUERY_FLAG_EDNS;
+        Leader = PendingQuery_FindLeader(&Key, time(NULL));
+    }
+
+    if( Leader == NULL )
+    {
+        EFFECTIVE_LOCK_RELEASE(QueriesLock);
+        Array_Free(&Found);
+        Array_Free(&Waiting);
+        return 0;
+    }
+
+    Queries.Delete(&Queries, Leader);
+
+    /* Take out the waiting ones, and answer them without the lock */
+    PendingQuery_TakeWaiting(&Key, &Found, &Waiting);
+
+    EFFECTIVE_LOCK_RELEASE(QueriesLock);
+
+    for( loop = 0; loop < Array_GetUsed(&Waiting); ++loop )
+    {
+        PendingQuery *w = Array_GetBySubscript(&Waiting, loop);
+
+        if( PendingQuery_AnswerOne(w, MsgCtx, AnswerQuestionEnd, Protocol, Type) == 0 )
+        {
+            ++Count;
+        }
+
+        MsgPool_Put(w->MsgCtx);
+    }
+
+    Array_Free(&Found);
+    Array_Free(&Waiting);
+
+    return Count;
+}
+
+static int PendingQuery_Sweep_Collect(Bst *t,
+                                      const PendingQuery *q,
+                                      Array *Pending
+                                      )
+{
+    if( time(NULL) - q->Timestamp > PENDING_QUERY_TIMEOUT )
+    {
+        Array_PushBack(Pending, &q, NULL);
+    }
+
+    return 0;
+}
+
+static void PendingQuery_Sweep_Task(void *Unused, void *Unused2)
+{
+    Array Pending;
+    int loop;
+
+    if( Array_Init(&Pending, sizeof(const PendingQuery *), 4, FALSE, NULL) != 0 )
+    {
+        return;
+    }
+
+    EFFECTIVE_LOCK_GET(QueriesLock);
+
+    Queries.Enum(&Queries,
+                 (Bst_Enum_Callback)PendingQuery_Sweep_Collect,
+                 &Pending
+                 );
+
+    for( loop = 0; loop < Array_GetUsed(&Pending); ++loop )
+    {
+        const PendingQuery **q = Array_GetBySubscript(&Pending, loop);
+
+        if( !((*q)->IsLeader) )
+        {
+            /* Counted as the modules do with the timed out ones */
+            DomainStatistic_Add((IHeader *)((*q)->MsgCtx), STATISTIC_TYPE_REFUSED);
+            MsgPool_Put((*q)->MsgCtx);
+        }
+
+        Queries.Delete(&Queries, *q);
+    }
+
+    EFFECTIVE_LOCK_RELEASE(QueriesLock);
+
+    Array_Free(&Pending);
+}
+
+int PendingQuery_Init(ConfigFileInfo *ConfigInfo)
+{
+    if( ConfigGetBoolean(ConfigInfo, "CoalesceQueries") == FALSE )
+    {
+        return 0;
+    }
+
+    if( Bst_Init(&Queries, sizeof(PendingQuery), PendingQuery_Compare) != 0 )
+    {
+        return -1;
+    }
+
+    EFFECTIVE_LOCK_INIT(QueriesLock);
+
+    Enabled = TRUE;
+
+    return TimedTask_Add(TRUE,
+                         FALSE,
+                         PENDING_QUERY_TIMEOUT * 1000,
+                         (TaskFunc)PendingQuery_Sweep_Task,
+                         NULL,
+                         NULL,
+                         FALSE
+                         );
+}
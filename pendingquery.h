@@ -0,0 +1,25 @@
+#ifndef PENDINGQUERY_H_INCLUDED
+#define PENDINGQUERY_H_INCLUDED
+
+#include "readconfig.h"
+#include "iheader.h"
+#include "domainstatistic.h"
+
+/* Queries sent upstream and not answered yet. Identical questions coming
+ * meanwhile wait for the answer of the first one instead of being sent again.
+ */
+
+int PendingQuery_Init(ConfigFileInfo *ConfigInfo);
+
+/* 0 returned if the query is to be answered along with an identical one sent
+ * before, then it must not be sent.
+ */
+int PendingQuery_Attach(MsgContext *MsgCtx);
+
+/* The query failed to be sent */
+void PendingQuery_Drop(MsgContext *MsgCtx);
+
+/* Count of the waiting queries answered returned */
+int PendingQuery_Answer(MsgContext *MsgCtx, char Protocol, StatisticType Type);
+
+#endif // PENDINGQUERY_H_INCLUDED
@@ -87,6 +87,52 @@ static SOCKET SocketPool_FetchOnSet(SocketPool *sp,
     return ret.Sock;
 }
 
+static int SocketPool_Find(SocketPool *sp, SOCKET Sock, void **Data)
+{
+    const SOCKET *s;
+
+    s = sp->t.Search(&(sp->t), &Sock, NULL);
+    if( s == NULL )
+    {
+        return -1;
+    }
+
+    if( Data != NULL )
+    {
+        *Data = (void *)(s + 1);
+    }
+
+    return 0;
+}
+
+typedef struct _SocketPool_Enum_Arg
+{
+    SocketPool_Enum_Callback cb;
+    void *Arg;
+} SocketPool_Enum_Arg;
+
+static int SocketPool_Enum_Inner(Bst *t,
+                                 const SocketUnit *su,
+                                 SocketPool_Enum_Arg *Arg)
+{
+    SOCKET *s = (SOCKET *)su;
+
+    return Arg->cb(*s, (void *)(s + 1), Arg->Arg);
+}
+
+static void SocketPool_Enum(SocketPool *sp,
+                            SocketPool_Enum_Callback cb,
+                            void *Arg
+                            )
+{
+    SocketPool_Enum_Arg a = {cb, Arg};
+
+    sp->t.Enum(&(sp->t),
+               (Bst_Enum_Callback)SocketPool_Enum_Inner,
+               &a
+               );
+}
+
 static int SocketPool_CloseAll_Inner(Bst *t,
                                      const SocketUnit *Data,
                                      SOCKET *ExceptFor
@@ -152,6 +198,8 @@ int SocketPool_Init(SocketPool *sp, int DataLength)
     sp->Del = SocketPool_Del;
     sp->CloseAll = SocketPool_CloseAll;
     sp->FetchOnSet = SocketPool_FetchOnSet;
+    sp->Find = SocketPool_Find;
+    sp->Enum = SocketPool_Enum;
     sp->Free = SocketPool_Free;
 
     return 0;
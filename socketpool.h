@@ -10,6 +10,8 @@ typedef struct _SocketUnit SocketUnit;
 
 typedef struct _SocketPool SocketPool;
 
+typedef int (*SocketPool_Enum_Callback)(SOCKET Sock, void *Data, void *Arg);
+
 struct _SocketPool{
     /* private */
     Bst t;
@@ -30,6 +32,12 @@ struct _SocketPool{
                          void **Data
                          );
 
+    /* 0 returned if `Sock' is in the pool */
+    int (*Find)(SocketPool *sp, SOCKET Sock, void **Data);
+
+    /* Stops once `cb' returns non-zero */
+    void (*Enum)(SocketPool *sp, SocketPool_Enum_Callback cb, void *Arg);
+
     void (*CloseAll)(SocketPool *sp, SOCKET ExceptFor);
 
     void (*Free)(SocketPool *sp, BOOL CloseAllSocket);
@@ -1,5 +1,149 @@
 #include "socketpuller.h"
 
+#ifdef SOCKET_PULLER_EPOLL
+
+static int SocketPuller_EpollCtl(SocketPuller *p, int Op, SOCKET s)
+{
+    struct epoll_event e;
+
+    e.events = p->Events;
+    e.data.fd = s;
+
+    return epoll_ctl(p->Epoll, Op, s, &e);
+}
+
+static int SocketPuller_Modify_Inner(SOCKET Sock,
+                                     void *Data,
+                                     SocketPuller *p
+                                     )
+{
+    SocketPuller_EpollCtl(p, EPOLL_CTL_MOD, Sock);
+
+    return 0;
+}
+
+static void SocketPuller_SetEvents(SocketPuller *p,
+                                   BOOL Reading,
+                                   BOOL Writing
+                                   )
+{
+    uint32_t Events = (Reading ? EPOLLIN : 0) | (Writing ? EPOLLOUT : 0);
+
+    if( Events == p->Events )
+    {
+        return;
+    }
+
+    p->Events = Events;
+
+    /* Reported for what was asked before */
+    p->ReadyCount = 0;
+    p->ReadyIndex = 0;
+
+    p->p.Enum(&(p->p),
+              (SocketPool_Enum_Callback)SocketPuller_Modify_Inner,
+              p
+              );
+}
+
+static SOCKET SocketPuller_EpollSelect(SocketPuller *p,
+                                       struct timeval *tv,
+                                       void **Data,
+                                       BOOL Reading,
+                                       BOOL Writing,
+                                       int *err
+                                       )
+{
+    SOCKET s = INVALID_SOCKET;
+    int Err = 0;
+    int Timeout = -1;
+
+    if( tv != NULL )
+    {
+        Timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+    }
+
+    SocketPuller_SetEvents(p, Reading, Writing);
+
+    while( TRUE )
+    {
+        int n;
+
+        while( p->ReadyIndex < p->ReadyCount )
+        {
+            s = p->Ready[p->ReadyIndex].data.fd;
+            ++(p->ReadyIndex);
+
+            if( s != INVALID_SOCKET && p->p.Find(&(p->p), s, Data) == 0 )
+            {
+                goto EXIT;
+            }
+        }
+
+        s = INVALID_SOCKET;
+
+        n = epoll_wait(p->Epoll, p->Ready, SOCKET_PULLER_EVENTS, Timeout);
+        if( n < 0 )
+        {
+            Err = GET_LAST_ERROR();
+            SLEEP(1); /* dead loop? */
+            if( FatalErrorDecideding(Err) == 0 )
+            {
+                continue;
+            }
+            break;
+        } else if( n == 0 )
+        {
+            /* timeout */
+            break;
+        }
+
+        p->ReadyCount = n;
+        p->ReadyIndex = 0;
+    }
+
+EXIT:
+    if( err != NULL )
+    {
+        *err = Err;
+    }
+    return s;
+}
+
+#endif /* SOCKET_PULLER_EPOLL */
+
+PUBFUNC int SocketPuller_Watch(SocketPuller *p, SOCKET s, BOOL Writing)
+{
+#ifdef SOCKET_PULLER_EPOLL
+    if( p->Epoll >= 0 )
+    {
+        struct epoll_event e;
+
+        e.events = p->Events | (Writing ? EPOLLOUT : 0);
+        e.data.fd = s;
+
+        return epoll_ctl(p->Epoll, EPOLL_CTL_MOD, s, &e);
+    }
+#endif /* SOCKET_PULLER_EPOLL */
+
+    if( !FD_ISSET(s, &(p->s)) )
+    {
+        return -41;
+    }
+
+    if( Writing && !FD_ISSET(s, &(p->w)) )
+    {
+        FD_SET(s, &(p->w));
+        ++(p->WatchedCount);
+    } else if( !Writing && FD_ISSET(s, &(p->w)) )
+    {
+        FD_CLR(s, &(p->w));
+        --(p->WatchedCount);
+    }
+
+    return 0;
+}
+
 PUBFUNC int SocketPuller_Add(SocketPuller *p,
                              SOCKET s,
                              const void *Data,
@@ -11,6 +155,31 @@ PUBFUNC int SocketPuller_Add(SocketPuller *p,
         return -11;
     }
 
+#ifdef SOCKET_PULLER_EPOLL
+    if( p->Epoll >= 0 )
+    {
+        if( p->p.Add(&(p->p), s, Data, DataLength) != 0 )
+        {
+            return -16;
+        }
+
+        if( SocketPuller_EpollCtl(p, EPOLL_CTL_ADD, s) != 0 )
+        {
+            p->p.Del(&(p->p), s);
+            return -17;
+        }
+
+        return 0;
+    }
+#endif /* SOCKET_PULLER_EPOLL */
+
+#ifndef WIN32
+    if( s >= FD_SETSIZE )
+    {
+        return -18;
+    }
+#endif /* WIN32 */
+
     if( p->p.Add(&(p->p), s, Data, DataLength) != 0 )
     {
         return -16;
@@ -33,6 +202,27 @@ PUBFUNC int SocketPuller_Del(SocketPuller *p, SOCKET s)
         return -33;
     }
 
+#ifdef SOCKET_PULLER_EPOLL
+    if( p->Epoll >= 0 )
+    {
+        int i;
+
+        epoll_ctl(p->Epoll, EPOLL_CTL_DEL, s, NULL);
+
+        /* It may be reported but not returned yet */
+        for( i = p->ReadyIndex; i < p->ReadyCount; ++i )
+        {
+            if( p->Ready[i].data.fd == s )
+            {
+                p->Ready[i].data.fd = INVALID_SOCKET;
+            }
+        }
+
+        return 0;
+    }
+#endif /* SOCKET_PULLER_EPOLL */
+
+    SocketPuller_Watch(p, s, FALSE);
     FD_CLR(s, &(p->s));
 
     return 0;
@@ -47,17 +237,31 @@ PUBFUNC SOCKET SocketPuller_Select(SocketPuller *p,
                                    )
 {
     fd_set ReadySet;
+    fd_set WritableSet;
+    BOOL Watching;
     SOCKET s;
     int Err = 0;
 
+#ifdef SOCKET_PULLER_EPOLL
+    if( p->Epoll >= 0 )
+    {
+        return SocketPuller_EpollSelect(p, tv, Data, Reading, Writing, err);
+    }
+#endif /* SOCKET_PULLER_EPOLL */
+
     ReadySet = p->s;
 
+    /* Those asked by `Watch' */
+    Watching = !Writing && p->WatchedCount > 0;
+    WritableSet = p->w;
+
     while( TRUE )
     {
 
         switch( select(p->Max + 1,
                        Reading ? &ReadySet : NULL,
-                       Writing ? &ReadySet : NULL,
+                       Writing ? &ReadySet :
+                                 (Watching ? &WritableSet : NULL),
                        NULL,
                        tv)
                 )
@@ -77,6 +281,10 @@ PUBFUNC SOCKET SocketPuller_Select(SocketPuller *p,
 
         default:
             s = p->p.FetchOnSet(&(p->p), &ReadySet, Data);
+            if( s == INVALID_SOCKET && Watching )
+            {
+                s = p->p.FetchOnSet(&(p->p), &WritableSet, Data);
+            }
             break;
         }
 
@@ -98,11 +306,27 @@ PUBFUNC void SocketPuller_CloseAll(SocketPuller *p, SOCKET ExceptFor)
 PUBFUNC void SocketPuller_Free(SocketPuller *p)
 {
     p->p.Free(&(p->p), TRUE);
+
+#ifdef SOCKET_PULLER_EPOLL
+    if( p->Epoll >= 0 )
+    {
+        close(p->Epoll);
+        p->Epoll = -1;
+    }
+#endif /* SOCKET_PULLER_EPOLL */
 }
 
 PUBFUNC void SocketPuller_FreeWithoutClose(SocketPuller *p)
 {
     p->p.Free(&(p->p), FALSE);
+
+#ifdef SOCKET_PULLER_EPOLL
+    if( p->Epoll >= 0 )
+    {
+        close(p->Epoll);
+        p->Epoll = -1;
+    }
+#endif /* SOCKET_PULLER_EPOLL */
 }
 
 int SocketPuller_Init(SocketPuller *p, int DataLength)
@@ -112,12 +336,33 @@ int SocketPuller_Init(SocketPuller *p, int DataLength)
     p->Add = SocketPuller_Add;
     p->Del = SocketPuller_Del;
     p->Select = SocketPuller_Select;
+    p->Watch = SocketPuller_Watch;
     p->CloseAll = SocketPuller_CloseAll;
     p->Free = SocketPuller_Free;
     p->FreeWithoutClose = SocketPuller_FreeWithoutClose;
 
     FD_ZERO(&(p->s));
-    return SocketPool_Init(&(p->p), DataLength);
+    FD_ZERO(&(p->w));
+    p->WatchedCount = 0;
+
+#ifdef SOCKET_PULLER_EPOLL
+    p->Epoll = -1;
+    p->Events = EPOLLIN;
+    p->ReadyCount = 0;
+    p->ReadyIndex = 0;
+#endif /* SOCKET_PULLER_EPOLL */
+
+    if( SocketPool_Init(&(p->p), DataLength) != 0 )
+    {
+        return -1;
+    }
+
+#ifdef SOCKET_PULLER_EPOLL
+    /* Falling back to select if it fails */
+    p->Epoll = epoll_create1(EPOLL_CLOEXEC);
+#endif /* SOCKET_PULLER_EPOLL */
+
+    return 0;
 }
 
 SocketPuller **SocketPullers_Init(int Count, int DataLength)
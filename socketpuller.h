@@ -6,6 +6,20 @@
 #include "common.h"
 #include "oo.h"
 
+/* Sockets are watched with epoll where available, otherwise with select,
+ * which is also used if the epoll instance cannot be created. One epoll_wait
+ * reports up to SOCKET_PULLER_EVENTS ready sockets, which are returned by the
+ * following `Select's without waiting again.
+ *
+ * It is level-triggered, since callers take one message from a socket
+ * returned and expect to get the socket again if there are more.
+ */
+#ifdef HAVE_SYS_EPOLL_H
+    #include <sys/epoll.h>
+    #define SOCKET_PULLER_EPOLL
+    #define SOCKET_PULLER_EVENTS    64
+#endif /* HAVE_SYS_EPOLL_H */
+
 typedef struct _SocketPuller SocketPuller;
 
 struct _SocketPuller{
@@ -13,6 +27,23 @@ struct _SocketPuller{
     PRIMEMB fd_set  s;
     PRIMEMB SOCKET  Max;
 
+    /* Of `s', also watched for being writable, see `Watch' */
+    PRIMEMB fd_set  w;
+    PRIMEMB int     WatchedCount;
+
+#ifdef SOCKET_PULLER_EPOLL
+    /* -1 if select is used */
+    PRIMEMB int         Epoll;
+
+    /* EPOLLIN and/or EPOLLOUT, as the last `Select' asked */
+    PRIMEMB uint32_t    Events;
+
+    /* Reported by the last epoll_wait, from `ReadyIndex' on not returned */
+    PRIMEMB struct epoll_event  Ready[SOCKET_PULLER_EVENTS];
+    PRIMEMB int         ReadyCount;
+    PRIMEMB int         ReadyIndex;
+#endif /* SOCKET_PULLER_EPOLL */
+
     PUBMEMB int (*Add)(SocketPuller *p,
                        SOCKET s,
                        const void *Data,
@@ -29,6 +60,13 @@ struct _SocketPuller{
                              int *err
                              );
 
+    /* A socket added also returned by `Select' when it is writable, or not
+     * any longer. It is for `Select's asked for reading only, and is lost
+     * once `Select' is asked for something else. Which of the two a socket is
+     * returned for is not told.
+     */
+    PUBMEMB int (*Watch)(SocketPuller *p, SOCKET s, BOOL Writing);
+
     PUBMEMB void (*CloseAll)(SocketPuller *p, SOCKET ExceptFor);
     PUBMEMB void (*Free)(SocketPuller *p);
     PUBMEMB void (*FreeWithoutClose)(SocketPuller *p);
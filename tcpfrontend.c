@@ -1,135 +1,548 @@
+#include <string.h>
+#include <time.h>
 #include "tcpfrontend.h"
 #include "socketpuller.h"
 #include "addresslist.h"
 #include "utils.h"
 #include "mmgr.h"
+#include "clientsubnet.h"
+#include "msgpool.h"
 #include "logs.h"
 
 extern BOOL Ipv6_Enabled;
 
+/* Buffer */
+#define BUF_LENGTH  CONTEXT_DATA_LENGTH
+#define LEFT_LENGTH  (BUF_LENGTH - sizeof(IHeader))
+
+/* Bytes of answers waiting for a client that doesn't read, beyond which the
+ * connection is dropped.
+ */
+#define TCP_OUT_MAX             65536
+
+/* How long the reactor waits for events, in milliseconds */
+#define TCP_WAIT                1000
+
+/* A connection, owned by the reactor thread except the members guarded by
+ * `Lock', which answering threads use. An answering thread holds the lock of
+ * the slot its `IHeader::ConnectionId' names, and then finds by `Id' whether
+ * the slot still is its connection.
+ */
+typedef struct _TcpConnection{
+    MutexHandle     Lock;
+
+    /* Guarded by `Lock' */
+    SOCKET          Sock; /* INVALID_SOCKET if the slot is free */
+    uint32_t        Id; /* `Generation' << 16 | slot, as `IHeader::ConnectionId' */
+    time_t          LastActive;
+    BOOL            Broken; /* To be closed by the reactor */
+    BOOL            Queued; /* Passed to the reactor, see `TcpFrontend_Queue' */
+    char            *Out;
+    int             OutLength;
+    int             OutSize;
+
+    /* The reactor only */
+    BOOL            Watched; /* For being writable, while `Out' isn't empty */
+    uint16_t        Generation;
+    Address_Type    Address;
+    char            Agent[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
+
+    /* Frames of queries, each led by the 2-byte length. A query is handled
+     * as soon as it is complete, so that several of a connection can be
+     * outstanding at a time, and answers go back in whatever order they
+     * come (RFC 7766, 6.2.1.1).
+     */
+    int             InLength;
+    char            In[2 + LEFT_LENGTH];
+} TcpConnection;
+
+/* Listening sockets and `Queue' with NULL, connections with their
+ * `TcpConnection *'
+ */
 static SocketPuller Frontend;
 
-static void TcpFrontend_Work(void *Unused)
+/* Ids of connections having answers not sent or being broken, sent by the
+ * answering threads to the reactor, so that only those are watched for being
+ * writable.
+ */
+static SOCKET Queue = INVALID_SOCKET;
+static Address_Type QueueAddress;
+
+static TcpConnection *Connections = NULL;
+static int MaxConnections = 0;
+static int ConnectionCount = 0;
+static int IdleTimeout = 0;
+
+static void TcpFrontend_Close(TcpConnection *c)
 {
-    /* Buffer */
-    #define BUF_LENGTH  2048
-    char *ReceiveBuffer;
-    IHeader *Header;
+    Frontend.Del(&Frontend, c->Sock);
+
+    GET_MUTEX(c->Lock);
+    CLOSE_SOCKET(c->Sock);
+    c->Sock = INVALID_SOCKET;
+    c->Broken = FALSE;
+    c->Queued = FALSE;
+    SafeFree(c->Out);
+    c->Out = NULL;
+    c->OutLength = 0;
+    c->OutSize = 0;
+    RELEASE_MUTEX(c->Lock);
+
+    c->Watched = FALSE;
+    c->InLength = 0;
+    --ConnectionCount;
+}
+
+/* Called with `Lock' held, once `c' has answers not sent or is broken */
+static void TcpFrontend_Queue(TcpConnection *c)
+{
+    if( c->Queued || Queue == INVALID_SOCKET )
+    {
+        return;
+    }
 
-    #define LEFT_LENGTH  (BUF_LENGTH - sizeof(IHeader))
-    char *Entity;
+    /* If it is lost, the sweep finds the connection later */
+    if( sendto(Queue,
+               (const char *)&(c->Id),
+               sizeof(c->Id),
+               MSG_NOSIGNAL,
+               (const struct sockaddr *)&(QueueAddress.Addr),
+               GetAddressLength(QueueAddress.family)
+               )
+        == sizeof(c->Id) )
+    {
+        c->Queued = TRUE;
+    }
+}
+
+/* Called with `Lock' held */
+static void TcpFrontend_Flush(TcpConnection *c)
+{
+    int State;
 
-    ReceiveBuffer = SafeMalloc(BUF_LENGTH);
-    if( ReceiveBuffer == NULL )
+    if( c->OutLength == 0 || c->Broken )
     {
-        ERRORMSG("No enough memory, 26.\n");
         return;
     }
 
-    Header = (IHeader *)ReceiveBuffer;
-    Entity = ReceiveBuffer + sizeof(IHeader);
+    State = send(c->Sock, c->Out, c->OutLength, MSG_NOSIGNAL);
+    if( State < 0 )
+    {
+        if( FatalErrorDecideding(GET_LAST_ERROR()) != 0 )
+        {
+            c->Broken = TRUE;
+        }
+        return;
+    }
 
-    /* Loop */
-    while( TRUE )
+    c->OutLength -= State;
+    if( c->OutLength > 0 )
+    {
+        memmove(c->Out, c->Out + State, c->OutLength);
+    }
+}
+
+/* `IHeader::SendBack' of the queries, an answer led by its 2-byte length */
+static int TcpFrontend_SendBack(IHeader *h, const char *Message, int Length)
+{
+    uint32_t ConnectionId = h->ConnectionId;
+    TcpConnection *c;
+    int State = 0;
+    int ret = 0;
+
+    if( Connections == NULL ||
+        (int)(ConnectionId & 0xFFFF) >= MaxConnections
+        )
+    {
+        return -1;
+    }
+
+    c = Connections + (ConnectionId & 0xFFFF);
+
+    GET_MUTEX(c->Lock);
+
+    /* The connection may be gone, or the slot may be reused */
+    if( c->Sock == INVALID_SOCKET || c->Id != ConnectionId || c->Broken )
+    {
+        ret = -2;
+        goto EXIT;
+    }
+
+    c->LastActive = time(NULL);
+
+    if( c->OutLength == 0 )
+    {
+        State = send(c->Sock, Message, Length, MSG_NOSIGNAL);
+        if( State == Length )
+        {
+            goto EXIT;
+        }
+
+        if( State < 0 )
+        {
+            if( FatalErrorDecideding(GET_LAST_ERROR()) != 0 )
+            {
+                c->Broken = TRUE;
+                ret = -3;
+                goto EXIT;
+            }
+            State = 0;
+        }
+    }
+
+    /* The rest is sent by the reactor once the client reads */
+    Length -= State;
+    if( c->OutLength + Length > TCP_OUT_MAX )
+    {
+        c->Broken = TRUE;
+        ret = -4;
+        goto EXIT;
+    }
+
+    if( c->OutLength + Length > c->OutSize )
+    {
+        int NewSize = ROUND_UP(c->OutLength + Length, 4096);
+
+        if( SafeRealloc((void **)&(c->Out), NewSize) != 0 )
+        {
+            c->Broken = TRUE;
+            ret = -5;
+            goto EXIT;
+        }
+
+        c->OutSize = NewSize;
+    }
+
+    memcpy(c->Out + c->OutLength, Message + State, Length);
+    c->OutLength += Length;
+
+EXIT:
+    if( c->Broken || c->OutLength > 0 )
+    {
+        TcpFrontend_Queue(c);
+    }
+    RELEASE_MUTEX(c->Lock);
+    return ret;
+}
+
+static void TcpFrontend_Accept(SOCKET Listening)
+{
+    Address_Type a;
+    socklen_t AddrLen = sizeof(a.Addr);
+    SOCKET sock;
+    TcpConnection *c;
+    int loop;
+
+    sock = accept(Listening, (struct sockaddr *)&(a.Addr), &AddrLen);
+    if( sock == INVALID_SOCKET )
     {
-        SOCKET sock, sock_c;
-        Address_Type *ClientAddr, ClientAddr_c;
-        BOOL IsNewConnected;
+        return;
+    }
+
+    a.family = ((struct sockaddr *)&(a.Addr))->sa_family;
+
+    if( ConnectionCount >= MaxConnections )
+    {
+        INFO("TCP connections reach the limit %d, a new one refused.\n",
+             MaxConnections
+             );
+        CLOSE_SOCKET(sock);
+        return;
+    }
+
+    for( loop = 0; loop != MaxConnections; ++loop )
+    {
+        if( Connections[loop].Sock == INVALID_SOCKET )
+        {
+            break;
+        }
+    }
+
+    c = Connections + loop;
+
+    if( SetSocketNonBlock(sock, TRUE) != 0 ||
+        Frontend.Add(&Frontend, sock, &c, sizeof(TcpConnection *)) != 0
+        )
+    {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+
+    memcpy(&(c->Address), &a, sizeof(Address_Type));
 
-        int RecvState;
+    if( a.family == AF_INET )
+    {
+        IPv4AddressToAsc(&(a.Addr.Addr4.sin_addr), c->Agent);
+    } else {
+        IPv6AddressToAsc(&(a.Addr.Addr6.sin6_addr), c->Agent);
+    }
+
+    c->InLength = 0;
+    ++(c->Generation);
+
+    GET_MUTEX(c->Lock);
+    c->Sock = sock;
+    c->Id = ((uint32_t)(c->Generation) << 16) | loop;
+    c->LastActive = time(NULL);
+    c->Broken = FALSE;
+    RELEASE_MUTEX(c->Lock);
+
+    ++ConnectionCount;
+}
+
+/* 0 returned if the connection is still usable */
+static int TcpFrontend_Read(TcpConnection *c)
+{
+    int RecvState;
+    int Start = 0;
+
+    RecvState = recv(c->Sock,
+                     c->In + c->InLength,
+                     sizeof(c->In) - c->InLength,
+                     0
+                     );
+    if( RecvState == 0 )
+    {
+        /* Closed by the client */
+        return -1;
+    } else if( RecvState < 0 )
+    {
+        return FatalErrorDecideding(GET_LAST_ERROR()) == 0 ? 0 : -2;
+    }
+
+    c->InLength += RecvState;
+
+    GET_MUTEX(c->Lock);
+    c->LastActive = time(NULL);
+    RELEASE_MUTEX(c->Lock);
+
+    /* Every complete frame */
+    while( c->InLength - Start >= 2 )
+    {
         uint16_t TCPLength;
+        char *ReceiveBuffer;
+        IHeader *Header;
+        char *Entity;
 
-        char Agent[sizeof(Header->Agent)];
+        memcpy(&TCPLength, c->In + Start, 2);
+        TCPLength = ntohs(TCPLength);
 
-        sock = Frontend.Select(&Frontend,
-                               NULL,
-                               (void **)&ClientAddr,
-                               TRUE,
-                               FALSE,
-                               NULL
-                               );
+        if( TCPLength > LEFT_LENGTH )
+        {
+            WARNING("TCP client %s segment is too large, discarded.\n",
+                    c->Agent
+                    );
+            return -3;
+        }
 
-        if( sock == INVALID_SOCKET )
+        if( c->InLength - Start - 2 < TCPLength )
         {
-            ERRORMSG("Fatal error 58.\n");
             break;
         }
 
-        if( ((struct sockaddr *)ClientAddr)->sa_family == AF_UNSPEC )
+        /* A new context for each query, as modules may keep it */
+        ReceiveBuffer = (char *)MsgPool_Get();
+        if( ReceiveBuffer == NULL )
         {
-            socklen_t AddrLen = sizeof(Address_Type);
+            ERRORMSG("No enough memory, 26.\n");
+            return -4;
+        }
 
-            sock_c = accept(sock, (struct sockaddr *)&(ClientAddr_c.Addr), &AddrLen);
-            if(sock_c == INVALID_SOCKET)
-            {
-                continue;
-            }
+        Header = (IHeader *)ReceiveBuffer;
+        Entity = ReceiveBuffer + sizeof(IHeader);
+
+        memcpy(Entity, c->In + Start + 2, TCPLength);
+        Start += 2 + TCPLength;
 
-            IsNewConnected = TRUE;
-            ClientAddr_c.family = ClientAddr->family;
-            ClientAddr = &ClientAddr_c;
-        } else {
-            IsNewConnected = FALSE;
-            sock_c = sock;
+        IHeader_Fill(Header,
+                     FALSE,
+                     Entity,
+                     TCPLength,
+                     NULL,
+                     c->Sock,
+                     c->Address.family,
+                     c->Agent
+                     );
+
+        Header->ConnectionId = c->Id;
+        Header->SendBack = TcpFrontend_SendBack;
+
+        ClientSubnet_FromClient(Header,
+                                (const struct sockaddr *)&(c->Address.Addr),
+                                c->Address.family
+                                );
+
+        MMgr_Send(ReceiveBuffer, BUF_LENGTH);
+        MsgPool_Put((MsgContext *)ReceiveBuffer);
+    }
+
+    /* A partial frame is kept for the next read */
+    if( Start > 0 )
+    {
+        c->InLength -= Start;
+        memmove(c->In, c->In + Start, c->InLength);
+    }
+
+    return 0;
+}
+
+/* `c' watched for being writable or not, as its answers not sent ask.
+ * 0 returned if the connection is still usable.
+ */
+static int TcpFrontend_Watch(TcpConnection *c)
+{
+    BOOL Broken;
+    BOOL Pending;
+
+    GET_MUTEX(c->Lock);
+    Broken = c->Broken;
+    Pending = c->OutLength > 0;
+    if( !Broken && !Pending )
+    {
+        c->Queued = FALSE;
+    }
+    RELEASE_MUTEX(c->Lock);
+
+    if( Broken )
+    {
+        return -1;
+    }
+
+    if( Pending != c->Watched &&
+        Frontend.Watch(&Frontend, c->Sock, Pending) == 0
+        )
+    {
+        c->Watched = Pending;
+    }
+
+    return 0;
+}
+
+/* An Id from `Queue' */
+static void TcpFrontend_Dequeue(void)
+{
+    uint32_t Id;
+    TcpConnection *c;
+    BOOL Valid;
+
+    if( recvfrom(Queue, (char *)&Id, sizeof(Id), 0, NULL, NULL)
+        != sizeof(Id) )
+    {
+        return;
+    }
+
+    if( (int)(Id & 0xFFFF) >= MaxConnections )
+    {
+        return;
+    }
+
+    c = Connections + (Id & 0xFFFF);
+
+    /* The connection may be gone, or the slot may be reused */
+    GET_MUTEX(c->Lock);
+    Valid = c->Sock != INVALID_SOCKET && c->Id == Id;
+    RELEASE_MUTEX(c->Lock);
+
+    if( Valid && TcpFrontend_Watch(c) != 0 )
+    {
+        TcpFrontend_Close(c);
+    }
+}
+
+/* Answers not sent sent as far as the client reads */
+static int TcpFrontend_Write(TcpConnection *c)
+{
+    GET_MUTEX(c->Lock);
+    TcpFrontend_Flush(c);
+    RELEASE_MUTEX(c->Lock);
+
+    return TcpFrontend_Watch(c);
+}
+
+/* Broken and idle connections closed, and those whose Ids `Queue' lost
+ * watched
+ */
+static void TcpFrontend_Sweep(void)
+{
+    time_t Now = time(NULL);
+    int loop;
+
+    for( loop = 0; loop != MaxConnections; ++loop )
+    {
+        TcpConnection *c = Connections + loop;
+        BOOL ToClose;
+
+        if( c->Sock == INVALID_SOCKET )
+        {
+            continue;
         }
 
-        if( ClientAddr->family == AF_INET )
+        GET_MUTEX(c->Lock);
+        ToClose = IdleTimeout > 0 && Now - c->LastActive > IdleTimeout;
+        RELEASE_MUTEX(c->Lock);
+
+        if( ToClose || TcpFrontend_Watch(c) != 0 )
         {
-            IPv4AddressToAsc(&(((struct sockaddr_in *)ClientAddr)->sin_addr), Agent);
-        } else {
-            IPv6AddressToAsc(&(((struct sockaddr_in6 *)ClientAddr)->sin6_addr), Agent);
+            TcpFrontend_Close(c);
         }
+    }
+}
+
+static void TcpFrontend_Work(void *Unused)
+{
+    time_t LastSwept = time(NULL);
+
+    /* Loop */
+    while( TRUE )
+    {
+        SOCKET sock;
+        TcpConnection **c;
+        int Err;
+        time_t Now;
+
+        struct timeval TimeOut;
+
+        TimeOut.tv_sec = TCP_WAIT / 1000;
+        TimeOut.tv_usec = (TCP_WAIT % 1000) * 1000;
+
+        sock = Frontend.Select(&Frontend,
+                               &TimeOut,
+                               (void **)&c,
+                               TRUE,
+                               FALSE,
+                               &Err
+                               );
 
-        RecvState = recv(sock_c, (char *)&TCPLength, 2, 0);
-        if( RecvState == 2 )
+        if( sock == INVALID_SOCKET )
         {
-            TCPLength = ntohs(TCPLength);
-            if( TCPLength <= LEFT_LENGTH )
+            if( Err != 0 )
             {
-                RecvState = recv(sock_c, Entity, TCPLength, 0);
-                if( RecvState == TCPLength )
-                {
-                    IHeader_Fill(Header,
-                                 FALSE,
-                                 Entity,
-                                 RecvState,
-                                 NULL,
-                                 sock_c,
-                                 ClientAddr->family,
-                                 Agent
-                                 );
-
-                    MMgr_Send(ReceiveBuffer, BUF_LENGTH);
-
-                    if( IsNewConnected )
-                    {
-                        Frontend.Add(&Frontend, sock_c, ClientAddr, sizeof(Address_Type));
-                    }
-
-                    continue;
-
-                } else {
-                    INFO("Invalid data received from TCP client %s.\n", Agent);
-                }
-            } else {
-                WARNING("TCP client %s segment is too large, discarded.\n", Agent);
+                ERRORMSG("Fatal error 58.\n");
+                break;
             }
-
-            CLOSE_SOCKET(sock_c);
-        } else if( RecvState == 1 )
+        } else if( sock == Queue )
+        {
+            TcpFrontend_Dequeue();
+        } else if( *c == NULL )
+        {
+            TcpFrontend_Accept(sock);
+        } else if( ((*c)->Watched && TcpFrontend_Write(*c) != 0) ||
+                   TcpFrontend_Read(*c) != 0
+                   )
         {
-            INFO("Invalid data received from TCP client %s.\n", Agent);
-            CLOSE_SOCKET(sock_c);
+            /* Which of the two it is returned for is unknown, but reading
+             * a socket not readable merely fails with EAGAIN.
+             */
+            TcpFrontend_Close(*c);
         }
 
-        /* recv failed */
-        if( IsNewConnected == FALSE )
+        Now = time(NULL);
+        if( Now != LastSwept )
         {
-            Frontend.Del(&Frontend, sock_c);
+            TcpFrontend_Sweep();
+            LastSwept = Now;
         }
     }
-
-    SafeFree(ReceiveBuffer);
 }
 
 void TcpFrontend_StartWork(void)
@@ -142,7 +555,17 @@ void TcpFrontend_StartWork(void)
 
 static void TcpFrontend_Cleanup(void)
 {
+    int loop;
+
     Frontend.Free(&Frontend);
+
+    for( loop = 0; loop != MaxConnections; ++loop )
+    {
+        SafeFree(Connections[loop].Out);
+    }
+
+    SafeFree(Connections);
+    Connections = NULL;
 }
 
 int TcpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
@@ -152,6 +575,8 @@ int TcpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
     const char *One;
 
     int Count = 0;
+    int Backlog = ConfigGetInt32(ConfigInfo, "TCPBacklog");
+    int loop;
 
     TCPLocal = ConfigGetStringList(ConfigInfo, "TCPLocal");
     if( TCPLocal == NULL )
@@ -165,17 +590,63 @@ int TcpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
         return -20;
     }
 
-    if( SocketPuller_Init(&Frontend, sizeof(Address_Type)) != 0 )
+    MaxConnections = ConfigGetInt32(ConfigInfo, "TCPMaxConnections");
+    if( MaxConnections < 1 )
     {
+        MaxConnections = 1;
+    } else if( MaxConnections > 0xFFFF )
+    {
+        MaxConnections = 0xFFFF;
+    }
+
+    IdleTimeout = ConfigGetInt32(ConfigInfo, "TCPIdleTimeout");
+
+    if( Backlog < 1 )
+    {
+        Backlog = SOMAXCONN;
+    }
+
+    if( SocketPuller_Init(&Frontend, sizeof(TcpConnection *)) != 0 )
+    {
+        return -19;
+    }
+
+    Connections = SafeMalloc(MaxConnections * sizeof(TcpConnection));
+    if( Connections == NULL )
+    {
+        Frontend.Free(&Frontend);
         return -19;
     }
 
+    memset(Connections, 0, MaxConnections * sizeof(TcpConnection));
+    for( loop = 0; loop != MaxConnections; ++loop )
+    {
+        Connections[loop].Sock = INVALID_SOCKET;
+        CREATE_MUTEX(Connections[loop].Lock);
+    }
+
+    Queue = TryBindLocal(Ipv6_Enabled, 10600, &QueueAddress);
+    if( Queue != INVALID_SOCKET &&
+        Frontend.Add(&Frontend, Queue, NULL, 0) != 0
+        )
+    {
+        CLOSE_SOCKET(Queue);
+        Queue = INVALID_SOCKET;
+    }
+
+    if( Queue == INVALID_SOCKET )
+    {
+        /* Left to the sweep */
+        WARNING("TCP answers not sent at once may be delayed up to a second.\n");
+    }
+
     while( (One = i.Next(&i)) != NULL )
     {
-        Address_Type a, ClientAddr;
+        Address_Type a;
         sa_family_t f;
 
         SOCKET sock;
+        TcpConnection *Listening = NULL;
 
         f = AddressList_ConvertFromString(&a, One, 53);
         if( f == AF_UNSPEC )
@@ -190,6 +661,17 @@ int TcpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
             continue;
         }
 
+#ifndef WIN32
+        {
+            /* Connections closed by us linger in TIME_WAIT, which mustn't
+             * keep a restart from binding.
+             */
+            const int On = 1;
+
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &On, sizeof(On));
+        }
+#endif /* WIN32 */
+
         if( bind(sock,
                  (const struct sockaddr *)&(a.Addr),
                  GetAddressLength(f)
@@ -206,20 +688,21 @@ int TcpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
             continue;
         }
 
-        if( listen(sock, 16) == SOCKET_ERROR )
+        if( listen(sock, Backlog) == SOCKET_ERROR )
         {
             ERRORMSG("Can't listen on interface: %s .\n", One);
             break;
         }
 
+        /* Accepting never blocks if the client has gone meanwhile */
+        SetSocketNonBlock(sock, TRUE);
+
         if( f == AF_INET6 )
         {
             Ipv6_Enabled = TRUE;
         }
 
-        memset(&ClientAddr, 0, sizeof(Address_Type));
-        ClientAddr.family = f;
-        Frontend.Add(&Frontend, sock, &ClientAddr, sizeof(Address_Type));
+        Frontend.Add(&Frontend, sock, &Listening, sizeof(TcpConnection *));
         INFO("TCP interface %s opened.\n", One);
         ++Count;
     }
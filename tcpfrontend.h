@@ -1,8 +1,14 @@
 #ifndef TCPFRONTEND_H_INCLUDED
 #define TCPFRONTEND_H_INCLUDED
 
+#include <stdint.h>
 #include "readconfig.h"
 
+/* The TCP frontend is a single-threaded reactor over non-blocking sockets.
+ * Answers, sent from any thread, are buffered if the client is slow to read,
+ * and dropped if the connection has gone.
+ */
+
 void TcpFrontend_StartWork(void);
 
 int TcpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork);
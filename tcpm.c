@@ -7,20 +7,19 @@
 #include "udpfrontend.h"
 #include "timedtask.h"
 #include "dnscache.h"
+#include "pendingquery.h"
+#include "clientsubnet.h"
 #include "dnsgenerator.h"
 #include "ipmisc.h"
 #include "domainstatistic.h"
 #include "ptimer.h"
-
-extern BOOL Ipv6_Enabled;
+#include "msgpool.h"
 
 #define TIMEOUT     5
 #define TIMEOUT_ms_SEND 2000
 #define TIMEOUT_ms_RECV 2000
 #define TIMEOUT_ms_ALIVE    100
 
-#define CONTEXT_DATA_LENGTH 2048
-
 extern int TCPM_Keep_Alive;
 static const struct timeval TimeOut_Const = {TIMEOUT, 0};
 
@@ -31,7 +30,7 @@ typedef struct _TcpContext
     /* To retry for server that force closed SOCKET. */
     int         Queried;
     int         MsgCtxQid;
-    uint32_t    MsgCtxHash;
+    uint64_t    MsgCtxHash;
     MsgContext  *MsgCtx;
 } TcpContext;
 
@@ -392,8 +391,12 @@ static int TcpM_Send_Actual(TcpM *m, MsgContext *MsgCtx, int SingleServerIndex)
     int i, NumOfServers, n = 0;
 
     IHeader *h = (IHeader *)MsgCtx;
-    char *msg = (char *)(IHEADER_TAIL(h)) - 2;
+    char *msg;
+
+    /* Contexts stored are all `CONTEXT_DATA_LENGTH' long */
+    ClientSubnet_AddToQuery(MsgCtx, CONTEXT_DATA_LENGTH);
 
+    msg = (char *)(IHEADER_TAIL(h)) - 2;
     DNSSetTcpLength(msg, h->EntityLength);
 
     if( SingleServerIndex == -1 && m->Parallel )
@@ -483,23 +486,32 @@ static int TcpM_Send_Actual(TcpM *m, MsgContext *MsgCtx, int SingleServerIndex)
     return n;
 }
 
+/* `Buffer' is a context of the message pool, only its address is passed to
+ * the working thread, which takes the reference taken here.
+ */
 PUBFUNC int TcpM_Send(TcpM *m,
                       const char *Buffer,
                       int BufferLength
                       )
 {
     int State;
-    IHeader *h = (IHeader *)Buffer;
+    MsgContext *MsgCtx = (MsgContext *)Buffer;
 
-    State = sendto(m->Incoming,
-                   Buffer,
-                   sizeof(IHeader) + h->EntityLength,
-                   MSG_NOSIGNAL,
-                   (const struct sockaddr *)&(m->IncomingAddr.Addr),
-                   GetAddressLength(m->IncomingAddr.family)
-                   );
+    MsgPool_Ref(MsgCtx);
 
-    return !(State > 0);
+    State = send(m->IncomingSender,
+                 (const char *)&MsgCtx,
+                 sizeof(MsgCtx),
+                 MSG_NOSIGNAL
+                 );
+
+    if( State != sizeof(MsgCtx) )
+    {
+        MsgPool_Put(MsgCtx);
+        return 1;
+    }
+
+    return 0;
 }
 
 static int TcpM_Cleanup(TcpM *m)
@@ -508,6 +520,8 @@ static int TcpM_Cleanup(TcpM *m)
 
     CLOSE_SOCKET(m->Incoming);
     m->Incoming = INVALID_SOCKET;
+    CLOSE_SOCKET(m->IncomingSender);
+    m->IncomingSender = INVALID_SOCKET;
     m->Puller.Free(&(m->Puller));
 
     ModuleContext_Free(&(m->Context));
@@ -573,6 +587,7 @@ static int TcpM_Works(TcpM *m)
 
         if( s == m->Incoming ) {
             int State;
+            MsgContext *MsgCtxPassed;
 
             if( NumberOfCumulated > 1024 )
             {
@@ -580,21 +595,23 @@ static int TcpM_Works(TcpM *m)
                 NumberOfCumulated = 0;
             }
 
-            State = recvfrom(s,
-                             ReceiveBuffer, /* Receiving a header */
-                             CONTEXT_DATA_LENGTH,
-                             0,
-                             NULL,
-                             NULL
-                             );
+            State = recv(s,
+                         (char *)&MsgCtxPassed, /* Receiving an address */
+                         sizeof(MsgCtxPassed),
+                         0
+                         );
 
-            if( State > 0 )
+            if( State == sizeof(MsgCtxPassed) )
             {
                 MsgContext *MsgCtxStored;
 
                 ++NumberOfCumulated;
 
-                MsgCtxStored = m->Context.Add(&(m->Context), MsgCtx);
+                MsgCtxStored = m->Context.Add(&(m->Context), MsgCtxPassed);
+
+                /* The reference of `TcpM_Send' */
+                MsgPool_Put(MsgCtxPassed);
+
                 if( MsgCtxStored == NULL )
                 {
                     p->Del(p, s);
@@ -622,8 +639,10 @@ static int TcpM_Works(TcpM *m)
                 if( State < 1 )
                 {
                     /* If Server force closed the keep-alive SOCKET: */
+                    /* Contexts of the pool stay readable, retried if still waiting */
                     IHeader *Header2 = (IHeader *)TcpCtx->MsgCtx;
-                    if( TcpCtx->Queried > 1 && Header2 != NULL && *(Header2->Domain) != 0 &&
+                    if( TcpCtx->Queried > 1 && Header2 != NULL &&
+                        m->Context.Find(&(m->Context), TcpCtx->MsgCtx) == TcpCtx->MsgCtx &&
                         TcpCtx->MsgCtxQid == DNSGetQueryIdentifier(Header2 + 1) &&
                         TcpCtx->MsgCtxHash == Header2->HashValue
                         )
@@ -718,6 +737,10 @@ static int TcpM_Works(TcpM *m)
                 continue;
             }
 
+            ClientSubnet_RemoveFromAnswer(MsgCtx);
+
+            PendingQuery_Answer(MsgCtx, 'T', STATISTIC_TYPE_TCP);
+
             if( MsgContext_SendBack(MsgCtx) != 0 )
             {
                 ShowErrorMessage(Header, 'T');
@@ -743,7 +766,7 @@ int TcpM_Init(TcpM *m, const char *Services, BOOL Parallel, const char *SocksPro
         return -7;
     }
 
-    if( ModuleContext_Init(&(m->Context), CONTEXT_DATA_LENGTH) != 0 )
+    if( ModuleContext_Init(&(m->Context)) != 0 )
     {
         return -12;
     }
@@ -754,11 +777,17 @@ int TcpM_Init(TcpM *m, const char *Services, BOOL Parallel, const char *SocksPro
         goto EXIT_1;
     }
 
-    m->Incoming = TryBindLocal(Ipv6_Enabled, 10400, &(m->IncomingAddr));
-    if( m->Incoming == INVALID_SOCKET )
     {
-        ret = -357;
-        goto EXIT_1;
+        SOCKET Pair[2];
+
+        if( CreateLocalSocketPair(10400, Pair) != 0 )
+        {
+            ret = -357;
+            goto EXIT_1;
+        }
+
+        m->Incoming = Pair[0];
+        m->IncomingSender = Pair[1];
     }
 
     m->Puller.Add(&(m->Puller), m->Incoming, NULL, 0);
@@ -909,6 +938,7 @@ EXIT_3:
     AddressList_Free(&(m->ServiceList));
 EXIT_2:
     m->Puller.Free(&(m->Puller));
+    CLOSE_SOCKET(m->IncomingSender);
 EXIT_1:
     ModuleContext_Free(&(m->Context));
     return ret;
@@ -9,8 +9,8 @@ typedef struct _TcpM TcpM;
 
 struct _TcpM {
     /* private */
-    SOCKET          Incoming;
-    Address_Type    IncomingAddr;
+    SOCKET          Incoming; /* Queries passed by address, see `TcpM_Send' */
+    SOCKET          IncomingSender;
     SocketPuller    Puller;
 
     ModuleContext   Context;
@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../../common.h"
+#include "../../utils.h"
+#include "../../cacheht.h"
+
+/* The table is driven the way dnscache.c does: chunks are taken from the
+ * bottom of `Arena' upwards, the nodes grow down from below the initial
+ * slots at the top, and every chunk starts with the hash value of its entry,
+ * so that a node whose `Offset' is wrong is told.
+ */
+#define ARENA_SIZE  262144
+
+static char     Arena[ARENA_SIZE];
+static int32_t  End = 0;
+static CacheHT  h;
+
+static int Failed = 0;
+
+static void Check(BOOL Passed, const char *What)
+{
+    if( !Passed )
+    {
+        printf("FAILED : %s\n", What);
+        ++Failed;
+    }
+}
+
+static void TrimEnd(void)
+{
+    if( h.NodeChunk.Used == 0 )
+    {
+        End = 0;
+    } else {
+        Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), h.NodeChunk.Used - 1);
+
+        End = Node->Offset + Node->Length;
+    }
+}
+
+static int32_t GetChunk(uint32_t Length, Cht_Node **Out)
+{
+    int32_t Subscript;
+    BOOL    NewCreated;
+
+    Length = ROUND_UP(Length, 8);
+
+    Subscript = CacheHT_FindUnusedNode(&h, Length, Out, Arena + End + Length, &NewCreated);
+    if( Subscript >= 0 && NewCreated )
+    {
+        (*Out)->Offset = End;
+        End += Length;
+    }
+
+    return Subscript;
+}
+
+static int32_t Add(uint64_t HashValue, uint32_t Length)
+{
+    Cht_Node    *Node;
+    int32_t     Subscript = GetChunk(Length, &Node);
+
+    if( Subscript < 0 )
+    {
+        return -1;
+    }
+
+    memcpy(Arena + Node->Offset, &HashValue, sizeof(HashValue));
+
+    Node->TTL = 60;
+    Node->TimeAdded = time(NULL);
+    Node->Hits = 0;
+
+    CacheHT_InsertToSlot(&h, "-", Subscript, Node, &HashValue);
+    CacheHT_ExpiryLink(&h, Node);
+
+    return Subscript;
+}
+
+static void Remove(int32_t Subscript)
+{
+    Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Subscript);
+
+    CacheHT_ExpiryUnlink(&h, Node);
+    CacheHT_RemoveFromSlot(&h, Subscript, Node);
+    TrimEnd();
+}
+
+/* Found through its slot chain, and its chunk is its own */
+static BOOL Find(uint64_t HashValue)
+{
+    Cht_Node *Node = CacheHT_Get(&h, "-", NULL, &HashValue);
+
+    return Node != NULL &&
+           Node->Slot >= 0 &&
+           (Node->Flags & CHT_NODE_FREE) == 0 &&
+           memcmp(Arena + Node->Offset, &HashValue, sizeof(HashValue)) == 0;
+}
+
+static BOOL FindAll(const uint64_t *Keys, int Count)
+{
+    int loop;
+
+    for( loop = 0; loop != Count; ++loop )
+    {
+        if( Keys[loop] != 0 && !Find(Keys[loop]) )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Every free node is in the list of its class exactly once, the lists are
+ * doubly linked well, `FreeBytes' sums them up, and the last node is never
+ * free.
+ */
+static BOOL FreeListsConsistent(void)
+{
+    int32_t Bytes = 0;
+    int32_t InLists = 0;
+    int32_t Free = 0;
+    int     Class;
+    int32_t loop;
+
+    for( Class = 0; Class != CHT_SIZE_CLASSES + 1; ++Class )
+    {
+        int32_t Prev = -1;
+        int32_t Subscript;
+
+        for( Subscript = h.FreeLists[Class]; Subscript >= 0; Subscript = ((Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Subscript))->Next )
+        {
+            Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Subscript);
+            int Expected;
+
+            if( Node == NULL )
+            {
+                return FALSE;
+            }
+
+            Expected = Node->Length / CHT_CLASS_SIZE - 1;
+            if( Expected < 0 )
+            {
+                Expected = 0;
+            } else if( Expected > CHT_SIZE_CLASSES ){
+                Expected = CHT_SIZE_CLASSES;
+            }
+
+            if( (Node->Flags & CHT_NODE_FREE) == 0 ||
+                Node->Slot >= 0 ||
+                Node->ExpiryPrev != Prev ||
+                Expected != Class ||
+                Subscript == h.NodeChunk.Used - 1
+                )
+            {
+                return FALSE;
+            }
+
+            Bytes += Node->Length;
+            ++InLists;
+            Prev = Subscript;
+        }
+    }
+
+    for( loop = 0; loop != h.NodeChunk.Used; ++loop )
+    {
+        Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), loop);
+
+        if( Node->Flags & CHT_NODE_FREE )
+        {
+            ++Free;
+        }
+    }
+
+    return Bytes == h.FreeBytes && InLists == Free;
+}
+
+/* Every entry is linked into the expiry bucket of its own, once */
+static BOOL ExpiryConsistent(void)
+{
+    int32_t Linked = 0;
+    int     Bucket;
+
+    for( Bucket = 0; Bucket != CHT_EXPIRY_BUCKETS; ++Bucket )
+    {
+        int32_t Prev = -1;
+        int32_t Subscript;
+
+        for( Subscript = h.Expiry[Bucket]; Subscript >= 0; Subscript = ((Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Subscript))->ExpiryNext )
+        {
+            Cht_Node *Node = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Subscript);
+
+            if( Node == NULL ||
+                Node->Slot < 0 ||
+                Node->ExpiryPrev != Prev ||
+                ((Node->TimeAdded + Node->TTL) / CHT_EXPIRY_GRANULARITY) % CHT_EXPIRY_BUCKETS != Bucket ||
+                ++Linked > h.ItemCount
+                )
+            {
+                return FALSE;
+            }
+
+            Prev = Subscript;
+        }
+    }
+
+    return Linked == h.ItemCount;
+}
+
+/* As `DNSCache_GrowSlots' does */
+static void GrowSlots(void)
+{
+    int         NewSlotCount;
+    int         Bytes = CacheHT_NeedGrowing(&h, &NewSlotCount);
+    int32_t     Subscript;
+    Cht_Node    *Node;
+
+    if( Bytes == 0 )
+    {
+        return;
+    }
+
+    Subscript = GetChunk(Bytes, &Node);
+    if( Subscript < 0 )
+    {
+        return;
+    }
+
+    Node->Slot = -1;
+    Node->TTL = 0;
+    Node->TimeAdded = 0;
+
+    CacheHT_Grow(&h, Arena, Subscript, Arena + Node->Offset, NewSlotCount);
+}
+
+/* As `DNSCache_CompactOnce' does */
+static BOOL CompactOnce(void)
+{
+    int32_t     Last = h.NodeChunk.Used - 1;
+    int32_t     Subscript;
+    Cht_Node    *From;
+    Cht_Node    *To;
+
+    if( Last < 0 || h.FreeBytes == 0 )
+    {
+        return FALSE;
+    }
+
+    From = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Last);
+
+    Subscript = CacheHT_FindFreeNode(&h, From->Length, TRUE, &To);
+    if( Subscript < 0 )
+    {
+        return FALSE;
+    }
+
+    memcpy(Arena + To->Offset, Arena + From->Offset, From->Length);
+
+    return CacheHT_Relocate(&h, Last, Subscript) == 0;
+}
+
+#define KEY_COUNT   600
+
+/* 0 for the removed ones */
+static uint64_t Keys[KEY_COUNT];
+static int32_t  Nodes[KEY_COUNT];
+static uint32_t Serial = 0;
+
+/* Unique and nonzero */
+static uint64_t NewKey(void)
+{
+    return ((uint64_t)rand() << 32) | ++Serial;
+}
+
+static void TestRehash(void)
+{
+    int Added = 0;
+    int Grows = 0;
+    BOOL Found = TRUE;
+
+    while( Added != KEY_COUNT )
+    {
+        Keys[Added] = NewKey();
+        Nodes[Added] = Add(Keys[Added], 24 + rand() % 200);
+        ++Added;
+
+        /* Removed in the middle of rehashing, from the old slots or not */
+        if( h.RehashIndex >= 0 && Added % 7 == 0 )
+        {
+            int Victim = rand() % Added;
+
+            if( Keys[Victim] != 0 )
+            {
+                Remove(Nodes[Victim]);
+                Keys[Victim] = 0;
+            }
+        }
+
+        if( h.RehashIndex < 0 )
+        {
+            GrowSlots();
+            Grows += (h.RehashIndex >= 0);
+        }
+
+        CacheHT_Rehash(&h, 1);
+
+        Found = Found && FindAll(Keys, Added);
+    }
+
+    while( h.RehashIndex >= 0 )
+    {
+        CacheHT_Rehash(&h, 1);
+        Found = Found && FindAll(Keys, Added);
+    }
+
+    Check(Grows > 1, "Grown more than once");
+    Check(Found, "Lookups while rehashing");
+    Check(FreeListsConsistent(), "Free lists after rehashing");
+    Check(ExpiryConsistent(), "Expiry lists after rehashing");
+}
+
+static void TestCompact(void)
+{
+    int loop;
+    int Moved = 0;
+    BOOL Found = TRUE;
+    BOOL Consistent = TRUE;
+
+    /* Holes everywhere, besides the chunks of the old slots freed */
+    for( loop = 0; loop < KEY_COUNT; loop += 3 )
+    {
+        if( Keys[loop] != 0 )
+        {
+            Remove(Nodes[loop]);
+            Keys[loop] = 0;
+        }
+    }
+
+    Check(FreeListsConsistent(), "Free lists after freeing");
+
+    /* Some of the holes taken again */
+    for( loop = 0; loop < KEY_COUNT; loop += 6 )
+    {
+        Keys[loop] = NewKey();
+        Nodes[loop] = Add(Keys[loop], 24 + rand() % 200);
+    }
+
+    /* Of a class no hole is of, so a new node at the end, and the first one of
+     * its expiry bucket, is moved first */
+    Keys[3] = NewKey();
+    Nodes[3] = Add(Keys[3], 16);
+
+    Check(FreeListsConsistent(), "Free lists after allocating");
+    Check(FindAll(Keys, KEY_COUNT), "Lookups after allocating");
+
+    while( CompactOnce() )
+    {
+        TrimEnd();
+        ++Moved;
+
+        Found = Found && FindAll(Keys, KEY_COUNT);
+        Consistent = Consistent && FreeListsConsistent() && ExpiryConsistent();
+    }
+
+    Check(Moved > 0, "Relocated");
+    Check(Found, "Lookups after relocating");
+    Check(Consistent, "Free and expiry lists after relocating");
+
+    /* The slots, wherever they are now, still work for new ones */
+    for( loop = 0; loop < KEY_COUNT; loop += 3 )
+    {
+        Keys[loop] = NewKey();
+        Nodes[loop] = Add(Keys[loop], 24 + rand() % 200);
+    }
+
+    Check(FindAll(Keys, KEY_COUNT), "Lookups after adding to relocated");
+}
+
+static void TestClock(void)
+{
+    int Count = h.ItemCount;
+    BOOL Good = TRUE;
+    int loop;
+
+    /* Every node has been referenced once, the hand clears them all first */
+    for( loop = 0; loop != Count; ++loop )
+    {
+        Cht_Node    *Victim;
+        int32_t     Subscript = CacheHT_ClockVictim(&h, &Victim);
+
+        if( Subscript < 0 ||
+            Victim->Slot < 0 ||
+            (Victim->Flags & (CHT_NODE_FREE | CHT_NODE_REFERENCED)) != 0 ||
+            Subscript == h.SlotsNode ||
+            Victim != (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), Subscript)
+            )
+        {
+            Good = FALSE;
+            break;
+        }
+
+        Remove(Subscript);
+    }
+
+    Check(Good, "Clock victims");
+    Check(h.ItemCount == 0, "Clock evicted all");
+    Check(FreeListsConsistent(), "Free lists after evicting");
+}
+
+/* The slots live in a chunk too, and are moved like the others */
+static void TestRelocateSlots(void)
+{
+    int         Added = 0;
+    int32_t     Big;
+    int32_t     SlotsNode;
+    BOOL        Found = TRUE;
+    Cht_Node    *Node;
+
+    CacheHT_Init(&h, Arena, ARENA_SIZE);
+    End = 0;
+    memset(Keys, 0, sizeof(Keys));
+
+    Big = Add(NewKey(), 2048);
+
+    /* Until the new slots are the last chunk */
+    while( h.RehashIndex < 0 && Added != KEY_COUNT )
+    {
+        Keys[Added] = NewKey();
+        Add(Keys[Added], 24 + rand() % 200);
+        ++Added;
+
+        GrowSlots();
+    }
+
+    SlotsNode = h.SlotsNode;
+    Check(SlotsNode == h.NodeChunk.Used - 1, "Slots grown at last");
+
+    Remove(Big);
+
+    Check(CompactOnce(), "Slots relocating");
+    TrimEnd();
+
+    Node = (Cht_Node *)Array_GetBySubscript(&(h.NodeChunk), h.SlotsNode);
+    Check(h.SlotsNode == Big &&
+          h.Slots.Data == Arena + Node->Offset &&
+          h.SlotsOffset == Node->Offset &&
+          h.RehashIndex >= 0,
+          "Slots relocated while rehashing"
+          );
+
+    while( h.RehashIndex >= 0 )
+    {
+        CacheHT_Rehash(&h, 1);
+        Found = Found && FindAll(Keys, Added);
+    }
+
+    Check(Found, "Lookups through relocated slots");
+    Check(FreeListsConsistent(), "Free lists after relocating slots");
+}
+
+int main(void)
+{
+    srand(time(NULL));
+
+    CacheHT_Init(&h, Arena, ARENA_SIZE);
+
+    TestRehash();
+    TestCompact();
+    TestClock();
+    TestRelocateSlots();
+
+    if( Failed == 0 )
+    {
+        printf("All passed.\n");
+    }
+
+    return Failed;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../common.h"
+#include "../../clientsubnet.h"
+
+/* a.test IN A, without and with an OPT record */
+static const char Query[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 'a', 0x04, 't', 'e', 's', 't', 0x00, 0x00, 0x01, 0x00, 0x01
+};
+
+static const char QueryEdns[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x01, 'a', 0x04, 't', 'e', 's', 't', 0x00, 0x00, 0x01, 0x00, 0x01,
+    0x00, 0x00, 0x29, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static int Failed = 0;
+
+static void Check(BOOL Passed, const char *What)
+{
+    if( !Passed )
+    {
+        printf("FAILED : %s\n", What);
+        ++Failed;
+    }
+}
+
+static int Parse(const char *RData, int RDLength, ClientSubnet *s)
+{
+    memset(s, 0, sizeof(ClientSubnet));
+
+    return ClientSubnet_Parse(RData, RDLength, s);
+}
+
+static void TestParse(void)
+{
+    ClientSubnet s;
+
+    /* 192.0.2.0/24 */
+    static const char Good[] = {0x00, 0x08, 0x00, 0x07, 0x00, 0x01, 24, 0, 0xC0, 0x00, 0x02};
+
+    /* 192.0.255.0/20, bits beyond the prefix set */
+    static const char Unmasked[] = {0x00, 0x08, 0x00, 0x07, 0x00, 0x01, 20, 0, 0xC0, 0x00, 0xFF};
+
+    /* Another option comes first */
+    static const char Second[] = {0x00, 0x0A, 0x00, 0x02, 0xAA, 0xBB,
+                                  0x00, 0x08, 0x00, 0x06, 0x00, 0x02, 16, 0, 0x20, 0x01};
+
+    static const char BadFamily[] = {0x00, 0x08, 0x00, 0x07, 0x00, 0x03, 24, 0, 0xC0, 0x00, 0x02};
+    static const char LongIPv4[] = {0x00, 0x08, 0x00, 0x08, 0x00, 0x01, 33, 0, 0xC0, 0x00, 0x02, 0x00};
+    static const char LongIPv6[] = {0x00, 0x08, 0x00, 0x06, 0x00, 0x02, 129, 0, 0x20, 0x01};
+    static const char LongScope[] = {0x00, 0x08, 0x00, 0x07, 0x00, 0x01, 24, 33, 0xC0, 0x00, 0x02};
+
+    /* /16 with 3 bytes of address */
+    static const char LongAddress[] = {0x00, 0x08, 0x00, 0x07, 0x00, 0x01, 16, 0, 0xC0, 0x00, 0x02};
+
+    static const char NoOption[] = {0x00, 0x0A, 0x00, 0x02, 0xAA, 0xBB};
+
+    Check(Parse(Good, sizeof(Good), &s) == 0 &&
+          s.Family == 1 && s.Prefix == 24 && s.Scope == 0 &&
+          memcmp(s.Address, "\xC0\x00\x02\x00", 4) == 0,
+          "Parse 192.0.2.0/24"
+          );
+
+    Check(Parse(Unmasked, sizeof(Unmasked), &s) == 0 &&
+          s.Prefix == 20 &&
+          memcmp(s.Address, "\xC0\x00\xF0\x00", 4) == 0,
+          "Parse masking"
+          );
+
+    Check(Parse(Second, sizeof(Second), &s) == 0 &&
+          s.Family == 2 && s.Prefix == 16 &&
+          memcmp(s.Address, "\x20\x01\x00", 3) == 0,
+          "Parse after another option"
+          );
+
+    Check(Parse(BadFamily, sizeof(BadFamily), &s) == -2, "Parse bad family");
+    Check(Parse(LongIPv4, sizeof(LongIPv4), &s) == -3, "Parse prefix above 32");
+    Check(Parse(LongIPv6, sizeof(LongIPv6), &s) == -3, "Parse prefix above 128");
+    Check(Parse(LongScope, sizeof(LongScope), &s) == -3, "Parse scope above 32");
+    Check(Parse(LongAddress, sizeof(LongAddress), &s) == -3, "Parse address longer than the prefix");
+    Check(Parse(NoOption, sizeof(NoOption), &s) == -1, "Parse no option");
+
+    /* The option overruns RDLENGTH */
+    Check(Parse(Good, sizeof(Good) - 1, &s) == -1, "Parse option overrunning");
+    Check(Parse(Second, sizeof(Second) - 2, &s) == -1, "Parse second option overrunning");
+}
+
+static void TestInsert(void)
+{
+    char Entity[128];
+    ClientSubnet s, Parsed;
+    int Length;
+
+    memset(&s, 0, sizeof(s));
+    s.Family = 1;
+    s.Prefix = 24;
+    memcpy(s.Address, "\xC0\x00\x02", 3);
+
+    memcpy(Entity, QueryEdns, sizeof(QueryEdns));
+    Length = ClientSubnet_Insert(Entity, sizeof(QueryEdns), sizeof(Entity), &s, 0);
+
+    /* Option code, length, family, prefixes and 3 bytes of address */
+    Check(Length == sizeof(QueryEdns) + 11, "Insert length");
+    Check(GET_16_BIT_U_INT(Entity + sizeof(QueryEdns) - 2) == 11, "Insert RDLENGTH");
+    Check(Parse(Entity + sizeof(QueryEdns), 11, &Parsed) == 0 &&
+          ClientSubnet_Same(&s, &Parsed),
+          "Insert parsed back"
+          );
+
+    memcpy(Entity, QueryEdns, sizeof(QueryEdns));
+    Check(ClientSubnet_Insert(Entity, sizeof(QueryEdns), sizeof(QueryEdns) + 10, &s, 0) == -2,
+          "Insert no room"
+          );
+
+    memcpy(Entity, Query, sizeof(Query));
+    Check(ClientSubnet_Insert(Entity, sizeof(Query), sizeof(Entity), &s, 0) == -1,
+          "Insert without OPT"
+          );
+}
+
+/* Added to the query, then removed from the answer, which must be the query
+ * itself but the QR bit and the scope.
+ */
+static void TestRemove(const char *Original, int OriginalLength, int Added)
+{
+    MsgContext *MsgCtx = malloc(CONTEXT_DATA_LENGTH);
+    IHeader *h = (IHeader *)MsgCtx;
+    char *Entity = IHEADER_TAIL(h);
+    char *Opt;
+
+    memset(MsgCtx, 0, CONTEXT_DATA_LENGTH);
+
+    memcpy(Entity, Original, OriginalLength);
+    h->EntityLength = OriginalLength;
+    h->EDNSEnabled = (Added == CLIENT_SUBNET_ADDED_OPTION);
+    h->Subnet.Family = 2;
+    h->Subnet.Prefix = 56;
+    memcpy(h->Subnet.Address, "\x20\x01\x0D\xB8\x00\x00\x01", 7);
+
+    Check(ClientSubnet_AddToQuery(MsgCtx, CONTEXT_DATA_LENGTH) == 0 &&
+          h->SubnetAdded == Added,
+          "AddToQuery"
+          );
+
+    Check(ClientSubnet_AddToQuery(MsgCtx, CONTEXT_DATA_LENGTH) == 0 &&
+          h->EntityLength == OriginalLength + 4 + 4 + 7 +
+                             (Added == CLIENT_SUBNET_ADDED_OPT ? 11 : 0),
+          "AddToQuery twice"
+          );
+
+    /* Answered, scoped to /48 */
+    Entity[2] |= 0x80;
+    Opt = Entity + h->EntityLength - 7 - 1;
+    *Opt = 48;
+
+    ClientSubnet_RemoveFromAnswer(MsgCtx);
+    Entity[2] &= ~0x80;
+
+    Check(h->EntityLength == OriginalLength &&
+          memcmp(Entity, Original, OriginalLength) == 0,
+          Added == CLIENT_SUBNET_ADDED_OPT ?
+              "RemoveFromAnswer OPT added" : "RemoveFromAnswer option added"
+          );
+
+    Check(h->EDNSEnabled == (Added == CLIENT_SUBNET_ADDED_OPTION),
+          "RemoveFromAnswer EDNS"
+          );
+
+    free(MsgCtx);
+}
+
+int main(void)
+{
+    TestParse();
+    TestInsert();
+    TestRemove(Query, sizeof(Query), CLIENT_SUBNET_ADDED_OPT);
+    TestRemove(QueryEdns, sizeof(QueryEdns), CLIENT_SUBNET_ADDED_OPTION);
+
+    if( Failed == 0 )
+    {
+        printf("All passed.\n");
+    }
+
+    return Failed;
+}
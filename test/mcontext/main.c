@@ -1,56 +1,110 @@
 #include "../../common.h"
 #include "../../mcontext.h"
+#include "../../msgpool.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-typedef struct {
-    IHeader h;
-    uint16_t    i;
-} HH;
-
-HH *MakeOne(void)
+static MsgContext *MakeOne(uint16_t Id, uint64_t HashValue)
 {
-    static int s = 0;
+    MsgContext *MsgCtx = MsgPool_Get();
+    IHeader *h = (IHeader *)MsgCtx;
+
+    IHeader_Reset(h);
+    h->HashValue = HashValue;
+    h->EntityLength = 12;
+
+    memset(IHEADER_TAIL(h), 0, 12);
+    Id = htons(Id);
+    memcpy(IHEADER_TAIL(h), &Id, sizeof(Id));
 
-    static HH h;
+    return MsgCtx;
+}
 
-    h.h.HashValue = s++;
+/* Contexts returned go back to the list of this thread first, so the one
+ * whose last reference is dropped is the next one taken.
+ */
+static BOOL IsReturned(MsgContext *MsgCtx)
+{
+    MsgContext *Next = MsgPool_Get();
 
-    h.i = s++;
+    MsgPool_Put(Next);
 
-    return &h;
+    return Next == MsgCtx;
+}
+
+static void Swept(const MsgContext *MsgCtx, int Number, void *Arg)
+{
+    ++*(int *)Arg;
 }
 
 int main(void)
 {
-    HH a, b;
-
-    ModuleContext   c;
-
-    ModuleContext_Init(&c, sizeof(HH));
-
-    a = *(HH *)MakeOne();
-
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, (IHeader *)&a);
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-    c.Add(&c, MakeOne());
-
-    c.GenAnswerHeaderAndRemove(&c, (IHeader *)&a, (IHeader *)&b);
+    ModuleContext c;
+    MsgContext *a, *s;
+    MsgContext *b;
+    int loop;
+    int Count = 0;
+
+    MsgPool_Init();
+    ModuleContext_Init(&c);
+
+    /* The context keeps its own reference of each one added */
+    for( loop = 0; loop != 16; ++loop )
+    {
+        MsgContext *One = MakeOne(loop, rand());
+
+        c.Add(&c, One);
+        MsgPool_Put(One);
+    }
+
+    a = MakeOne(100, 1);
+    c.Add(&c, a);
+
+    s = MakeOne(200, 2);
+    c.Add(&c, s);
+
+    /* An answer matches the query by identifier and name */
+    b = MakeOne(100, 1);
+    if( c.GenAnswerHeaderAndRemove(&c, b, b) != 0 )
+    {
+        printf("GenAnswerHeaderAndRemove failed.\n");
+    }
+
+    if( c.Find(&c, a) != NULL )
+    {
+        printf("Still found after GenAnswerHeaderAndRemove.\n");
+    }
+
+    /* Exactly one reference dropped, ours is the last one */
+    if( IsReturned(a) )
+    {
+        printf("GenAnswerHeaderAndRemove dropped too many references.\n");
+    }
+
+    MsgPool_Put(a);
+    printf("GenAnswerHeaderAndRemove %s\n", IsReturned(a) ? "OK" : "leaks");
+
+    /* The same for those swept */
+    ((IHeader *)s)->Timestamp = time(NULL) - 10;
+    c.Swep(&c, Swept, &Count);
+
+    if( Count != 1 || c.Find(&c, s) != NULL )
+    {
+        printf("Swep removed %d.\n", Count);
+    }
+
+    if( IsReturned(s) )
+    {
+        printf("Swep dropped too many references.\n");
+    }
+
+    MsgPool_Put(s);
+    printf("Swep %s\n", IsReturned(s) ? "OK" : "leaks");
+
+    MsgPool_Put(b);
+    ModuleContext_Free(&c);
 
     return 0;
 }
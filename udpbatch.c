@@ -0,0 +1,270 @@
+/* recvmmsg and sendmmsg */
+#define _GNU_SOURCE
+
+#include <string.h>
+#include "udpbatch.h"
+#include "msgpool.h"
+#include "utils.h"
+
+#ifdef UDP_BATCH_SUPPORTED
+
+/* The batch whose responses are being queued by this thread */
+static THREAD_LOCAL UdpBatch *Current = NULL;
+
+int UdpBatch_Init(UdpBatch *b, int Size, int BufferLength, int Reserved)
+{
+    int loop;
+
+    memset(b, 0, sizeof(UdpBatch));
+
+    b->Size = Size;
+    b->BufferLength = BufferLength;
+    b->Reserved = Reserved;
+
+    b->Contexts = SafeMalloc(Size * sizeof(MsgContext *));
+    b->RecvMsgs = SafeMalloc(Size * sizeof(struct mmsghdr));
+    b->RecvVecs = SafeMalloc(Size * sizeof(struct iovec));
+    b->RecvAddrs = SafeMalloc(Size * sizeof(Address_Type));
+
+    b->Queue = SafeMalloc(Size * BufferLength);
+    b->SendMsgs = SafeMalloc(Size * sizeof(struct mmsghdr));
+    b->SendVecs = SafeMalloc(Size * sizeof(struct iovec));
+    b->SendAddrs = SafeMalloc(Size * sizeof(Address_Type));
+    b->SendSockets = SafeMalloc(Size * sizeof(SOCKET));
+
+    if( b->Contexts == NULL || b->RecvMsgs == NULL || b->RecvVecs == NULL ||
+        b->RecvAddrs == NULL || b->Queue == NULL || b->SendMsgs == NULL ||
+        b->SendVecs == NULL || b->SendAddrs == NULL || b->SendSockets == NULL
+        )
+    {
+        UdpBatch_Free(b);
+        return -1;
+    }
+
+    memset(b->Contexts, 0, Size * sizeof(MsgContext *));
+    memset(b->RecvMsgs, 0, Size * sizeof(struct mmsghdr));
+    memset(b->SendMsgs, 0, Size * sizeof(struct mmsghdr));
+
+    for( loop = 0; loop != Size; ++loop )
+    {
+        b->RecvVecs[loop].iov_len = CONTEXT_DATA_LENGTH - Reserved;
+        b->RecvMsgs[loop].msg_hdr.msg_iov = b->RecvVecs + loop;
+        b->RecvMsgs[loop].msg_hdr.msg_iovlen = 1;
+        b->RecvMsgs[loop].msg_hdr.msg_name = &(b->RecvAddrs[loop].Addr);
+
+        b->SendVecs[loop].iov_base = b->Queue + loop * BufferLength;
+        b->SendMsgs[loop].msg_hdr.msg_iov = b->SendVecs + loop;
+        b->SendMsgs[loop].msg_hdr.msg_iovlen = 1;
+        b->SendMsgs[loop].msg_hdr.msg_name = &(b->SendAddrs[loop].Addr);
+    }
+
+    return 0;
+}
+
+int UdpBatch_Receive(UdpBatch *b, SOCKET sock)
+{
+    int loop;
+    int Count;
+
+    for( loop = 0; loop != b->Size; ++loop )
+    {
+        if( b->Contexts[loop] == NULL )
+        {
+            b->Contexts[loop] = MsgPool_Get();
+            if( b->Contexts[loop] == NULL )
+            {
+                break;
+            }
+
+            b->RecvVecs[loop].iov_base =
+                        (char *)(b->Contexts[loop]) + b->Reserved;
+        }
+
+        b->RecvMsgs[loop].msg_hdr.msg_namelen = sizeof(b->RecvAddrs[loop].Addr);
+    }
+
+    if( loop == 0 )
+    {
+        return -1;
+    }
+
+    /* At least one is waiting, the rest are taken if any */
+    Count = recvmmsg(sock, b->RecvMsgs, loop, MSG_DONTWAIT, NULL);
+    if( Count > 0 )
+    {
+        ++(b->Wakeups);
+        b->Received += Count;
+    }
+
+    return Count;
+}
+
+char *UdpBatch_Get(UdpBatch *b,
+                   int Index,
+                   int *Length,
+                   struct sockaddr **Address
+                   )
+{
+    char *Ret = (char *)(b->Contexts[Index]);
+
+    *Length = b->RecvMsgs[Index].msg_len;
+    *Address = (struct sockaddr *)&(b->RecvAddrs[Index].Addr);
+
+    b->Contexts[Index] = NULL;
+
+    return Ret;
+}
+
+static void UdpBatch_Flush(UdpBatch *b)
+{
+    int Start = 0;
+
+    while( Start < b->Queued )
+    {
+        int End = Start + 1;
+        int Sent;
+
+        /* Responses of a socket are sent together */
+        while( End < b->Queued && b->SendSockets[End] == b->SendSockets[Start] )
+        {
+            ++End;
+        }
+
+        Sent = sendmmsg(b->SendSockets[Start],
+                        b->SendMsgs + Start,
+                        End - Start,
+                        MSG_NOSIGNAL
+                        );
+        ++(b->Flushes);
+
+        if( Sent > 0 )
+        {
+            b->Sent += Sent;
+        } else {
+            /* The first one failed, dropped like a failed sendto */
+            Sent = 1;
+        }
+
+        Start += Sent;
+    }
+
+    b->Queued = 0;
+}
+
+void UdpBatch_Begin(UdpBatch *b)
+{
+    Current = b;
+}
+
+void UdpBatch_End(void)
+{
+    if( Current != NULL )
+    {
+        UdpBatch_Flush(Current);
+        Current = NULL;
+    }
+}
+
+int UdpBatch_Queue(SOCKET sock,
+                   const char *Content,
+                   int Length,
+                   const struct sockaddr *Address,
+                   socklen_t AddressLength
+                   )
+{
+    UdpBatch *b = Current;
+    int i;
+
+    if( b == NULL ||
+        Length > b->BufferLength ||
+        AddressLength > sizeof(b->SendAddrs[0].Addr)
+        )
+    {
+        return -1;
+    }
+
+    if( b->Queued == b->Size )
+    {
+        UdpBatch_Flush(b);
+    }
+
+    i = b->Queued;
+
+    memcpy(b->Queue + i * b->BufferLength, Content, Length);
+    b->SendVecs[i].iov_len = Length;
+
+    memcpy(&(b->SendAddrs[i].Addr), Address, AddressLength);
+    b->SendMsgs[i].msg_hdr.msg_namelen = AddressLength;
+
+    b->SendSockets[i] = sock;
+
+    ++(b->Queued);
+
+    return 0;
+}
+
+void UdpBatch_Free(UdpBatch *b)
+{
+    int loop;
+
+    for( loop = 0; b->Contexts != NULL && loop != b->Size; ++loop )
+    {
+        MsgPool_Put(b->Contexts[loop]);
+    }
+
+    SafeFree(b->Contexts);
+    SafeFree(b->RecvMsgs);
+    SafeFree(b->RecvVecs);
+    SafeFree(b->RecvAddrs);
+    SafeFree(b->Queue);
+    SafeFree(b->SendMsgs);
+    SafeFree(b->SendVecs);
+    SafeFree(b->SendAddrs);
+    SafeFree(b->SendSockets);
+    memset(b, 0, sizeof(UdpBatch));
+}
+
+#else /* UDP_BATCH_SUPPORTED */
+
+int UdpBatch_Init(UdpBatch *b, int Size, int BufferLength, int Reserved)
+{
+    return -1;
+}
+
+int UdpBatch_Receive(UdpBatch *b, SOCKET sock)
+{
+    return -1;
+}
+
+char *UdpBatch_Get(UdpBatch *b,
+                   int Index,
+                   int *Length,
+                   struct sockaddr **Address
+                   )
+{
+    return NULL;
+}
+
+void UdpBatch_Begin(UdpBatch *b)
+{
+}
+
+void UdpBatch_End(void)
+{
+}
+
+int UdpBatch_Queue(SOCKET sock,
+                   const char *Content,
+                   int Length,
+                   const struct sockaddr *Address,
+                   socklen_t AddressLength
+                   )
+{
+    return -1;
+}
+
+void UdpBatch_Free(UdpBatch *b)
+{
+}
+
+#endif /* UDP_BATCH_SUPPORTED */
@@ -0,0 +1,82 @@
+#ifndef UDPBATCH_H_INCLUDED
+#define UDPBATCH_H_INCLUDED
+
+#include <stdint.h>
+#include "common.h"
+#include "iheader.h"
+
+/* Batched UDP I/O of the UDP frontend. A wakeup drains up to `Size'
+ * datagrams from a socket with one recvmmsg, and the responses sent by the
+ * thread while they are being handled are queued and flushed with sendmmsg
+ * at the end of the batch, instead of one syscall each.
+ */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+    #define UDP_BATCH_SUPPORTED
+#endif
+
+typedef struct _UdpBatch{
+    int     Size;
+    int     BufferLength;
+    int     Reserved;
+
+    /* Receiving, `Size' contexts of the message pool, the datagrams starting
+     * at `Reserved' of each. Those taken by `UdpBatch_Get' are replaced on
+     * the next receiving.
+     */
+    MsgContext      **Contexts;
+    struct mmsghdr  *RecvMsgs;
+    struct iovec    *RecvVecs;
+    Address_Type    *RecvAddrs;
+
+    /* Queued responses, `Size' buffers of `BufferLength' bytes */
+    char            *Queue;
+    struct mmsghdr  *SendMsgs;
+    struct iovec    *SendVecs;
+    Address_Type    *SendAddrs;
+    SOCKET          *SendSockets;
+    int             Queued;
+
+    /* Statistic, read by other threads without locking */
+    uint64_t    Wakeups;
+    uint64_t    Received;
+    uint64_t    Flushes;
+    uint64_t    Sent;
+} UdpBatch;
+
+/* `BufferLength' bytes are reserved for each response queued */
+int UdpBatch_Init(UdpBatch *b, int Size, int BufferLength, int Reserved);
+
+/* Datagrams waiting on `sock' received, the number returned, negative on
+ * error. `sock' must be readable.
+ */
+int UdpBatch_Receive(UdpBatch *b, SOCKET sock);
+
+/* The context of the `Index'th datagram received, and its client. The
+ * reference of the batch is handed to the caller, who drops it with
+ * `MsgPool_Put' when done.
+ */
+char *UdpBatch_Get(UdpBatch *b,
+                   int Index,
+                   int *Length,
+                   struct sockaddr **Address
+                   );
+
+/* Responses sent by the current thread are queued into `b' from now on */
+void UdpBatch_Begin(UdpBatch *b);
+
+/* The queue of the current thread flushed and detached */
+void UdpBatch_End(void);
+
+/* 0 returned if the datagram is queued by the batch of the current thread,
+ * otherwise it must be sent by the caller.
+ */
+int UdpBatch_Queue(SOCKET sock,
+                   const char *Content,
+                   int Length,
+                   const struct sockaddr *Address,
+                   socklen_t AddressLength
+                   );
+
+void UdpBatch_Free(UdpBatch *b);
+
+#endif // UDPBATCH_H_INCLUDED
@@ -3,32 +3,164 @@
 #include "addresslist.h"
 #include "utils.h"
 #include "mmgr.h"
+#include "clientsubnet.h"
+#include "udpbatch.h"
+#include "msgpool.h"
+#include "timedtask.h"
 #include "logs.h"
 
 /* UDP is main; TCP is fallback. */
 BOOL Ipv6_Enabled = FALSE;
 
-static SocketPuller Frontend;
+#define BUF_LENGTH  CONTEXT_DATA_LENGTH
 
-static void UdpFrontend_Work(void *Unused)
+#define UDP_BATCH_MAX               256
+#define UDP_STATISTIC_INTERVAL      60000
+
+typedef struct _UdpWorker{
+    /* Holding its own socket of every UDPLocal address */
+    SocketPuller    *Frontend;
+
+    /* Used if `BatchSize' > 1 */
+    UdpBatch        Batch;
+} UdpWorker;
+
+/* One puller per worker, NULL terminated */
+static SocketPuller **Frontends = NULL;
+
+static UdpWorker *Workers = NULL;
+static int WorkerCount = 0;
+
+static int BatchSize = 0;
+
+/* `IHeader::SendBack' of the queries if `BatchSize' > 1, the answer queued
+ * if the thread is handling a batch
+ */
+static int UdpFrontend_SendBack(IHeader *h, const char *Content, int Length)
 {
-    /* Buffer */
-    #define BUF_LENGTH  2048
-    char *ReceiveBuffer;
-    IHeader *Header;
+    const struct sockaddr *a = (const struct sockaddr *)&(h->BackAddress.Addr);
+    socklen_t AddrLen = GetAddressLength(h->BackAddress.family);
 
-    #define LEFT_LENGTH  (BUF_LENGTH - sizeof(IHeader))
-    char *Entity;
+    if( UdpBatch_Queue(h->SendBackSocket, Content, Length, a, AddrLen) == 0 )
+    {
+        return 0;
+    }
 
-    ReceiveBuffer = SafeMalloc(BUF_LENGTH);
-    if( ReceiveBuffer == NULL )
+    return sendto(h->SendBackSocket, Content, Length, MSG_NOSIGNAL, a, AddrLen)
+           == Length ? 0 : -1;
+}
+
+/* `Buffer' is a context of the message pool, the datagram following the
+ * IHeader. The reference of the caller is not taken.
+ */
+static void UdpFrontend_Handle(char *Buffer,
+                               int Length,
+                               struct sockaddr *IncomingAddress,
+                               SOCKET sock,
+                               sa_family_t f
+                               )
+{
+    IHeader *Header = (IHeader *)Buffer;
+    char Agent[sizeof(Header->Agent)];
+
+    if( f == AF_INET )
     {
-        ERRORMSG("No enough memory, 26.\n");
+        IPv4AddressToAsc(&(((struct sockaddr_in *)IncomingAddress)->sin_addr),
+                         Agent
+                         );
+    } else {
+        IPv6AddressToAsc(&(((struct sockaddr_in6 *)IncomingAddress)->sin6_addr),
+                         Agent
+                         );
+    }
+
+    if( Length < 0 )
+    {
+        INFO("An error occured while receiving from UDP client %s, not a big deal.\n",
+             Agent
+             );
         return;
     }
 
-    Header = (IHeader *)ReceiveBuffer;
-    Entity = ReceiveBuffer + sizeof(IHeader);
+    IHeader_Fill(Header,
+                 FALSE,
+                 Buffer + sizeof(IHeader),
+                 Length,
+                 IncomingAddress,
+                 sock,
+                 f,
+                 Agent
+                 );
+
+    if( BatchSize > 1 )
+    {
+        Header->SendBack = UdpFrontend_SendBack;
+    }
+
+    ClientSubnet_FromClient(Header, IncomingAddress, f);
+
+    MMgr_Send(Buffer, BUF_LENGTH);
+}
+
+static void UdpFrontend_WorkBatched(UdpWorker *w)
+{
+    UdpBatch *b = &(w->Batch);
+
+    while( TRUE )
+    {
+        SOCKET sock;
+        const sa_family_t *f;
+
+        int Count;
+        int loop;
+
+        sock = w->Frontend->Select(w->Frontend,
+                                   NULL,
+                                   (void **)&f,
+                                   TRUE,
+                                   FALSE,
+                                   NULL
+                                   );
+        if( sock == INVALID_SOCKET )
+        {
+            ERRORMSG("Fatal error 57.\n");
+            break;
+        }
+
+        Count = UdpBatch_Receive(b, sock);
+        if( Count <= 0 )
+        {
+            INFO("An error occured while receiving from UDP clients, not a big deal.\n");
+            continue;
+        }
+
+        /* Responses made in place are sent together once all are handled */
+        UdpBatch_Begin(b);
+
+        for( loop = 0; loop != Count; ++loop )
+        {
+            char *Buffer;
+            int Length;
+            struct sockaddr *IncomingAddress;
+
+            Buffer = UdpBatch_Get(b, loop, &Length, &IncomingAddress);
+            UdpFrontend_Handle(Buffer, Length, IncomingAddress, sock, *f);
+            MsgPool_Put((MsgContext *)Buffer);
+        }
+
+        UdpBatch_End();
+    }
+}
+
+static void UdpFrontend_Work(UdpWorker *w)
+{
+    #define LEFT_LENGTH  (BUF_LENGTH - sizeof(IHeader))
+
+    if( BatchSize > 1 )
+    {
+        UdpFrontend_WorkBatched(w);
+        return;
+    }
 
     /* Loop */
     while( TRUE )
@@ -40,80 +172,158 @@ static void UdpFrontend_Work(void *Unused)
         SOCKET sock;
         const sa_family_t *f;
 
+        /* Buffer, a new one each time as modules may keep it */
+        char *ReceiveBuffer;
+
         int RecvState;
 
         socklen_t AddrLen;
 
-        char Agent[sizeof(Header->Agent)];
-
-        sock = Frontend.Select(&Frontend,
-                               NULL,
-                               (void **)&f,
-                               TRUE,
-                               FALSE,
-                               NULL
-                               );
+        sock = w->Frontend->Select(w->Frontend,
+                                   NULL,
+                                   (void **)&f,
+                                   TRUE,
+                                   FALSE,
+                                   NULL
+                                   );
         if( sock == INVALID_SOCKET )
         {
             ERRORMSG("Fatal error 57.\n");
             break;
         }
 
+        ReceiveBuffer = (char *)MsgPool_Get();
+        if( ReceiveBuffer == NULL )
+        {
+            ERRORMSG("No enough memory, 26.\n");
+            break;
+        }
+
         AddrLen = sizeof(Address_Type);
 
         RecvState = recvfrom(sock,
-                             Entity,
+                             ReceiveBuffer + sizeof(IHeader),
                              LEFT_LENGTH,
                              0,
                              IncomingAddress,
                              &AddrLen
                              );
 
-        if( *f == AF_INET )
-        {
-            IPv4AddressToAsc(&(((struct sockaddr_in *)IncomingAddress)->sin_addr),
-                             Agent
-                             );
-        } else {
-            IPv6AddressToAsc(&(((struct sockaddr_in6 *)IncomingAddress)->sin6_addr),
-                             Agent
-                             );
-        }
+        UdpFrontend_Handle(ReceiveBuffer, RecvState, IncomingAddress, sock, *f);
+        MsgPool_Put((MsgContext *)ReceiveBuffer);
+    }
+}
 
-        if( RecvState < 0 )
-        {
-            INFO("An error occured while receiving from UDP client %s, not a big deal.\n",
-                 Agent
-                 );
-            continue;
-        }
+static void UdpFrontend_Statistic_Task(void *Unused, void *Unused2)
+{
+    uint64_t Wakeups = 0, Received = 0, Flushes = 0, Sent = 0;
+    int loop;
 
-        IHeader_Fill(Header,
-                     FALSE,
-                     Entity,
-                     RecvState,
-                     IncomingAddress,
-                     sock,
-                     *f,
-                     Agent
-                     );
+    if( !Log_DebugOn() )
+    {
+        return;
+    }
+
+    for( loop = 0; loop != WorkerCount; ++loop )
+    {
+        UdpBatch *b = &(Workers[loop].Batch);
 
-        MMgr_Send(ReceiveBuffer, BUF_LENGTH);
+        Wakeups += b->Wakeups;
+        Received += b->Received;
+        Flushes += b->Flushes;
+        Sent += b->Sent;
     }
-    SafeFree(ReceiveBuffer);
+
+    DEBUG("UDP batches: %lu datagrams received in %lu wakeups, %.2f per wakeup; %lu responses sent in %lu calls, %.2f per call.\n",
+          (unsigned long)Received,
+          (unsigned long)Wakeups,
+          Wakeups == 0 ? 0.0 : (double)Received / Wakeups,
+          (unsigned long)Sent,
+          (unsigned long)Flushes,
+          Flushes == 0 ? 0.0 : (double)Sent / Flushes
+          );
 }
 
 void UdpFrontend_StartWork(void)
 {
-    ThreadHandle t;
+    int loop;
 
-    CREATE_THREAD(UdpFrontend_Work, NULL, t);
-    DETACH_THREAD(t);
+    for( loop = 0; loop != WorkerCount; ++loop )
+    {
+        ThreadHandle t;
+
+        CREATE_THREAD(UdpFrontend_Work, Workers + loop, t);
+        DETACH_THREAD(t);
+    }
 }
 
 static void UdpFrontend_Cleanup(void)
 {
-    Frontend.Free(&Frontend);
+    int loop;
+
+    if( BatchSize > 1 )
+    {
+        for( loop = 0; loop != WorkerCount; ++loop )
+        {
+            UdpBatch_Free(&(Workers[loop].Batch));
+        }
+    }
+
+    SafeFree(Workers);
+    SocketPullers_Free(Frontends);
+}
+
+static SOCKET UdpFrontend_Open(const char *One,
+                               const Address_Type *a,
+                               sa_family_t f,
+                               BOOL ReusePort
+                               )
+{
+    SOCKET sock;
+
+    sock = socket(f, SOCK_DGRAM, IPPROTO_UDP);
+    if( sock == INVALID_SOCKET )
+    {
+        return INVALID_SOCKET;
+    }
+
+#ifdef SO_REUSEPORT
+    if( ReusePort )
+    {
+        const int On = 1;
+
+        if( setsockopt(sock,
+                       SOL_SOCKET,
+                       SO_REUSEPORT,
+                       (const char *)&On,
+                       sizeof(On)
+                       )
+            != 0 )
+        {
+            ShowSocketError("Setting SO_REUSEPORT failed", GET_LAST_ERROR());
+            CLOSE_SOCKET(sock);
+            return INVALID_SOCKET;
+        }
+    }
+#endif /* SO_REUSEPORT */
+
+    if( bind(sock,
+             (const struct sockaddr *)&(a->Addr),
+             GetAddressLength(f)
+             )
+        != 0 )
+    {
+        char p[128];
+
+        snprintf(p, sizeof(p), "Opening UDP interface %s failed", One);
+        p[sizeof(p) - 1] = '\0';
+
+        ShowSocketError(p, GET_LAST_ERROR());
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
 }
 
 int UdpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
@@ -123,6 +333,7 @@ int UdpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
     const char *One;
 
     int Count = 0;
+    int Threads = ConfigGetInt32(ConfigInfo, "UDPThreads");
 
     UDPLocal = ConfigGetStringList(ConfigInfo, "UDPLocal");
     if( UDPLocal == NULL )
@@ -136,17 +347,69 @@ int UdpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
         return -20;
     }
 
-    if( SocketPuller_Init(&Frontend, sizeof(sa_family_t)) != 0 )
+    if( Threads < 1 )
+    {
+        Threads = 1;
+    }
+
+#ifndef SO_REUSEPORT
+    if( Threads > 1 )
+    {
+        WARNING("SO_REUSEPORT is not supported, UDPThreads is ignored.\n");
+        Threads = 1;
+    }
+#endif /* SO_REUSEPORT */
+
+    BatchSize = ConfigGetInt32(ConfigInfo, "UDPBatch");
+    if( BatchSize > UDP_BATCH_MAX )
+    {
+        BatchSize = UDP_BATCH_MAX;
+    }
+
+#ifndef UDP_BATCH_SUPPORTED
+    if( BatchSize > 1 )
+    {
+        WARNING("recvmmsg and sendmmsg are not supported, UDPBatch is ignored.\n");
+        BatchSize = 0;
+    }
+#endif /* UDP_BATCH_SUPPORTED */
+
+    Frontends = SocketPullers_Init(Threads, sizeof(sa_family_t));
+    if( Frontends == NULL )
     {
         return -19;
     }
 
+    Workers = SafeMalloc(Threads * sizeof(UdpWorker));
+    if( Workers == NULL )
+    {
+        SocketPullers_Free(Frontends);
+        return -19;
+    }
+
+    for( WorkerCount = 0; WorkerCount != Threads; ++WorkerCount )
+    {
+        UdpWorker *w = Workers + WorkerCount;
+
+        w->Frontend = Frontends[WorkerCount];
+
+        if( BatchSize > 1 &&
+            UdpBatch_Init(&(w->Batch), BatchSize, BUF_LENGTH, sizeof(IHeader))
+                != 0 )
+        {
+            ERRORMSG("No enough memory, 52.\n");
+            UdpFrontend_Cleanup();
+            return -19;
+        }
+    }
+
     while( (One = i.Next(&i)) != NULL )
     {
         Address_Type a;
         sa_family_t f;
 
-        SOCKET sock;
+        SocketPuller **p;
+        int Opened = 0;
 
         f = AddressList_ConvertFromString(&a, One, 53);
         if( f == AF_UNSPEC )
@@ -155,25 +418,22 @@ int UdpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
             continue;
         }
 
-        sock = socket(f, SOCK_DGRAM, IPPROTO_UDP);
-        if( sock == INVALID_SOCKET )
+        /* The kernel spreads clients among the sockets of one address */
+        for( p = Frontends; *p != NULL; ++p )
         {
-            continue;
-        }
+            SOCKET sock = UdpFrontend_Open(One, &a, f, Threads > 1);
 
-        if( bind(sock,
-                 (const struct sockaddr *)&(a.Addr),
-                 GetAddressLength(f)
-                 )
-            != 0 )
-        {
-            char p[128];
+            if( sock == INVALID_SOCKET )
+            {
+                break;
+            }
 
-            snprintf(p, sizeof(p), "Opening UDP interface %s failed", One);
-            p[sizeof(p) - 1] = '\0';
+            (*p)->Add(*p, sock, &f, sizeof(sa_family_t));
+            ++Opened;
+        }
 
-            ShowSocketError(p, GET_LAST_ERROR());
-            CLOSE_SOCKET(sock);
+        if( Opened == 0 )
+        {
             continue;
         }
 
@@ -182,13 +442,26 @@ int UdpFrontend_Init(ConfigFileInfo *ConfigInfo, BOOL StartWork)
             Ipv6_Enabled = TRUE;
         }
 
-        Frontend.Add(&Frontend, sock, &f, sizeof(sa_family_t));
-        INFO("UDP interface %s opened.\n", One);
+        INFO("UDP interface %s opened, %d socket(s).\n", One, Opened);
         ++Count;
     }
 
     atexit(UdpFrontend_Cleanup);
 
+    if( BatchSize > 1 )
+    {
+        INFO("UDP datagrams are handled in batches of up to %d.\n", BatchSize);
+
+        TimedTask_Add(TRUE,
+                      FALSE,
+                      UDP_STATISTIC_INTERVAL,
+                      (TaskFunc)UdpFrontend_Statistic_Task,
+                      NULL,
+                      NULL,
+                      FALSE
+                      );
+    }
+
     if( Count == 0 )
     {
         ERRORMSG("No UDP interface opened.\n");
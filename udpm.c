@@ -4,11 +4,12 @@
 #include "logs.h"
 #include "utils.h"
 #include "dnscache.h"
+#include "pendingquery.h"
+#include "clientsubnet.h"
 #include "ipmisc.h"
 #include "domainstatistic.h"
 #include "timedtask.h"
-
-#define CONTEXT_DATA_LENGTH  2048
+#include "msgpool.h"
 
 static void SweepWorks(MsgContext *MsgCtx, int Number, UdpM *Module)
 {
@@ -228,6 +229,10 @@ static void UdpM_Works(UdpM *m)
             continue;
         }
 
+        ClientSubnet_RemoveFromAnswer(MsgCtx);
+
+        PendingQuery_Answer(MsgCtx, 'U', STATISTIC_TYPE_UDP);
+
         if( MsgContext_SendBack(MsgCtx) != 0 )
         {
             ShowErrorMessage(Header, 'U');
@@ -250,7 +255,9 @@ static int UdpM_Send(UdpM *m,
     IHeader *h = (IHeader *)Buffer;
 
     MsgContext_AddFakeEdns((MsgContext *)Buffer, BufferLength);
+    ClientSubnet_AddToQuery((MsgContext *)Buffer, BufferLength);
 
+    /* Kept by pointer, `Buffer' is a context of the message pool */
     EFFECTIVE_LOCK_GET(m->Lock);
     if( m->Context.Add(&(m->Context), (MsgContext *)Buffer) == NULL )
     {
@@ -382,7 +389,7 @@ int UdpM_Init(UdpM *m, const char *Services, BOOL Parallel)
         m->Parallels.addrlen = 0;
     }
 
-    if( ModuleContext_Init(&(m->Context), CONTEXT_DATA_LENGTH) != 0 )
+    if( ModuleContext_Init(&(m->Context)) != 0 )
     {
         ret = -143;
         goto EXIT_3;
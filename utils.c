@@ -715,6 +715,19 @@ unsigned int BKDRHash(const char* str, unsigned int Unused)
     return hash;
 }
 
+uint64_t BKDRHash64(const char *str, unsigned int Unused)
+{
+    uint64_t hash = 0;
+
+    while( *str != '\0' )
+    {
+        hash = (hash * 131) + (*str);
+        str++;
+    }
+
+    return hash;
+}
+
 void HexDump(const char *Data, int Length)
 {
     int Itr;
@@ -1239,6 +1252,47 @@ SOCKET TryBindLocal(BOOL Ipv6, int StartPort, Address_Type *Address)
     return ret;
 }
 
+int CreateLocalSocketPair(int StartPort, SOCKET Pair[2])
+{
+#ifdef WIN32
+    Address_Type a[2];
+
+    Pair[0] = TryBindLocal(FALSE, StartPort, &(a[0]));
+    if( Pair[0] == INVALID_SOCKET )
+    {
+        return -1;
+    }
+
+    Pair[1] = TryBindLocal(FALSE, StartPort + 1, &(a[1]));
+    if( Pair[1] == INVALID_SOCKET )
+    {
+        CLOSE_SOCKET(Pair[0]);
+        return -2;
+    }
+
+    /* Datagrams from anywhere else are dropped */
+    if( connect(Pair[0],
+                (const struct sockaddr *)&(a[1].Addr),
+                GetAddressLength(a[1].family)
+                )
+        != 0 ||
+        connect(Pair[1],
+                (const struct sockaddr *)&(a[0].Addr),
+                GetAddressLength(a[0].family)
+                )
+        != 0 )
+    {
+        CLOSE_SOCKET(Pair[0]);
+        CLOSE_SOCKET(Pair[1]);
+        return -3;
+    }
+
+    return 0;
+#else /* WIN32 */
+    return socketpair(AF_UNIX, SOCK_DGRAM, 0, Pair) == 0 ? 0 : -1;
+#endif /* WIN32 */
+}
+
 char *SplitNameAndValue(char *Line, const char *Delimiters)
 {
     char *Delimiter = strpbrk(Line, Delimiters);
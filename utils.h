@@ -14,6 +14,7 @@
 #define STRINGIZINGINT(val)     STRINGIZING(val)
 
 #define HASH                    BKDRHash
+#define HASH64                  BKDRHash64
 
 typedef int offset_t;
 
@@ -104,6 +105,9 @@ int FindNextPrime(int Current);
 
 unsigned int BKDRHash(const char *str, unsigned int Unused);
 
+/* The low 32 bits are the same as `BKDRHash' */
+uint64_t BKDRHash64(const char *str, unsigned int Unused);
+
 void HexDump(const char *Data, int Length);
 
 char *BinaryOutput(const char *Origin, int OriginLength, char *Buffer);
@@ -159,6 +163,13 @@ void ClearTCPSocketBuffer(SOCKET Sock, int Length);
 
 SOCKET TryBindLocal(BOOL Ipv6, int StartPort, Address_Type *Address);
 
+/* Two datagram sockets connected to each other, which nothing but this
+ * process can send to, for passing pointers between its threads. Whatever
+ * is sent by `Pair[1]' is received by `Pair[0]'. `StartPort' is where
+ * loopback ports are looked for if there are no socket pairs.
+ */
+int CreateLocalSocketPair(int StartPort, SOCKET Pair[2]);
+
 char *SplitNameAndValue(char *Line, const char *Delimiters);
 
 char *GetPathPart(char *FullPath);